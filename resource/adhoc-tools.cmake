@@ -19,10 +19,40 @@ function(enable_adhoc_tools)
 
         # If use adhoc-ndk-uncaught & adhoc-ndk-backtrace
         PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/ndk-backtrace/adhoc-ndk-backtrace.cpp
+        # If use adhoc-thread-dump (which depends on adhoc-ndk-backtrace)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/ndk-backtrace/adhoc-thread-dump.cpp
         # If use adhoc-ndk-backtrace
         PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/ndk-uncaught/adhoc-ndk-uncaught.cpp
-        # If use adhoc-perf
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/ndk-uncaught/adhoc-minidump.cpp
+        # Needed by adhoc-ndk-backtrace
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/elf/adhoc-elf.cpp
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/elf/adhoc-dwarf-line.cpp
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/elf/adhoc-symbol-index.cpp
+        # If use adhoc-profiler (which depends on adhoc-ndk-backtrace)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/profiler/adhoc-profiler.cpp
+        # If use adhoc-heap-profiler (which depends on adhoc-ndk-backtrace)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/profiler/adhoc-heap-profiler.cpp
+        # If interpose malloc / new for adhoc-heap-profiler
+        # PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/profiler/adhoc-heap-interpose.cpp
+        # If use adhoc-lock-profiler (which depends on adhoc-ndk-backtrace and adhoc-perf)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/profiler/adhoc-lock-profiler.cpp
+        # If interpose pthread_mutex_lock (and so std::mutex) for adhoc-lock-profiler
+        # PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/profiler/adhoc-lock-interpose.cpp
+        # If use adhoc-perf or adhoc-trace
         PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/perf/adhoc-perf.cpp
+        # If use adhoc-perf-exporter (which depends on adhoc-perf)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/perf/adhoc-perf-exporter.cpp
+        # If use adhoc-perf-shared (which depends on adhoc-perf)
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/perf/adhoc-perf-shared.cpp
+        # If use adhoc-trace
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/trace/adhoc-trace.cpp
+        # Needed by all of the above
+        PRIVATE ${ADHOC_TOOLS_SRC_DIR}/adhoc/log/adhoc-log.cpp
     )
 
+    # If use adhoc-heap-interpose or adhoc-lock-interpose, bind the calls of the .so to its own
+    # definitions, or they are bound to libc if the .so is loaded by `dlopen` (like
+    # `System.loadLibrary`).
+    # target_link_options(your_so_name PRIVATE "-Wl,-Bsymbolic-functions")
+
 endfunction()
@@ -0,0 +1,201 @@
+/// Helpers that can be used in signal handlers: no allocation, no lock, no stdio, only
+/// fixed size buffers and `write(2)`.
+/// See https://man7.org/linux/man-pages/man7/signal-safety.7.html
+
+#ifndef _ADHOC_TOOLS_SIGNAL_SAFE_H_
+#define _ADHOC_TOOLS_SIGNAL_SAFE_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+namespace {
+
+namespace signalsafe {
+
+static void writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+/// Formats a line into the given buffer, and writes it to the fd (and to logcat in NDK) by
+/// `flush()`. Text exceeding the buffer is truncated.
+class LineWriter {
+  public:
+    /// @param tag of logcat, or null not to write to logcat.
+    LineWriter(char* buffer, size_t capacity, int fd, const char* tag)
+            : mBuffer(buffer), mCapacity(capacity), mLength(0), mFd(fd), mTag(tag) {
+    }
+
+    LineWriter& append(const char* str) {
+        if (!str) {
+            str = "(null)";
+        }
+        while (*str && mLength + 1 < mCapacity) {
+            mBuffer[mLength++] = *str++;
+        }
+        return *this;
+    }
+
+    /// @param minWidth padded with spaces on the left.
+    LineWriter& appendDec(int64_t value, int minWidth = 0) {
+        char digits[24];
+        int count = 0;
+        // Do not negate it directly, which overflows for the min value.
+        uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+        do {
+            digits[count++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (value < 0) {
+            digits[count++] = '-';
+        }
+        return appendReversed(digits, count, minWidth, ' ');
+    }
+
+    /// Like `0x1a2b`, padded with zeros to `minDigits`.
+    LineWriter& appendHex(uintptr_t value, int minDigits = 1) {
+        static const char HEX[] = "0123456789abcdef";
+        char digits[2 * sizeof(uintptr_t)];
+        int count = 0;
+        do {
+            digits[count++] = HEX[value & 0xf];
+            value >>= 4;
+        } while (value);
+        append("0x");
+        return appendReversed(digits, count, minDigits, '0');
+    }
+
+    /// Write the line with a line break, and clear it.
+    void flush() {
+        mBuffer[mLength] = '\0';
+#ifdef __ANDROID__
+        if (mTag) {
+            // Not guaranteed by the docs, but liblog writes to the logd socket directly
+            // without allocating, as the bionic crash dumper also relies on.
+            __android_log_write(ANDROID_LOG_ERROR, mTag, mBuffer);
+        }
+#endif
+        if (mFd >= 0) {
+            mBuffer[mLength] = '\n';
+            writeAll(mFd, mBuffer, mLength + 1);
+        }
+        mLength = 0;
+    }
+
+  private:
+    LineWriter& appendReversed(const char* digits, int count, int minWidth, char pad) {
+        for (int i = count; i < minWidth && mLength + 1 < mCapacity; i++) {
+            mBuffer[mLength++] = pad;
+        }
+        while (count > 0 && mLength + 1 < mCapacity) {
+            mBuffer[mLength++] = digits[--count];
+        }
+        return *this;
+    }
+
+    char* mBuffer;
+    size_t mCapacity;
+    size_t mLength;
+    int mFd;
+    const char* mTag;
+};
+
+inline const char* parseHex(const char* p, uint64_t& value) {
+    value = 0;
+    while (true) {
+        char c = *p;
+        if (c >= '0' && c <= '9') { value = value * 16 + (uint64_t)(c - '0'); }
+        else if (c >= 'a' && c <= 'f') { value = value * 16 + (uint64_t)(c - 'a' + 10); }
+        else { return p; }
+        p++;
+    }
+}
+
+inline const char* skipField(const char* p) {
+    while (*p && *p != ' ') { p++; }
+    while (*p == ' ') { p++; }
+    return p;
+}
+
+/// A line of `/proc/self/maps`, like:
+/// `7f1234000-7f1235000 r-xp 00001000 fd:01 1234    /system/lib64/libc.so`
+struct MapsLine {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    /// Point into the line.
+    const char* perms;
+    /// Empty for anonymous mappings.
+    const char* path;
+
+    bool isReadable() const { return perms[0] == 'r'; }
+    bool isExecutable() const { return perms[0] && perms[1] && perms[2] == 'x'; }
+};
+
+inline bool parseMapsLine(const char* line, MapsLine& out) {
+    const char* p = parseHex(line, out.start);
+    if (*p != '-') {
+        return false;
+    }
+    p = parseHex(p + 1, out.end);
+    p = skipField(p);
+    out.perms = p;
+    p = skipField(p);
+    parseHex(p, out.offset);
+    out.path = skipField(skipField(skipField(p)));
+    return true;
+}
+
+/// Read `/proc/self/maps`, and call `onLine(const char* line)` for each line, through the
+/// given buffers. The part of a line beyond `lineSize` is cut.
+template <typename OnLine>
+inline bool forEachMapsLine(char* chunk, size_t chunkSize, char* line, size_t lineSize, OnLine onLine) {
+    int mapsFd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (mapsFd < 0) {
+        return false;
+    }
+    size_t lineLength = 0;
+    while (true) {
+        ssize_t size = read(mapsFd, chunk, chunkSize);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < size; i++) {
+            char c = chunk[i];
+            if (c == '\n') {
+                line[lineLength] = '\0';
+                onLine(static_cast<const char*>(line));
+                lineLength = 0;
+            }
+            else if (lineLength + 1 < lineSize) {
+                line[lineLength++] = c;
+            }
+        }
+    }
+    close(mapsFd);
+    return true;
+}
+
+} // end of namespace signalsafe
+
+} // end of anonymous namespace
+
+#endif // end of _ADHOC_TOOLS_SIGNAL_SAFE_H_
@@ -0,0 +1,413 @@
+#include "adhoc-dwarf-line.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace adhocelf {
+
+namespace {
+
+// Standard opcodes.
+const uint8_t DW_LNS_COPY = 1;
+const uint8_t DW_LNS_ADVANCE_PC = 2;
+const uint8_t DW_LNS_ADVANCE_LINE = 3;
+const uint8_t DW_LNS_SET_FILE = 4;
+const uint8_t DW_LNS_CONST_ADD_PC = 8;
+const uint8_t DW_LNS_FIXED_ADVANCE_PC = 9;
+// Extended opcodes.
+const uint8_t DW_LNE_END_SEQUENCE = 1;
+const uint8_t DW_LNE_SET_ADDRESS = 2;
+const uint8_t DW_LNE_DEFINE_FILE = 3;
+// Forms used in the DWARF 5 directory and file name tables.
+const uint64_t DW_FORM_BLOCK = 0x09;
+const uint64_t DW_FORM_DATA1 = 0x0b;
+const uint64_t DW_FORM_DATA2 = 0x05;
+const uint64_t DW_FORM_DATA4 = 0x06;
+const uint64_t DW_FORM_DATA8 = 0x07;
+const uint64_t DW_FORM_DATA16 = 0x1e;
+const uint64_t DW_FORM_STRING = 0x08;
+const uint64_t DW_FORM_STRP = 0x0e;
+const uint64_t DW_FORM_UDATA = 0x0f;
+const uint64_t DW_FORM_LINE_STRP = 0x1f;
+// Content types of the entries.
+const uint64_t DW_LNCT_PATH = 1;
+const uint64_t DW_LNCT_DIRECTORY_INDEX = 2;
+
+/// Reads little-endian values, and stops at the end rather than overrunning it.
+class DataReader {
+  public:
+    DataReader(const uint8_t* begin, const uint8_t* end): mPos(begin), mEnd(end) {}
+
+    bool ok() const { return mOk; }
+    const uint8_t* pos() const { return mPos; }
+    void seek(const uint8_t* pos) {
+        if (pos > mEnd) { mOk = false; mPos = mEnd; }
+        else { mPos = pos; }
+    }
+
+    uint64_t fixed(size_t size) {
+        if ((size_t)(mEnd - mPos) < size) {
+            mOk = false;
+            mPos = mEnd;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < size && i < 8; i++) {
+            value |= (uint64_t)mPos[i] << (8 * i);
+        }
+        mPos += size;
+        return value;
+    }
+    uint8_t u8() { return (uint8_t)fixed(1); }
+    uint16_t u16() { return (uint16_t)fixed(2); }
+    uint32_t u32() { return (uint32_t)fixed(4); }
+    uint64_t u64() { return fixed(8); }
+
+    uint64_t uleb() {
+        uint64_t value = 0;
+        int shift = 0;
+        while (mPos < mEnd) {
+            uint8_t byte = *mPos++;
+            if (shift < 64) { value |= (uint64_t)(byte & 0x7f) << shift; }
+            shift += 7;
+            if (!(byte & 0x80)) { return value; }
+        }
+        mOk = false;
+        return value;
+    }
+
+    int64_t sleb() {
+        int64_t value = 0;
+        int shift = 0;
+        while (mPos < mEnd) {
+            uint8_t byte = *mPos++;
+            if (shift < 64) { value |= (int64_t)(byte & 0x7f) << shift; }
+            shift += 7;
+            if (!(byte & 0x80)) {
+                if (shift < 64 && (byte & 0x40)) { value |= -((int64_t)1 << shift); }
+                return value;
+            }
+        }
+        mOk = false;
+        return value;
+    }
+
+    const char* cstr() {
+        const uint8_t* start = mPos;
+        while (mPos < mEnd && *mPos) { mPos++; }
+        if (mPos == mEnd) {
+            mOk = false;
+            return "";
+        }
+        mPos++;
+        return reinterpret_cast<const char*>(start);
+    }
+
+  private:
+    const uint8_t* mPos;
+    const uint8_t* mEnd;
+    bool mOk = true;
+};
+
+/// A string in a string section, by offset.
+const char* sectionString(const ElfFile& elf, const ElfSection* section, uint64_t offset) {
+    const uint8_t* data = section ? elf.sectionData(*section) : nullptr;
+    if (!data || offset >= section->mSize) {
+        return "";
+    }
+    const char* str = reinterpret_cast<const char*>(data + offset);
+    return strnlen(str, (size_t)(section->mSize - offset)) < section->mSize - offset ? str : "";
+}
+
+struct EntryFormat {
+    uint64_t mContentType;
+    uint64_t mForm;
+};
+
+struct FileEntry {
+    std::string mPath;
+    uint64_t mDirectory;
+};
+
+/// The tombstones that linkers write for the addresses of discarded functions.
+bool isDiscardedAddress(uint64_t address, size_t addressSize) {
+    return address == 0 || address == (addressSize == 4 ? 0xffffffffULL : ~0ULL);
+}
+
+std::string joinPath(const std::string& directory, const std::string& name) {
+    if (name.empty() || name[0] == '/' || directory.empty()) {
+        return name;
+    }
+    return directory.back() == '/' ? directory + name : directory + "/" + name;
+}
+
+} // end of anonymous namespace
+
+
+struct DwarfLineTable::UnitContext {
+    std::vector<std::string> mDirectories;
+    std::vector<FileEntry> mFiles;
+    /// Unit file index to the index of `mFiles` of the table, -1 if not interned yet.
+    std::vector<int64_t> mFileIndices;
+};
+
+bool DwarfLineTable::load(const ElfFile& elf) {
+    const ElfSection* section = elf.findSection(".debug_line");
+    if (!section || !elf.sectionData(*section)) {
+        return false;
+    }
+    bool ok = true;
+    uint64_t offset = 0;
+    while (offset < section->mSize) {
+        uint64_t next = decodeUnit(elf, offset);
+        if (!next) {
+            ok = false;
+            break;
+        }
+        offset = next;
+    }
+    // End rows go before the start of another sequence at the same address.
+    std::stable_sort(mRows.begin(), mRows.end(), [](const Row& a, const Row& b) {
+        return a.mAddress < b.mAddress || (a.mAddress == b.mAddress && a.mLine == 0 && b.mLine != 0);
+    });
+    mFileIndices.clear();
+    return ok && !mRows.empty();
+}
+
+uint32_t DwarfLineTable::internFile(const std::string& path) {
+    auto found = mFileIndices.find(path);
+    if (found != mFileIndices.end()) {
+        return found->second;
+    }
+    uint32_t index = (uint32_t)mFiles.size();
+    mFiles.push_back(path);
+    mFileIndices.emplace(path, index);
+    return index;
+}
+
+uint64_t DwarfLineTable::decodeUnit(const ElfFile& elf, uint64_t offset) {
+    const ElfSection* section = elf.findSection(".debug_line");
+    const uint8_t* sectionBegin = elf.sectionData(*section);
+    const uint8_t* sectionEnd = sectionBegin + section->mSize;
+    DataReader reader(sectionBegin + offset, sectionEnd);
+
+    uint64_t unitLength = reader.u32();
+    bool isDwarf64 = false;
+    if (unitLength == 0xffffffffULL) {
+        unitLength = reader.u64();
+        isDwarf64 = true;
+    }
+    if (!reader.ok() || unitLength > (uint64_t)(sectionEnd - reader.pos())) {
+        return 0;
+    }
+    const uint8_t* unitEnd = reader.pos() + unitLength;
+    reader = DataReader(reader.pos(), unitEnd);
+
+    uint16_t version = reader.u16();
+    if (version < 2 || version > 5) {
+        return 0;
+    }
+    size_t addressSize = elf.is64() ? 8 : 4;
+    if (version >= 5) {
+        addressSize = reader.u8();
+        reader.u8(); // segment_selector_size
+    }
+    uint64_t headerLength = isDwarf64 ? reader.u64() : reader.u32();
+    const uint8_t* programStart = reader.pos() + headerLength;
+    uint8_t minInstructionLength = reader.u8();
+    if (version >= 4) {
+        reader.u8(); // maximum_operations_per_instruction, only for VLIW.
+    }
+    reader.u8(); // default_is_stmt
+    int8_t lineBase = (int8_t)reader.u8();
+    uint8_t lineRange = reader.u8();
+    uint8_t opcodeBase = reader.u8();
+    if (!reader.ok() || lineRange == 0 || opcodeBase == 0) {
+        return 0;
+    }
+    std::vector<uint8_t> standardOpcodeLengths(opcodeBase, 0);
+    for (uint8_t i = 1; i < opcodeBase; i++) {
+        standardOpcodeLengths[i] = reader.u8();
+    }
+
+    UnitContext unit;
+    if (version < 5) {
+        // Index 0 is the compilation directory, which is only in `.debug_info`.
+        unit.mDirectories.push_back("");
+        while (true) {
+            const char* directory = reader.cstr();
+            if (!reader.ok() || !*directory) { break; }
+            unit.mDirectories.push_back(directory);
+        }
+        // File indices start from 1.
+        unit.mFiles.push_back(FileEntry{"", 0});
+        while (true) {
+            const char* name = reader.cstr();
+            if (!reader.ok() || !*name) { break; }
+            uint64_t directory = reader.uleb();
+            reader.uleb(); // modification time
+            reader.uleb(); // length
+            unit.mFiles.push_back(FileEntry{name, directory});
+        }
+    }
+    else {
+        const ElfSection* lineStrings = elf.findSection(".debug_line_str");
+        const ElfSection* strings = elf.findSection(".debug_str");
+        // Directories and file names are in the same form: formats, count, and entries.
+        for (int table = 0; table < 2 && reader.ok(); table++) {
+            std::vector<EntryFormat> formats(reader.u8());
+            for (auto& format : formats) {
+                format.mContentType = reader.uleb();
+                format.mForm = reader.uleb();
+            }
+            uint64_t count = reader.uleb();
+            for (uint64_t i = 0; i < count && reader.ok(); i++) {
+                FileEntry entry{"", 0};
+                for (auto& format : formats) {
+                    const char* str = nullptr;
+                    uint64_t value = 0;
+                    switch (format.mForm) {
+                        case DW_FORM_STRING: str = reader.cstr(); break;
+                        case DW_FORM_LINE_STRP:
+                            str = sectionString(elf, lineStrings, isDwarf64 ? reader.u64() : reader.u32());
+                            break;
+                        case DW_FORM_STRP:
+                            str = sectionString(elf, strings, isDwarf64 ? reader.u64() : reader.u32());
+                            break;
+                        case DW_FORM_UDATA: value = reader.uleb(); break;
+                        case DW_FORM_DATA1: value = reader.u8(); break;
+                        case DW_FORM_DATA2: value = reader.u16(); break;
+                        case DW_FORM_DATA4: value = reader.u32(); break;
+                        case DW_FORM_DATA8: value = reader.u64(); break;
+                        case DW_FORM_DATA16: reader.fixed(16); break;
+                        case DW_FORM_BLOCK: reader.seek(reader.pos() + reader.uleb()); break;
+                        // Others (like `DW_FORM_strx`) are not used by compilers here.
+                        default: return 0;
+                    }
+                    if (format.mContentType == DW_LNCT_PATH && str) {
+                        entry.mPath = str;
+                    }
+                    else if (format.mContentType == DW_LNCT_DIRECTORY_INDEX) {
+                        entry.mDirectory = value;
+                    }
+                }
+                if (table == 0) {
+                    unit.mDirectories.push_back(entry.mPath);
+                }
+                else {
+                    unit.mFiles.push_back(entry);
+                }
+            }
+        }
+        // Directories are relative to the compilation directory (index 0).
+        for (size_t i = 1; i < unit.mDirectories.size(); i++) {
+            unit.mDirectories[i] = joinPath(unit.mDirectories[0], unit.mDirectories[i]);
+        }
+    }
+    if (!reader.ok()) {
+        return 0;
+    }
+
+    auto fileIndex = [&](uint64_t file) -> uint32_t {
+        if (file >= unit.mFiles.size()) {
+            return internFile("??");
+        }
+        if (unit.mFileIndices.size() < unit.mFiles.size()) {
+            unit.mFileIndices.resize(unit.mFiles.size(), -1);
+        }
+        if (unit.mFileIndices[file] < 0) {
+            const FileEntry& entry = unit.mFiles[file];
+            const std::string& directory = entry.mDirectory < unit.mDirectories.size()
+                    ? unit.mDirectories[entry.mDirectory] : std::string();
+            unit.mFileIndices[file] = internFile(joinPath(directory, entry.mPath));
+        }
+        return (uint32_t)unit.mFileIndices[file];
+    };
+
+    // The line number state machine. Rows of a sequence are kept only if the sequence is
+    // not discarded by the linker.
+    reader.seek(programStart);
+    std::vector<Row> sequence;
+    uint64_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    auto emitRow = [&]() {
+        sequence.push_back(Row{address, fileIndex(file), line > 0 ? (uint32_t)line : 1});
+    };
+    auto endSequence = [&]() {
+        if (!sequence.empty() && !isDiscardedAddress(sequence[0].mAddress, addressSize)) {
+            mRows.insert(mRows.end(), sequence.begin(), sequence.end());
+            mRows.push_back(Row{address, 0, 0});
+        }
+        sequence.clear();
+        address = 0;
+        file = 1;
+        line = 1;
+    };
+    while (reader.ok() && reader.pos() < unitEnd) {
+        uint8_t opcode = reader.u8();
+        if (opcode >= opcodeBase) {
+            uint8_t adjusted = opcode - opcodeBase;
+            address += (uint64_t)(adjusted / lineRange) * minInstructionLength;
+            line += lineBase + adjusted % lineRange;
+            emitRow();
+        }
+        else if (opcode == 0) {
+            uint64_t length = reader.uleb();
+            const uint8_t* instructionEnd = reader.pos() + length;
+            if (length == 0 || instructionEnd > unitEnd) {
+                return 0;
+            }
+            uint8_t extended = reader.u8();
+            if (extended == DW_LNE_END_SEQUENCE) {
+                endSequence();
+            }
+            else if (extended == DW_LNE_SET_ADDRESS) {
+                address = reader.fixed((size_t)length - 1);
+            }
+            else if (extended == DW_LNE_DEFINE_FILE) {
+                const char* name = reader.cstr();
+                uint64_t directory = reader.uleb();
+                unit.mFiles.push_back(FileEntry{name, directory});
+            }
+            reader.seek(instructionEnd);
+        }
+        else {
+            switch (opcode) {
+                case DW_LNS_COPY: emitRow(); break;
+                case DW_LNS_ADVANCE_PC: address += reader.uleb() * minInstructionLength; break;
+                case DW_LNS_ADVANCE_LINE: line += reader.sleb(); break;
+                case DW_LNS_SET_FILE: file = reader.uleb(); break;
+                case DW_LNS_CONST_ADD_PC:
+                    address += (uint64_t)((255 - opcodeBase) / lineRange) * minInstructionLength;
+                    break;
+                case DW_LNS_FIXED_ADVANCE_PC: address += reader.u16(); break;
+                default:
+                    // Including the ones without operands, and unknown ones.
+                    for (uint8_t i = 0; i < standardOpcodeLengths[opcode]; i++) {
+                        reader.uleb();
+                    }
+                    break;
+            }
+        }
+    }
+    return reader.ok() ? (uint64_t)(unitEnd - sectionBegin) : 0;
+}
+
+bool DwarfLineTable::find(uint64_t vaddr, const char*& file, uint32_t& line) const {
+    auto found = std::upper_bound(mRows.begin(), mRows.end(), vaddr, [](uint64_t address, const Row& row) {
+        return address < row.mAddress;
+    });
+    if (found == mRows.begin()) {
+        return false;
+    }
+    --found;
+    if (found->mLine == 0) {
+        return false;
+    }
+    file = mFiles[found->mFile].c_str();
+    line = found->mLine;
+    return true;
+}
+
+} // end of namespace adhocelf
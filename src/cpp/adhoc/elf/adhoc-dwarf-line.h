@@ -0,0 +1,56 @@
+/// Resolve addresses to source file and line by the DWARF line table (`.debug_line`), like
+/// `addr2line`. DWARF versions 2 to 5 are supported, in both 32-bit and 64-bit DWARF.
+/// Compressed debug sections (`SHF_COMPRESSED`, `.zdebug_*`) are not supported.
+/// See https://dwarfstd.org/doc/DWARF5.pdf (6.2 Line Number Information)
+
+#ifndef _ADHOC_TOOLS_DWARF_LINE_H_
+#define _ADHOC_TOOLS_DWARF_LINE_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "adhoc-elf.h"
+
+namespace adhocelf {
+
+/// The line program of all units decoded once into address ranges sorted by address, and
+/// then looked up by binary search.
+/// Not thread-safe to load, but `find()` can be called concurrently after it is loaded.
+class DwarfLineTable {
+  public:
+    /// @return false if there is no `.debug_line` or it is corrupted. Units decoded before
+    /// the corrupted one are kept.
+    bool load(const ElfFile& elf);
+
+    /// @param vaddr the virtual address in the ELF file (not the runtime pc).
+    /// @param file set to the path (joined with its directory), lives as long as the table.
+    /// @return false if the address is not covered.
+    bool find(uint64_t vaddr, const char*& file, uint32_t& line) const;
+
+    size_t rowCount() const { return mRows.size(); }
+
+  private:
+    struct Row {
+        uint64_t mAddress;
+        /// Index of `mFiles`.
+        uint32_t mFile;
+        /// 0 marks the end of a sequence, the address after it is not covered.
+        uint32_t mLine;
+    };
+
+    struct UnitContext;
+    /// @return the offset of the next unit, or 0 if it is corrupted.
+    uint64_t decodeUnit(const ElfFile& elf, uint64_t offset);
+    uint32_t internFile(const std::string& path);
+
+    std::vector<Row> mRows;
+    std::vector<std::string> mFiles;
+    /// Path to index of `mFiles`, only used while loading.
+    std::unordered_map<std::string, uint32_t> mFileIndices;
+};
+
+} // end of namespace adhocelf
+
+#endif // _ADHOC_TOOLS_DWARF_LINE_H_
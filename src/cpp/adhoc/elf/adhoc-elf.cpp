@@ -0,0 +1,191 @@
+#include "adhoc-elf.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace adhocelf {
+
+ElfFile::~ElfFile() {
+    if (mMapped && mData) {
+        munmap(const_cast<uint8_t*>(mData), mSize);
+    }
+}
+
+bool ElfFile::open(const char* path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    mPath = path;
+    mData = static_cast<const uint8_t*>(data);
+    mSize = (size_t)st.st_size;
+    mMapped = true;
+    return parse();
+}
+
+bool ElfFile::openMemory(const uint8_t* data, size_t size) {
+    mData = data;
+    mSize = size;
+    mMapped = false;
+    return parse();
+}
+
+bool ElfFile::parse() {
+    if (!isSupportedElf(mData, mSize)) {
+        return false;
+    }
+    mIs64 = reinterpret_cast<const ElfIdent*>(mData)->mClass == ELF_CLASS_64;
+    bool ok = mIs64
+            ? parseHeaders<Elf64Header, Elf64ProgramHeader, Elf64SectionHeader>()
+            : parseHeaders<Elf32Header, Elf32ProgramHeader, Elf32SectionHeader>();
+    if (!ok) {
+        return false;
+    }
+    uint8_t buildId[ELF_MAX_BUILD_ID_SIZE];
+    for (auto& section : mSections) {
+        const uint8_t* data = section.mType == ELF_SHT_NOTE ? sectionData(section) : nullptr;
+        size_t size = data ? findBuildIdInNotes(data, (size_t)section.mSize, buildId, sizeof(buildId)) : 0;
+        if (size) {
+            mBuildId = buildIdToHex(buildId, size);
+            break;
+        }
+    }
+    return true;
+}
+
+template <typename Header, typename ProgramHeader, typename SectionHeader>
+bool ElfFile::parseHeaders() {
+    if (mSize < sizeof(Header)) {
+        return false;
+    }
+    Header header;
+    memcpy(&header, mData, sizeof(header));
+    mMachine = header.mMachine;
+
+    if (header.mProgramHeaderOffset + (uint64_t)header.mProgramHeaderCount * sizeof(ProgramHeader) <= mSize) {
+        for (uint16_t i = 0; i < header.mProgramHeaderCount; i++) {
+            ProgramHeader programHeader;
+            memcpy(&programHeader, mData + header.mProgramHeaderOffset + i * sizeof(ProgramHeader),
+                    sizeof(programHeader));
+            if (programHeader.mType == ELF_PT_LOAD) {
+                mLoadSegments.push_back(ElfSegment{programHeader.mOffset, programHeader.mVaddr,
+                        programHeader.mFileSize, programHeader.mMemorySize, programHeader.mFlags});
+            }
+        }
+    }
+
+    // Section headers may be absent in files extracted from memory.
+    if (header.mSectionHeaderOffset == 0
+            || header.mSectionHeaderOffset + (uint64_t)header.mSectionHeaderCount * sizeof(SectionHeader) > mSize) {
+        return true;
+    }
+    std::vector<SectionHeader> sectionHeaders(header.mSectionHeaderCount);
+    memcpy(sectionHeaders.data(), mData + header.mSectionHeaderOffset,
+            header.mSectionHeaderCount * sizeof(SectionHeader));
+    const char* names = nullptr;
+    uint64_t namesSize = 0;
+    if (header.mSectionNameIndex < sectionHeaders.size()) {
+        const SectionHeader& nameSection = sectionHeaders[header.mSectionNameIndex];
+        if (nameSection.mOffset + nameSection.mSize <= mSize) {
+            names = reinterpret_cast<const char*>(mData + nameSection.mOffset);
+            namesSize = nameSection.mSize;
+        }
+    }
+    for (auto& sectionHeader : sectionHeaders) {
+        ElfSection section;
+        if (names && sectionHeader.mName < namesSize) {
+            section.mName.assign(names + sectionHeader.mName,
+                    strnlen(names + sectionHeader.mName, (size_t)(namesSize - sectionHeader.mName)));
+        }
+        section.mType = sectionHeader.mType;
+        section.mAddr = sectionHeader.mAddr;
+        section.mOffset = sectionHeader.mOffset;
+        section.mSize = sectionHeader.mSize;
+        section.mLink = sectionHeader.mLink;
+        section.mEntrySize = sectionHeader.mEntrySize;
+        mSections.push_back(std::move(section));
+    }
+    return true;
+}
+
+const ElfSection* ElfFile::findSection(const char* name) const {
+    for (auto& section : mSections) {
+        if (section.mName == name) {
+            return &section;
+        }
+    }
+    return nullptr;
+}
+
+const uint8_t* ElfFile::sectionData(const ElfSection& section) const {
+    if (section.mType == ELF_SHT_NOBITS || section.mOffset + section.mSize > mSize) {
+        return nullptr;
+    }
+    return mData + section.mOffset;
+}
+
+uint64_t ElfFile::firstLoadVaddr() const {
+    return mLoadSegments.empty() ? 0 : mLoadSegments[0].mVaddr - mLoadSegments[0].mOffset;
+}
+
+void ElfFile::forEachSymbol(const std::function<void(const ElfSymbol&)>& onSymbol) const {
+    for (auto& section : mSections) {
+        if (section.mType == ELF_SHT_SYMTAB) {
+            forEachSymbolInTable(ELF_SHT_SYMTAB, onSymbol);
+            return;
+        }
+    }
+    forEachSymbolInTable(ELF_SHT_DYNSYM, onSymbol);
+}
+
+void ElfFile::forEachSymbolInTable(uint32_t tableType, const std::function<void(const ElfSymbol&)>& onSymbol) const {
+    for (auto& section : mSections) {
+        if (section.mType != tableType) {
+            continue;
+        }
+        if (mIs64) {
+            forEachSymbolIn<Elf64Symbol>(section, onSymbol);
+        }
+        else {
+            forEachSymbolIn<Elf32Symbol>(section, onSymbol);
+        }
+    }
+}
+
+template <typename Symbol>
+void ElfFile::forEachSymbolIn(const ElfSection& table, const std::function<void(const ElfSymbol&)>& onSymbol) const {
+    const uint8_t* symbols = sectionData(table);
+    if (!symbols || table.mLink >= mSections.size()) {
+        return;
+    }
+    const ElfSection& stringTable = mSections[table.mLink];
+    const char* strings = reinterpret_cast<const char*>(sectionData(stringTable));
+    if (!strings) {
+        return;
+    }
+    size_t count = (size_t)(table.mSize / sizeof(Symbol));
+    for (size_t i = 0; i < count; i++) {
+        Symbol symbol;
+        memcpy(&symbol, symbols + i * sizeof(Symbol), sizeof(symbol));
+        uint8_t type = symbol.mInfo & 0xf;
+        if ((type != ELF_STT_FUNC && type != ELF_STT_OBJECT) || symbol.mSectionIndex == ELF_SHN_UNDEF
+                || symbol.mName == 0 || symbol.mName >= stringTable.mSize) {
+            continue;
+        }
+        onSymbol(ElfSymbol{strings + symbol.mName, symbol.mValue, symbol.mSize, type});
+    }
+}
+
+} // end of namespace adhocelf
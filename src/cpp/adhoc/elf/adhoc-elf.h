@@ -0,0 +1,298 @@
+/// A small ELF reader, shared by the crash tools and the offline symbolizers.
+/// Only little-endian ELF files are supported (all of the Android ABIs), both 32-bit and 64-bit.
+/// The structures are defined here rather than included from `<elf.h>`, which is absent on macOS
+/// hosts.
+/// See https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+
+#ifndef _ADHOC_TOOLS_ELF_H_
+#define _ADHOC_TOOLS_ELF_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace adhocelf {
+
+const uint8_t ELF_MAGIC[4] = {0x7f, 'E', 'L', 'F'};
+const uint8_t ELF_CLASS_32 = 1;
+const uint8_t ELF_CLASS_64 = 2;
+const uint8_t ELF_DATA_LITTLE_ENDIAN = 1;
+
+/// `e_machine`
+const uint16_t ELF_MACHINE_386 = 3;
+const uint16_t ELF_MACHINE_ARM = 40;
+const uint16_t ELF_MACHINE_X86_64 = 62;
+const uint16_t ELF_MACHINE_AARCH64 = 183;
+
+const uint32_t ELF_PT_LOAD = 1;
+const uint32_t ELF_PT_NOTE = 4;
+
+const uint32_t ELF_SHT_PROGBITS = 1;
+const uint32_t ELF_SHT_SYMTAB = 2;
+const uint32_t ELF_SHT_NOTE = 7;
+const uint32_t ELF_SHT_NOBITS = 8;
+const uint32_t ELF_SHT_DYNSYM = 11;
+
+const uint8_t ELF_STT_OBJECT = 1;
+const uint8_t ELF_STT_FUNC = 2;
+const uint16_t ELF_SHN_UNDEF = 0;
+
+const uint32_t ELF_NT_GNU_BUILD_ID = 3;
+/// The max size of build ids. It is 20 bytes (SHA1) by default, and can be 16 (md5/uuid).
+const size_t ELF_MAX_BUILD_ID_SIZE = 32;
+
+/// The part shared by both classes.
+struct ElfIdent {
+    uint8_t mMagic[4];
+    uint8_t mClass;
+    uint8_t mData;
+    uint8_t mVersion;
+    uint8_t mPadding[9];
+};
+
+struct Elf32Header {
+    ElfIdent mIdent;
+    uint16_t mType;
+    uint16_t mMachine;
+    uint32_t mVersion;
+    uint32_t mEntry;
+    uint32_t mProgramHeaderOffset;
+    uint32_t mSectionHeaderOffset;
+    uint32_t mFlags;
+    uint16_t mHeaderSize;
+    uint16_t mProgramHeaderEntrySize;
+    uint16_t mProgramHeaderCount;
+    uint16_t mSectionHeaderEntrySize;
+    uint16_t mSectionHeaderCount;
+    uint16_t mSectionNameIndex;
+};
+
+struct Elf64Header {
+    ElfIdent mIdent;
+    uint16_t mType;
+    uint16_t mMachine;
+    uint32_t mVersion;
+    uint64_t mEntry;
+    uint64_t mProgramHeaderOffset;
+    uint64_t mSectionHeaderOffset;
+    uint32_t mFlags;
+    uint16_t mHeaderSize;
+    uint16_t mProgramHeaderEntrySize;
+    uint16_t mProgramHeaderCount;
+    uint16_t mSectionHeaderEntrySize;
+    uint16_t mSectionHeaderCount;
+    uint16_t mSectionNameIndex;
+};
+
+struct Elf32ProgramHeader {
+    uint32_t mType;
+    uint32_t mOffset;
+    uint32_t mVaddr;
+    uint32_t mPaddr;
+    uint32_t mFileSize;
+    uint32_t mMemorySize;
+    uint32_t mFlags;
+    uint32_t mAlign;
+};
+
+struct Elf64ProgramHeader {
+    uint32_t mType;
+    uint32_t mFlags;
+    uint64_t mOffset;
+    uint64_t mVaddr;
+    uint64_t mPaddr;
+    uint64_t mFileSize;
+    uint64_t mMemorySize;
+    uint64_t mAlign;
+};
+
+struct Elf32SectionHeader {
+    uint32_t mName;
+    uint32_t mType;
+    uint32_t mFlags;
+    uint32_t mAddr;
+    uint32_t mOffset;
+    uint32_t mSize;
+    uint32_t mLink;
+    uint32_t mInfo;
+    uint32_t mAlign;
+    uint32_t mEntrySize;
+};
+
+struct Elf64SectionHeader {
+    uint32_t mName;
+    uint32_t mType;
+    uint64_t mFlags;
+    uint64_t mAddr;
+    uint64_t mOffset;
+    uint64_t mSize;
+    uint32_t mLink;
+    uint32_t mInfo;
+    uint64_t mAlign;
+    uint64_t mEntrySize;
+};
+
+struct Elf32Symbol {
+    uint32_t mName;
+    uint32_t mValue;
+    uint32_t mSize;
+    uint8_t mInfo;
+    uint8_t mOther;
+    uint16_t mSectionIndex;
+};
+
+struct Elf64Symbol {
+    uint32_t mName;
+    uint8_t mInfo;
+    uint8_t mOther;
+    uint16_t mSectionIndex;
+    uint64_t mValue;
+    uint64_t mSize;
+};
+
+struct ElfNoteHeader {
+    uint32_t mNameSize;
+    uint32_t mDescSize;
+    uint32_t mType;
+};
+
+static_assert(sizeof(Elf32Header) == 52, "Elf32Header should be 52 bytes");
+static_assert(sizeof(Elf64Header) == 64, "Elf64Header should be 64 bytes");
+static_assert(sizeof(Elf64ProgramHeader) == 56, "Elf64ProgramHeader should be 56 bytes");
+static_assert(sizeof(Elf64SectionHeader) == 64, "Elf64SectionHeader should be 64 bytes");
+static_assert(sizeof(Elf64Symbol) == 24, "Elf64Symbol should be 24 bytes");
+
+inline bool isSupportedElf(const void* data, size_t size) {
+    if (size < sizeof(ElfIdent)) {
+        return false;
+    }
+    const ElfIdent* ident = static_cast<const ElfIdent*>(data);
+    return memcmp(ident->mMagic, ELF_MAGIC, sizeof(ELF_MAGIC)) == 0
+            && (ident->mClass == ELF_CLASS_32 || ident->mClass == ELF_CLASS_64)
+            && ident->mData == ELF_DATA_LITTLE_ENDIAN;
+}
+
+/// Find the GNU build id in the content of a note segment or section.
+/// Nothing is allocated, so that it can be used in signal handlers.
+/// @return the size of the build id written to `out`, 0 if not found.
+inline size_t findBuildIdInNotes(const uint8_t* data, size_t size, uint8_t* out, size_t maxSize) {
+    size_t offset = 0;
+    while (offset + sizeof(ElfNoteHeader) <= size) {
+        ElfNoteHeader note;
+        memcpy(&note, data + offset, sizeof(note));
+        offset += sizeof(note);
+        size_t nameEnd = offset + ((note.mNameSize + 3) & ~3u);
+        size_t descEnd = nameEnd + ((note.mDescSize + 3) & ~3u);
+        if (descEnd > size || nameEnd > size) {
+            return 0;
+        }
+        if (note.mType == ELF_NT_GNU_BUILD_ID && note.mNameSize == 4
+                && memcmp(data + offset, "GNU", 4) == 0 && note.mDescSize <= maxSize) {
+            memcpy(out, data + nameEnd, note.mDescSize);
+            return note.mDescSize;
+        }
+        offset = descEnd;
+    }
+    return 0;
+}
+
+/// Like "0a1b2c...", as shown by `readelf -n` or `file`.
+inline std::string buildIdToHex(const uint8_t* buildId, size_t size) {
+    static const char HEX[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += HEX[buildId[i] >> 4];
+        hex += HEX[buildId[i] & 0xf];
+    }
+    return hex;
+}
+
+/// A section, in the same form for both classes.
+struct ElfSection {
+    std::string mName;
+    uint32_t mType;
+    uint64_t mAddr;
+    uint64_t mOffset;
+    uint64_t mSize;
+    uint32_t mLink;
+    uint64_t mEntrySize;
+};
+
+/// A loadable segment.
+struct ElfSegment {
+    uint64_t mOffset;
+    uint64_t mVaddr;
+    uint64_t mFileSize;
+    uint64_t mMemorySize;
+    uint32_t mFlags;
+};
+
+struct ElfSymbol {
+    /// Points into the string table of the file.
+    const char* mName;
+    uint64_t mValue;
+    uint64_t mSize;
+    uint8_t mType;
+};
+
+/// An ELF file mapped into memory (read only), or an ELF image already in memory (for example,
+/// decompressed from `.gnu_debugdata`).
+/// Not thread-safe to open, but all of the const methods can be called concurrently.
+class ElfFile {
+  public:
+    ElfFile() {}
+    ~ElfFile();
+    ElfFile(const ElfFile&) = delete;
+    ElfFile& operator=(const ElfFile&) = delete;
+
+    bool open(const char* path);
+    /// The memory should live as long as it.
+    bool openMemory(const uint8_t* data, size_t size);
+
+    const std::string& path() const { return mPath; }
+    bool is64() const { return mIs64; }
+    uint16_t machine() const { return mMachine; }
+    const uint8_t* data() const { return mData; }
+    size_t size() const { return mSize; }
+    const std::vector<ElfSection>& sections() const { return mSections; }
+    const std::vector<ElfSegment>& loadSegments() const { return mLoadSegments; }
+
+    /// The first one of the name, or null.
+    const ElfSection* findSection(const char* name) const;
+    /// Null if it is out of the file (`SHT_NOBITS` or truncated).
+    const uint8_t* sectionData(const ElfSection& section) const;
+    /// The vaddr of the first loadable segment, which is mapped at the load base.
+    uint64_t firstLoadVaddr() const;
+    /// Hex, empty if there is none.
+    const std::string& buildId() const { return mBuildId; }
+
+    /// Iterate functions and objects (defined, with names) in `.symtab`, or `.dynsym` if there
+    /// is no `.symtab`.
+    void forEachSymbol(const std::function<void(const ElfSymbol&)>& onSymbol) const;
+    /// Like `forEachSymbol`, but only in the section of the type (`ELF_SHT_SYMTAB` or `ELF_SHT_DYNSYM`).
+    void forEachSymbolInTable(uint32_t tableType, const std::function<void(const ElfSymbol&)>& onSymbol) const;
+
+  private:
+    bool parse();
+    template <typename Header, typename ProgramHeader, typename SectionHeader>
+    bool parseHeaders();
+    template <typename Symbol>
+    void forEachSymbolIn(const ElfSection& table, const std::function<void(const ElfSymbol&)>& onSymbol) const;
+
+    std::string mPath;
+    const uint8_t* mData = nullptr;
+    size_t mSize = 0;
+    bool mMapped = false;
+    bool mIs64 = false;
+    uint16_t mMachine = 0;
+    std::vector<ElfSection> mSections;
+    std::vector<ElfSegment> mLoadSegments;
+    std::string mBuildId;
+};
+
+} // end of namespace adhocelf
+
+#endif // _ADHOC_TOOLS_ELF_H_
@@ -0,0 +1,114 @@
+#include "adhoc-symbol-index.h"
+
+#include <algorithm>
+
+#include "config.h"
+
+#if _ADHOC_TOOLS_ELF_LZMA_
+#include <lzma.h>
+#endif
+
+namespace adhocelf {
+
+namespace {
+
+#if _ADHOC_TOOLS_ELF_LZMA_
+/// Decompress a whole xz stream.
+bool decompressXz(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&stream, UINT64_MAX, 0) != LZMA_OK) {
+        return false;
+    }
+    out.resize(size * 4);
+    stream.next_in = data;
+    stream.avail_in = size;
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+    lzma_ret ret;
+    while ((ret = lzma_code(&stream, LZMA_FINISH)) == LZMA_OK) {
+        if (stream.avail_out == 0) {
+            size_t used = out.size();
+            out.resize(used * 2);
+            stream.next_out = out.data() + used;
+            stream.avail_out = out.size() - used;
+        }
+    }
+    out.resize(out.size() - stream.avail_out);
+    lzma_end(&stream);
+    return ret == LZMA_STREAM_END;
+}
+#endif
+
+} // end of anonymous namespace
+
+
+bool SymbolIndex::load(const ElfFile& elf) {
+    addSymbols(elf, ELF_SHT_SYMTAB);
+    addSymbols(elf, ELF_SHT_DYNSYM);
+#if _ADHOC_TOOLS_ELF_LZMA_
+    // Stripped files may keep the local functions here, in a tiny ELF file compressed by xz.
+    const ElfSection* miniDebugInfo = elf.findSection(".gnu_debugdata");
+    const uint8_t* compressed = miniDebugInfo ? elf.sectionData(*miniDebugInfo) : nullptr;
+    std::vector<uint8_t> decompressed;
+    if (compressed && decompressXz(compressed, miniDebugInfo->mSize, decompressed)) {
+        ElfFile miniElf;
+        if (miniElf.openMemory(decompressed.data(), decompressed.size())) {
+            addSymbols(miniElf, ELF_SHT_SYMTAB);
+            mHasMiniDebugInfo = true;
+        }
+    }
+#endif
+    // The same function can be in several tables, or have aliases. Keep one of them, with
+    // the size if any.
+    std::sort(mSymbols.begin(), mSymbols.end(), [](const Symbol& a, const Symbol& b) {
+        return a.mStart < b.mStart || (a.mStart == b.mStart && a.mSize > b.mSize);
+    });
+    mSymbols.erase(std::unique(mSymbols.begin(), mSymbols.end(), [](const Symbol& a, const Symbol& b) {
+        return a.mStart == b.mStart;
+    }), mSymbols.end());
+    mSymbols.shrink_to_fit();
+    mNames.shrink_to_fit();
+    mNameOffsets.clear();
+    return !mSymbols.empty();
+}
+
+void SymbolIndex::addSymbols(const ElfFile& elf, uint32_t tableType) {
+    bool isArm = elf.machine() == ELF_MACHINE_ARM;
+    elf.forEachSymbolInTable(tableType, [&](const ElfSymbol& symbol) {
+        if (symbol.mType != ELF_STT_FUNC || symbol.mValue == 0) {
+            return;
+        }
+        // The lowest bit of thumb functions is set.
+        uint64_t start = isArm ? symbol.mValue & ~1ULL : symbol.mValue;
+        uint32_t size = symbol.mSize > UINT32_MAX ? UINT32_MAX : (uint32_t)symbol.mSize;
+        mSymbols.push_back(Symbol{start, size, internName(symbol.mName)});
+    });
+}
+
+uint32_t SymbolIndex::internName(const char* name) {
+    auto found = mNameOffsets.find(name);
+    if (found != mNameOffsets.end()) {
+        return found->second;
+    }
+    uint32_t offset = (uint32_t)mNames.size();
+    mNames.insert(mNames.end(), name, name + strlen(name) + 1);
+    mNameOffsets.emplace(name, offset);
+    return offset;
+}
+
+const char* SymbolIndex::find(uint64_t vaddr, uint64_t& offset) const {
+    auto found = std::upper_bound(mSymbols.begin(), mSymbols.end(), vaddr, [](uint64_t address, const Symbol& symbol) {
+        return address < symbol.mStart;
+    });
+    if (found == mSymbols.begin()) {
+        return nullptr;
+    }
+    --found;
+    if (found->mSize && vaddr >= found->mStart + found->mSize) {
+        return nullptr;
+    }
+    offset = vaddr - found->mStart;
+    return mNames.data() + found->mName;
+}
+
+} // end of namespace adhocelf
@@ -0,0 +1,59 @@
+/// Find the function of an address by all of the symbols of an ELF file, including the
+/// local ones (static functions, anonymous namespaces), which `dladdr` can not see since it
+/// only reads `.dynsym`.
+/// Symbols are read from `.symtab` and `.dynsym`, and from the `.symtab` in the MiniDebugInfo
+/// (`.gnu_debugdata`) if the file is stripped (see `_ADHOC_TOOLS_ELF_LZMA_`).
+/// See https://sourceware.org/gdb/current/onlinedocs/gdb.html/MiniDebugInfo.html
+
+#ifndef _ADHOC_TOOLS_SYMBOL_INDEX_H_
+#define _ADHOC_TOOLS_SYMBOL_INDEX_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "adhoc-elf.h"
+
+namespace adhocelf {
+
+/// Functions sorted by address (16 bytes each), with their names in a pool where each
+/// distinct name is stored once. Looked up by binary search.
+/// Not thread-safe to load, but `find()` can be called concurrently after it is loaded.
+class SymbolIndex {
+  public:
+    /// @return false if there is no function symbol at all.
+    bool load(const ElfFile& elf);
+
+    /// @param vaddr the virtual address in the ELF file (not the runtime pc).
+    /// @param offset set to the offset to the start of the function.
+    /// @return the mangled name (lives as long as the index), or null if not in any function.
+    const char* find(uint64_t vaddr, uint64_t& offset) const;
+
+    size_t symbolCount() const { return mSymbols.size(); }
+    /// Whether the symbols of `.gnu_debugdata` are included.
+    bool hasMiniDebugInfo() const { return mHasMiniDebugInfo; }
+
+  private:
+    struct Symbol {
+        uint64_t mStart;
+        /// 0 if unknown, in which case it covers until the next symbol.
+        uint32_t mSize;
+        /// Offset in `mNames`.
+        uint32_t mName;
+    };
+
+    void addSymbols(const ElfFile& elf, uint32_t tableType);
+    uint32_t internName(const char* name);
+
+    std::vector<Symbol> mSymbols;
+    /// Names ended with '\0'.
+    std::vector<char> mNames;
+    /// Name to offset in `mNames`, only used while loading.
+    std::unordered_map<std::string, uint32_t> mNameOffsets;
+    bool mHasMiniDebugInfo = false;
+};
+
+} // end of namespace adhocelf
+
+#endif // _ADHOC_TOOLS_SYMBOL_INDEX_H_
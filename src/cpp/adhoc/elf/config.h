@@ -0,0 +1,4 @@
+/// Decompress the MiniDebugInfo (`.gnu_debugdata`, xz) of stripped libraries, which needs
+/// liblzma (https://tukaani.org/xz/) to be linked. Most Android system libraries have it.
+/// Without it, only `.symtab` and `.dynsym` are read.
+#define _ADHOC_TOOLS_ELF_LZMA_ 0
@@ -0,0 +1,292 @@
+#include "adhoc-log.h"
+
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+namespace adhoclog {
+
+namespace {
+
+const size_t MAX_MESSAGE_LENGTH = _ADHOC_TOOLS_LOG_MAX_MESSAGE_LENGTH_;
+const size_t ASYNC_MAX_QUEUED_BYTES = _ADHOC_TOOLS_LOG_ASYNC_MAX_QUEUED_BYTES_;
+
+std::atomic<LogSink*> s_sink{nullptr};
+
+char levelChar(LogLevel level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return 'D';
+        case LOG_LEVEL_INFO: return 'I';
+        case LOG_LEVEL_WARN: return 'W';
+        default: return 'E';
+    }
+}
+
+/// Never destroyed, so that it can be used in static destructors of other files.
+LogSink* defaultLogSink() {
+    static LogSink* sink = [] {
+#ifdef __ANDROID__
+        LogSink* target = new AndroidLogSink();
+#else
+        LogSink* target = new FileLogSink(stderr);
+#endif
+#if _ADHOC_TOOLS_LOG_DEFAULT_ASYNC_
+        LogSink* async = new AsyncLogSink(target);
+        atexit(logFlush);
+        return async;
+#else
+        return target;
+#endif
+    }();
+    return sink;
+}
+
+} // end of anonymous namespace
+
+
+#ifdef __ANDROID__
+void AndroidLogSink::write(LogLevel level, const char* tag, const char* message, size_t length) {
+    static const int PRIORITIES[] = {ANDROID_LOG_DEBUG, ANDROID_LOG_INFO, ANDROID_LOG_WARN, ANDROID_LOG_ERROR};
+    __android_log_print(PRIORITIES[level], tag, "%.*s", (int)length, message);
+}
+#endif
+
+
+FileLogSink::FileLogSink(FILE* file, bool autoFlush): mFile(file), mOwnsFile(false), mAutoFlush(autoFlush) {
+}
+
+FileLogSink::FileLogSink(const char* path, bool autoFlush)
+        : mFile(fopen(path, "ae")), mOwnsFile(true), mAutoFlush(autoFlush) {
+}
+
+FileLogSink::~FileLogSink() {
+    if (mFile && mOwnsFile) {
+        fclose(mFile);
+    }
+}
+
+void FileLogSink::write(LogLevel level, const char* tag, const char* message, size_t length) {
+    if (!mFile) {
+        return;
+    }
+    // Some messages are already ended with line break.
+    bool hasLineBreak = length > 0 && message[length - 1] == '\n';
+    std::lock_guard<std::mutex> lock(mMutex);
+    fprintf(mFile, "%c %s: %.*s%s", levelChar(level), tag, (int)length, message, hasLineBreak ? "" : "\n");
+    if (mAutoFlush) {
+        fflush(mFile);
+    }
+}
+
+void FileLogSink::flush() {
+    if (!mFile) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    fflush(mFile);
+}
+
+
+void MemoryLogSink::write(LogLevel level, const char* tag, const char* message, size_t length) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.push_back(Entry{level, tag, std::string(message, length)});
+}
+
+std::vector<MemoryLogSink::Entry> MemoryLogSink::take() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::vector<Entry> entries;
+    entries.swap(mEntries);
+    return entries;
+}
+
+
+struct AsyncLogSink::Message {
+    std::atomic<Message*> mNext;
+    LogLevel mLevel;
+    size_t mLength;
+    /// The tag (null-terminated), and then the text.
+    char mData[1];
+
+    const char* tag() const { return mData; }
+    const char* text() const { return mData + strlen(mData) + 1; }
+
+    static Message* create(LogLevel level, const char* tag, const char* text, size_t length) {
+        size_t tagSize = strlen(tag) + 1;
+        size_t size = offsetof(Message, mData) + tagSize + length;
+        void* memory = malloc(size < sizeof(Message) ? sizeof(Message) : size);
+        if (!memory) {
+            return nullptr;
+        }
+        Message* message = new (memory) Message();
+        message->mNext.store(nullptr, std::memory_order_relaxed);
+        message->mLevel = level;
+        message->mLength = length;
+        memcpy(message->mData, tag, tagSize);
+        memcpy(message->mData + tagSize, text, length);
+        return message;
+    }
+
+    static void destroy(Message* message) {
+        message->~Message();
+        free(message);
+    }
+};
+
+AsyncLogSink::AsyncLogSink(LogSink* target)
+        : mTarget(target), mQueuedBytes(0), mDropped(0), mStopRequested(false) {
+    mStub = Message::create(LOG_LEVEL_INFO, "", "", 0);
+    mHead.store(mStub, std::memory_order_relaxed);
+    mTail = mStub;
+    mWriter = std::thread(&AsyncLogSink::writerLoop, this);
+}
+
+AsyncLogSink::~AsyncLogSink() {
+    {
+        std::lock_guard<std::mutex> lock(mWakeMutex);
+        mStopRequested = true;
+    }
+    mWakeCondition.notify_all();
+    mWriter.join();
+    flush();
+    Message::destroy(mStub);
+}
+
+void AsyncLogSink::write(LogLevel level, const char* tag, const char* message, size_t length) {
+    if (mQueuedBytes.fetch_add(length, std::memory_order_relaxed) + length > ASYNC_MAX_QUEUED_BYTES) {
+        mQueuedBytes.fetch_sub(length, std::memory_order_relaxed);
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Message* node = Message::create(level, tag, message, length);
+    if (!node) {
+        mQueuedBytes.fetch_sub(length, std::memory_order_relaxed);
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    push(node);
+    // The writer is not woken up here, it picks up messages in every interval, so that
+    // writers never make syscalls.
+}
+
+void AsyncLogSink::push(Message* message) {
+    message->mNext.store(nullptr, std::memory_order_relaxed);
+    Message* previous = mHead.exchange(message, std::memory_order_acq_rel);
+    // Between the exchange and the store, the consumer sees the queue as ended at `previous`.
+    previous->mNext.store(message, std::memory_order_release);
+}
+
+bool AsyncLogSink::drain() {
+    bool written = false;
+    uint64_t dropped = mDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+        std::string message = std::to_string(dropped) + " log messages are dropped, since the writer can not catch up.";
+        mTarget->write(LOG_LEVEL_WARN, "adhoclog", message.data(), message.size());
+        written = true;
+    }
+    while (true) {
+        Message* tail = mTail;
+        Message* next = tail->mNext.load(std::memory_order_acquire);
+        if (tail == mStub) {
+            if (!next) {
+                break;
+            }
+            mTail = tail = next;
+            next = next->mNext.load(std::memory_order_acquire);
+        }
+        if (!next) {
+            if (tail != mHead.load(std::memory_order_acquire)) {
+                // A producer is linking a new message, take it in the next time.
+                break;
+            }
+            // `tail` is the last one. Push the stub behind it, so that it can be taken out.
+            push(mStub);
+            next = tail->mNext.load(std::memory_order_acquire);
+            if (!next) {
+                break;
+            }
+        }
+        mTail = next;
+        mTarget->write(tail->mLevel, tail->tag(), tail->text(), tail->mLength);
+        mQueuedBytes.fetch_sub(tail->mLength, std::memory_order_relaxed);
+        Message::destroy(tail);
+        written = true;
+    }
+    return written;
+}
+
+void AsyncLogSink::flush() {
+    std::lock_guard<std::mutex> lock(mDrainMutex);
+    drain();
+    mTarget->flush();
+}
+
+void AsyncLogSink::writerLoop() {
+    std::unique_lock<std::mutex> lock(mWakeMutex);
+    while (!mStopRequested) {
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> drainLock(mDrainMutex);
+            if (drain()) {
+                // One flush per batch.
+                mTarget->flush();
+            }
+        }
+        lock.lock();
+        if (mStopRequested) {
+            break;
+        }
+        mWakeCondition.wait_for(lock, std::chrono::milliseconds(_ADHOC_TOOLS_LOG_ASYNC_INTERVAL_MS_));
+    }
+}
+
+
+void setLogSink(LogSink* sink) {
+    s_sink.store(sink, std::memory_order_release);
+}
+
+LogSink* getLogSink() {
+    LogSink* sink = s_sink.load(std::memory_order_acquire);
+    return sink ? sink : defaultLogSink();
+}
+
+void logWrite(LogLevel level, const char* tag, const char* message, size_t length) {
+    if (!tag) {
+        tag = "";
+    }
+    getLogSink()->write(level, tag, message, length < MAX_MESSAGE_LENGTH ? length : MAX_MESSAGE_LENGTH);
+}
+
+void logPrint(LogLevel level, const char* tag, const char* format, ...) {
+    char stackBuffer[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(stackBuffer, sizeof(stackBuffer), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if ((size_t)length < sizeof(stackBuffer)) {
+        logWrite(level, tag, stackBuffer, length);
+        return;
+    }
+    size_t bufferSize = ((size_t)length < MAX_MESSAGE_LENGTH ? length : MAX_MESSAGE_LENGTH) + 1;
+    char* buffer = static_cast<char*>(malloc(bufferSize));
+    if (!buffer) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(buffer, bufferSize, format, args);
+    va_end(args);
+    logWrite(level, tag, buffer, bufferSize - 1);
+    free(buffer);
+}
+
+void logFlush() {
+    getLogSink()->flush();
+}
+
+} // end of namespace adhoclog
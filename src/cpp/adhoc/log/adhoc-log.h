@@ -0,0 +1,138 @@
+/// Log sinks used by all of the adhoc tools, so that they can run on Android or on Linux
+/// host, and the reports do not block the calling threads on I/O.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/log/adhoc-log.h"
+/// // Optional. By default, log to Android logcat in NDK, or stderr in others, in a
+/// // background thread (see `_ADHOC_TOOLS_LOG_DEFAULT_ASYNC_`).
+/// static adhoclog::FileLogSink fileSink("/data/data/com.xxx.yyy/files/adhoc.log");
+/// static adhoclog::AsyncLogSink asyncSink(&fileSink);
+/// adhoclog::setLogSink(&asyncSink);
+///
+/// adhoclog::logPrint(adhoclog::LOG_LEVEL_INFO, "adhoc", "count: %d", count);
+/// ```
+
+#ifndef _ADHOC_TOOLS_LOG_H_
+#define _ADHOC_TOOLS_LOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+namespace adhoclog {
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+/// Sinks should be thread-safe, and live as long as they are set by `setLogSink()`.
+class LogSink {
+  public:
+    virtual ~LogSink() {}
+    /// @param message is not null-terminated necessarily.
+    virtual void write(LogLevel level, const char* tag, const char* message, size_t length) = 0;
+    /// Write out all of the messages written before.
+    virtual void flush() {}
+};
+
+#ifdef __ANDROID__
+/// Android logcat.
+class AndroidLogSink : public LogSink {
+  public:
+    void write(LogLevel level, const char* tag, const char* message, size_t length) override;
+};
+#endif
+
+/// Writes lines like `I adhoc: message` to a file (stderr by default), buffered until `flush()`
+/// if `autoFlush` is false.
+class FileLogSink : public LogSink {
+  public:
+    explicit FileLogSink(FILE* file = stderr, bool autoFlush = true);
+    /// Append to the file of the path. Nothing is written if it can not be opened.
+    explicit FileLogSink(const char* path, bool autoFlush = true);
+    ~FileLogSink() override;
+    void write(LogLevel level, const char* tag, const char* message, size_t length) override;
+    void flush() override;
+  private:
+    std::mutex mMutex;
+    FILE* mFile;
+    bool mOwnsFile;
+    bool mAutoFlush;
+};
+
+/// Keeps messages in memory, for tests or to send them by other means.
+class MemoryLogSink : public LogSink {
+  public:
+    struct Entry {
+        LogLevel mLevel;
+        std::string mTag;
+        std::string mMessage;
+    };
+    void write(LogLevel level, const char* tag, const char* message, size_t length) override;
+    /// Take the messages out.
+    std::vector<Entry> take();
+  private:
+    std::mutex mMutex;
+    std::vector<Entry> mEntries;
+};
+
+/// Hands messages to a background thread, which writes them to the target sink in batches.
+/// Writing only formats the message and pushes it into a lock-free queue, so it never
+/// blocks on I/O or on other writers.
+class AsyncLogSink : public LogSink {
+  public:
+    explicit AsyncLogSink(LogSink* target);
+    /// Write out the queued messages and stop the background thread.
+    ~AsyncLogSink() override;
+    void write(LogLevel level, const char* tag, const char* message, size_t length) override;
+    /// Wait until all of the messages written before are written to the target.
+    void flush() override;
+
+  private:
+    struct Message;
+    void push(Message* message);
+    /// @return whether any message is written.
+    bool drain();
+    void writerLoop();
+
+    LogSink* mTarget;
+    /// A Vyukov MPSC queue: producers exchange `mHead`, and the only consumer reads from
+    /// `mTail`. `mStub` keeps it never empty.
+    alignas(64) std::atomic<Message*> mHead;
+    alignas(64) std::atomic<size_t> mQueuedBytes;
+    std::atomic<uint64_t> mDropped;
+    alignas(64) Message* mTail;
+    Message* mStub;
+    /// Held by the consumer.
+    std::mutex mDrainMutex;
+    std::mutex mWakeMutex;
+    std::condition_variable mWakeCondition;
+    bool mStopRequested;
+    std::thread mWriter;
+};
+
+/// Not owned. Set it to null to use the default sink.
+extern void setLogSink(LogSink* sink);
+extern LogSink* getLogSink();
+
+extern void logWrite(LogLevel level, const char* tag, const char* message, size_t length);
+extern void logPrint(LogLevel level, const char* tag, const char* format, ...)
+        __attribute__((format(printf, 3, 4)));
+/// Flush the current sink, for example, before the process exits.
+extern void logFlush();
+
+} // end of namespace adhoclog
+
+#endif // _ADHOC_TOOLS_LOG_H_
@@ -0,0 +1,14 @@
+/// Whether the default sink writes in a background thread (see `AsyncLogSink`).
+/// The default sink is Android logcat in NDK, and stderr in others.
+#define _ADHOC_TOOLS_LOG_DEFAULT_ASYNC_ 1
+
+/// Messages longer than it are truncated.
+#define _ADHOC_TOOLS_LOG_MAX_MESSAGE_LENGTH_ (64 * 1024)
+
+/// If the background writer can not catch up, new messages are dropped once the queued
+/// messages exceed it (and the dropped count is logged later).
+#define _ADHOC_TOOLS_LOG_ASYNC_MAX_QUEUED_BYTES_ (4 * 1024 * 1024)
+
+/// The max latency of the background writer to pick up new messages, which is also how often
+/// it wakes up when idle. Producers never wait for it.
+#define _ADHOC_TOOLS_LOG_ASYNC_INTERVAL_MS_ 20
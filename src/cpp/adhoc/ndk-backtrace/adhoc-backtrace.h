@@ -0,0 +1,104 @@
+/// Capture backtraces cheaply, and symbolize them later (or never).
+/// Unlike `adhoc_dumpCppBacktrace`, which resolves and logs every frame right away, it can be
+/// used on warm paths, like logging where something is called from.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/ndk-backtrace/adhoc-backtrace.h"
+///
+/// adhocbacktrace::Backtrace backtrace;
+/// adhocbacktrace::captureBacktrace(backtrace);
+/// // ... later, maybe in another thread.
+/// adhocbacktrace::logBacktrace("adhoc", backtrace);
+/// ```
+/// Symbols are resolved at the first time of each pc, and then taken from a process-wide
+/// lock-free cache. Libraries are assumed to be never unloaded (`dlclose`).
+/// Source file and line are resolved by the `.debug_line` of the object file, if it is not
+/// stripped (see `_ADHOC_TOOLS_BACKTRACE_RESOLVE_LINES_`).
+
+#ifndef _ADHOC_TOOLS_BACKTRACE_H_
+#define _ADHOC_TOOLS_BACKTRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "config.h"
+
+namespace adhocbacktrace {
+
+const size_t MAX_BACKTRACE_FRAMES = _ADHOC_TOOLS_BACKTRACE_MAX_FRAMES_;
+
+/// Raw pcs, the innermost first. It is a plain struct, so it can be kept or copied by value.
+struct Backtrace {
+    uint32_t mCount;
+    void* mPcs[MAX_BACKTRACE_FRAMES];
+};
+
+/// How `captureBacktrace` walks the stack.
+enum UnwindMethod {
+    /// By `_Unwind_Backtrace`, which finds and interprets the unwind tables (`.eh_frame` or
+    /// `.ARM.exidx`) for every frame. Works for any code, but takes microseconds.
+    UNWIND_BY_TABLES = 0,
+    /// By the chain of frame pointers, which is several times faster, but only works for the
+    /// code compiled by `-fno-omit-frame-pointer` (the frames above a function compiled
+    /// without it are lost). Falls back to `UNWIND_BY_TABLES` if the chain looks broken right
+    /// away, or on 32-bit ARM.
+    UNWIND_BY_FRAME_POINTERS = 1,
+};
+/// The default is `_ADHOC_TOOLS_BACKTRACE_UNWIND_METHOD_`. Can be changed at any time.
+void setUnwindMethod(UnwindMethod method);
+UnwindMethod getUnwindMethod();
+
+/// Nothing is allocated (except by `initThreadStackBounds()` the first time in a thread).
+/// @param skipFrames the count of the innermost callers to skip (this function itself is
+/// always skipped).
+void captureBacktrace(Backtrace& backtrace, int skipFrames = 0);
+
+/// Like `captureBacktrace`, but async-signal-safe. With `UNWIND_BY_FRAME_POINTERS`, call
+/// `initThreadStackBounds()` in the thread beforehand, or it falls back to the unwind tables.
+void captureBacktraceInSignalHandler(Backtrace& backtrace, int skipFrames = 0);
+
+/// Capture the stack interrupted by a signal, from the interrupted pc rather than from the
+/// signal handler (whose frames are not included). Async-signal-safe, like
+/// `captureBacktraceInSignalHandler`.
+/// @param ucontext the third argument of the `SA_SIGINFO` handler.
+/// @return the count of pcs written. The first one is the interrupted pc itself, the others
+/// are return addresses.
+size_t captureInterruptedBacktrace(const void* ucontext, void** pcs, size_t maxCount);
+
+/// Find and keep the bounds of the stack of the current thread, which the frame pointers
+/// are checked against. Not async-signal-safe.
+/// @return false if they can not be found.
+bool initThreadStackBounds();
+
+struct SymbolInfo {
+    /// The path of the object file, null if unknown.
+    const char* mModule;
+    /// Relative to the base of the object file, which `addr2line` accepts. The absolute pc
+    /// if the object file is unknown.
+    uintptr_t mModuleOffset;
+    /// The function, by the symbols of the object file if it can be read (see
+    /// `_ADHOC_TOOLS_BACKTRACE_RESOLVE_SYMTAB_`), or else by the dynamic symbols. Null if unknown.
+    const char* mSymbol;
+    /// The same as `mSymbol` if it is not mangled.
+    const char* mDemangled;
+    uintptr_t mSymbolOffset;
+    /// The source file, null if unknown.
+    const char* mFile;
+    /// 0 if unknown.
+    uint32_t mLine;
+};
+
+/// Thread-safe. The returned info lives forever, unless the cache is full, in which case it
+/// is valid until the next call in the same thread.
+const SymbolInfo& symbolize(const void* pc);
+
+/// Lines like `    # 0: 0x1234  foo(int)+0x10 @/path/libxxx.so (foo.cpp:12)`, each ended with a
+/// line break. The source file and line are omitted if unknown.
+void formatBacktrace(const Backtrace& backtrace, std::string& out);
+void logBacktrace(const char* tag, const Backtrace& backtrace);
+
+} // end of namespace adhocbacktrace
+
+#endif // _ADHOC_TOOLS_BACKTRACE_H_
@@ -3,26 +3,54 @@
 // #define _ADHOC_TOOLS_NDK_BACKTRACE_DONT_DEMANGLE_ 1
 
 #include "adhoc-ndk-backtrace.h"
+#include "adhoc-backtrace.h"
 #include <unwind.h>
 #include <dlfcn.h> // For dladdr()
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
-#include <sstream>
-#include <iomanip> // For std::setw()
-#include <android/log.h> // Only for __android_log_print
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #ifndef _ADHOC_TOOLS_NDK_BACKTRACE_DONT_DEMANGLE_
 #include <cxxabi.h> // Only for demangling
 #endif
 
 #include "../common/adhoc-private.h"
+#include "../common/adhoc-signal-safe.h"
+#include "../elf/adhoc-dwarf-line.h"
+#include "../elf/adhoc-symbol-index.h"
+#include "../log/adhoc-log.h"
 
 
 namespace {
 
 const size_t BUFFER_MAX = 500;
+const size_t LINE_BUFFER_SIZE = 512;
+const size_t SYMBOL_CACHE_SIZE = _ADHOC_TOOLS_BACKTRACE_SYMBOL_CACHE_SIZE_;
+/// Give up caching after probing that many entries.
+const size_t SYMBOL_CACHE_MAX_PROBES = 64;
+const bool RESOLVE_LINES = _ADHOC_TOOLS_BACKTRACE_RESOLVE_LINES_;
+const bool RESOLVE_SYMTAB = _ADHOC_TOOLS_BACKTRACE_RESOLVE_SYMTAB_;
+/// If the frame pointer chain ends with less frames, it is taken as broken (like the code
+/// calling is compiled without frame pointers).
+const size_t MIN_FRAME_POINTER_FRAMES = 3;
+
+std::atomic<int> s_unwindMethod(_ADHOC_TOOLS_BACKTRACE_UNWIND_METHOD_);
 
 struct BacktraceState {
     void** current; // pointer of addr
     void** end; // pointer of addr
+    int skip; // count of frames to skip
 };
 
 static _Unwind_Reason_Code unwindCallback(
@@ -30,7 +58,10 @@ static _Unwind_Reason_Code unwindCallback(
     BacktraceState* state = static_cast<BacktraceState*>(arg);
     uintptr_t pc = _Unwind_GetIP(context);
     if (pc) {
-        if (state->current == state->end) {
+        if (state->skip > 0) {
+            state->skip--;
+        }
+        else if (state->current == state->end) {
             return _URC_END_OF_STACK;
         }
         else {
@@ -40,52 +71,247 @@ static _Unwind_Reason_Code unwindCallback(
     return _URC_NO_REASON;
 }
 
-} // end of anonymous namespace
+/// The range of the stack of a thread, [mLow, mHigh). {0, 0} if unknown.
+struct StackBounds {
+    uintptr_t mLow;
+    uintptr_t mHigh;
 
+    bool contains(uintptr_t address, size_t size) const {
+        return address >= mLow && address < mHigh && mHigh - address >= size;
+    }
+};
+/// Set by `adhocbacktrace::initThreadStackBounds()`, since `pthread_getattr_np` is not
+/// async-signal-safe.
+thread_local StackBounds t_stackBounds;
 
-void adhoc_dumpCppBacktrace(const char* tag) {
+static inline uintptr_t stripPointerAuthentication(uintptr_t pc) {
+#if defined(__aarch64__)
+    // Return addresses may be signed (`-mbranch-protection=pac-ret`). `xpaclri` strips the
+    // signature in x30, and is a nop before ARMv8.3.
+    register uintptr_t x30 __asm__("x30") = pc;
+    __asm__("hint 0x7" : "+r"(x30));
+    return x30;
+#else
+    return pc;
+#endif
+}
 
-    __android_log_print(ANDROID_LOG_ERROR, tag, "============ C++ StackTrace End ============");
+/// Follow the chain of the frame records {the fp of the caller, the return address}, which
+/// every function compiled by `-fno-omit-frame-pointer` pushes at its fp. Every record is
+/// checked to be in the stack of the thread (or the alternate signal stack, in signal
+/// handlers) before it is read, and to be above the previous one, so it never faults. It
+/// stops at the first bad pointer, which is usually the fp of the outermost frame (0), or
+/// an fp clobbered by a function without frame pointers.
+/// Async-signal-safe.
+/// @param fp the frame pointer of the innermost frame to walk, whose return address is
+/// the first pc.
+/// @return false if the bounds of the stack are unknown, or the chain looks broken (see
+/// `MIN_FRAME_POINTER_FRAMES`).
+static bool walkFramePointers(uintptr_t fp, void** buffer, size_t max, int skip, size_t& count) {
+    count = 0;
+#if defined(__aarch64__) || defined(__x86_64__) || defined(__i386__)
+    const size_t recordSize = 2 * sizeof(uintptr_t);
+    StackBounds stack = t_stackBounds;
+    if (!stack.mHigh) {
+        return false;
+    }
+    // Callers are above the current frame. And the part of the main thread stack below it
+    // may be not mapped yet (it grows on demand up to the rlimit).
+    uintptr_t current = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    if (stack.contains(current, 1)) {
+        stack.mLow = current;
+    }
+    StackBounds altStack = {0, 0};
+    if (!stack.contains(fp, recordSize)) {
+        stack_t signalStack;
+        if (sigaltstack(nullptr, &signalStack) == 0 && (signalStack.ss_flags & SS_ONSTACK)) {
+            altStack.mLow = reinterpret_cast<uintptr_t>(signalStack.ss_sp);
+            altStack.mHigh = altStack.mLow + signalStack.ss_size;
+        }
+    }
+    while (count < max && fp) {
+        bool onAltStack = altStack.contains(fp, recordSize);
+        if (fp % sizeof(uintptr_t) != 0 || (!onAltStack && !stack.contains(fp, recordSize))) {
+            break;
+        }
+        const uintptr_t* record = reinterpret_cast<const uintptr_t*>(fp);
+        uintptr_t nextFp = record[0];
+        uintptr_t pc = stripPointerAuthentication(record[1]);
+        if (!pc) {
+            break;
+        }
+        if (skip > 0) {
+            skip--;
+        }
+        else {
+            buffer[count++] = reinterpret_cast<void*>(pc);
+        }
+        // The stack grows down, so callers are above, except that the frames in the
+        // alternate signal stack are called from the ones in the thread stack.
+        if (nextFp <= fp && !(onAltStack && !altStack.contains(nextFp, recordSize))) {
+            break;
+        }
+        fp = nextFp;
+    }
+    return count >= MIN_FRAME_POINTER_FRAMES || count == max;
+#else
+    // Frame records are not at a fixed place in 32-bit ARM (it differs between ARM and
+    // Thumb, and between compilers).
+    (void)fp; (void)buffer; (void)max; (void)skip;
+    return false;
+#endif
+}
 
-    void *buffer[BUFFER_MAX];
+/// Read the pc and the frame pointer of the interrupted code.
+static bool readContext(const void* ucontextVoid, uintptr_t& pc, uintptr_t& fp) {
+    const ucontext_t* uc = static_cast<const ucontext_t*>(ucontextVoid);
+    if (!uc) {
+        return false;
+    }
+#if defined(__aarch64__)
+    pc = (uintptr_t)uc->uc_mcontext.pc;
+    fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#elif defined(__arm__)
+    pc = (uintptr_t)uc->uc_mcontext.arm_pc;
+    fp = (uintptr_t)uc->uc_mcontext.arm_fp;
+#elif defined(__x86_64__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__i386__)
+    pc = (uintptr_t)uc->uc_mcontext.gregs[REG_EIP];
+    fp = (uintptr_t)uc->uc_mcontext.gregs[REG_EBP];
+#else
+    return false;
+#endif
+    return true;
+}
 
-    // capture backtrace
-    BacktraceState state = {buffer, buffer + BUFFER_MAX};
+/// @param skip the count of frames to skip, including this function.
+/// @param method `adhocbacktrace::UnwindMethod`.
+__attribute__((noinline))
+static size_t captureBacktrace(void** buffer, size_t max, int skip, int method) {
+    if (method == adhocbacktrace::UNWIND_BY_FRAME_POINTERS) {
+        // The first pc walked is the return address of this function, which is skipped.
+        size_t count = 0;
+        uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+        if (walkFramePointers(fp, buffer, max, skip > 0 ? skip - 1 : 0, count)) {
+            return count;
+        }
+    }
+    BacktraceState state = {buffer, buffer + max, skip};
     _Unwind_Backtrace(unwindCallback, &state);
-    size_t count = state.current - buffer;
+    return state.current - buffer;
+}
 
-    // dump backtrace
-    int index = 0;
-    for (size_t idx = 0; idx < count; ++idx) {
-        const void* addr = buffer[idx];
-        const char* symbol = NULL;
-        const char* objFileName = NULL;
-        // const void* symbolAddr;
-        // const void* objFileBaseAddr;
-        void* addrToBase;
-        Dl_info info;
-
-        // Find the nearest symbol by the address.
-        if (dladdr(addr, &info) && info.dli_sname) {
-            symbol = info.dli_sname;
-            objFileName = info.dli_fname;
-            addrToBase = reinterpret_cast<void *>(
-                    reinterpret_cast<const size_t>(addr) - reinterpret_cast<const size_t>(info.dli_fbase));
-            // symbolAddr = info.dli_saddr;
-            // objFileBaseAddr = info.dli_fbase;
-
-            // FIXME:
-            // How to implement addr2line here?
-            // https://android.googlesource.com/platform/ndk/+/5e0720014efeafbf6228ae4cd93b3968c1de53fc/sources/host-tools/ndk-stack/elff/dwarf_cu.cc?autodive=0%2F%2F
-        }
-        if (!symbol) {
-            continue;
+/// The symbol and the object file of an address, found by `dladdr`.
+struct FrameInfo {
+    /// Relative to the base of the object file, which `addr2line` accepts. The absolute
+    /// address if the object file is not found.
+    uintptr_t addrToBase;
+    /// The nearest symbol (mangled), can be null.
+    const char* symbol;
+    /// The offset to the symbol.
+    uintptr_t symbolOffset;
+    /// Can be null.
+    const char* objFileName;
+};
+
+static void findFrameInfo(const void* addr, FrameInfo& frame) {
+    frame.addrToBase = reinterpret_cast<uintptr_t>(addr);
+    frame.symbol = nullptr;
+    frame.symbolOffset = 0;
+    frame.objFileName = nullptr;
+    Dl_info info;
+    // Find the nearest symbol by the address.
+    if (dladdr(addr, &info)) {
+        frame.objFileName = info.dli_fname;
+        frame.addrToBase -= reinterpret_cast<uintptr_t>(info.dli_fbase);
+        if (info.dli_sname) {
+            frame.symbol = info.dli_sname;
+            frame.symbolOffset = reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(info.dli_saddr);
         }
-        std::stringstream symbolOut;
+    }
+}
 
+/// The symbols and the line table of an object file, read at the first time a pc in it is
+/// resolved. The file is unmapped after that, they keep their own copy of the strings.
+struct ModuleDebugInfo {
+    adhocelf::SymbolIndex mSymbols;
+    adhocelf::DwarfLineTable mLines;
+    /// Added to the offset to the load base to get the vaddr in the file.
+    uint64_t mLoadVaddr;
+    bool mHasSymbols;
+    bool mHasLines;
+};
+/// Keyed by path, never removed. Guarded by the mutex, which is only taken when a pc is not
+/// in the symbol cache.
+std::mutex s_moduleDebugInfoMutex;
+std::unordered_map<std::string, std::unique_ptr<ModuleDebugInfo>> s_moduleDebugInfo;
+
+static const ModuleDebugInfo* findModuleDebugInfo(const char* path) {
+    std::lock_guard<std::mutex> lock(s_moduleDebugInfoMutex);
+    std::unique_ptr<ModuleDebugInfo>& module = s_moduleDebugInfo[path];
+    if (!module) {
+        module.reset(new ModuleDebugInfo());
+        adhocelf::ElfFile elf;
+        bool opened = elf.open(path);
+        module->mHasSymbols = opened && RESOLVE_SYMTAB && module->mSymbols.load(elf);
+        module->mHasLines = opened && RESOLVE_LINES && module->mLines.load(elf);
+        module->mLoadVaddr = opened ? elf.firstLoadVaddr() : 0;
+    }
+    return module.get();
+}
+
+/// Find the function by the symbol index (if `dladdr` is not enough), and the source line.
+static void resolveFromModule(adhocbacktrace::SymbolInfo& info) {
+    if (!info.mModule) {
+        return;
+    }
+    const ModuleDebugInfo* module = findModuleDebugInfo(info.mModule);
+    uint64_t vaddr = module->mLoadVaddr + info.mModuleOffset;
+    // Pcs (except the innermost one) are return addresses, which may be the first
+    // instruction of the next function or line, so look up the call instruction before it.
+    uint64_t callVaddr = vaddr > 0 ? vaddr - 1 : vaddr;
+    uint64_t symbolOffset = 0;
+    const char* symbol = module->mHasSymbols ? module->mSymbols.find(callVaddr, symbolOffset) : nullptr;
+    // The symbol index sees the local functions, which `dladdr` may have taken as a part of
+    // the dynamic symbol before them.
+    if (symbol) {
+        info.mSymbol = symbol;
+        info.mSymbolOffset = (uintptr_t)(symbolOffset + (vaddr - callVaddr));
+    }
+    if (module->mHasLines) {
+        module->mLines.find(callVaddr, info.mFile, info.mLine);
+    }
+}
+
+/// The symbol cache. An open-addressing table keyed by pc, inserted by CAS, so it is
+/// lock-free. Entries are never removed.
+struct SymbolCacheEntry {
+    std::atomic<uintptr_t> mPc;
+    /// Null means the entry is just claimed and the info is not published yet.
+    std::atomic<adhocbacktrace::SymbolInfo*> mInfo;
+};
+SymbolCacheEntry s_symbolCache[SYMBOL_CACHE_SIZE];
+
+static void resolveSymbol(const void* pc, adhocbacktrace::SymbolInfo& info) {
+    FrameInfo frame;
+    findFrameInfo(pc, frame);
+    info.mModule = frame.objFileName;
+    info.mModuleOffset = frame.addrToBase;
+    info.mSymbol = frame.symbol;
+    info.mDemangled = frame.symbol;
+    info.mSymbolOffset = frame.symbolOffset;
+    info.mFile = nullptr;
+    info.mLine = 0;
+    if (RESOLVE_SYMTAB || RESOLVE_LINES) {
+        resolveFromModule(info);
+    }
+    info.mDemangled = info.mSymbol;
 #ifndef _ADHOC_TOOLS_NDK_BACKTRACE_DONT_DEMANGLE_
+    if (info.mSymbol) {
         int demangleStatus = 0;
-        char* demangled = __cxxabiv1::__cxa_demangle(symbol, 0, 0, &demangleStatus);
+        char* demangled = __cxxabiv1::__cxa_demangle(info.mSymbol, 0, 0, &demangleStatus);
         // The output demangleStatus:
         //    demangle_invalid_args = -3,
         //    demangle_invalid_mangled_name = -2,
@@ -93,29 +319,330 @@ void adhoc_dumpCppBacktrace(const char* tag) {
         //    demangle_success = 0,
         // If the symbol is not mangled, demangleStatus can be -2.
         if (NULL != demangled && 0 == demangleStatus) {
-            symbolOut << terminalcolor::red << demangled << terminalcolor::reset <<
-                    "  (original mangled symbol: " << symbol << ")";
+            // Owned by the info.
+            info.mDemangled = demangled;
         }
-        else {
-            symbolOut << terminalcolor::red << symbol << terminalcolor::reset;
-            // __android_log_print(ANDROID_LOG_ERROR, tag, "Demangle failed. status: %d", demangleStatus);
+        else if (NULL != demangled) {
+            std::free(demangled);
         }
-#elif
-        symbolOut << terminalcolor::red << symbol << terminalcolor::reset;
+    }
 #endif
+}
 
-        std::stringstream lineStream;
-        lineStream << terminalcolor::red << "    #" << std::setw(2) << index++ << ": " << terminalcolor::reset
-                << addrToBase << "  " << symbolOut.str().c_str() << " @" << objFileName << "\n";
-        __android_log_print(ANDROID_LOG_ERROR, tag, "%s", lineStream.str().c_str());
+static void freeSymbolInfo(adhocbacktrace::SymbolInfo* info) {
+    if (info->mDemangled != info->mSymbol) {
+        std::free(const_cast<char*>(info->mDemangled));
+    }
+    delete info;
+}
 
-#ifndef _ADHOC_TOOLS_NDK_BACKTRACE_DONT_DEMANGLE_
-        if (NULL != demangled) {
-            std::free(demangled);
+} // end of anonymous namespace
+
+
+void adhoc_dumpCppBacktrace(const char* tag) {
+
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_ERROR, tag, "============ C++ StackTrace Begin ============");
+
+    void *buffer[BUFFER_MAX];
+    // Skip `captureBacktrace` itself. Crashes and assertions are not hot, so always use the
+    // unwind tables, which also walk through signal frames and code without frame pointers.
+    size_t count = captureBacktrace(buffer, BUFFER_MAX, 1, adhocbacktrace::UNWIND_BY_TABLES);
+
+    // dump backtrace
+    for (size_t idx = 0; idx < count; ++idx) {
+        const adhocbacktrace::SymbolInfo& info = adhocbacktrace::symbolize(buffer[idx]);
+        // Frames without symbols are kept, the address can still be resolved by `addr2line`.
+        bool demangled = info.mDemangled != info.mSymbol;
+        char sourceLine[LINE_BUFFER_SIZE] = "";
+        if (info.mFile) {
+            snprintf(sourceLine, sizeof(sourceLine), " (%s:%u)", info.mFile, info.mLine);
         }
-#endif
+        adhoclog::logPrint(adhoclog::LOG_LEVEL_ERROR, tag, "%s    #%2d: %s%p  %s%s%s%s%s%s @%s%s",
+                terminalcolor::red, (int)idx, terminalcolor::reset,
+                reinterpret_cast<void*>(info.mModuleOffset),
+                terminalcolor::red, info.mDemangled ? info.mDemangled : "??", terminalcolor::reset,
+                demangled ? "  (original mangled symbol: " : "",
+                demangled ? info.mSymbol : "",
+                demangled ? ")" : "",
+                info.mModule ? info.mModule : "?",
+                sourceLine);
+    }
+
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_ERROR, tag, "============ C++ StackTrace End ============");
+    // It is usually followed by abort, so do not leave the lines in the queue of the log sink.
+    adhoclog::logFlush();
+}
+
+size_t adhoc_captureCppBacktrace(void** pcs, size_t maxCount) {
+    return captureBacktrace(pcs, maxCount, 1, adhocbacktrace::UNWIND_BY_TABLES);
+}
+
+namespace {
+
+const size_t CRASH_MAPS_CHUNK_SIZE = 512;
+const size_t CRASH_MAPS_LINE_SIZE = 512;
+const size_t CRASH_MAX_MODULES = 32;
+const size_t CRASH_MODULE_PATHS_SIZE = 2048;
+/// `CrashModules::mModuleOfFrames` of the frames not in any module (yet).
+const uint8_t CRASH_NO_MODULE = 0xff;
+/// Of the frames in a module whose path is not kept, since there are too many modules.
+const uint8_t CRASH_UNKNOWN_MODULE = 0xfe;
+
+/// The modules of the frames of `adhoc_writeCppBacktrace`, found in `/proc/self/maps` rather
+/// than by `dladdr`, which takes the lock of the dynamic linker (held by `dlopen` in another
+/// thread, or by the crashed thread itself). On the stack, nothing is allocated.
+struct CrashModules {
+    char mMapsChunk[CRASH_MAPS_CHUNK_SIZE];
+    char mLine[CRASH_MAPS_LINE_SIZE];
+    /// The consecutive mappings of the same file, and the base of the module, which is the
+    /// one with the ELF header (libraries in APKs are mapped at an offset of the APK).
+    char mRunPath[CRASH_MAPS_LINE_SIZE];
+    uint64_t mRunBase;
+    /// The module of the run, `CRASH_NO_MODULE` until a frame is found in it.
+    uint8_t mRunModule;
+    char mPaths[CRASH_MODULE_PATHS_SIZE];
+    size_t mPathsUsed;
+    uint16_t mPathOffsets[CRASH_MAX_MODULES];
+    size_t mModuleCount;
+    uint8_t mModuleOfFrames[BUFFER_MAX];
+};
+
+/// Read by `process_vm_readv`, since a mapping can be beyond the end of the file, where
+/// reading it raises SIGBUS.
+bool hasElfMagicAt(const signalsafe::MapsLine& mapping) {
+    char magic[4];
+    struct iovec local = {magic, sizeof(magic)};
+    struct iovec remote = {reinterpret_cast<void*>((uintptr_t)mapping.start), sizeof(magic)};
+    return mapping.isReadable()
+            && syscall(SYS_process_vm_readv, getpid(), &local, 1UL, &remote, 1UL, 0UL) == (long)sizeof(magic)
+            && memcmp(magic, "\x7f" "ELF", sizeof(magic)) == 0;
+}
 
+uint8_t addCrashModule(CrashModules& modules, const char* path) {
+    size_t length = strlen(path) + 1;
+    if (modules.mModuleCount >= CRASH_MAX_MODULES || modules.mPathsUsed + length > CRASH_MODULE_PATHS_SIZE) {
+        return CRASH_UNKNOWN_MODULE;
     }
+    memcpy(modules.mPaths + modules.mPathsUsed, path, length);
+    modules.mPathOffsets[modules.mModuleCount] = (uint16_t)modules.mPathsUsed;
+    modules.mPathsUsed += length;
+    return (uint8_t)modules.mModuleCount++;
+}
 
-    __android_log_print(ANDROID_LOG_ERROR, tag, "============ C++ StackTrace End ============");
+/// Replace the pcs in the mapping by the offsets to the base of the module.
+void resolveCrashFrames(CrashModules& modules, const char* line, void** pcs, size_t count) {
+    signalsafe::MapsLine mapping;
+    if (!signalsafe::parseMapsLine(line, mapping)) {
+        return;
+    }
+    if (*mapping.path != '/') {
+        modules.mRunPath[0] = '\0';
+        return;
+    }
+    if (strcmp(modules.mRunPath, mapping.path) != 0) {
+        size_t length = strnlen(mapping.path, CRASH_MAPS_LINE_SIZE - 1);
+        memcpy(modules.mRunPath, mapping.path, length);
+        modules.mRunPath[length] = '\0';
+        modules.mRunBase = mapping.start - mapping.offset;
+        modules.mRunModule = CRASH_NO_MODULE;
+    }
+    if (hasElfMagicAt(mapping)) {
+        // Another library in the same APK starts here.
+        if (modules.mRunBase != mapping.start) {
+            modules.mRunModule = CRASH_NO_MODULE;
+        }
+        modules.mRunBase = mapping.start;
+    }
+    if (!mapping.isExecutable()) {
+        return;
+    }
+    for (size_t idx = 0; idx < count; ++idx) {
+        uintptr_t pc = reinterpret_cast<uintptr_t>(pcs[idx]);
+        if (modules.mModuleOfFrames[idx] != CRASH_NO_MODULE || pc < mapping.start || pc >= mapping.end) {
+            continue;
+        }
+        if (modules.mRunModule == CRASH_NO_MODULE) {
+            modules.mRunModule = addCrashModule(modules, mapping.path);
+        }
+        modules.mModuleOfFrames[idx] = modules.mRunModule;
+        pcs[idx] = reinterpret_cast<void*>(pc - (uintptr_t)modules.mRunBase);
+    }
 }
+
+} // end of anonymous namespace
+
+void adhoc_writeCppBacktrace(const char* tag, int fd) {
+    // All on the stack, nothing is allocated.
+    char line[LINE_BUFFER_SIZE];
+    void* buffer[BUFFER_MAX];
+    CrashModules modules;
+    signalsafe::LineWriter out(line, sizeof(line), fd, tag);
+
+    out.append("============ C++ StackTrace Begin ============").flush();
+    // Skip `captureBacktrace` itself. Crashes and assertions are not hot, so always use the
+    // unwind tables, which also walk through signal frames and code without frame pointers.
+    size_t count = captureBacktrace(buffer, BUFFER_MAX, 1, adhocbacktrace::UNWIND_BY_TABLES);
+    modules.mRunPath[0] = '\0';
+    modules.mRunBase = 0;
+    modules.mRunModule = CRASH_NO_MODULE;
+    modules.mPathsUsed = 0;
+    modules.mModuleCount = 0;
+    memset(modules.mModuleOfFrames, CRASH_NO_MODULE, sizeof(modules.mModuleOfFrames));
+    signalsafe::forEachMapsLine(modules.mMapsChunk, CRASH_MAPS_CHUNK_SIZE, modules.mLine, CRASH_MAPS_LINE_SIZE,
+            [&modules, &buffer, count](const char* mapsLine) {
+                resolveCrashFrames(modules, mapsLine, buffer, count);
+            });
+    for (size_t idx = 0; idx < count; ++idx) {
+        // Symbols are not looked up, resolve the offsets by `addr2line` (or
+        // `adhoc-minidump-symbolize`) with the unstripped object file.
+        uint8_t module = modules.mModuleOfFrames[idx];
+        out.append(terminalcolor::red).append("    #").appendDec((int64_t)idx, 2).append(": ")
+                .append(terminalcolor::reset).appendHex(reinterpret_cast<uintptr_t>(buffer[idx])).append("  @")
+                .append(module < CRASH_MAX_MODULES ? modules.mPaths + modules.mPathOffsets[module] : "?").flush();
+    }
+    out.append("============ C++ StackTrace End ============").flush();
+}
+
+
+namespace adhocbacktrace {
+
+__attribute__((noinline))
+void captureBacktrace(Backtrace& backtrace, int skipFrames) {
+    int method = s_unwindMethod.load(std::memory_order_relaxed);
+    if (method == UNWIND_BY_FRAME_POINTERS && !t_stackBounds.mHigh) {
+        initThreadStackBounds();
+    }
+    // Skip the two functions capturing.
+    backtrace.mCount = (uint32_t)::captureBacktrace(backtrace.mPcs, MAX_BACKTRACE_FRAMES, skipFrames + 2, method);
+}
+
+__attribute__((noinline))
+void captureBacktraceInSignalHandler(Backtrace& backtrace, int skipFrames) {
+    int method = s_unwindMethod.load(std::memory_order_relaxed);
+    backtrace.mCount = (uint32_t)::captureBacktrace(backtrace.mPcs, MAX_BACKTRACE_FRAMES, skipFrames + 2, method);
+}
+
+size_t captureInterruptedBacktrace(const void* ucontext, void** pcs, size_t maxCount) {
+    uintptr_t pc = 0;
+    uintptr_t fp = 0;
+    if (maxCount == 0 || !readContext(ucontext, pc, fp)) {
+        return 0;
+    }
+    if (s_unwindMethod.load(std::memory_order_relaxed) == UNWIND_BY_FRAME_POINTERS) {
+        // If the interrupted function has not pushed its frame record yet (or does not at
+        // all, like leaf functions), the fp is still of its caller, which is then missed.
+        size_t count = 0;
+        if (walkFramePointers(fp, pcs + 1, maxCount - 1, 0, count)) {
+            pcs[0] = reinterpret_cast<void*>(pc);
+            return count + 1;
+        }
+    }
+    // The unwinder walks through the signal frame. Drop the frames of the handler, which are
+    // before the interrupted pc.
+    size_t count = ::captureBacktrace(pcs, maxCount, 1, UNWIND_BY_TABLES);
+    for (size_t i = 0; i < count; i++) {
+        if (reinterpret_cast<uintptr_t>(pcs[i]) == pc) {
+            memmove(pcs, pcs + i, (count - i) * sizeof(pcs[0]));
+            return count - i;
+        }
+    }
+    return count;
+}
+
+void setUnwindMethod(UnwindMethod method) {
+    s_unwindMethod.store(method, std::memory_order_relaxed);
+}
+
+UnwindMethod getUnwindMethod() {
+    return (UnwindMethod)s_unwindMethod.load(std::memory_order_relaxed);
+}
+
+bool initThreadStackBounds() {
+    if (t_stackBounds.mHigh) {
+        return true;
+    }
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+    void* stackAddress = nullptr;
+    size_t stackSize = 0;
+    int error = pthread_attr_getstack(&attr, &stackAddress, &stackSize);
+    pthread_attr_destroy(&attr);
+    if (error != 0 || !stackAddress) {
+        return false;
+    }
+    t_stackBounds.mLow = reinterpret_cast<uintptr_t>(stackAddress);
+    t_stackBounds.mHigh = reinterpret_cast<uintptr_t>(stackAddress) + stackSize;
+    return true;
+}
+
+const SymbolInfo& symbolize(const void* pc) {
+    uintptr_t key = reinterpret_cast<uintptr_t>(pc);
+    // 0 is reserved for empty entries, and is not a valid pc anyway.
+    if (key == 0) {
+        key = 1;
+    }
+    // Pcs are aligned and clustered, so mix them before indexing.
+    uint64_t hash = (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+    for (size_t probe = 0; probe < SYMBOL_CACHE_MAX_PROBES; probe++) {
+        SymbolCacheEntry& entry = s_symbolCache[(hash + probe) % SYMBOL_CACHE_SIZE];
+        uintptr_t entryPc = entry.mPc.load(std::memory_order_acquire);
+        if (entryPc == 0) {
+            if (!entry.mPc.compare_exchange_strong(entryPc, key, std::memory_order_acq_rel)) {
+                // Lost the race, check what the winner inserted.
+                if (entryPc != key) {
+                    continue;
+                }
+            }
+        }
+        else if (entryPc != key) {
+            continue;
+        }
+        SymbolInfo* info = entry.mInfo.load(std::memory_order_acquire);
+        if (info) {
+            return *info;
+        }
+        // Not published yet, by this thread or another one. Resolve it rather than waiting
+        // (`dladdr` may take a while), and the first one published is kept.
+        SymbolInfo* resolved = new SymbolInfo();
+        resolveSymbol(pc, *resolved);
+        if (entry.mInfo.compare_exchange_strong(info, resolved, std::memory_order_acq_rel)) {
+            return *resolved;
+        }
+        freeSymbolInfo(resolved);
+        return *info;
+    }
+    // The cache is full.
+    static thread_local SymbolInfo t_uncached;
+    if (t_uncached.mDemangled != t_uncached.mSymbol) {
+        std::free(const_cast<char*>(t_uncached.mDemangled));
+    }
+    resolveSymbol(pc, t_uncached);
+    return t_uncached;
+}
+
+void formatBacktrace(const Backtrace& backtrace, std::string& out) {
+    char line[LINE_BUFFER_SIZE];
+    for (uint32_t i = 0; i < backtrace.mCount; i++) {
+        const SymbolInfo& info = symbolize(backtrace.mPcs[i]);
+        int length = info.mFile
+                ? snprintf(line, sizeof(line), "    #%2u: %p  %s+0x%zx @%s (%s:%u)\n", i,
+                        reinterpret_cast<void*>(info.mModuleOffset), info.mDemangled ? info.mDemangled : "??",
+                        (size_t)info.mSymbolOffset, info.mModule ? info.mModule : "?", info.mFile, info.mLine)
+                : snprintf(line, sizeof(line), "    #%2u: %p  %s+0x%zx @%s\n", i,
+                        reinterpret_cast<void*>(info.mModuleOffset), info.mDemangled ? info.mDemangled : "??",
+                        (size_t)info.mSymbolOffset, info.mModule ? info.mModule : "?");
+        if (length > 0) {
+            out.append(line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+        }
+    }
+}
+
+void logBacktrace(const char* tag, const Backtrace& backtrace) {
+    std::string out;
+    formatBacktrace(backtrace, out);
+    adhoclog::logWrite(adhoclog::LOG_LEVEL_INFO, tag, out.data(), out.size());
+}
+
+} // end of namespace adhocbacktrace
@@ -4,15 +4,34 @@
 /// -----------------------------------------
 
 /// [Get source file and line number]
-/// Do not know how to implement it yet.
-/// So we have to use `addr2line` to get line number.
+/// `adhoc_dumpCppBacktrace` prints them if the object files are not stripped of debug info
+/// (`.debug_line`). Otherwise use `addr2line` with the unstripped object files.
 
 #ifndef _ADHOC_TOOLS_NDK_BACKTRACE_H_
 #define _ADHOC_TOOLS_NDK_BACKTRACE_H_
 
+#include <stddef.h>
+
 #include "../common/adhoc-public.h"
 
 _ADHOC_TOOLS_EXPORT_
 void adhoc_dumpCppBacktrace(const char* tag);
 
+/// Capture the pcs of the current stack (the innermost first) without resolving them. Nothing
+/// is allocated, so it can be called in signal handlers.
+/// @return the count of pcs written.
+_ADHOC_TOOLS_EXPORT_
+size_t adhoc_captureCppBacktrace(void** pcs, size_t maxCount);
+
+/// Like `adhoc_dumpCppBacktrace`, but can be called in signal handlers: nothing is allocated
+/// (about 9KB of the stack is used), and lines are written to `fd` by `write(2)` (and to
+/// logcat in NDK) rather than by the log sink. Each frame is printed as the offset in its
+/// module, found in `/proc/self/maps` (not by `dladdr`, which takes the lock of the dynamic
+/// linker), and symbols are not looked up: resolve them by `addr2line`.
+/// Note that the unwinder may still take the lock of the dynamic linker (by
+/// `dl_iterate_phdr`) on libc without a lock-free lookup of the unwind tables.
+/// @param fd can be -1 to only write to logcat.
+_ADHOC_TOOLS_EXPORT_
+void adhoc_writeCppBacktrace(const char* tag, int fd);
+
 #endif // end of _ADHOC_TOOLS_NDK_BACKTRACE_H_
\ No newline at end of file
@@ -0,0 +1,371 @@
+#include "adhoc-thread-dump.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../log/adhoc-log.h"
+
+namespace adhocbacktrace {
+
+namespace {
+
+const size_t MAX_THREADS = _ADHOC_TOOLS_BACKTRACE_DUMP_MAX_THREADS_;
+const int DUMP_TIMEOUT_MS = _ADHOC_TOOLS_BACKTRACE_DUMP_TIMEOUT_MS_;
+const size_t MAX_HEARTBEATS = _ADHOC_TOOLS_BACKTRACE_WATCHDOG_MAX_HEARTBEATS_;
+const size_t THREAD_NAME_SIZE = 16;
+const size_t HEARTBEAT_NAME_SIZE = 32;
+
+enum SlotState {
+    SLOT_FREE = 0,
+    /// Signaled, not answered yet.
+    SLOT_REQUESTED,
+    /// The handler is capturing.
+    SLOT_CAPTURING,
+    SLOT_CAPTURED,
+    /// Not answered in time. A late handler leaves it alone.
+    SLOT_TIMED_OUT,
+};
+
+struct ThreadSlot {
+    std::atomic<int> mState;
+    pid_t mTid;
+    char mName[THREAD_NAME_SIZE];
+    char mRunState;
+    Backtrace mBacktrace;
+};
+
+/// Only touched by the signal handler between `SLOT_REQUESTED` and `SLOT_CAPTURED`.
+ThreadSlot s_slots[MAX_THREADS];
+std::atomic<size_t> s_slotCount(0);
+/// Guards `s_slots` except the handler, and so one dump at a time.
+std::mutex s_dumpMutex;
+bool s_handlerInstalled = false;
+
+struct Heartbeat {
+    std::atomic<bool> mUsed;
+    std::atomic<int64_t> mLastBeatMs;
+    /// The fields below are guarded by `s_heartbeatMutex`.
+    uint32_t mDeadlineMs;
+    pid_t mTid;
+    char mName[HEARTBEAT_NAME_SIZE];
+    /// Dumped for the current miss already.
+    bool mReported;
+};
+Heartbeat s_heartbeats[MAX_HEARTBEATS];
+std::mutex s_heartbeatMutex;
+
+std::thread s_watchdogThread;
+std::mutex s_watchdogMutex;
+std::condition_variable s_watchdogCondition;
+bool s_watchdogStopRequested = false;
+std::string s_watchdogTag;
+uint32_t s_watchdogIntervalMs = 0;
+
+pid_t currentTid() {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+int64_t monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void onDumpSignal(int, siginfo_t* sigInfo, void* ucontext) {
+    // Only answer `tgkill` from this process.
+    if (sigInfo->si_code != SI_TKILL || sigInfo->si_pid != getpid()) {
+        return;
+    }
+    int savedErrno = errno;
+    pid_t tid = currentTid();
+    size_t count = s_slotCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        ThreadSlot& slot = s_slots[i];
+        int state = SLOT_REQUESTED;
+        if (slot.mTid == tid && slot.mState.compare_exchange_strong(state, SLOT_CAPTURING, std::memory_order_acquire)) {
+            slot.mBacktrace.mCount = (uint32_t)captureInterruptedBacktrace(ucontext, slot.mBacktrace.mPcs, MAX_BACKTRACE_FRAMES);
+            slot.mState.store(SLOT_CAPTURED, std::memory_order_release);
+            break;
+        }
+    }
+    errno = savedErrno;
+}
+
+/// Read a small file of procfs without allocating. @return the length read.
+size_t readSmallFile(const char* path, char* buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    length = length < 0 ? 0 : length;
+    buffer[length] = '\0';
+    return (size_t)length;
+}
+
+/// The name (`comm`) and the state letter in `/proc/self/task/<tid>/stat`.
+void readThreadInfo(ThreadSlot& slot) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)slot.mTid);
+    char stat[512];
+    slot.mName[0] = '\0';
+    slot.mRunState = '?';
+    if (!readSmallFile(path, stat, sizeof(stat))) {
+        return;
+    }
+    // Like `1234 (js thread) S 1 ...`, the name may contain spaces and parentheses.
+    const char* nameBegin = strchr(stat, '(');
+    const char* nameEnd = strrchr(stat, ')');
+    if (!nameBegin || !nameEnd || nameEnd < nameBegin) {
+        return;
+    }
+    size_t nameLength = (size_t)(nameEnd - nameBegin - 1);
+    nameLength = nameLength < THREAD_NAME_SIZE - 1 ? nameLength : THREAD_NAME_SIZE - 1;
+    memcpy(slot.mName, nameBegin + 1, nameLength);
+    slot.mName[nameLength] = '\0';
+    if (nameEnd[1] == ' ' && nameEnd[2]) {
+        slot.mRunState = nameEnd[2];
+    }
+}
+
+bool installHandler() {
+    if (s_handlerInstalled) {
+        return true;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = onDumpSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    // Never uninstalled, since the default action of real-time signals is to terminate, and
+    // late signals may still come.
+    s_handlerInstalled = sigaction(_ADHOC_TOOLS_BACKTRACE_DUMP_SIGNAL_, &action, nullptr) == 0;
+    return s_handlerInstalled;
+}
+
+/// Fill `s_slots`. Locked by `s_dumpMutex`.
+/// @return false if the dump can not run.
+bool captureAllThreads() {
+    // A handler of the last dump, timed out but then answered, may still be running.
+    size_t lastCount = s_slotCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < lastCount; i++) {
+        if (s_slots[i].mState.load(std::memory_order_acquire) == SLOT_CAPTURING) {
+            return false;
+        }
+    }
+    s_slotCount.store(0, std::memory_order_release);
+    if (!installHandler()) {
+        return false;
+    }
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+        return false;
+    }
+    pid_t self = currentTid();
+    size_t count = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        pid_t tid = (pid_t)atoi(entry->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+        if (count == MAX_THREADS) {
+            break;
+        }
+        ThreadSlot& slot = s_slots[count++];
+        slot.mTid = tid;
+        slot.mBacktrace.mCount = 0;
+        readThreadInfo(slot);
+        slot.mState.store(tid == self ? SLOT_CAPTURED : SLOT_REQUESTED, std::memory_order_relaxed);
+        if (tid == self) {
+            // Skip `captureAllThreads` itself.
+            captureBacktrace(slot.mBacktrace, 1);
+        }
+    }
+    closedir(dir);
+    s_slotCount.store(count, std::memory_order_release);
+
+    // Signal all of them first, so they unwind in parallel.
+    pid_t pid = getpid();
+    for (size_t i = 0; i < count; i++) {
+        ThreadSlot& slot = s_slots[i];
+        if (slot.mState.load(std::memory_order_relaxed) == SLOT_REQUESTED
+                && syscall(SYS_tgkill, pid, slot.mTid, _ADHOC_TOOLS_BACKTRACE_DUMP_SIGNAL_) != 0) {
+            // Exited.
+            slot.mState.store(SLOT_TIMED_OUT, std::memory_order_relaxed);
+        }
+    }
+    int64_t deadline = monotonicMs() + DUMP_TIMEOUT_MS;
+    while (true) {
+        bool pending = false;
+        for (size_t i = 0; i < count && !pending; i++) {
+            int state = s_slots[i].mState.load(std::memory_order_acquire);
+            pending = state == SLOT_REQUESTED || state == SLOT_CAPTURING;
+        }
+        if (!pending || monotonicMs() >= deadline) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (size_t i = 0; i < count; i++) {
+        int state = SLOT_REQUESTED;
+        s_slots[i].mState.compare_exchange_strong(state, SLOT_TIMED_OUT, std::memory_order_acq_rel);
+    }
+    return true;
+}
+
+void formatThread(const ThreadSlot& slot, std::string& out) {
+    char line[128];
+    snprintf(line, sizeof(line), "--- tid %d \"%s\" (%c)\n", (int)slot.mTid, slot.mName, slot.mRunState);
+    out += line;
+    int state = slot.mState.load(std::memory_order_acquire);
+    if (state == SLOT_CAPTURED) {
+        formatBacktrace(slot.mBacktrace, out);
+    }
+    else if (state == SLOT_CAPTURING) {
+        out += "    (still unwinding)\n";
+    }
+    else {
+        out += "    (not answered, exited or blocking the signal)\n";
+    }
+}
+
+void watchdogLoop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(s_watchdogMutex);
+            if (s_watchdogCondition.wait_for(lock, std::chrono::milliseconds(s_watchdogIntervalMs),
+                    [] { return s_watchdogStopRequested; })) {
+                return;
+            }
+        }
+        int64_t now = monotonicMs();
+        char message[128];
+        bool missed = false;
+        {
+            std::lock_guard<std::mutex> lock(s_heartbeatMutex);
+            for (Heartbeat& heartbeat : s_heartbeats) {
+                if (!heartbeat.mUsed.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                int64_t elapsed = now - heartbeat.mLastBeatMs.load(std::memory_order_relaxed);
+                if (elapsed <= (int64_t)heartbeat.mDeadlineMs) {
+                    heartbeat.mReported = false;
+                }
+                else if (!heartbeat.mReported) {
+                    heartbeat.mReported = true;
+                    // Dump once even if several of them miss at the same time.
+                    if (!missed) {
+                        snprintf(message, sizeof(message), "\"%s\" (tid %d) missed its heartbeat for %lld ms",
+                                heartbeat.mName, (int)heartbeat.mTid, (long long)elapsed);
+                    }
+                    missed = true;
+                }
+            }
+        }
+        if (missed) {
+            adhoclog::logPrint(adhoclog::LOG_LEVEL_WARN, s_watchdogTag.c_str(), "adhoc watchdog: %s, all threads:", message);
+            dumpAllThreads(s_watchdogTag.c_str());
+        }
+    }
+}
+
+} // end of anonymous namespace
+
+
+void formatAllThreads(std::string& out) {
+    std::lock_guard<std::mutex> lock(s_dumpMutex);
+    if (!captureAllThreads()) {
+        out += "(can not dump threads)\n";
+        return;
+    }
+    size_t count = s_slotCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        formatThread(s_slots[i], out);
+    }
+}
+
+void dumpAllThreads(const char* tag) {
+    std::lock_guard<std::mutex> lock(s_dumpMutex);
+    if (!captureAllThreads()) {
+        adhoclog::logPrint(adhoclog::LOG_LEVEL_WARN, tag, "adhoc: can not dump threads");
+        return;
+    }
+    size_t count = s_slotCount.load(std::memory_order_relaxed);
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_INFO, tag, "adhoc: backtraces of %zu threads", count);
+    std::string out;
+    for (size_t i = 0; i < count; i++) {
+        out.clear();
+        formatThread(s_slots[i], out);
+        adhoclog::logWrite(adhoclog::LOG_LEVEL_INFO, tag, out.data(), out.size());
+    }
+}
+
+bool startWatchdog(const char* tag, uint32_t checkIntervalMs) {
+    std::lock_guard<std::mutex> lock(s_watchdogMutex);
+    if (s_watchdogThread.joinable() || checkIntervalMs == 0) {
+        return false;
+    }
+    s_watchdogTag = tag;
+    s_watchdogIntervalMs = checkIntervalMs;
+    s_watchdogStopRequested = false;
+    s_watchdogThread = std::thread(watchdogLoop);
+    return true;
+}
+
+void stopWatchdog() {
+    {
+        std::lock_guard<std::mutex> lock(s_watchdogMutex);
+        s_watchdogStopRequested = true;
+    }
+    s_watchdogCondition.notify_all();
+    if (s_watchdogThread.joinable()) {
+        s_watchdogThread.join();
+    }
+}
+
+int registerHeartbeat(const char* name, uint32_t deadlineMs) {
+    std::lock_guard<std::mutex> lock(s_heartbeatMutex);
+    for (size_t i = 0; i < MAX_HEARTBEATS; i++) {
+        Heartbeat& heartbeat = s_heartbeats[i];
+        if (heartbeat.mUsed.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        snprintf(heartbeat.mName, sizeof(heartbeat.mName), "%s", name ? name : "");
+        heartbeat.mDeadlineMs = deadlineMs;
+        heartbeat.mTid = currentTid();
+        heartbeat.mReported = false;
+        heartbeat.mLastBeatMs.store(monotonicMs(), std::memory_order_relaxed);
+        heartbeat.mUsed.store(true, std::memory_order_relaxed);
+        return (int)i;
+    }
+    return -1;
+}
+
+void heartbeat(int id) {
+    if (id >= 0 && (size_t)id < MAX_HEARTBEATS) {
+        s_heartbeats[id].mLastBeatMs.store(monotonicMs(), std::memory_order_relaxed);
+    }
+}
+
+void unregisterHeartbeat(int id) {
+    if (id >= 0 && (size_t)id < MAX_HEARTBEATS) {
+        std::lock_guard<std::mutex> lock(s_heartbeatMutex);
+        s_heartbeats[id].mUsed.store(false, std::memory_order_relaxed);
+    }
+}
+
+} // end of namespace adhocbacktrace
@@ -0,0 +1,70 @@
+/// Dump the backtraces of all threads of the process, and a watchdog which dumps them when a
+/// thread misses its heartbeat, to see what a hung thread is doing.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/ndk-backtrace/adhoc-thread-dump.h"
+///
+/// // On demand.
+/// adhocbacktrace::dumpAllThreads("adhoc");
+///
+/// // Or in the watched thread, like a loop of tasks.
+/// adhocbacktrace::startWatchdog("adhoc");
+/// int heartbeatId = adhocbacktrace::registerHeartbeat("js-thread", 5000);
+/// while (runTask()) {
+///     adhocbacktrace::heartbeat(heartbeatId);
+/// }
+/// adhocbacktrace::unregisterHeartbeat(heartbeatId);
+/// ```
+///
+/// Threads are found in `/proc/self/task`, and each of them is sent
+/// `_ADHOC_TOOLS_BACKTRACE_DUMP_SIGNAL_` by `tgkill`. The handler captures the interrupted
+/// stack (see `captureInterruptedBacktrace`) into a statically allocated slot of the thread,
+/// and only after all threads answer (or the timeout) are they symbolized and logged, so the
+/// threads are stopped for no more than an unwind each.
+/// Note that the symbolization allocates, so the dump itself hangs if the hung thread holds
+/// the lock of `malloc`.
+
+#ifndef _ADHOC_TOOLS_THREAD_DUMP_H_
+#define _ADHOC_TOOLS_THREAD_DUMP_H_
+
+#include <cstdint>
+#include <string>
+
+#include "adhoc-backtrace.h"
+
+namespace adhocbacktrace {
+
+/// Capture the backtraces of all threads, and format them like:
+/// ```
+/// --- tid 1234 "js-thread" (R)
+///     # 0: 0x1234  foo(int)+0x10 @/path/libxxx.so (foo.cpp:12)
+/// ```
+/// The letter is the state in `/proc/<pid>/task/<tid>/stat`, like R (running), S (sleeping),
+/// D (uninterruptible, usually waiting for IO).
+/// Only one dump runs at a time, others wait for it.
+void formatAllThreads(std::string& out);
+
+/// `formatAllThreads` into the log, one log entry per thread.
+void dumpAllThreads(const char* tag);
+
+/// Check the heartbeats in a background thread, and dump all threads (into the log with the
+/// tag) once each time a heartbeat is missed.
+bool startWatchdog(const char* tag, uint32_t checkIntervalMs = _ADHOC_TOOLS_BACKTRACE_WATCHDOG_CHECK_INTERVAL_MS_);
+void stopWatchdog();
+
+/// Register a heartbeat of the current thread, which is taken as hung if `heartbeat()` is not
+/// called within the deadline.
+/// @param name only for the log, copied.
+/// @return the id for the others, or -1 if there are too many
+/// (see `_ADHOC_TOOLS_BACKTRACE_WATCHDOG_MAX_HEARTBEATS_`).
+int registerHeartbeat(const char* name, uint32_t deadlineMs);
+
+/// Cheap (a clock read and a store), can be called in loops.
+void heartbeat(int id);
+
+void unregisterHeartbeat(int id);
+
+} // end of namespace adhocbacktrace
+
+#endif // _ADHOC_TOOLS_THREAD_DUMP_H_
@@ -0,0 +1,41 @@
+/// The max count of frames kept in `adhocbacktrace::Backtrace` (see `adhoc-backtrace.h`).
+/// It is captured by value, so keep it small.
+#define _ADHOC_TOOLS_BACKTRACE_MAX_FRAMES_ 32
+
+/// The max count of distinct pcs in the process-wide symbol cache. Pcs beyond it are still
+/// resolved, but every time.
+#define _ADHOC_TOOLS_BACKTRACE_SYMBOL_CACHE_SIZE_ 16384
+
+/// Resolve source file and line of each pc by the `.debug_line` of the object file (loaded
+/// once per object file, at the first pc in it). Only works if the installed object files
+/// are not stripped of debug info. Set 0 to never open the object files.
+#define _ADHOC_TOOLS_BACKTRACE_RESOLVE_LINES_ 1
+
+/// Resolve the functions by all of the symbols of the object file (`.symtab`, and the
+/// MiniDebugInfo of stripped files, see `elf/config.h`) rather than only the dynamic symbols
+/// seen by `dladdr`, so that static functions are named. The symbols are also read once per
+/// object file.
+#define _ADHOC_TOOLS_BACKTRACE_RESOLVE_SYMTAB_ 1
+
+/// The default of `adhocbacktrace::setUnwindMethod`, 0: `UNWIND_BY_TABLES`,
+/// 1: `UNWIND_BY_FRAME_POINTERS` (build everything with `-fno-omit-frame-pointer` then).
+#define _ADHOC_TOOLS_BACKTRACE_UNWIND_METHOD_ 0
+
+/// The signal sent to each thread by `adhocbacktrace::dumpAllThreads` (see
+/// `adhoc-thread-dump.h`), which must not be used by others in the process. Its handler is
+/// installed at the first dump, and then kept.
+#define _ADHOC_TOOLS_BACKTRACE_DUMP_SIGNAL_ (SIGRTMIN + 3)
+
+/// The max count of threads in a dump. Their slots are allocated statically
+/// (about `8 * _ADHOC_TOOLS_BACKTRACE_MAX_FRAMES_` bytes each), threads beyond are omitted.
+#define _ADHOC_TOOLS_BACKTRACE_DUMP_MAX_THREADS_ 256
+
+/// How long a dump waits for the threads to capture their stacks. Threads blocking the
+/// signal, or blocked in the kernel uninterruptibly, never answer.
+#define _ADHOC_TOOLS_BACKTRACE_DUMP_TIMEOUT_MS_ 1000
+
+/// The max count of heartbeats registered to the watchdog at the same time.
+#define _ADHOC_TOOLS_BACKTRACE_WATCHDOG_MAX_HEARTBEATS_ 32
+
+/// How often the watchdog checks the heartbeats by default.
+#define _ADHOC_TOOLS_BACKTRACE_WATCHDOG_CHECK_INTERVAL_MS_ 500
@@ -0,0 +1,117 @@
+/// Compare the cost of `adhocbacktrace::captureBacktrace` by the unwind tables and by the
+/// frame pointers, at several stack depths. Also check that both find the same pcs. The frame
+/// pointers stop at the first function without them, usually in libc below `main`.
+///
+/// [Build] (on host, or by the NDK clang to run on devices)
+/// ```shell
+/// c++ -std=c++17 -O2 -fno-omit-frame-pointer -pthread -I../../.. -o adhoc-backtrace-benchmark adhoc-backtrace-benchmark.cpp ../adhoc-ndk-backtrace.cpp ../../elf/adhoc-elf.cpp ../../elf/adhoc-dwarf-line.cpp ../../elf/adhoc-symbol-index.cpp ../../log/adhoc-log.cpp
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// adhoc-backtrace-benchmark
+/// # Depths (frames above `main`, at most `_ADHOC_TOOLS_BACKTRACE_MAX_FRAMES_` are captured)
+/// # and the count of captures of each.
+/// adhoc-backtrace-benchmark -d 4,8,16,32 -n 100000
+/// ```
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "adhoc/ndk-backtrace/adhoc-backtrace.h"
+
+using namespace adhocbacktrace;
+
+namespace {
+
+struct Result {
+    double mNanosPerCapture;
+    Backtrace mLastBacktrace;
+};
+
+__attribute__((noinline))
+void captureRepeatedly(int iterations, Result& result) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        captureBacktrace(result.mLastBacktrace);
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.mNanosPerCapture = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+/// Go `depth` frames deeper, and then capture.
+__attribute__((noinline))
+void recurse(int depth, int iterations, Result& result) {
+    if (depth > 0) {
+        recurse(depth - 1, iterations, result);
+    }
+    else {
+        captureRepeatedly(iterations, result);
+    }
+    // Not a tail call, so each level keeps its frame.
+    __asm__ __volatile__("" ::: "memory");
+}
+
+void measure(UnwindMethod method, int depth, int iterations, Result& result) {
+    setUnwindMethod(method);
+    // Warm up the caches of the unwinder.
+    recurse(depth, 1, result);
+    recurse(depth, iterations, result);
+}
+
+/// Compare the frames of `captureRepeatedly` and `recurse`, the ones below are called from
+/// different places.
+bool isSameBacktrace(const Backtrace& a, const Backtrace& b, int depth) {
+    uint32_t count = std::min(std::min(a.mCount, b.mCount), (uint32_t)depth + 2);
+    return count > 0 && memcmp(a.mPcs, b.mPcs, count * sizeof(a.mPcs[0])) == 0;
+}
+
+int printUsage() {
+    fprintf(stderr, "Usage: adhoc-backtrace-benchmark [-d <depth,...>] [-n <iterations>]\n");
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    std::vector<int> depths = {4, 8, 16, 32};
+    int iterations = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return printUsage();
+        }
+        if (strcmp(argv[i], "-d") == 0) {
+            depths.clear();
+            for (char* token = strtok(argv[++i], ","); token; token = strtok(nullptr, ",")) {
+                depths.push_back(atoi(token));
+            }
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            iterations = std::max(1, atoi(argv[++i]));
+        }
+        else {
+            return printUsage();
+        }
+    }
+
+    initThreadStackBounds();
+    printf("%8s %16s %16s %12s %12s %8s %s\n", "depth", "tables (ns)", "fp (ns)", "tables (fr)", "fp (fr)",
+            "speedup", "same pcs");
+    for (int depth : depths) {
+        Result byTables;
+        Result byFramePointers;
+        measure(UNWIND_BY_TABLES, depth, iterations, byTables);
+        measure(UNWIND_BY_FRAME_POINTERS, depth, iterations, byFramePointers);
+        printf("%8d %16.1f %16.1f %12u %12u %7.1fx %s\n", depth,
+                byTables.mNanosPerCapture, byFramePointers.mNanosPerCapture,
+                byTables.mLastBacktrace.mCount, byFramePointers.mLastBacktrace.mCount,
+                byTables.mNanosPerCapture / byFramePointers.mNanosPerCapture,
+                isSameBacktrace(byTables.mLastBacktrace, byFramePointers.mLastBacktrace, depth) ? "yes" : "no");
+    }
+    return 0;
+}
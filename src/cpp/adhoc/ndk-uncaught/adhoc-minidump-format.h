@@ -0,0 +1,113 @@
+/// The binary minidump written by the crash handler (see `adhoc_setNativeCrashMinidumpFile`),
+/// shared by `adhoc-minidump.cpp` and the offline symbolizer.
+///
+/// [MinidumpHeader][record][record]...[MINIDUMP_RECORD_END]
+/// Each record is [MinidumpRecordHeader][payload of `mSize` bytes, padded to 8 bytes]:
+///     MINIDUMP_RECORD_REGISTERS: uint64_t[], in the order of `minidumpRegisterNames()`.
+///     MINIDUMP_RECORD_FRAMES: uint64_t[], the absolute pcs, the first one is the crashed pc.
+///     MINIDUMP_RECORD_STACK: [MinidumpStackHeader][the memory from the stack pointer]
+///     MINIDUMP_RECORD_MODULE: [MinidumpModule][path chars, not null-terminated]
+///     MINIDUMP_RECORD_EXCEPTION: [the mangled type name of the uncaught C++ exception]
+/// If `MINIDUMP_RECORD_END` is absent, the process was killed while writing it.
+/// All of the values are in the native byte order.
+
+#ifndef _ADHOC_TOOLS_MINIDUMP_FORMAT_H_
+#define _ADHOC_TOOLS_MINIDUMP_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../elf/adhoc-elf.h"
+
+namespace adhocminidump {
+
+const char MINIDUMP_MAGIC[8] = {'A', 'D', 'H', 'O', 'C', 'M', 'D', 'P'};
+const uint32_t MINIDUMP_VERSION = 1;
+
+struct MinidumpHeader {
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mHeaderSize;
+    /// ELF `e_machine` of the process, which decides the registers.
+    uint32_t mMachine;
+    uint32_t mPid;
+    uint32_t mTid;
+    int32_t mSignal;
+    int32_t mSignalCode;
+    uint32_t mReserved;
+    uint64_t mFaultAddress;
+    uint64_t mRealtimeNanos;
+    char mThreadName[16];
+};
+
+enum MinidumpRecordType : uint32_t {
+    MINIDUMP_RECORD_END = 0,
+    MINIDUMP_RECORD_REGISTERS = 1,
+    MINIDUMP_RECORD_FRAMES = 2,
+    MINIDUMP_RECORD_STACK = 3,
+    MINIDUMP_RECORD_MODULE = 4,
+    MINIDUMP_RECORD_EXCEPTION = 5,
+};
+
+struct MinidumpRecordHeader {
+    uint32_t mType;
+    uint32_t mSize;
+};
+
+struct MinidumpStackHeader {
+    /// The address of the first byte copied.
+    uint64_t mStart;
+};
+
+/// An executable mapping of a loaded ELF file (from `/proc/self/maps`).
+struct MinidumpModule {
+    /// Where the file is loaded, that is, the start of its mapping of file offset 0.
+    /// `vaddr in the file = pc - mBase + (vaddr - offset of the first PT_LOAD)`
+    uint64_t mBase;
+    /// The executable mapping.
+    uint64_t mStart;
+    uint64_t mEnd;
+    uint64_t mFileOffset;
+    uint32_t mBuildIdSize;
+    uint32_t mReserved;
+    uint8_t mBuildId[adhocelf::ELF_MAX_BUILD_ID_SIZE];
+};
+
+static_assert(sizeof(MinidumpHeader) == 72, "MinidumpHeader should be 72 bytes");
+static_assert(sizeof(MinidumpModule) == 72, "MinidumpModule should be 72 bytes");
+
+inline uint32_t minidumpPaddedSize(uint32_t size) {
+    return (size + 7) & ~7u;
+}
+
+/// The register names of the machine (ELF `e_machine`), in the order written.
+/// @param pcIndex, spIndex set to the index of them.
+/// @return null if not supported.
+inline const char* const* minidumpRegisterNames(uint32_t machine, size_t& count, size_t& pcIndex, size_t& spIndex) {
+    static const char* const AARCH64[] = {
+        "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+        "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "lr",
+        "sp", "pc", "pstate",
+    };
+    static const char* const ARM[] = {
+        "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "fp", "ip", "sp", "lr", "pc", "cpsr",
+    };
+    static const char* const X86_64[] = {
+        "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rip", "eflags",
+    };
+    static const char* const X86[] = {
+        "eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "esp", "eip", "eflags",
+    };
+    switch (machine) {
+        case adhocelf::ELF_MACHINE_AARCH64: count = sizeof(AARCH64) / sizeof(AARCH64[0]); pcIndex = 32; spIndex = 31; return AARCH64;
+        case adhocelf::ELF_MACHINE_ARM: count = sizeof(ARM) / sizeof(ARM[0]); pcIndex = 15; spIndex = 13; return ARM;
+        case adhocelf::ELF_MACHINE_X86_64: count = sizeof(X86_64) / sizeof(X86_64[0]); pcIndex = 16; spIndex = 7; return X86_64;
+        case adhocelf::ELF_MACHINE_386: count = sizeof(X86) / sizeof(X86[0]); pcIndex = 8; spIndex = 7; return X86;
+        default: count = 0; pcIndex = 0; spIndex = 0; return nullptr;
+    }
+}
+
+} // end of namespace adhocminidump
+
+#endif // _ADHOC_TOOLS_MINIDUMP_FORMAT_H_
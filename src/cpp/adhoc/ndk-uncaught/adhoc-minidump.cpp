@@ -0,0 +1,383 @@
+#include "adhoc-minidump.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cxxabi.h>
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <typeinfo>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "adhoc-minidump-format.h"
+#include "../common/adhoc-signal-safe.h"
+#include "../elf/adhoc-elf.h"
+#include "../ndk-backtrace/adhoc-ndk-backtrace.h"
+
+namespace adhocminidump {
+
+namespace {
+
+/// The stack memory copied from the stack pointer.
+const size_t STACK_COPY_SIZE = 32 * 1024;
+/// Below the stack pointer, which may still be used by the leaf function (the red zone of x86_64).
+const size_t STACK_COPY_BELOW_SP = 128;
+const size_t MAX_FRAMES = 256;
+const size_t MAPS_READ_SIZE = 4096;
+const size_t MAPS_LINE_SIZE = 4096;
+/// For the ELF header, the program headers, or a note segment of a module.
+const size_t ELF_READ_SIZE = 2048;
+const size_t MAX_REGISTERS = 40;
+const size_t PAGE_SIZE_ASSUMED = 4096;
+
+#if defined(__aarch64__)
+const uint32_t CURRENT_MACHINE = adhocelf::ELF_MACHINE_AARCH64;
+#elif defined(__arm__)
+const uint32_t CURRENT_MACHINE = adhocelf::ELF_MACHINE_ARM;
+#elif defined(__x86_64__)
+const uint32_t CURRENT_MACHINE = adhocelf::ELF_MACHINE_X86_64;
+#elif defined(__i386__)
+const uint32_t CURRENT_MACHINE = adhocelf::ELF_MACHINE_386;
+#else
+const uint32_t CURRENT_MACHINE = 0;
+#endif
+
+/// Allocated in `setMinidumpFile`, since nothing can be allocated in the signal handler.
+struct MinidumpBuffers {
+    uint8_t stack[STACK_COPY_SIZE + STACK_COPY_BELOW_SP];
+    void* frames[MAX_FRAMES];
+    uint64_t pcs[MAX_FRAMES + 1];
+    char mapsChunk[MAPS_READ_SIZE];
+    char line[MAPS_LINE_SIZE];
+    /// The path of the previous mapping, whose start can be the base of the next one.
+    char previousPath[MAPS_LINE_SIZE];
+    uint8_t elf[ELF_READ_SIZE];
+};
+
+static int s_fd = -1;
+static MinidumpBuffers* s_buffers = nullptr;
+
+/// @return the count of bytes read from the start. It stops at the first page not readable.
+static size_t readMemory(uintptr_t address, void* out, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        // Page by page, so that a partial read is reported rather than failing as a whole.
+        size_t pageEnd = ((address + done) / PAGE_SIZE_ASSUMED + 1) * PAGE_SIZE_ASSUMED;
+        size_t chunk = pageEnd - (address + done);
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        struct iovec local = {static_cast<uint8_t*>(out) + done, chunk};
+        struct iovec remote = {reinterpret_cast<void*>(address + done), chunk};
+        ssize_t read = syscall(SYS_process_vm_readv, getpid(), &local, 1UL, &remote, 1UL, 0UL);
+        if (read <= 0) {
+            break;
+        }
+        done += (size_t)read;
+    }
+    return done;
+}
+
+static void writeRecordHeader(uint32_t type, uint32_t size) {
+    MinidumpRecordHeader header = {type, size};
+    signalsafe::writeAll(s_fd, reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+static void writePadding(uint32_t size) {
+    static const char ZEROS[8] = {0};
+    signalsafe::writeAll(s_fd, ZEROS, minidumpPaddedSize(size) - size);
+}
+
+static void writeRecord(uint32_t type, const void* data, uint32_t size) {
+    writeRecordHeader(type, size);
+    signalsafe::writeAll(s_fd, static_cast<const char*>(data), size);
+    writePadding(size);
+}
+
+/// @return the count of registers.
+static size_t readRegisters(const void* ucontextVoid, uint64_t registers[MAX_REGISTERS], uint64_t& sp, uint64_t& pc) {
+    size_t count = 0;
+    sp = pc = 0;
+    if (!ucontextVoid) {
+        return 0;
+    }
+    const ucontext_t* uc = static_cast<const ucontext_t*>(ucontextVoid);
+#if defined(__aarch64__)
+    for (int i = 0; i < 31; i++) {
+        registers[count++] = uc->uc_mcontext.regs[i];
+    }
+    registers[count++] = uc->uc_mcontext.sp;
+    registers[count++] = uc->uc_mcontext.pc;
+    registers[count++] = uc->uc_mcontext.pstate;
+    sp = uc->uc_mcontext.sp;
+    pc = uc->uc_mcontext.pc;
+#elif defined(__arm__)
+    const unsigned long* first = &uc->uc_mcontext.arm_r0;
+    // arm_r0 ... arm_r10, arm_fp, arm_ip, arm_sp, arm_lr, arm_pc, arm_cpsr are contiguous.
+    for (int i = 0; i < 17; i++) {
+        registers[count++] = first[i];
+    }
+    sp = uc->uc_mcontext.arm_sp;
+    pc = uc->uc_mcontext.arm_pc;
+#elif defined(__x86_64__)
+    static const int ORDER[] = {
+        REG_RAX, REG_RBX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_RBP, REG_RSP,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15, REG_RIP, REG_EFL,
+    };
+    for (int reg : ORDER) {
+        registers[count++] = (uint64_t)uc->uc_mcontext.gregs[reg];
+    }
+    sp = (uint64_t)uc->uc_mcontext.gregs[REG_RSP];
+    pc = (uint64_t)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+    static const int ORDER[] = {
+        REG_EAX, REG_EBX, REG_ECX, REG_EDX, REG_ESI, REG_EDI, REG_EBP, REG_ESP, REG_EIP, REG_EFL,
+    };
+    for (int reg : ORDER) {
+        registers[count++] = (uint32_t)uc->uc_mcontext.gregs[reg];
+    }
+    sp = (uint32_t)uc->uc_mcontext.gregs[REG_ESP];
+    pc = (uint32_t)uc->uc_mcontext.gregs[REG_EIP];
+#endif
+    return count;
+}
+
+static bool hasElfMagic(uintptr_t address) {
+    uint8_t magic[sizeof(adhocelf::ELF_MAGIC)];
+    return readMemory(address, magic, sizeof(magic)) == sizeof(magic)
+            && memcmp(magic, adhocelf::ELF_MAGIC, sizeof(magic)) == 0;
+}
+
+template <typename Header, typename ProgramHeader>
+static size_t readBuildIdOfClass(uintptr_t base, uint8_t* out) {
+    uint8_t* buffer = s_buffers->elf;
+    Header header;
+    if (readMemory(base, &header, sizeof(header)) != sizeof(header)) {
+        return 0;
+    }
+    size_t programHeadersSize = (size_t)header.mProgramHeaderCount * sizeof(ProgramHeader);
+    if (programHeadersSize > ELF_READ_SIZE
+            || readMemory(base + header.mProgramHeaderOffset, buffer, programHeadersSize) != programHeadersSize) {
+        return 0;
+    }
+    // The load bias, by the first loadable segment, which is mapped at the base.
+    uint64_t firstLoadVaddr = 0;
+    for (size_t i = 0; i < header.mProgramHeaderCount; i++) {
+        ProgramHeader programHeader;
+        memcpy(&programHeader, buffer + i * sizeof(ProgramHeader), sizeof(programHeader));
+        if (programHeader.mType == adhocelf::ELF_PT_LOAD) {
+            firstLoadVaddr = programHeader.mVaddr - programHeader.mOffset;
+            break;
+        }
+    }
+    for (size_t i = 0; i < header.mProgramHeaderCount; i++) {
+        ProgramHeader programHeader;
+        // The buffer is reused for notes below, so read program headers again every time.
+        if (readMemory(base + header.mProgramHeaderOffset + i * sizeof(ProgramHeader), &programHeader,
+                sizeof(programHeader)) != sizeof(programHeader)) {
+            return 0;
+        }
+        if (programHeader.mType != adhocelf::ELF_PT_NOTE) {
+            continue;
+        }
+        size_t size = programHeader.mFileSize < ELF_READ_SIZE ? (size_t)programHeader.mFileSize : ELF_READ_SIZE;
+        size = readMemory(base + programHeader.mVaddr - firstLoadVaddr, buffer, size);
+        size_t buildIdSize = adhocelf::findBuildIdInNotes(buffer, size, out, adhocelf::ELF_MAX_BUILD_ID_SIZE);
+        if (buildIdSize) {
+            return buildIdSize;
+        }
+    }
+    return 0;
+}
+
+static size_t readBuildId(uintptr_t base, uint8_t* out) {
+    adhocelf::ElfIdent ident;
+    if (readMemory(base, &ident, sizeof(ident)) != sizeof(ident) || !adhocelf::isSupportedElf(&ident, sizeof(ident))) {
+        return 0;
+    }
+    return ident.mClass == adhocelf::ELF_CLASS_64
+            ? readBuildIdOfClass<adhocelf::Elf64Header, adhocelf::Elf64ProgramHeader>(base, out)
+            : readBuildIdOfClass<adhocelf::Elf32Header, adhocelf::Elf32ProgramHeader>(base, out);
+}
+
+/// Previous mapping, see `MinidumpBuffers::previousPath`.
+struct PreviousMapping {
+    uint64_t start;
+    uint64_t offset;
+};
+
+/// A line of `/proc/self/maps`, see `signalsafe::MapsLine`.
+static void processMapsLine(const char* line, PreviousMapping& previous) {
+    signalsafe::MapsLine mapping;
+    if (!signalsafe::parseMapsLine(line, mapping)) {
+        return;
+    }
+    uint64_t start = mapping.start;
+    uint64_t end = mapping.end;
+    uint64_t offset = mapping.offset;
+    const char* path = mapping.path;
+    if (*path != '/') {
+        previous.start = 0;
+        s_buffers->previousPath[0] = '\0';
+        return;
+    }
+
+    if (mapping.isExecutable()) {
+        MinidumpModule module;
+        memset(&module, 0, sizeof(module));
+        module.mStart = start;
+        module.mEnd = end;
+        module.mFileOffset = offset;
+        // Linkers put a read-only segment before the executable one (lld), or not (old
+        // ones). And libraries can be loaded from the inside of APKs, where the offset is
+        // not 0. So find the ELF header rather than relying on the offset.
+        if (previous.start && strcmp(s_buffers->previousPath, path) == 0 && hasElfMagic(previous.start)) {
+            module.mBase = previous.start;
+        }
+        else if (hasElfMagic(start)) {
+            module.mBase = start;
+        }
+        else {
+            module.mBase = start - offset;
+        }
+        module.mBuildIdSize = (uint32_t)readBuildId(module.mBase, module.mBuildId);
+        uint32_t pathLength = (uint32_t)strlen(path);
+        uint32_t size = (uint32_t)sizeof(module) + pathLength;
+        writeRecordHeader(MINIDUMP_RECORD_MODULE, size);
+        signalsafe::writeAll(s_fd, reinterpret_cast<const char*>(&module), sizeof(module));
+        signalsafe::writeAll(s_fd, path, pathLength);
+        writePadding(size);
+    }
+
+    // Only the first mapping of a file can be the base.
+    if (strcmp(s_buffers->previousPath, path) != 0) {
+        previous.start = start;
+        previous.offset = offset;
+        size_t length = strnlen(path, MAPS_LINE_SIZE - 1);
+        memcpy(s_buffers->previousPath, path, length);
+        s_buffers->previousPath[length] = '\0';
+    }
+}
+
+static void writeModules() {
+    PreviousMapping previous = {0, 0};
+    s_buffers->previousPath[0] = '\0';
+    signalsafe::forEachMapsLine(s_buffers->mapsChunk, MAPS_READ_SIZE, s_buffers->line, MAPS_LINE_SIZE,
+            [&previous](const char* line) { processMapsLine(line, previous); });
+}
+
+} // end of anonymous namespace
+
+
+bool setMinidumpFile(const char* path) {
+    if (!path) {
+        if (s_fd >= 0) {
+            close(s_fd);
+        }
+        s_fd = -1;
+        return true;
+    }
+    if (!s_buffers) {
+        s_buffers = static_cast<MinidumpBuffers*>(malloc(sizeof(MinidumpBuffers)));
+        if (!s_buffers) {
+            return false;
+        }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (s_fd >= 0) {
+        close(s_fd);
+    }
+    s_fd = fd;
+    return true;
+}
+
+bool isMinidumpEnabled() {
+    return s_fd >= 0 && s_buffers;
+}
+
+void writeMinidump(int sigNum, const siginfo_t* sigInfo, const void* ucontext) {
+    if (!isMinidumpEnabled()) {
+        return;
+    }
+
+    MinidumpHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.mMagic, MINIDUMP_MAGIC, sizeof(MINIDUMP_MAGIC));
+    header.mVersion = MINIDUMP_VERSION;
+    header.mHeaderSize = sizeof(header);
+    header.mMachine = CURRENT_MACHINE;
+    header.mPid = (uint32_t)getpid();
+    header.mTid = (uint32_t)syscall(SYS_gettid);
+    header.mSignal = sigNum;
+    header.mSignalCode = sigInfo->si_code;
+    header.mFaultAddress = reinterpret_cast<uintptr_t>(sigInfo->si_addr);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.mRealtimeNanos = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    prctl(PR_GET_NAME, header.mThreadName, 0, 0, 0);
+    signalsafe::writeAll(s_fd, reinterpret_cast<const char*>(&header), sizeof(header));
+
+    uint64_t registers[MAX_REGISTERS];
+    uint64_t sp, pc;
+    size_t registerCount = readRegisters(ucontext, registers, sp, pc);
+    if (registerCount) {
+        writeRecord(MINIDUMP_RECORD_REGISTERS, registers, (uint32_t)(registerCount * sizeof(uint64_t)));
+    }
+
+    // The unwound frames start from this function, skip them until the crashed pc (the
+    // unwinder steps over the signal frame).
+    size_t frameCount = adhoc_captureCppBacktrace(s_buffers->frames, MAX_FRAMES);
+    size_t first = 0;
+    while (first < frameCount && reinterpret_cast<uintptr_t>(s_buffers->frames[first]) != pc) {
+        first++;
+    }
+    if (first == frameCount) {
+        first = 0;
+    }
+    else {
+        first++;
+    }
+    size_t pcCount = 0;
+    if (pc) {
+        s_buffers->pcs[pcCount++] = pc;
+    }
+    for (size_t i = first; i < frameCount; i++) {
+        s_buffers->pcs[pcCount++] = reinterpret_cast<uintptr_t>(s_buffers->frames[i]);
+    }
+    writeRecord(MINIDUMP_RECORD_FRAMES, s_buffers->pcs, (uint32_t)(pcCount * sizeof(uint64_t)));
+
+    if (sp) {
+        MinidumpStackHeader stackHeader = {sp - STACK_COPY_BELOW_SP};
+        size_t stackSize = readMemory((uintptr_t)stackHeader.mStart, s_buffers->stack, sizeof(s_buffers->stack));
+        if (!stackSize) {
+            // The red zone may be out of the stack (stack overflow).
+            stackHeader.mStart = sp;
+            stackSize = readMemory((uintptr_t)sp, s_buffers->stack, STACK_COPY_SIZE);
+        }
+        uint32_t size = (uint32_t)(sizeof(stackHeader) + stackSize);
+        writeRecordHeader(MINIDUMP_RECORD_STACK, size);
+        signalsafe::writeAll(s_fd, reinterpret_cast<const char*>(&stackHeader), sizeof(stackHeader));
+        signalsafe::writeAll(s_fd, reinterpret_cast<const char*>(s_buffers->stack), stackSize);
+        writePadding(size);
+    }
+
+    std::type_info* exceptionType = __cxxabiv1::__cxa_current_exception_type();
+    if (exceptionType) {
+        const char* name = exceptionType->name();
+        writeRecord(MINIDUMP_RECORD_EXCEPTION, name, (uint32_t)strlen(name));
+    }
+
+    writeModules();
+
+    writeRecord(MINIDUMP_RECORD_END, nullptr, 0);
+    fsync(s_fd);
+}
+
+} // end of namespace adhocminidump
@@ -0,0 +1,23 @@
+/// Write the binary minidump (see `adhoc-minidump-format.h`) in the crash signal handler.
+/// Only used by `adhoc-ndk-uncaught.cpp`.
+
+#ifndef _ADHOC_TOOLS_MINIDUMP_H_
+#define _ADHOC_TOOLS_MINIDUMP_H_
+
+#include <csignal>
+
+namespace adhocminidump {
+
+/// Open (append) the file and allocate the buffers, since neither can be done in the
+/// signal handler. Pass null to disable it.
+bool setMinidumpFile(const char* path);
+bool isMinidumpEnabled();
+
+/// Async-signal-safe: nothing is allocated, and all of the memory is read by
+/// `process_vm_readv`, which fails rather than faults on bad addresses.
+/// @param ucontext the third argument of the `SA_SIGINFO` handler.
+void writeMinidump(int sigNum, const siginfo_t* sigInfo, const void* ucontext);
+
+} // end of namespace adhocminidump
+
+#endif // _ADHOC_TOOLS_MINIDUMP_H_
@@ -6,39 +6,52 @@
 
 #include <assert.h>
 
-#include <jni.h>
+#include <atomic>
 #include <csignal>
-#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <exception>
-#include <memory>
+#include <ctime>
 #include <cxxabi.h>
-#include <android/log.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <typeinfo>
 #include <unistd.h>
 
-#include <sstream>
-#include <map>
-#include <string>
-
+#include "adhoc-minidump.h"
 #include "../ndk-backtrace/adhoc-ndk-backtrace.h"
 
 #include "../common/adhoc-private.h"
+#include "../common/adhoc-signal-safe.h"
+#include "../log/adhoc-log.h"
 
 
-/// For some older systems, signal handlers eat crashes entirely. For those rare cases,
-/// we will need to trigger a signal after our initial handling is done to be able to
-/// crash properly. Checking the Linux kernel sources, the author learnt that __NR_tgkill
-/// will do the trick. Let’s copy its value to our source to finalize our imports.
-/// This is tgkill syscall id (more signals available in many linux kernels)
-#define __NR_tgkill 270
-
 /// Helper macro to get size of an fixed length array during compile time
 #define sizeofa(array) sizeof(array) / sizeof(array[0])
 
 
 namespace {
 
+/// Nothing is allocated in the signal handler (the malloc lock may be held by the crashed
+/// thread), so the report is formatted in this buffer allocated at initialization.
+const size_t LINE_BUFFER_SIZE = 1024;
+/// The alternate signal stack, where the handler runs, so that stack overflow can also be
+/// reported. `adhoc_writeCppBacktrace` takes about 9KB of it.
+const size_t SIGNAL_STACK_SIZE = 64 * 1024;
+/// The smallest existing alternate signal stack that is used rather than replaced. Bionic
+/// installs a 16KB one for every thread.
+const size_t SIGNAL_STACK_MIN_SIZE = 16 * 1024;
+/// If another thread crashes while reporting, it waits for the report at most that long.
+const int CONCURRENT_CRASH_WAIT_MS = 3000;
+
 static const char* s_tag = nullptr;
+/// The report is written to it by `write(2)`. Opened before any crash.
+static int s_reportFd = STDERR_FILENO;
+static bool s_ownsReportFd = false;
+/// The thread writing the report, 0 if none.
+static std::atomic<pid_t> s_reportingTid{0};
 
 /// Caught signal numbers
 static const int SIGNALS_TO_CATCH[] = {
@@ -50,38 +63,89 @@ static const int SIGNALS_TO_CATCH[] = {
         SIGSTKFLT,
         SIGTRAP,
 };
-static const std::map<int, std::string> SIGNALS_DESC {
-    {SIGABRT, "abort"},
-    {SIGBUS, "bus error"},
-    {SIGFPE, "floating point exception"},
-    {SIGSEGV, "segmentation violation"},
-    {SIGILL, "illegal instruction"},
-    {SIGSTKFLT, "Stack fault on coprocessor"},
-    {SIGTRAP, "trace trap"},
-};
+
+/// A switch rather than a map, which is not safe to use in signal handlers.
+static const char* signalDesc(int sigNum) {
+    switch (sigNum) {
+        case SIGABRT: return "abort";
+        case SIGBUS: return "bus error";
+        case SIGFPE: return "floating point exception";
+        case SIGSEGV: return "segmentation violation";
+        case SIGILL: return "illegal instruction";
+        case SIGSTKFLT: return "Stack fault on coprocessor";
+        case SIGTRAP: return "trace trap";
+        default: return "?";
+    }
+}
 
 /// Signal handler context
 struct CrashInContext {
     /// Old handlers of signals that we restore on de-initialization. Keep values for all possible
     /// signals, for unused signals nullptr value is stored.
     struct sigaction old_handlers[NSIG];
+    char lineBuffer[LINE_BUFFER_SIZE];
 };
 /// Crash handler function signature
-typedef void (*CrashSignalHandler)(int, siginfo*, void*);
+typedef void (*CrashSignalHandler)(int, siginfo_t*, void*);
 /// Global instance of context. Since an app can't crash twice in a single run, we can make this singleton.
 static CrashInContext* crashInContext = nullptr;
 
+static pid_t currentTid() {
+    return static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+/// The alternate signal stack of a thread, released when the thread exits.
+struct ThreadSignalStack {
+    void* memory = nullptr;
+
+    ~ThreadSignalStack() {
+        if (!memory) {
+            return;
+        }
+        stack_t disabled;
+        memset(&disabled, 0, sizeof(disabled));
+        disabled.ss_flags = SS_DISABLE;
+        sigaltstack(&disabled, nullptr);
+        munmap(memory, SIGNAL_STACK_SIZE);
+    }
+};
+static thread_local ThreadSignalStack t_signalStack;
+
+static bool installSignalStack() {
+    stack_t current;
+    if (sigaltstack(nullptr, &current) == 0 && !(current.ss_flags & SS_DISABLE)
+            && current.ss_size >= SIGNAL_STACK_MIN_SIZE) {
+        // Already installed, by us or by others (bionic installs one for every thread).
+        return true;
+    }
+    void* memory = mmap(nullptr, SIGNAL_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    stack_t stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = memory;
+    stack.ss_size = SIGNAL_STACK_SIZE;
+    if (sigaltstack(&stack, nullptr) != 0) {
+        munmap(memory, SIGNAL_STACK_SIZE);
+        return false;
+    }
+    t_signalStack.memory = memory;
+    return true;
+}
+
 /// Register signal handler for crashes
 /// See https://man7.org/linux/man-pages/man2/sigaction.2.html
 /// See https://man7.org/linux/man-pages/man7/signal.7.html
 static bool registerSignalHandler(CrashSignalHandler handler, struct sigaction old_handlers[NSIG]) {
     struct sigaction sigactionstruct;
     memset(&sigactionstruct, 0, sizeof(sigactionstruct));
-    sigactionstruct.sa_flags = SA_SIGINFO;
+    // Run on the alternate signal stack if the thread has one, otherwise on the current stack.
+    sigactionstruct.sa_flags = SA_SIGINFO | SA_ONSTACK;
     sigactionstruct.sa_sigaction = handler;
 
     // Register new handlers for all signals
-    for (int index = 0; index < sizeofa(SIGNALS_TO_CATCH); ++index) {
+    for (size_t index = 0; index < sizeofa(SIGNALS_TO_CATCH); ++index) {
         const int sigNum = SIGNALS_TO_CATCH[index];
 
         if (sigaction(sigNum, &sigactionstruct, &old_handlers[sigNum])) {
@@ -94,136 +158,118 @@ static bool registerSignalHandler(CrashSignalHandler handler, struct sigaction o
 
 /// Unregister already register signal handler
 static void unregisterSignalHandler(struct sigaction old_handlers[NSIG]) {
-    // Recover old handler for all signals
-    for (int sigNum = 0; sigNum < NSIG; ++sigNum) {
-        const struct sigaction* old_handler = &old_handlers[sigNum];
-
-        if (!old_handler->sa_handler) {
-            continue;
-        }
-
-        sigaction(sigNum, old_handler, nullptr);
+    // Recover old handler for all signals, including the default ones (`SIG_DFL` is null).
+    for (size_t index = 0; index < sizeofa(SIGNALS_TO_CATCH); ++index) {
+        const int sigNum = SIGNALS_TO_CATCH[index];
+        sigaction(sigNum, &old_handlers[sigNum], nullptr);
     }
 }
 
+/// Only the type of the exception, since getting `what()` needs to rethrow it, which allocates.
+/// The default terminate handler (libc++abi and libstdc++) also prints `what()` before abort.
 /// FIXME: Try to find cpp exception but not working for me. Do not know why yet.
-static bool tryPrintCppException(int sigNum, siginfo* sigInfo) {
-    void* currException = __cxxabiv1::__cxa_current_primary_exception();
+static bool tryPrintCppException(signalsafe::LineWriter& out) {
     std::type_info* currExceptionTypeInfo = __cxxabiv1::__cxa_current_exception_type();
-
-    if (!currException) {
+    if (!currExceptionTypeInfo) {
         return false;
     }
-    try {
-        // Check if we can get the message
-        if (currExceptionTypeInfo) {
-            const char* exceptionName = currExceptionTypeInfo->name();
-            std::stringstream out;
-            out << terminalcolor::red;
-
-            // Try demangling exception name
-            int demangleStatus = -1;
-            char* demangled = __cxxabiv1::__cxa_demangle(exceptionName, 0, 0, &demangleStatus);
-            // The output demangleStatus:
-            //    demangle_invalid_args = -3,
-            //    demangle_invalid_mangled_name = -2,
-            //    demangle_memory_alloc_failure = -1,
-            //    demangle_success = 0,
-            // If the symbol is not mangled, demangleStatus can be -2.
-            // Check demangle demangleStatus
-            if (NULL == demangled || 0 != demangleStatus) {
-                // Couldn't demangle, go with exceptionName
-                out << "Uncaught exception: " << exceptionName;
-            } else {
-                if (strstr(demangled, "nullptr") || strstr(demangled, "NULL")) {
-                    // Could demangle, go with demangled and state that it was null
-                    out << "Uncaught exception: " << demangled;
-                } else {
-                    // Could demangle, go with demangled and exception.what() if exists
-                    try {
-                        __cxxabiv1::__cxa_rethrow_primary_exception(currException);
-                    } catch (std::exception& e) {
-                        // Include message from what() in the abort message
-                        out << "Uncaught exception: " << demangled << " " << e.what();
-                    } catch (...) {
-                        // Just report the exception type since it is not an std::exception
-                        out << "Uncaught exception: " << demangled;
-                    }
-                }
-            }
-            out << terminalcolor::reset;
-            __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s", out.str().c_str());
-
-            return true;
-        } else {
-            // Not a cpp exception, assume a custom crash and act like C
-        }
-    }
-    catch (std::bad_cast& bc) {
-        // Not a cpp exception, assume a custom crash and act like C
-    }
-
-    return false;
+    // Not demangled, since demangling allocates. Use `c++filt` to demangle it.
+    out.append(terminalcolor::red).append("Uncaught exception: ").append(currExceptionTypeInfo->name())
+            .append(terminalcolor::reset).flush();
+    return true;
 }
 
 /// Create a crash message using whatever available such as signal, C++ exception etc
-static void printCrashMessage(int sigNum, siginfo* sigInfo) {
-    // It works to pring backtrace use this approach.
-    adhoc_dumpCppBacktrace(s_tag);
-
-    std::stringstream out;
+static void printCrashMessage(int sigNum, siginfo_t* sigInfo) {
+    signalsafe::LineWriter out(crashInContext->lineBuffer, LINE_BUFFER_SIZE, s_reportFd, s_tag);
 
     // See: https://man7.org/linux/man-pages/man2/sigaction.2.html
     // sigNum: signal number that caused the crash, lile SIGILL, SIGSEGV, SIGFPE, etc.
     // sigInfo->si_code: signal code for the signal number.
     //      For example, SIGILL has signal code like ILL_ILLOPC, ILL_ILLTRP, etc.
-    if (!tryPrintCppException(sigNum, sigInfo)) {
-        // Assume C crash and print signal no and code
-        out << "Terminating with a C crash." << std::endl;
+    out.append(terminalcolor::red)
+            .append("Signal Number: ").appendDec(sigNum).append(" (").append(signalDesc(sigNum)).append(") ")
+            .append("Signal Code: ").appendDec(sigInfo->si_code);
+    // Only faults raised by the kernel have the address, not the ones sent by `kill`.
+    if (sigInfo->si_code > 0 && (sigNum == SIGSEGV || sigNum == SIGBUS || sigNum == SIGFPE || sigNum == SIGILL)) {
+        out.append(" Fault Address: ").appendHex(reinterpret_cast<uintptr_t>(sigInfo->si_addr));
     }
+    out.append(terminalcolor::reset).flush();
 
-    const char* sigNumDesc = "?";
-    auto sigFindIt = SIGNALS_DESC.find(sigNum);
-    if (sigFindIt != SIGNALS_DESC.end()) {
-        sigNumDesc = sigFindIt->second.c_str();
-    }
+    char threadName[17] = {0};
+    prctl(PR_GET_NAME, threadName, 0, 0, 0);
+    out.append("Thread: ").appendDec(currentTid()).append(" (").append(threadName).append(")").flush();
 
-    out << terminalcolor::red
-            << "Signal Number: " << sigNum << " (" << sigNumDesc << ") "
-            << "Signal Code: " << sigInfo->si_code
-            << terminalcolor::reset << std::endl;
+    if (!tryPrintCppException(out)) {
+        // Assume C crash and print signal no and code
+        out.append("Terminating with a C crash.").flush();
+    }
 
     if (SIGSEGV == sigNum) {
-        out << terminalcolor::lightGreen
-                << "Notice: when segmentation violation occurs, the printed call stack may not be actually where the problem is."
-                << terminalcolor::reset << std::endl;
+        out.append(terminalcolor::lightGreen)
+                .append("Notice: when segmentation violation occurs, the printed call stack may not be actually where the problem is.")
+                .append(terminalcolor::reset).flush();
     }
 
-     __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s", out.str().c_str());
+    if (adhocminidump::isMinidumpEnabled()) {
+        // Symbolizing is left to the offline tool.
+        out.append("Minidump is written, symbolize it by adhoc-minidump-symbolize.").flush();
+        return;
+    }
+    // It works to pring backtrace use this approach.
+    adhoc_writeCppBacktrace(s_tag, s_reportFd);
+}
+
+static void writeHandlerMessage(const char* message) {
+    signalsafe::LineWriter out(crashInContext->lineBuffer, LINE_BUFFER_SIZE, s_reportFd, s_tag);
+    out.append(terminalcolor::red).append(message).append(terminalcolor::reset).flush();
 }
 
 /// Main signal handling function.
-static void nativeCrashSignalHandler(int sigNum, siginfo* sigInfo, void* uctxvoid) {
-    __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s nativeCrashSignalHandler enter %s",
-            terminalcolor::red, terminalcolor::reset);
+static void nativeCrashSignalHandler(int sigNum, siginfo_t* sigInfo, void* uctxvoid) {
+    int savedErrno = errno;
+
+    pid_t tid = currentTid();
+    pid_t reportingTid = 0;
+    if (!s_reportingTid.compare_exchange_strong(reportingTid, tid)) {
+        if (reportingTid != tid) {
+            // Another thread is reporting, and the buffer is in use. Usually the process is
+            // killed before it wakes up.
+            struct timespec interval = {0, 10 * 1000 * 1000};
+            for (int waited = 0; waited < CONCURRENT_CRASH_WAIT_MS && s_reportingTid.load() != 0; waited += 10) {
+                nanosleep(&interval, nullptr);
+            }
+        }
+        // Or crashed again in the handler. Either way, leave it to the old handler without
+        // a report: returning from a fault runs the faulting instruction again.
+        sigaction(sigNum, &crashInContext->old_handlers[sigNum], nullptr);
+        errno = savedErrno;
+        return;
+    }
+
+    writeHandlerMessage(" nativeCrashSignalHandler enter ");
 
     // Restoring an old handler to make built-in Android crash mechanism work.
     sigaction(sigNum, &crashInContext->old_handlers[sigNum], nullptr);
 
+    // The minidump goes first, the text report is less important with it.
+    adhocminidump::writeMinidump(sigNum, sigInfo, uctxvoid);
     // Log crash message
     printCrashMessage(sigNum, sigInfo);
 
-    // In some cases we need to re-send a signal to run standard bionic handler.
-    if (sigInfo->si_code <= 0 || sigNum == SIGABRT) {
-        if (syscall(__NR_tgkill, getpid(), gettid(), sigNum) < 0) {
-            __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s nativeCrashSignalHandler __NR_tgkill exit %s",
-                    terminalcolor::red, terminalcolor::reset);
+    // In some cases we need to re-send a signal to run standard bionic handler: it is sent by
+    // `kill` or `abort`, or it is a trap (like `int3` on x86), which returns after the
+    // trapping instruction rather than running it again.
+    if (sigInfo->si_code <= 0 || sigNum == SIGABRT || sigNum == SIGTRAP) {
+        if (syscall(SYS_tgkill, getpid(), tid, sigNum) < 0) {
+            writeHandlerMessage(" nativeCrashSignalHandler tgkill exit ");
             _exit(1);
         }
     }
 
-    __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s nativeCrashSignalHandler leave %s",
-            terminalcolor::red, terminalcolor::reset);
+    writeHandlerMessage(" nativeCrashSignalHandler leave ");
+    s_reportingTid.store(0);
+    errno = savedErrno;
 }
 
 } // end of anonymous namespace
@@ -236,22 +282,27 @@ void adhoc_initializeNativeCrashHandler(const char* tag) {
 
     s_tag = tag;
 
-    __android_log_print(ANDROID_LOG_INFO, s_tag, "%s adhoc_initializeNativeCrashHandler init %s",
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_INFO, s_tag, "%s adhoc_initializeNativeCrashHandler init %s",
             terminalcolor::green, terminalcolor::reset);
 
     // Initialize singleton crash handler context
     crashInContext = static_cast<CrashInContext *>(malloc(sizeof(CrashInContext)));
     memset(crashInContext, 0, sizeof(CrashInContext));
 
+    if (!installSignalStack()) {
+        adhoclog::logPrint(adhoclog::LOG_LEVEL_WARN, s_tag, "Can not install the alternate signal stack. "
+                "Stack overflow will not be reported.");
+    }
+
     // Trying to register signal handler.
     if (!registerSignalHandler(&nativeCrashSignalHandler, crashInContext->old_handlers)) {
         adhoc_deinitializeNativeCrashHandler();
-        __android_log_print(ANDROID_LOG_ERROR, s_tag, "%s adhoc_initializeNativeCrashHandler init failed. %s",
+        adhoclog::logPrint(adhoclog::LOG_LEVEL_ERROR, tag, "%s adhoc_initializeNativeCrashHandler init failed. %s",
                 terminalcolor::red, terminalcolor::reset);
         return;
     }
 
-    __android_log_print(ANDROID_LOG_INFO, s_tag, "adhoc_initializeNativeCrashHandler initialized.");
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_INFO, s_tag, "adhoc_initializeNativeCrashHandler initialized.");
 }
 
 bool adhoc_deinitializeNativeCrashHandler() {
@@ -263,13 +314,40 @@ bool adhoc_deinitializeNativeCrashHandler() {
     // Unregister signal handlers
     unregisterSignalHandler(crashInContext->old_handlers);
 
+    adhoclog::logPrint(adhoclog::LOG_LEVEL_INFO, s_tag, "Native crash handler successfully deinitialized.");
+
     // Free singleton crash handler context
     free(crashInContext);
     crashInContext = nullptr;
     s_tag = nullptr;
 
-    __android_log_print(ANDROID_LOG_ERROR, s_tag, "Native crash handler successfully deinitialized.");
+    return true;
+}
 
+bool adhoc_setNativeCrashReportFile(const char* path) {
+    int fd = STDERR_FILENO;
+    bool owns = false;
+    if (path) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        owns = true;
+    }
+    int oldFd = s_reportFd;
+    bool ownsOldFd = s_ownsReportFd;
+    s_reportFd = fd;
+    s_ownsReportFd = owns;
+    if (ownsOldFd) {
+        close(oldFd);
+    }
     return true;
 }
 
+bool adhoc_setNativeCrashMinidumpFile(const char* path) {
+    return adhocminidump::setMinidumpFile(path);
+}
+
+bool adhoc_installNativeCrashSignalStack() {
+    return installSignalStack();
+}
@@ -13,5 +13,25 @@ void adhoc_initializeNativeCrashHandler(const char* tag);
 _ADHOC_TOOLS_EXPORT_
 bool adhoc_deinitializeNativeCrashHandler();
 
+/// The crash report is written to the file (appended) besides logcat in NDK, by `write(2)`
+/// in the signal handler. It is opened right now, since nothing can be opened safely in the
+/// signal handler. Pass null to write to stderr (by default).
+_ADHOC_TOOLS_EXPORT_
+bool adhoc_setNativeCrashReportFile(const char* path);
+
+/// Write a binary minidump to the file (appended) on crash, which holds the signal, registers,
+/// raw pcs, a copy of the stack and loaded modules with build ids. Symbolize it on host by
+/// `ndk-uncaught/tools/adhoc-minidump-symbolize.cpp`. The text report then only has the
+/// signal, without the backtrace. Pass null to disable it.
+_ADHOC_TOOLS_EXPORT_
+bool adhoc_setNativeCrashMinidumpFile(const char* path);
+
+/// Install an alternate signal stack for the calling thread, so that its stack overflow can be
+/// reported. It is installed for the thread calling `adhoc_initializeNativeCrashHandler`, and
+/// bionic installs one for every thread. Call it at the start of other threads if needed on
+/// other libc.
+_ADHOC_TOOLS_EXPORT_
+bool adhoc_installNativeCrashSignalStack();
+
 
 #endif // end of _ADHOC_TOOLS_NDK_UNCAUGHT_H_
\ No newline at end of file
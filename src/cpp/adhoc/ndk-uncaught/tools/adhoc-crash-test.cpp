@@ -0,0 +1,190 @@
+/// Check the crash report of every signal the handler catches (and of a stack overflow and an
+/// uncaught exception) on Linux host: each case crashes a forked child, which has the handler
+/// installed and reports to a file, and the parent checks that the child was killed by the
+/// signal and the report is complete.
+///
+/// [Build] (on host)
+/// ```shell
+/// c++ -std=c++17 -O0 -pthread -o adhoc-crash-test adhoc-crash-test.cpp ../adhoc-ndk-uncaught.cpp ../adhoc-minidump.cpp ../../ndk-backtrace/adhoc-ndk-backtrace.cpp ../../elf/adhoc-elf.cpp ../../elf/adhoc-dwarf-line.cpp ../../elf/adhoc-symbol-index.cpp ../../log/adhoc-log.cpp
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// # Prints a line for each case, and exits with 1 if any of them fails.
+/// adhoc-crash-test
+/// # Keep the reports in the directory (the current one by default).
+/// adhoc-crash-test /tmp
+/// ```
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../adhoc-ndk-uncaught.h"
+
+namespace {
+
+volatile int s_zero = 0;
+
+void crashBySegv() {
+    *static_cast<volatile int*>(nullptr) = 1;
+}
+
+/// Touch a mapped page beyond the end of the file.
+void crashByBus() {
+    FILE* file = tmpfile();
+    char* page = static_cast<char*>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0));
+    page[0] = 1;
+}
+
+void crashByFpe() {
+    s_zero = 1 / s_zero;
+    // Integer division by zero does not trap on ARM (or on some virtual machines).
+    raise(SIGFPE);
+}
+
+void crashByIll() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_trap();
+#else
+    // `__builtin_trap` raises SIGTRAP on ARM.
+    raise(SIGILL);
+#endif
+}
+
+void crashByTrap() {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile("int3");
+#else
+    __builtin_trap();
+#endif
+}
+
+void crashByStackFault() {
+    raise(SIGSTKFLT);
+}
+
+void crashByAbort() {
+    abort();
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winfinite-recursion"
+__attribute__((noinline)) int recurse(volatile char* previous) {
+    volatile char frame[1024];
+    frame[0] = previous ? previous[0] + 1 : 0;
+    return recurse(frame) + frame[1];
+}
+#pragma GCC diagnostic pop
+
+void crashByStackOverflow() {
+    recurse(nullptr);
+}
+
+void crashByUncaughtException() {
+    throw std::runtime_error("adhoc-crash-test");
+}
+
+struct CrashCase {
+    const char* mName;
+    void (*mCrash)();
+    int mSignal;
+};
+
+const CrashCase CASES[] = {
+    {"SIGABRT", crashByAbort, SIGABRT},
+    {"SIGBUS", crashByBus, SIGBUS},
+    {"SIGFPE", crashByFpe, SIGFPE},
+    {"SIGSEGV", crashBySegv, SIGSEGV},
+    {"SIGILL", crashByIll, SIGILL},
+    {"SIGSTKFLT", crashByStackFault, SIGSTKFLT},
+    {"SIGTRAP", crashByTrap, SIGTRAP},
+    {"stack overflow", crashByStackOverflow, SIGSEGV},
+    {"uncaught exception", crashByUncaughtException, SIGABRT},
+};
+
+std::string readFile(const std::string& path) {
+    std::string content;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return content;
+    }
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        content.append(buffer, size);
+    }
+    fclose(file);
+    return content;
+}
+
+/// @return an empty string if it passes, or else why it fails.
+std::string runCase(const CrashCase& crashCase, const std::string& reportPath) {
+    unlink(reportPath.c_str());
+    pid_t pid = fork();
+    if (pid < 0) {
+        return "can not fork";
+    }
+    if (pid == 0) {
+        // No core dumps of the expected crashes.
+        struct rlimit noCore = {0, 0};
+        setrlimit(RLIMIT_CORE, &noCore);
+        adhoc_setNativeCrashReportFile(reportPath.c_str());
+        adhoc_initializeNativeCrashHandler("adhoc");
+        crashCase.mCrash();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status)) {
+        return "not killed by a signal";
+    }
+    if (WTERMSIG(status) != crashCase.mSignal) {
+        return std::string("killed by ") + strsignal(WTERMSIG(status));
+    }
+    std::string report = readFile(reportPath);
+    std::string signalLine = "Signal Number: " + std::to_string(crashCase.mSignal) + " (";
+    const char* expected[] = {
+        "nativeCrashSignalHandler enter",
+        signalLine.c_str(),
+        "Thread: ",
+        "C++ StackTrace Begin",
+        "C++ StackTrace End",
+        "nativeCrashSignalHandler leave",
+    };
+    for (const char* text : expected) {
+        if (report.find(text) == std::string::npos) {
+            return std::string("no \"") + text + "\" in the report";
+        }
+    }
+    return "";
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    std::string directory = argc > 1 ? argv[1] : ".";
+    int failures = 0;
+    for (const CrashCase& crashCase : CASES) {
+        std::string reportPath = directory + "/adhoc-crash-test-" + std::to_string(&crashCase - CASES) + ".log";
+        std::string failure = runCase(crashCase, reportPath);
+        if (failure.empty()) {
+            printf("PASS %s\n", crashCase.mName);
+        }
+        else {
+            printf("FAIL %s: %s (see %s)\n", crashCase.mName, failure.c_str(), reportPath.c_str());
+            failures++;
+        }
+    }
+    printf("%d of %zu failed\n", failures, sizeof(CASES) / sizeof(CASES[0]));
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,425 @@
+/// Symbolize the minidumps written by the crash handler (see `adhoc_setNativeCrashMinidumpFile`)
+/// against the unstripped libraries, matched by build id (or by file name if no build id).
+/// Source file and line are printed if the libraries have `.debug_line`.
+///
+/// [Build] (on host)
+/// ```shell
+/// c++ -std=c++17 -O2 -o adhoc-minidump-symbolize adhoc-minidump-symbolize.cpp ../../elf/adhoc-elf.cpp ../../elf/adhoc-dwarf-line.cpp ../../elf/adhoc-symbol-index.cpp
+/// # To read the MiniDebugInfo of stripped libraries, set `_ADHOC_TOOLS_ELF_LZMA_` 1 in
+/// # `elf/config.h` and add `-llzma`.
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// adb pull /data/data/com.xxx.yyy/files/crash.dmp
+/// # `-s` can be given multiple times, a directory is searched recursively.
+/// adhoc-minidump-symbolize -s ~/my-proj/intermediates/cmake/debug/obj/arm64-v8a crash.dmp
+/// # Also print the stack memory (words pointing into modules are symbolized) and the modules.
+/// adhoc-minidump-symbolize -s libxxyyzz.so --stack --modules crash.dmp
+/// ```
+/// If the process crashed several times with the same file, all of the minidumps are printed.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cxxabi.h>
+#include <dirent.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+#include "../adhoc-minidump-format.h"
+#include "../../elf/adhoc-dwarf-line.h"
+#include "../../elf/adhoc-elf.h"
+#include "../../elf/adhoc-symbol-index.h"
+
+using namespace adhocminidump;
+
+namespace {
+
+bool readFile(const char* path, std::vector<uint8_t>& content) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t buffer[64 * 1024];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        content.insert(content.end(), buffer, buffer + size);
+    }
+    fclose(file);
+    return true;
+}
+
+std::string baseName(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+std::string demangle(const char* symbol) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
+    std::string result = demangled && status == 0 ? demangled : symbol;
+    free(demangled);
+    return result;
+}
+
+const char* signalName(int sigNum) {
+    switch (sigNum) {
+        case 4: return "SIGILL";
+        case 5: return "SIGTRAP";
+        case 6: return "SIGABRT";
+        case 7: return "SIGBUS";
+        case 8: return "SIGFPE";
+        case 11: return "SIGSEGV";
+        case 16: return "SIGSTKFLT";
+        default: return "?";
+    }
+}
+
+struct Module {
+    MinidumpModule mInfo;
+    std::string mPath;
+    std::string mBuildId;
+};
+
+/// The functions and lines of an unstripped library, sorted by address.
+class SymbolFile {
+  public:
+    bool open(const std::string& path) {
+        if (!mElf.open(path.c_str())) {
+            return false;
+        }
+        mSymbols.load(mElf);
+        mLines.load(mElf);
+        return true;
+    }
+
+    const adhocelf::ElfFile& elf() const { return mElf; }
+
+    /// @return null if not found, or set the offset to the symbol.
+    const char* find(uint64_t vaddr, uint64_t& offset) const {
+        return mSymbols.find(vaddr, offset);
+    }
+
+    bool findLine(uint64_t vaddr, const char*& file, uint32_t& line) const {
+        return mLines.find(vaddr, file, line);
+    }
+
+  private:
+    adhocelf::ElfFile mElf;
+    adhocelf::SymbolIndex mSymbols;
+    adhocelf::DwarfLineTable mLines;
+};
+
+/// Finds the symbol files given by `-s`, and loads them lazily.
+class Symbolizer {
+  public:
+    void addPath(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            fprintf(stderr, "Warning: can not find %s\n", path.c_str());
+            return;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            DIR* dir = opendir(path.c_str());
+            if (!dir) {
+                return;
+            }
+            while (dirent* entry = readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    addPath(path + "/" + entry->d_name);
+                }
+            }
+            closedir(dir);
+            return;
+        }
+        adhocelf::ElfFile elf;
+        if (!S_ISREG(st.st_mode) || !elf.open(path.c_str())) {
+            return;
+        }
+        if (!elf.buildId().empty()) {
+            mPathsByBuildId.emplace(elf.buildId(), path);
+        }
+        mBuildIdsByPath.emplace(path, elf.buildId());
+        mPathsByName.emplace(baseName(path), path);
+    }
+
+    /// @return null if no symbol file of the module.
+    const SymbolFile* find(const Module& module) {
+        std::string path;
+        auto byBuildId = mPathsByBuildId.find(module.mBuildId);
+        if (!module.mBuildId.empty() && byBuildId != mPathsByBuildId.end()) {
+            path = byBuildId->second;
+        }
+        else {
+            auto byName = mPathsByName.find(baseName(module.mPath));
+            if (byName == mPathsByName.end()) {
+                return nullptr;
+            }
+            // A file of the same name but another build id is not the crashed binary.
+            const std::string& buildId = mBuildIdsByPath[byName->second];
+            if (!module.mBuildId.empty() && !buildId.empty()) {
+                return nullptr;
+            }
+            path = byName->second;
+        }
+        auto loaded = mFiles.find(path);
+        if (loaded != mFiles.end()) {
+            return loaded->second.get();
+        }
+        std::unique_ptr<SymbolFile> file(new SymbolFile());
+        if (!file->open(path)) {
+            file.reset();
+        }
+        return (mFiles[path] = std::move(file)).get();
+    }
+
+  private:
+    std::unordered_map<std::string, std::string> mPathsByBuildId;
+    std::unordered_map<std::string, std::string> mBuildIdsByPath;
+    std::unordered_map<std::string, std::string> mPathsByName;
+    std::unordered_map<std::string, std::unique_ptr<SymbolFile>> mFiles;
+};
+
+struct Minidump {
+    MinidumpHeader mHeader;
+    std::vector<uint64_t> mRegisters;
+    std::vector<uint64_t> mFrames;
+    uint64_t mStackStart = 0;
+    std::vector<uint8_t> mStack;
+    std::vector<Module> mModules;
+    std::string mException;
+    bool mComplete = false;
+};
+
+/// @return the offset after the minidump, or 0 if it is not a minidump.
+size_t parseMinidump(const uint8_t* data, size_t size, Minidump& dump) {
+    if (size < sizeof(MinidumpHeader) || memcmp(data, MINIDUMP_MAGIC, sizeof(MINIDUMP_MAGIC)) != 0) {
+        return 0;
+    }
+    memcpy(&dump.mHeader, data, sizeof(MinidumpHeader));
+    size_t offset = dump.mHeader.mHeaderSize;
+    while (offset + sizeof(MinidumpRecordHeader) <= size) {
+        MinidumpRecordHeader record;
+        memcpy(&record, data + offset, sizeof(record));
+        const uint8_t* payload = data + offset + sizeof(record);
+        size_t next = offset + sizeof(record) + minidumpPaddedSize(record.mSize);
+        if (offset + sizeof(record) + record.mSize > size) {
+            break;
+        }
+        switch (record.mType) {
+            case MINIDUMP_RECORD_REGISTERS:
+            case MINIDUMP_RECORD_FRAMES: {
+                std::vector<uint64_t>& values = record.mType == MINIDUMP_RECORD_REGISTERS ? dump.mRegisters : dump.mFrames;
+                values.resize(record.mSize / sizeof(uint64_t));
+                memcpy(values.data(), payload, values.size() * sizeof(uint64_t));
+                break;
+            }
+            case MINIDUMP_RECORD_STACK: {
+                if (record.mSize >= sizeof(MinidumpStackHeader)) {
+                    MinidumpStackHeader stack;
+                    memcpy(&stack, payload, sizeof(stack));
+                    dump.mStackStart = stack.mStart;
+                    dump.mStack.assign(payload + sizeof(stack), payload + record.mSize);
+                }
+                break;
+            }
+            case MINIDUMP_RECORD_MODULE: {
+                if (record.mSize >= sizeof(MinidumpModule)) {
+                    Module module;
+                    memcpy(&module.mInfo, payload, sizeof(MinidumpModule));
+                    module.mPath.assign(reinterpret_cast<const char*>(payload) + sizeof(MinidumpModule),
+                            record.mSize - sizeof(MinidumpModule));
+                    size_t buildIdSize = std::min<size_t>(module.mInfo.mBuildIdSize, sizeof(module.mInfo.mBuildId));
+                    module.mBuildId = adhocelf::buildIdToHex(module.mInfo.mBuildId, buildIdSize);
+                    dump.mModules.push_back(std::move(module));
+                }
+                break;
+            }
+            case MINIDUMP_RECORD_EXCEPTION:
+                dump.mException.assign(reinterpret_cast<const char*>(payload), record.mSize);
+                break;
+            case MINIDUMP_RECORD_END:
+                dump.mComplete = true;
+                return next;
+            default:
+                break;
+        }
+        offset = next;
+    }
+    return size;
+}
+
+class Printer {
+  public:
+    Printer(const Minidump& dump, Symbolizer& symbolizer): mDump(dump), mSymbolizer(symbolizer) {
+        uint32_t machine = dump.mHeader.mMachine;
+        mWordSize = machine == adhocelf::ELF_MACHINE_ARM || machine == adhocelf::ELF_MACHINE_386 ? 4 : 8;
+    }
+
+    void print(bool withStack, bool withModules) {
+        const MinidumpHeader& header = mDump.mHeader;
+        printf("*** *** *** *** *** *** *** *** *** *** *** *** *** *** *** ***\n");
+        time_t seconds = (time_t)(header.mRealtimeNanos / 1000000000ULL);
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        char timeText[64];
+        strftime(timeText, sizeof(timeText), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("time: %s.%03u UTC\n", timeText, (unsigned)(header.mRealtimeNanos / 1000000 % 1000));
+        printf("pid: %u, tid: %u, name: %.16s\n", header.mPid, header.mTid, header.mThreadName);
+        printf("signal %d (%s), code %d, fault addr 0x%" PRIx64 "\n", header.mSignal, signalName(header.mSignal),
+                header.mSignalCode, header.mFaultAddress);
+        if (!mDump.mException.empty()) {
+            printf("uncaught exception: %s\n", demangle(mDump.mException.c_str()).c_str());
+        }
+        if (!mDump.mComplete) {
+            printf("(the minidump is truncated)\n");
+        }
+
+        size_t count, pcIndex, spIndex;
+        const char* const* names = minidumpRegisterNames(header.mMachine, count, pcIndex, spIndex);
+        if (names && mDump.mRegisters.size() == count) {
+            printf("\nregisters:\n");
+            for (size_t i = 0; i < count; i++) {
+                printf("%s%-6s %0*" PRIx64, i % 4 == 0 ? "    " : "  ", names[i], mWordSize * 2, mDump.mRegisters[i]);
+                if (i % 4 == 3 || i + 1 == count) {
+                    printf("\n");
+                }
+            }
+        }
+
+        printf("\nbacktrace:\n");
+        for (size_t i = 0; i < mDump.mFrames.size(); i++) {
+            printf("    #%02zu pc ", i);
+            // Other frames are return addresses, the call is the instruction before it.
+            printAddress(mDump.mFrames[i], i > 0);
+            printf("\n");
+        }
+
+        if (withStack && !mDump.mStack.empty()) {
+            printf("\nstack:\n");
+            for (size_t offset = 0; offset + mWordSize <= mDump.mStack.size(); offset += mWordSize) {
+                uint64_t value = 0;
+                memcpy(&value, mDump.mStack.data() + offset, mWordSize);
+                printf("    %0*" PRIx64 "  %0*" PRIx64, mWordSize * 2, mDump.mStackStart + offset, mWordSize * 2, value);
+                if (findModule(value)) {
+                    printf("  ");
+                    printAddress(value, true);
+                }
+                printf("\n");
+            }
+        }
+
+        if (withModules) {
+            printf("\nmodules:\n");
+            for (auto& module : mDump.mModules) {
+                printf("    %0*" PRIx64 "-%0*" PRIx64 "  %s%s%s\n", mWordSize * 2, module.mInfo.mStart,
+                        mWordSize * 2, module.mInfo.mEnd, module.mPath.c_str(),
+                        module.mBuildId.empty() ? "" : "  BuildId: ", module.mBuildId.c_str());
+            }
+        }
+        printf("\n");
+    }
+
+  private:
+    const Module* findModule(uint64_t pc) const {
+        for (auto& module : mDump.mModules) {
+            if (pc >= module.mInfo.mStart && pc < module.mInfo.mEnd) {
+                return &module;
+            }
+        }
+        return nullptr;
+    }
+
+    void printAddress(uint64_t pc, bool isReturnAddress) {
+        const Module* module = findModule(pc);
+        if (!module) {
+            printf("%0*" PRIx64 "  ???", mWordSize * 2, pc);
+            return;
+        }
+        const SymbolFile* symbols = mSymbolizer.find(*module);
+        uint64_t vaddr = pc - module->mInfo.mBase + (symbols ? symbols->elf().firstLoadVaddr() : 0);
+        printf("%0*" PRIx64 "  %s", mWordSize * 2, vaddr, module->mPath.c_str());
+        uint64_t offset = 0;
+        const char* symbol = symbols ? symbols->find(isReturnAddress ? vaddr - 1 : vaddr, offset) : nullptr;
+        if (symbol) {
+            printf(" (%s+%" PRIu64 ")", demangle(symbol).c_str(), isReturnAddress ? offset + 1 : offset);
+        }
+        const char* file = nullptr;
+        uint32_t line = 0;
+        if (symbols && symbols->findLine(isReturnAddress ? vaddr - 1 : vaddr, file, line)) {
+            printf(" (%s:%u)", file, line);
+        }
+        if (!module->mBuildId.empty()) {
+            printf(" (BuildId: %s)", module->mBuildId.c_str());
+        }
+    }
+
+    const Minidump& mDump;
+    Symbolizer& mSymbolizer;
+    int mWordSize;
+};
+
+int printUsage() {
+    fprintf(stderr, "Usage: adhoc-minidump-symbolize [-s <symbol file or directory>]... [--stack] [--modules] <minidump>\n");
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    Symbolizer symbolizer;
+    const char* dumpPath = nullptr;
+    bool withStack = false;
+    bool withModules = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            symbolizer.addPath(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--stack") == 0) {
+            withStack = true;
+        }
+        else if (strcmp(argv[i], "--modules") == 0) {
+            withModules = true;
+        }
+        else if (argv[i][0] == '-' || dumpPath) {
+            return printUsage();
+        }
+        else {
+            dumpPath = argv[i];
+        }
+    }
+    if (!dumpPath) {
+        return printUsage();
+    }
+
+    std::vector<uint8_t> content;
+    if (!readFile(dumpPath, content)) {
+        fprintf(stderr, "Can not read: %s\n", dumpPath);
+        return 1;
+    }
+    size_t offset = 0;
+    size_t dumpCount = 0;
+    while (offset < content.size()) {
+        Minidump dump;
+        size_t size = parseMinidump(content.data() + offset, content.size() - offset, dump);
+        if (!size) {
+            break;
+        }
+        Printer(dump, symbolizer).print(withStack, withModules);
+        offset += size;
+        dumpCount++;
+    }
+    if (!dumpCount) {
+        fprintf(stderr, "Not a minidump: %s\n", dumpPath);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,371 @@
+#include "adhoc-perf-exporter.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "clock.h"
+#include _ADHOC_TOOLS_PERF_LOG_INCLUDE_
+
+namespace adhocperf {
+
+namespace {
+
+const char* const UNIX_SOCKET_PREFIX = "unix:";
+
+std::thread s_exporterThread;
+std::mutex s_exporterMutex;
+std::condition_variable s_exporterCondition;
+bool s_exporterStopRequested = false;
+std::string s_exporterTarget;
+ExportFormat s_exporterFormat = EXPORT_JSON;
+uint32_t s_exporterIntervalMs = 0;
+
+double ticksToMillis(double ticks) {
+    return clockTicksToNanos(ticks) / 1e6;
+}
+
+void appendFormat(std::string& out, const char* format, double value) {
+    char text[64];
+    snprintf(text, sizeof(text), format, value);
+    out += text;
+}
+
+void appendJsonString(std::string& out, const char* value) {
+    out += '"';
+    for (const char* c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        }
+        else if ((unsigned char)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+            out += escaped;
+        }
+        else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+/// Label values of Prometheus escape only backslashes, quotes and line feeds.
+void appendPrometheusLabel(std::string& out, const char* value) {
+    out += "{name=\"";
+    for (const char* c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        }
+        else if (*c == '\n') {
+            out += "\\n";
+        }
+        else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+void formatJson(std::string& out, const std::vector<PerfItemDelta>& deltas, double intervalMs) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    out += "{\"time_ms\":" + std::to_string((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    appendFormat(out, ",\"interval_ms\":%.3f", intervalMs);
+    const char* const sections[] = {"timers", "counters", "gauges"};
+    for (int kind = ITEM_TIMER; kind <= ITEM_GAUGE; kind++) {
+        out += ",\"";
+        out += sections[kind];
+        out += "\":{";
+        bool first = true;
+        for (const PerfItemDelta& delta : deltas) {
+            // Leave out the idle ones, gauges are always there.
+            if (delta.mKind != kind || (kind == ITEM_TIMER && !delta.mTimer.mCount && !delta.mSkipped)
+                    || (kind == ITEM_COUNTER && !delta.mCounter)) {
+                continue;
+            }
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+            appendJsonString(out, delta.mName);
+            out += ':';
+            if (kind == ITEM_COUNTER) {
+                out += std::to_string(delta.mCounter);
+            }
+            else if (kind == ITEM_GAUGE) {
+                out += std::to_string(delta.mGauge);
+            }
+            else {
+                const HistogramSnapshot& timer = delta.mTimer;
+                out += "{\"count\":" + std::to_string(timer.mCount);
+                if (delta.mSkipped) {
+                    // Sampled, see `TimerItem::setSampleRate()`.
+                    out += ",\"calls\":" + std::to_string(timer.mCount + delta.mSkipped);
+                }
+                appendFormat(out, ",\"sum_ms\":%.6f", ticksToMillis((double)timer.mSum));
+                appendFormat(out, ",\"mean_ms\":%.6f", ticksToMillis(timer.mean()));
+                appendFormat(out, ",\"p50_ms\":%.6f", ticksToMillis((double)timer.percentile(50)));
+                appendFormat(out, ",\"p90_ms\":%.6f", ticksToMillis((double)timer.percentile(90)));
+                appendFormat(out, ",\"p99_ms\":%.6f", ticksToMillis((double)timer.percentile(99)));
+                appendFormat(out, ",\"max_ms\":%.6f", ticksToMillis((double)timer.max()));
+                out += '}';
+            }
+        }
+        out += '}';
+    }
+    out += "}\n";
+}
+
+void formatPrometheus(std::string& out, const std::vector<PerfItemDelta>& deltas,
+        const std::vector<PerfItemDelta>& totals) {
+    const double quantiles[] = {0.5, 0.9, 0.99};
+    out += "# TYPE adhoc_timer_milliseconds summary\n";
+    for (size_t i = 0; i < deltas.size(); i++) {
+        if (deltas[i].mKind != ITEM_TIMER) {
+            continue;
+        }
+        for (double quantile : quantiles) {
+            out += "adhoc_timer_milliseconds";
+            appendPrometheusLabel(out, deltas[i].mName);
+            appendFormat(out, ",quantile=\"%g\"} ", quantile);
+            if (deltas[i].mTimer.mCount) {
+                appendFormat(out, "%.6f\n", ticksToMillis((double)deltas[i].mTimer.percentile(quantile * 100)));
+            }
+            else {
+                // Not called in the interval, which is not a latency of 0.
+                out += "NaN\n";
+            }
+        }
+        out += "adhoc_timer_milliseconds_sum";
+        appendPrometheusLabel(out, deltas[i].mName);
+        appendFormat(out, "} %.6f\n", ticksToMillis((double)totals[i].mTimer.mSum));
+        out += "adhoc_timer_milliseconds_count";
+        appendPrometheusLabel(out, deltas[i].mName);
+        out += "} " + std::to_string(totals[i].mTimer.mCount + totals[i].mSkipped) + "\n";
+    }
+    out += "# TYPE adhoc_counter_total counter\n";
+    for (size_t i = 0; i < deltas.size(); i++) {
+        if (deltas[i].mKind == ITEM_COUNTER) {
+            out += "adhoc_counter_total";
+            appendPrometheusLabel(out, deltas[i].mName);
+            out += "} " + std::to_string(totals[i].mCounter) + "\n";
+        }
+    }
+    out += "# TYPE adhoc_gauge gauge\n";
+    for (size_t i = 0; i < deltas.size(); i++) {
+        if (deltas[i].mKind == ITEM_GAUGE) {
+            out += "adhoc_gauge";
+            appendPrometheusLabel(out, deltas[i].mName);
+            out += "} " + std::to_string(deltas[i].mGauge) + "\n";
+        }
+    }
+}
+
+bool writeAll(int fd, const std::string& data, bool isSocket) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t result = isSocket
+                ? send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL)
+                : write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        written += (size_t)result;
+    }
+    return true;
+}
+
+int connectUnixSocket(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t length = strlen(path);
+    if (length >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memcpy(address.sun_path, path, length);
+    // An abstract socket, which has no file.
+    if (path[0] == '@') {
+        address.sun_path[0] = '\0';
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    socklen_t addressLength = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length + (path[0] == '@' ? 0 : 1));
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), addressLength) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Where the exports go, opened at the first export and reopened after failures.
+class ExportOutput {
+  public:
+    ExportOutput(const std::string& target, ExportFormat format): mTarget(target), mFormat(format) {
+        mIsSocket = mTarget.compare(0, strlen(UNIX_SOCKET_PREFIX), UNIX_SOCKET_PREFIX) == 0;
+    }
+
+    ~ExportOutput() {
+        closeOutput();
+    }
+
+    void write(const std::string& data) {
+        if (!mIsSocket && mFormat == EXPORT_PROMETHEUS) {
+            replaceFile(data);
+            return;
+        }
+        if (mFd < 0) {
+            mFd = mIsSocket
+                    ? connectUnixSocket(mTarget.c_str() + strlen(UNIX_SOCKET_PREFIX))
+                    : open(mTarget.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (mFd < 0) {
+                reportError("open");
+                return;
+            }
+            mErrorReported = false;
+        }
+        if (!writeAll(mFd, data, mIsSocket)) {
+            reportError("write");
+            closeOutput();
+        }
+    }
+
+  private:
+    void replaceFile(const std::string& data) {
+        std::string tmpPath = mTarget + ".tmp";
+        int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            reportError("open");
+            return;
+        }
+        bool ok = writeAll(fd, data, false);
+        close(fd);
+        if (!ok || rename(tmpPath.c_str(), mTarget.c_str()) != 0) {
+            reportError("write");
+            return;
+        }
+        mErrorReported = false;
+    }
+
+    /// Only once until it works again, since it retries every interval.
+    void reportError(const char* operation) {
+        if (!mErrorReported) {
+            _ADHOC_TOOLS_PERF_LOG_("adhoc perf exporter: can not %s %s: %s", operation, mTarget.c_str(), strerror(errno));
+            mErrorReported = true;
+        }
+    }
+
+    void closeOutput() {
+        if (mFd >= 0) {
+            close(mFd);
+            mFd = -1;
+        }
+    }
+
+    std::string mTarget;
+    ExportFormat mFormat;
+    bool mIsSocket;
+    int mFd = -1;
+    bool mErrorReported = false;
+};
+
+void exporterLoop() {
+    ExportOutput output(s_exporterTarget, s_exporterFormat);
+    PerfCursor cursor;
+    std::vector<PerfItemDelta> deltas;
+    std::vector<PerfItemDelta> totals;
+    std::string data;
+    // Skip what was recorded before the start.
+    cursor.collect(deltas);
+    Ticks lastTicks = clockNow();
+    bool stopping = false;
+    while (!stopping) {
+        {
+            std::unique_lock<std::mutex> lock(s_exporterMutex);
+            stopping = s_exporterCondition.wait_for(lock, std::chrono::milliseconds(s_exporterIntervalMs),
+                    [] { return s_exporterStopRequested; });
+        }
+        cursor.collect(deltas);
+        Ticks now = clockNow();
+        data = formatPerfExport(deltas, s_exporterFormat, ticksToMillis((double)(now - lastTicks)), totals);
+        lastTicks = now;
+        output.write(data);
+    }
+}
+
+} // end of anonymous namespace
+
+
+std::string formatPerfExport(const std::vector<PerfItemDelta>& deltas, ExportFormat format,
+        double intervalMs, std::vector<PerfItemDelta>& totals) {
+    std::string out;
+    if (format == EXPORT_JSON) {
+        formatJson(out, deltas, intervalMs);
+        return out;
+    }
+    // Items registered since the last call are appended (zero-initialized).
+    totals.resize(deltas.size());
+    for (size_t i = 0; i < deltas.size(); i++) {
+        const PerfItemDelta& delta = deltas[i];
+        PerfItemDelta& total = totals[i];
+        total.mTimer.add(delta.mTimer);
+        total.mCounter += delta.mCounter;
+        if (delta.mSkipped) {
+            // Sampled, see `TimerItem::setSampleRate()`. `_sum` is of all of the calls, with
+            // the ones not timed taking the average of the timed ones in the interval (or so
+            // far if none is timed in the interval).
+            uint64_t callsSoFar = total.mTimer.mCount + total.mSkipped;
+            double mean = delta.mTimer.mCount
+                    ? delta.mTimer.mean()
+                    : callsSoFar ? (double)total.mTimer.mSum / (double)callsSoFar : 0;
+            total.mTimer.mSum += (uint64_t)(mean * (double)delta.mSkipped + 0.5);
+            total.mSkipped += delta.mSkipped;
+        }
+    }
+    formatPrometheus(out, deltas, totals);
+    return out;
+}
+
+bool startPerfExporter(const char* target, ExportFormat format, uint32_t intervalMs) {
+    std::lock_guard<std::mutex> lock(s_exporterMutex);
+    if (s_exporterThread.joinable() || intervalMs == 0) {
+        return false;
+    }
+    s_exporterTarget = target;
+    s_exporterFormat = format;
+    s_exporterIntervalMs = intervalMs;
+    s_exporterStopRequested = false;
+    s_exporterThread = std::thread(exporterLoop);
+    return true;
+}
+
+void stopPerfExporter() {
+    {
+        std::lock_guard<std::mutex> lock(s_exporterMutex);
+        s_exporterStopRequested = true;
+    }
+    s_exporterCondition.notify_all();
+    if (s_exporterThread.joinable()) {
+        s_exporterThread.join();
+    }
+}
+
+} // end of namespace adhocperf
@@ -0,0 +1,61 @@
+/// Export the timers, counters and gauges of `adhoc-perf` periodically in a background
+/// thread, as JSON lines or Prometheus text, to a file or a Unix domain socket, for a
+/// continuous time series instead of the logs of `summarizeAndPrintPerf()`.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/perf/adhoc-perf-exporter.h"
+///
+/// adhocperf::startPerfExporter("/data/data/com.xxx.yyy/files/perf.jsonl", adhocperf::EXPORT_JSON, 1000);
+/// // Or to a socket listened by a collector (an abstract socket if it starts with "@"):
+/// adhocperf::startPerfExporter("unix:@adhoc-perf", adhocperf::EXPORT_PROMETHEUS, 1000);
+/// ```
+/// The values are read by a `PerfCursor`, which neither stops the recording threads nor
+/// resets anything, so `summarizeAndPrintPerf()` can still be used at the same time.
+///
+/// JSON: one line per interval, with the deltas of the interval (durations in ms), leaving out
+/// the timers and counters not used in the interval. A sampled timer (see
+/// `TimerItem::setSampleRate()`) has "calls" as well, with "count" of the timed ones only:
+/// ```
+/// {"time_ms":1700000000000,"interval_ms":1000.2,"timers":{"v8Timer":{"count":30,"sum_ms":6.05,"mean_ms":0.20,"p50_ms":0.19,"p90_ms":0.25,"p99_ms":0.31,"max_ms":0.31}},"counters":{"bytesMarshalled":1048576},"gauges":{"bridgeQueueDepth":3}}
+/// ```
+/// Prometheus: the text exposition format, rewritten every interval. The quantiles are of the
+/// interval (`NaN` if the timer was not called in it), and `_count`, `_sum` and the counters are cumulative since the export started,
+/// as Prometheus expects (the deltas are given by `rate()` or `increase()`). For a sampled
+/// timer, `_count` is of all of the calls, and `_sum` is scaled to them by the average of the
+/// timed ones.
+/// Written into "<path>.tmp" and renamed to the file, so a reader (like the textfile collector
+/// of node_exporter) never sees a partial one.
+
+#ifndef _ADHOC_TOOLS_PERF_EXPORTER_H_
+#define _ADHOC_TOOLS_PERF_EXPORTER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "adhoc-perf.h"
+
+namespace adhocperf {
+
+enum ExportFormat {
+    EXPORT_JSON,
+    EXPORT_PROMETHEUS,
+};
+
+/// @param target a file path, or "unix:<path>" for a stream socket (reconnected at the next
+///     interval if it fails). JSON lines are appended to a file.
+/// @return false if it is started already, or the interval is 0.
+extern bool startPerfExporter(const char* target, ExportFormat format, uint32_t intervalMs);
+/// Export the last interval and stop.
+extern void stopPerfExporter();
+
+/// Format the deltas of one interval (see `PerfCursor::collect()`), for other transports.
+/// @param totals the cumulative values for Prometheus, accumulated by every call (indexed like
+///     `deltas`). Not used by JSON.
+extern std::string formatPerfExport(const std::vector<PerfItemDelta>& deltas, ExportFormat format,
+        double intervalMs, std::vector<PerfItemDelta>& totals);
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_EXPORTER_H_
@@ -0,0 +1,98 @@
+/// The shared memory region published by `adhoc-perf-shared.cpp`, shared with the reader
+/// (`tools/adhoc-perf-top.cpp`), which may be built with another config.
+///
+/// [PerfSharedHeader][PerfSharedItem + uint64_t buckets[mBucketCount]] * mMaxItems
+/// All of the values are cumulative since the start of the process, and in the native byte
+/// order. The items are protected by the seqlock `mSequence` of the header: it is odd while
+/// the publisher is writing, so a reader copies the region, and retries if the sequence was
+/// odd or changed in between.
+/// The region is a memfd named `PERF_SHARED_MEMFD_NAME`, found by a reader in
+/// `/proc/<pid>/fd`, or (where memfd is not supported) `/dev/shm/adhoc-perf-<pid>`.
+
+#ifndef _ADHOC_TOOLS_PERF_SHARED_FORMAT_H_
+#define _ADHOC_TOOLS_PERF_SHARED_FORMAT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace adhocperf {
+
+const char PERF_SHARED_MAGIC[8] = {'A', 'D', 'H', 'O', 'C', 'P', 'S', 'M'};
+const uint32_t PERF_SHARED_VERSION = 2;
+/// Shown as "/memfd:adhoc-perf (deleted)" by `readlink` of `/proc/<pid>/fd/<fd>`.
+const char PERF_SHARED_MEMFD_NAME[] = "adhoc-perf";
+/// Followed by the pid.
+const char PERF_SHARED_SHM_PREFIX[] = "/adhoc-perf-";
+const size_t PERF_SHARED_NAME_LENGTH = 64;
+
+struct PerfSharedHeader {
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mHeaderSize;
+    /// Including the buckets.
+    uint32_t mItemSize;
+    uint32_t mMaxItems;
+    /// Of the log-linear histograms, see `perfSharedBucketMidpoint()`.
+    uint32_t mBucketCount;
+    uint32_t mSubBucketBits;
+    uint32_t mPid;
+    /// The count of items published, under the seqlock.
+    uint32_t mItemCount;
+    /// The seqlock, odd while writing. Only accessed by `__atomic` builtins.
+    uint64_t mSequence;
+    /// The `CLOCK_MONOTONIC` time of the last publishing, under the seqlock.
+    uint64_t mPublishNanos;
+    /// To convert the timer values (clock ticks) to nanoseconds.
+    double mNanosPerTick;
+    uint64_t mReserved;
+};
+
+enum PerfSharedItemKind : uint32_t {
+    PERF_SHARED_TIMER = 0,
+    PERF_SHARED_COUNTER = 1,
+    PERF_SHARED_GAUGE = 2,
+};
+
+struct PerfSharedItem {
+    char mName[PERF_SHARED_NAME_LENGTH];
+    uint32_t mKind;
+    uint32_t mReserved;
+    /// Of a timer, in clock ticks. Only the timed calls if it is sampled.
+    uint64_t mCount;
+    uint64_t mSum;
+    uint64_t mCounter;
+    int64_t mGauge;
+    /// The calls of a timer not timed by sampling (see `TimerItem::setSampleRate()`), so the
+    /// calls are `mCount + mSkipped`.
+    uint64_t mSkipped;
+    /// Followed by `uint64_t` buckets of a timer.
+};
+
+static_assert(sizeof(PerfSharedHeader) == 72, "PerfSharedHeader should be 72 bytes");
+static_assert(sizeof(PerfSharedItem) == 112, "PerfSharedItem should be 112 bytes");
+
+inline size_t perfSharedItemSize(uint32_t bucketCount) {
+    return sizeof(PerfSharedItem) + sizeof(uint64_t) * bucketCount;
+}
+
+inline uint64_t* perfSharedBuckets(PerfSharedItem* item) {
+    return reinterpret_cast<uint64_t*>(item + 1);
+}
+
+inline const uint64_t* perfSharedBuckets(const PerfSharedItem* item) {
+    return reinterpret_cast<const uint64_t*>(item + 1);
+}
+
+/// Like `histogramBucketMidpoint()` of `histogram.h`, with the bits of the publisher.
+inline uint64_t perfSharedBucketMidpoint(int index, uint32_t subBucketBits) {
+    int subBucketCount = 1 << subBucketBits;
+    if (index < 2 * subBucketCount) {
+        return index;
+    }
+    int shift = index / subBucketCount - 1;
+    return (uint64_t(index - shift * subBucketCount) << shift) + (uint64_t(1) << shift) / 2;
+}
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_SHARED_FORMAT_H_
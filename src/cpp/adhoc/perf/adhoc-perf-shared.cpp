@@ -0,0 +1,201 @@
+#include "adhoc-perf-shared.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "adhoc-perf.h"
+#include "adhoc-perf-shared-format.h"
+#include "clock.h"
+#include "histogram.h"
+#include _ADHOC_TOOLS_PERF_LOG_INCLUDE_
+
+namespace adhocperf {
+
+namespace {
+
+const uint32_t MAX_ITEMS = _ADHOC_TOOLS_PERF_MAX_TIMER_ITEMS_;
+
+std::thread s_sharedThread;
+std::mutex s_sharedMutex;
+std::condition_variable s_sharedCondition;
+bool s_sharedStopRequested = false;
+uint32_t s_sharedIntervalMs = 0;
+
+/// The region, only touched by the publishing thread after it is started.
+int s_sharedFd = -1;
+void* s_sharedRegion = nullptr;
+size_t s_sharedSize = 0;
+/// Empty if it is a memfd.
+std::string s_sharedShmName;
+
+uint64_t monotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/// memfd has no name in the file system, so nothing is left if the process is killed.
+/// Called by `syscall`, since the wrapper is only in newer libc.
+int createRegionFd() {
+#if defined(__NR_memfd_create)
+    // MFD_CLOEXEC
+    int fd = (int)syscall(__NR_memfd_create, PERF_SHARED_MEMFD_NAME, 1u);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+#if defined(__ANDROID__)
+    return -1;
+#else
+    s_sharedShmName = PERF_SHARED_SHM_PREFIX + std::to_string(getpid());
+    return shm_open(s_sharedShmName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+#endif
+}
+
+void releaseRegion() {
+    if (s_sharedRegion) {
+        munmap(s_sharedRegion, s_sharedSize);
+        s_sharedRegion = nullptr;
+    }
+    if (s_sharedFd >= 0) {
+        close(s_sharedFd);
+        s_sharedFd = -1;
+    }
+#if !defined(__ANDROID__)
+    if (!s_sharedShmName.empty()) {
+        shm_unlink(s_sharedShmName.c_str());
+        s_sharedShmName.clear();
+    }
+#endif
+}
+
+bool createRegion() {
+    size_t itemSize = perfSharedItemSize(HISTOGRAM_BUCKET_COUNT);
+    s_sharedSize = sizeof(PerfSharedHeader) + itemSize * MAX_ITEMS;
+    s_sharedFd = createRegionFd();
+    if (s_sharedFd < 0 || ftruncate(s_sharedFd, (off_t)s_sharedSize) != 0) {
+        _ADHOC_TOOLS_PERF_LOG_("adhoc perf shared memory: can not create it: %s", strerror(errno));
+        releaseRegion();
+        return false;
+    }
+    void* region = mmap(nullptr, s_sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, s_sharedFd, 0);
+    if (region == MAP_FAILED) {
+        _ADHOC_TOOLS_PERF_LOG_("adhoc perf shared memory: can not map it: %s", strerror(errno));
+        releaseRegion();
+        return false;
+    }
+    s_sharedRegion = region;
+    // Zero-filled by ftruncate.
+    PerfSharedHeader* header = static_cast<PerfSharedHeader*>(region);
+    header->mVersion = PERF_SHARED_VERSION;
+    header->mHeaderSize = sizeof(PerfSharedHeader);
+    header->mItemSize = (uint32_t)itemSize;
+    header->mMaxItems = MAX_ITEMS;
+    header->mBucketCount = HISTOGRAM_BUCKET_COUNT;
+    header->mSubBucketBits = HISTOGRAM_SUB_BUCKET_BITS;
+    header->mPid = (uint32_t)getpid();
+    header->mNanosPerTick = clockNanosPerTick();
+    // The magic is the last, so a reader never takes a half-initialized header.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->mMagic, PERF_SHARED_MAGIC, sizeof(PERF_SHARED_MAGIC));
+    return true;
+}
+
+inline PerfSharedItem* sharedItem(uint32_t index) {
+    PerfSharedHeader* header = static_cast<PerfSharedHeader*>(s_sharedRegion);
+    return reinterpret_cast<PerfSharedItem*>(
+            static_cast<char*>(s_sharedRegion) + header->mHeaderSize + (size_t)header->mItemSize * index);
+}
+
+/// Add the deltas into the region under the seqlock.
+void publish(const std::vector<PerfItemDelta>& deltas) {
+    PerfSharedHeader* header = static_cast<PerfSharedHeader*>(s_sharedRegion);
+    uint32_t count = deltas.size() < MAX_ITEMS ? (uint32_t)deltas.size() : MAX_ITEMS;
+    uint64_t sequence = __atomic_load_n(&header->mSequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->mSequence, sequence + 1, __ATOMIC_RELAXED);
+    // The odd sequence is seen before any of the writes below.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (uint32_t i = header->mItemCount; i < count; i++) {
+        PerfSharedItem* item = sharedItem(i);
+        strncpy(item->mName, deltas[i].mName, PERF_SHARED_NAME_LENGTH - 1);
+        item->mKind = deltas[i].mKind == ITEM_COUNTER
+                ? PERF_SHARED_COUNTER
+                : deltas[i].mKind == ITEM_GAUGE ? PERF_SHARED_GAUGE : PERF_SHARED_TIMER;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const PerfItemDelta& delta = deltas[i];
+        PerfSharedItem* item = sharedItem(i);
+        if (delta.mKind == ITEM_COUNTER) {
+            item->mCounter += delta.mCounter;
+        }
+        else if (delta.mKind == ITEM_GAUGE) {
+            item->mGauge = delta.mGauge;
+        }
+        else if (delta.mTimer.mCount || delta.mSkipped) {
+            item->mCount += delta.mTimer.mCount;
+            item->mSkipped += delta.mSkipped;
+            item->mSum += delta.mTimer.mSum;
+            uint64_t* buckets = perfSharedBuckets(item);
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; bucket++) {
+                buckets[bucket] += delta.mTimer.mCounts[bucket];
+            }
+        }
+    }
+    header->mItemCount = count;
+    header->mPublishNanos = monotonicNanos();
+    __atomic_store_n(&header->mSequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void sharedLoop() {
+    PerfCursor cursor;
+    std::vector<PerfItemDelta> deltas;
+    bool stopping = false;
+    while (!stopping) {
+        cursor.collect(deltas);
+        publish(deltas);
+        std::unique_lock<std::mutex> lock(s_sharedMutex);
+        stopping = s_sharedCondition.wait_for(lock, std::chrono::milliseconds(s_sharedIntervalMs),
+                [] { return s_sharedStopRequested; });
+    }
+}
+
+} // end of anonymous namespace
+
+
+bool startPerfSharedMemory(uint32_t intervalMs) {
+    std::lock_guard<std::mutex> lock(s_sharedMutex);
+    if (s_sharedThread.joinable() || intervalMs == 0 || !createRegion()) {
+        return false;
+    }
+    s_sharedIntervalMs = intervalMs;
+    s_sharedStopRequested = false;
+    s_sharedThread = std::thread(sharedLoop);
+    return true;
+}
+
+void stopPerfSharedMemory() {
+    {
+        std::lock_guard<std::mutex> lock(s_sharedMutex);
+        s_sharedStopRequested = true;
+    }
+    s_sharedCondition.notify_all();
+    if (s_sharedThread.joinable()) {
+        s_sharedThread.join();
+        releaseRegion();
+    }
+}
+
+} // end of namespace adhocperf
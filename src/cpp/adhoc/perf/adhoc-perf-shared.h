@@ -0,0 +1,34 @@
+/// Publish the timers, counters and gauges of `adhoc-perf` in a shared memory region, which
+/// another process reads live (see `tools/adhoc-perf-top.cpp`) without any log.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/perf/adhoc-perf-shared.h"
+///
+/// adhocperf::startPerfSharedMemory(200);
+/// ```
+/// ```shell
+/// adb shell su -c /data/local/tmp/adhoc-perf-top 12345 12346
+/// ```
+/// A background thread reads the values by a `PerfCursor` every interval (so nothing is reset,
+/// and the recording threads are not stopped) and adds them into the region under a seqlock
+/// (see `adhoc-perf-shared-format.h`). Readers never write to it, so observing costs the
+/// process nothing more than the publishing, whether anyone reads it or not.
+/// The reader needs to open `/proc/<pid>/fd` of the process, that is, the same user (like
+/// `run-as`) or root.
+
+#ifndef _ADHOC_TOOLS_PERF_SHARED_H_
+#define _ADHOC_TOOLS_PERF_SHARED_H_
+
+#include <cstdint>
+
+namespace adhocperf {
+
+/// @return false if it is started already, the interval is 0, or the region can not be created.
+extern bool startPerfSharedMemory(uint32_t intervalMs);
+/// Stop publishing, and release the region.
+extern void stopPerfSharedMemory();
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_SHARED_H_
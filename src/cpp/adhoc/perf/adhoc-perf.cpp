@@ -1,50 +1,1070 @@
 #include "adhoc-perf.h"
 
-#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <map>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "config.h"
+#include "clock.h"
+#include "hardware-counters.h"
+#include "histogram.h"
 #include "../common/adhoc-private.h"
 #include _ADHOC_TOOLS_PERF_LOG_INCLUDE_
 
 namespace adhocperf {
 
+namespace {
+
+const int MAX_TIMER_ITEMS = _ADHOC_TOOLS_PERF_MAX_TIMER_ITEMS_;
+const size_t MAX_TIMER_NAME_LENGTH = _ADHOC_TOOLS_PERF_MAX_TIMER_NAME_LENGTH_;
+const size_t CACHE_LINE_SIZE = 64;
+const uint32_t DEFAULT_SAMPLE_RATE = _ADHOC_TOOLS_PERF_DEFAULT_SAMPLE_RATE_;
+
+/// The registry of timer items.
+/// Slots are allocated in registration order, and never released.
+/// The hash index is an open-addressing table, inserted by CAS, so it is lock-free.
+struct RegistrySlot {
+    char mName[MAX_TIMER_NAME_LENGTH];
+};
+struct RegistryIndexEntry {
+    std::atomic<uint64_t> mNameHash;
+    /// The slot + 1, published after the name of the slot is written. 0 (zero-initialized)
+    /// means the entry is just claimed and the slot is not published yet.
+    std::atomic<int> mSlotPlusOne;
+};
+const int REGISTRY_INDEX_SIZE = MAX_TIMER_ITEMS * 2;
+
+RegistrySlot s_registrySlots[MAX_TIMER_ITEMS];
+RegistryIndexEntry s_registryIndex[REGISTRY_INDEX_SIZE];
+/// Count of published slots. All of them are zero-initialized (not dynamic-initialized),
+/// so items can be registered in static initializers of any other file.
+std::atomic<int> s_registrySlotCount{0};
+std::atomic<int> s_registrySlotAllocated{0};
+/// Whether to read hardware counters for the slot, see `TimerItem::enableHardwareCounters()`.
+std::atomic<bool> s_registryCountersEnabled[MAX_TIMER_ITEMS];
+/// See `TimerItem::setSampleRate()`, 0 for the default.
+std::atomic<uint32_t> s_registrySampleRates[MAX_TIMER_ITEMS];
+const char* const ITEM_KIND_NAMES[] = {"timer", "counter", "gauge"};
+/// Set before the slot is published.
+ItemKind s_registryKinds[MAX_TIMER_ITEMS];
+
+const int MAX_REPORTERS = _ADHOC_TOOLS_PERF_MAX_REPORTERS_;
+/// Published in order like `s_registrySlots`.
+std::atomic<PerfReporter> s_reporters[MAX_REPORTERS];
+std::atomic<int> s_reporterCount{0};
+std::atomic<int> s_reporterAllocated{0};
+
+int registerItem(uint64_t nameHash, const char* name, ItemKind kind) {
+    // 0 is reserved for empty entries.
+    if (nameHash == 0) {
+        nameHash = 1;
+    }
+    for (int probe = 0; probe < REGISTRY_INDEX_SIZE; probe++) {
+        RegistryIndexEntry& entry = s_registryIndex[(nameHash + probe) % REGISTRY_INDEX_SIZE];
+        uint64_t entryHash = entry.mNameHash.load(std::memory_order_acquire);
+        if (entryHash == 0) {
+            if (entry.mNameHash.compare_exchange_strong(entryHash, nameHash, std::memory_order_acq_rel)) {
+                int slot = s_registrySlotAllocated.fetch_add(1, std::memory_order_relaxed);
+                if (slot >= MAX_TIMER_ITEMS) {
+                    _ADHOC_TOOLS_PERF_LOG_("Too many timer items (max: %d), ignore: %s", MAX_TIMER_ITEMS, name);
+                    slot = MAX_TIMER_ITEMS;
+                }
+                else {
+                    strncpy(s_registrySlots[slot].mName, name, MAX_TIMER_NAME_LENGTH - 1);
+                    s_registryKinds[slot] = kind;
+                    // Slots are published in order, so that readers can simply iterate [0, count).
+                    int expected = slot;
+                    while (!s_registrySlotCount.compare_exchange_weak(
+                            expected, slot + 1, std::memory_order_release, std::memory_order_relaxed)) {
+                        expected = slot;
+                    }
+                }
+                entry.mSlotPlusOne.store(slot + 1, std::memory_order_release);
+                return slot < MAX_TIMER_ITEMS ? slot : -1;
+            }
+            // Lost the race, check what the winner inserted.
+        }
+        if (entryHash != nameHash) {
+            continue;
+        }
+        // Wait for the name of the winner, or it may be compared half-written, and the same
+        // name would take another entry.
+        int slotPlusOne;
+        while ((slotPlusOne = entry.mSlotPlusOne.load(std::memory_order_acquire)) == 0) {
+        }
+        int slot = slotPlusOne - 1;
+        if (slot >= MAX_TIMER_ITEMS) {
+            return -1;
+        }
+        // Different names with the same hash take different slots.
+        if (strncmp(s_registrySlots[slot].mName, name, MAX_TIMER_NAME_LENGTH - 1) == 0) {
+            if (s_registryKinds[slot] != kind) {
+                _ADHOC_TOOLS_PERF_LOG_("%s is registered as a %s, ignore it as a %s",
+                        name, ITEM_KIND_NAMES[s_registryKinds[slot]], ITEM_KIND_NAMES[kind]);
+                return -1;
+            }
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/// Records of `AsyncTimer` of one timer item in one thread, created at the first use.
+struct AsyncTimerRecord {
+    /// Of the procedures ended in this thread. On-CPU time is in nanoseconds.
+    std::atomic<Ticks> mWall{0};
+    Histogram mCpuHistogram;
+    std::atomic<uint64_t> mSuspensions{0};
+    /// On-CPU time of the parts of procedures run in this thread, wherever they began or ended.
+    std::atomic<uint64_t> mRunNanos{0};
+
+    /// The values at the last flush (the histogram is flushed by `s_timersFlushed`). Kept in
+    /// other cache lines from the writer's.
+    alignas(CACHE_LINE_SIZE) Ticks mWallFlushed = 0;
+    uint64_t mSuspensionsFlushed = 0;
+    uint64_t mRunNanosFlushed = 0;
+};
+
+/// Hardware counters of one timer item in one thread, created at the first use.
+struct CounterRecord {
+    HardwareCounterValues mStart;
+    bool mStarted = false;
+    /// Bits of `HardwareCounter` opened in this thread.
+    uint32_t mAvailable = 0;
+    std::atomic<uint64_t> mSamples{0};
+    /// The samples during which the group was multiplexed, whose values are scaled.
+    std::atomic<uint64_t> mScaled{0};
+    std::atomic<uint64_t> mSums[COUNTER_COUNT] = {};
+
+    /// The values at the last flush. Kept in other cache lines from the writer's.
+    alignas(CACHE_LINE_SIZE) uint64_t mSamplesFlushed = 0;
+    uint64_t mScaledFlushed = 0;
+    uint64_t mSumsFlushed[COUNTER_COUNT] = {};
+};
+
+/// Records of one timer item in one thread.
+/// Only the owner thread writes `mStart`, `mHistogram`, `mAsync`, `mCounters` and the
+/// sampling, and only the flushing thread writes the flushed values.
+struct TimerRecord {
+    alignas(CACHE_LINE_SIZE) Ticks mStart;
+    std::atomic<AsyncTimerRecord*> mAsync;
+    std::atomic<CounterRecord*> mCounters;
+    /// The calls left until the next one timed, see `TimerItem::setSampleRate()`.
+    uint32_t mSampleCountdown;
+    /// Whether the current call is not timed.
+    bool mSkipping;
+    /// The calls not timed, only written by the owner thread.
+    std::atomic<uint64_t> mSkipped;
+    Histogram mHistogram;
+    /// The values at the last flush, for the result of each thread (the buckets are flushed
+    /// by `s_timersFlushed`). Kept in another cache line from the writer's.
+    alignas(CACHE_LINE_SIZE) uint64_t mCountFlushed;
+    uint64_t mSumFlushed;
+    uint64_t mSkippedFlushed;
+};
+
+/// The histogram counters of all threads at the last flush, of one timer item. Kept for each
+/// item rather than in the records of each thread, so a record takes only a few hundred
+/// bytes. Created at the first flush of the item.
+struct TimerFlushed {
+    HistogramCounters mTimer;
+    HistogramCounters mCpu;
+};
+TimerFlushed* s_timersFlushed[MAX_TIMER_ITEMS];
+
+/// Records are allocated in chunks on demand, since most of the threads use only a few items.
+const int RECORD_CHUNK_SIZE = 16;
+const int RECORD_CHUNK_COUNT = (MAX_TIMER_ITEMS + RECORD_CHUNK_SIZE - 1) / RECORD_CHUNK_SIZE;
+
+/// The shards of `CounterItem` in one thread, indexed like the timer records. Only the owner
+/// thread writes them, and they are in their own cache lines, so adding needs neither an
+/// atomic read-modify-write nor a shared cache line.
+struct alignas(CACHE_LINE_SIZE) CounterShardChunk {
+    std::atomic<uint64_t> mValues[RECORD_CHUNK_SIZE];
+};
+
+/// Gauges are set and moved by any threads, so each one is a single atomic value (the current
+/// value can not be summed from shards if it is also set).
+struct alignas(CACHE_LINE_SIZE) GaugeValue {
+    std::atomic<int64_t> mValue;
+    /// Since the last report.
+    std::atomic<int64_t> mMax;
+};
+GaugeValue s_gauges[MAX_TIMER_ITEMS];
+/// The totals of counters at the last report, only written by the reporting thread.
+uint64_t s_countersFlushed[MAX_TIMER_ITEMS];
+
+const int MAX_CALL_TREE_NODES = _ADHOC_TOOLS_PERF_MAX_CALL_TREE_NODES_;
+const int CALL_TREE_NO_NODE = -1;
+
+/// A node is a path of timer items from the root, like "quickjsTimer > v8Timer".
+/// `mParent`, `mSlot` are set before the node is published and never change.
+/// The others are only written by the owner thread.
+struct CallTreeNode {
+    int mParent;
+    int mSlot;
+    int mFirstChild;
+    int mNextSibling;
+    std::atomic<uint64_t> mCount;
+    std::atomic<Ticks> mInclusive;
+    std::atomic<Ticks> mExclusive;
+};
+
+struct CallTreeFlushed {
+    uint64_t mCount;
+    Ticks mInclusive;
+    Ticks mExclusive;
+};
+
+/// Call tree of `ScopedTimer` in one thread. Nodes are appended only, so parents are always
+/// before their children, and readers can iterate [0, mNodeCount) without lock.
+struct CallTree {
+    std::atomic<int> mNodeCount;
+    int mFirstRootChild;
+    CallTreeNode mNodes[MAX_CALL_TREE_NODES];
+    /// Only written by the flushing thread. Kept in other cache lines from the writer's.
+    alignas(CACHE_LINE_SIZE) CallTreeFlushed mFlushed[MAX_CALL_TREE_NODES];
+};
+
+struct ThreadRecords {
+    long mThreadId;
+    /// Never removed from the list, so that the records of exited threads can still be flushed.
+    ThreadRecords* mNext;
+    std::atomic<TimerRecord*> mChunks[RECORD_CHUNK_COUNT];
+    std::atomic<CounterShardChunk*> mCounterChunks[RECORD_CHUNK_COUNT];
+    /// Created at the first use of `ScopedTimer` in this thread.
+    std::atomic<CallTree*> mCallTree;
+};
+
+std::atomic<ThreadRecords*> s_threadRecordsHead{nullptr};
+
+thread_local ThreadRecords* t_threadRecords = nullptr;
+
+ThreadRecords* createThreadRecords() {
+    ThreadRecords* records = new ThreadRecords();
+    records->mThreadId = syscall(SYS_gettid);
+    records->mNext = s_threadRecordsHead.load(std::memory_order_relaxed);
+    while (!s_threadRecordsHead.compare_exchange_weak(
+            records->mNext, records, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return records;
+}
+
+TimerRecord* createRecordChunk(ThreadRecords* records, int chunkIndex) {
+    TimerRecord* chunk = new TimerRecord[RECORD_CHUNK_SIZE]();
+    records->mChunks[chunkIndex].store(chunk, std::memory_order_release);
+    return chunk;
+}
+
+inline ThreadRecords* getThreadRecords() {
+    ThreadRecords* records = t_threadRecords;
+    if (!records) {
+        records = t_threadRecords = createThreadRecords();
+    }
+    return records;
+}
+
+inline TimerRecord& getTimerRecord(int slot) {
+    ThreadRecords* records = getThreadRecords();
+    int chunkIndex = slot / RECORD_CHUNK_SIZE;
+    TimerRecord* chunk = records->mChunks[chunkIndex].load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = createRecordChunk(records, chunkIndex);
+    }
+    return chunk[slot % RECORD_CHUNK_SIZE];
+}
+
+inline std::atomic<uint64_t>& getCounterShard(int slot) {
+    ThreadRecords* records = getThreadRecords();
+    int chunkIndex = slot / RECORD_CHUNK_SIZE;
+    CounterShardChunk* chunk = records->mCounterChunks[chunkIndex].load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new CounterShardChunk();
+        records->mCounterChunks[chunkIndex].store(chunk, std::memory_order_release);
+    }
+    return chunk->mValues[slot % RECORD_CHUNK_SIZE];
+}
+
+/// Sum the shards of all threads, including the exited ones.
+uint64_t sumCounterShards(int slot) {
+    uint64_t sum = 0;
+    for (ThreadRecords* records = s_threadRecordsHead.load(std::memory_order_acquire);
+            records;
+            records = records->mNext) {
+        CounterShardChunk* chunk = records->mCounterChunks[slot / RECORD_CHUNK_SIZE].load(std::memory_order_acquire);
+        if (chunk) {
+            sum += chunk->mValues[slot % RECORD_CHUNK_SIZE].load(std::memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+/// Only for reading from other threads, may return null.
+inline TimerRecord* findTimerRecord(ThreadRecords* records, int slot) {
+    TimerRecord* chunk = records->mChunks[slot / RECORD_CHUNK_SIZE].load(std::memory_order_acquire);
+    return chunk ? &chunk[slot % RECORD_CHUNK_SIZE] : nullptr;
+}
+
+inline AsyncTimerRecord& getAsyncTimerRecord(int slot) {
+    TimerRecord& record = getTimerRecord(slot);
+    AsyncTimerRecord* asyncRecord = record.mAsync.load(std::memory_order_relaxed);
+    if (!asyncRecord) {
+        asyncRecord = new AsyncTimerRecord();
+        record.mAsync.store(asyncRecord, std::memory_order_release);
+    }
+    return *asyncRecord;
+}
+
+thread_local ThreadHardwareCounters t_hardwareCounters;
+
+inline bool isCountersEnabled(int slot) {
+    return s_registryCountersEnabled[slot].load(std::memory_order_relaxed);
+}
+
+inline uint32_t getSampleRate(int slot) {
+    uint32_t rate = s_registrySampleRates[slot].load(std::memory_order_relaxed);
+    return rate ? rate : DEFAULT_SAMPLE_RATE;
+}
+
+/// Called before reading the clock, so that reading counters is not in the time.
+void startCounters(TimerRecord& record) {
+    if (!t_hardwareCounters.open()) {
+        return;
+    }
+    CounterRecord* counters = record.mCounters.load(std::memory_order_relaxed);
+    if (!counters) {
+        counters = new CounterRecord();
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            counters->mAvailable |= t_hardwareCounters.has(i) ? 1u << i : 0;
+        }
+        record.mCounters.store(counters, std::memory_order_release);
+    }
+    counters->mStarted = t_hardwareCounters.read(counters->mStart);
+}
+
+/// Called after reading the clock.
+void endCounters(TimerRecord& record) {
+    CounterRecord* counters = record.mCounters.load(std::memory_order_relaxed);
+    HardwareCounterValues values;
+    if (!counters || !counters->mStarted || !t_hardwareCounters.read(values)) {
+        return;
+    }
+    counters->mStarted = false;
+    uint64_t enabled = values.mEnabled - counters->mStart.mEnabled;
+    uint64_t running = values.mRunning - counters->mStart.mRunning;
+    if (running == 0) {
+        // Not counted at all (the group was switched out the whole time), nothing to estimate.
+        return;
+    }
+    // If the group was multiplexed, estimate the counts as if it was running all the time.
+    bool scaled = running < enabled;
+    double scale = scaled ? (double)enabled / (double)running : 1;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        uint64_t delta = values.mValues[i] - counters->mStart.mValues[i];
+        if (scaled) {
+            delta = (uint64_t)((double)delta * scale);
+        }
+        counters->mSums[i].store(counters->mSums[i].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    counters->mSamples.store(counters->mSamples.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (scaled) {
+        counters->mScaled.store(counters->mScaled.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+inline uint64_t threadCpuNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+thread_local CallTree* t_callTree = nullptr;
+/// The innermost living `ScopedTimer` in this thread.
+thread_local ScopedTimer* t_currentScope = nullptr;
+
+CallTree* createCallTree() {
+    CallTree* tree = new CallTree();
+    tree->mFirstRootChild = CALL_TREE_NO_NODE;
+    getThreadRecords()->mCallTree.store(tree, std::memory_order_release);
+    return tree;
+}
+
+int findOrCreateCallTreeNode(int parent, int slot) {
+    CallTree* tree = t_callTree;
+    if (!tree) {
+        tree = t_callTree = createCallTree();
+    }
+    int* firstChild = parent == CALL_TREE_NO_NODE ? &tree->mFirstRootChild : &tree->mNodes[parent].mFirstChild;
+    for (int child = *firstChild; child != CALL_TREE_NO_NODE; child = tree->mNodes[child].mNextSibling) {
+        if (tree->mNodes[child].mSlot == slot) {
+            return child;
+        }
+    }
+    int nodeCount = tree->mNodeCount.load(std::memory_order_relaxed);
+    if (nodeCount >= MAX_CALL_TREE_NODES) {
+        return CALL_TREE_NO_NODE;
+    }
+    CallTreeNode& node = tree->mNodes[nodeCount];
+    node.mParent = parent;
+    node.mSlot = slot;
+    node.mFirstChild = CALL_TREE_NO_NODE;
+    node.mNextSibling = *firstChild;
+    *firstChild = nodeCount;
+    tree->mNodeCount.store(nodeCount + 1, std::memory_order_release);
+    return nodeCount;
+}
+
+/// Only written by the owner thread, so no read-modify-write is needed.
+inline void addRelaxed(std::atomic<uint64_t>& target, uint64_t value) {
+    target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+#if _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_
+Ticks monotonicRawNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (Ticks)ts.tv_sec * 1000000000 + (Ticks)ts.tv_nsec;
+}
+
+/// Taken at startup, and used to calibrate the cycle counter at the first report,
+/// which makes the calibration period long without sleeping anywhere.
+const Ticks s_calibrationStartTicks = clockNow();
+const Ticks s_calibrationStartNanos = monotonicRawNanos();
+const Ticks MIN_CALIBRATION_NANOS = 10 * 1000 * 1000;
+#endif
+
+double ticksToMillis(double ticks) {
+    return clockTicksToNanos(ticks) / 1e6;
+}
+
+double nanosToMillis(double nanos) {
+    return nanos / 1e6;
+}
+
+/// @param toMillis converts the values in the histogram.
+void printSnapshot(std::stringstream& out, const HistogramSnapshot& snapshot,
+        double (*toMillis)(double) = ticksToMillis) {
+    if (snapshot.mCount == 0) {
+        out << "{count: 0}";
+        return;
+    }
+    out << "{count: " << snapshot.mCount
+            << ", average: " << std::to_string(toMillis(snapshot.mean())) << " ms"
+            << ", min: " << std::to_string(toMillis(snapshot.min()))
+            << ", p50: " << std::to_string(toMillis(snapshot.percentile(50)))
+            << ", p90: " << std::to_string(toMillis(snapshot.percentile(90)))
+            << ", p99: " << std::to_string(toMillis(snapshot.percentile(99)))
+            << ", max: " << std::to_string(toMillis(snapshot.max()))
+            << ", stddev: " << std::to_string(toMillis(snapshot.stddev()))
+            << "}";
+}
+
+/// The statistics of `AsyncTimer` of one timer item since the last flush.
+struct AsyncTimerDelta {
+    HistogramSnapshot mCpu;
+    Ticks mWall = 0;
+    uint64_t mSuspensions = 0;
+    std::stringstream mRunByThread;
+    bool mHasRun = false;
+    /// Of all threads.
+    HistogramCounters mCpuCounters;
+
+    void collect(AsyncTimerRecord& record, long threadId) {
+        record.mCpuHistogram.read(mCpuCounters);
+        Ticks wall = record.mWall.load(std::memory_order_relaxed);
+        mWall += wall - record.mWallFlushed;
+        record.mWallFlushed = wall;
+        uint64_t suspensions = record.mSuspensions.load(std::memory_order_relaxed);
+        mSuspensions += suspensions - record.mSuspensionsFlushed;
+        record.mSuspensionsFlushed = suspensions;
+        uint64_t runNanos = record.mRunNanos.load(std::memory_order_relaxed);
+        if (runNanos != record.mRunNanosFlushed) {
+            mRunByThread << " " << threadId << ": " << std::to_string(nanosToMillis(runNanos - record.mRunNanosFlushed));
+            mHasRun = true;
+        }
+        record.mRunNanosFlushed = runNanos;
+    }
+
+    /// After collecting all of the threads.
+    void finish(HistogramCounters& cpuFlushed) {
+        mCpuCounters.collect(cpuFlushed, mCpu);
+    }
+
+    void print(std::stringstream& out) {
+        if (!mCpu.mCount && !mHasRun) {
+            return;
+        }
+        double count = mCpu.mCount ? (double)mCpu.mCount : 1;
+        double offCpuMillis = (clockTicksToNanos(mWall) - (double)mCpu.mSum) / 1e6 / count;
+        out << " async: {on-cpu: ";
+        printSnapshot(out, mCpu, nanosToMillis);
+        out << ", off-cpu average: " << std::to_string(offCpuMillis < 0 ? 0 : offCpuMillis) << " ms"
+                << ", suspensions: " << mSuspensions
+                << ", average suspensions: " << std::to_string((double)mSuspensions / count);
+        if (mHasRun) {
+            out << ", on-cpu ms by thread:" << mRunByThread.str();
+        }
+        out << "}";
+    }
+};
+
+/// The hardware counters of one timer item since the last flush.
+struct CountersDelta {
+    uint64_t mSamples = 0;
+    uint64_t mScaled = 0;
+    uint64_t mSums[COUNTER_COUNT] = {};
+    uint32_t mAvailable = 0;
+
+    void collect(CounterRecord& record) {
+        uint64_t samples = record.mSamples.load(std::memory_order_relaxed);
+        mSamples += samples - record.mSamplesFlushed;
+        record.mSamplesFlushed = samples;
+        uint64_t scaled = record.mScaled.load(std::memory_order_relaxed);
+        mScaled += scaled - record.mScaledFlushed;
+        record.mScaledFlushed = scaled;
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            uint64_t sum = record.mSums[i].load(std::memory_order_relaxed);
+            mSums[i] += sum - record.mSumsFlushed[i];
+            record.mSumsFlushed[i] = sum;
+        }
+        mAvailable |= record.mAvailable;
+    }
+
+    void printAverage(std::stringstream& out, const char* name, int counter) {
+        out << ", " << name << ": ";
+        if (mAvailable & (1u << counter)) {
+            out << std::to_string((double)mSums[counter] / (double)mSamples);
+        }
+        else {
+            out << "n/a";
+        }
+    }
+
+    /// Misses per 1000 instructions.
+    void printMpki(std::stringstream& out, const char* name, int counter) {
+        if ((mAvailable & (1u << counter)) && (mAvailable & (1u << COUNTER_INSTRUCTIONS))
+                && mSums[COUNTER_INSTRUCTIONS]) {
+            out << ", " << name << ": "
+                    << std::to_string((double)mSums[counter] * 1000 / (double)mSums[COUNTER_INSTRUCTIONS]);
+        }
+    }
+
+    void print(std::stringstream& out) {
+        if (!mSamples) {
+            return;
+        }
+        out << " counters: {samples: " << mSamples;
+        if (mScaled) {
+            // The PMU was shared by more events than it has counters, so these are estimated.
+            out << ", multiplexed (scaled): " << mScaled;
+        }
+        if ((mAvailable & (1u << COUNTER_CYCLES)) && (mAvailable & (1u << COUNTER_INSTRUCTIONS))
+                && mSums[COUNTER_CYCLES]) {
+            out << ", IPC: " << std::to_string((double)mSums[COUNTER_INSTRUCTIONS] / (double)mSums[COUNTER_CYCLES]);
+        }
+        printAverage(out, "cycles", COUNTER_CYCLES);
+        printAverage(out, "instructions", COUNTER_INSTRUCTIONS);
+        printAverage(out, "cache misses", COUNTER_CACHE_MISSES);
+        printMpki(out, "cache MPKI", COUNTER_CACHE_MISSES);
+        printAverage(out, "branch misses", COUNTER_BRANCH_MISSES);
+        printMpki(out, "branch MPKI", COUNTER_BRANCH_MISSES);
+        printAverage(out, "context switches", COUNTER_CONTEXT_SWITCHES);
+        out << "}";
+    }
+};
+
+std::string flushTimerRecords(int slot) {
+    TimerFlushed* flushed = s_timersFlushed[slot];
+    if (!flushed) {
+        flushed = s_timersFlushed[slot] = new TimerFlushed();
+    }
+    std::stringstream perThreadOut;
+    HistogramCounters counters;
+    HistogramSnapshot total;
+    uint64_t skipped = 0;
+    AsyncTimerDelta asyncDelta;
+    CountersDelta countersDelta;
+    for (ThreadRecords* records = s_threadRecordsHead.load(std::memory_order_acquire);
+            records;
+            records = records->mNext) {
+        TimerRecord* record = findTimerRecord(records, slot);
+        if (!record) {
+            continue;
+        }
+        AsyncTimerRecord* asyncRecord = record->mAsync.load(std::memory_order_acquire);
+        if (asyncRecord) {
+            asyncDelta.collect(*asyncRecord, records->mThreadId);
+        }
+        CounterRecord* counterRecord = record->mCounters.load(std::memory_order_acquire);
+        if (counterRecord) {
+            countersDelta.collect(*counterRecord);
+        }
+        uint64_t recordSkipped = record->mSkipped.load(std::memory_order_relaxed);
+        skipped += recordSkipped - record->mSkippedFlushed;
+        record->mSkippedFlushed = recordSkipped;
+        record->mHistogram.read(counters);
+        uint64_t count = record->mHistogram.count();
+        uint64_t sum = record->mHistogram.sum();
+        if (count != record->mCountFlushed) {
+            // Only the count and the average, since the buckets are flushed for all threads.
+            uint64_t countDelta = count - record->mCountFlushed;
+            perThreadOut << " " << records->mThreadId << ": {count: " << countDelta
+                    << ", average: " << std::to_string(ticksToMillis((double)(sum - record->mSumFlushed) / (double)countDelta))
+                    << " ms}";
+        }
+        record->mCountFlushed = count;
+        record->mSumFlushed = sum;
+    }
+    counters.collect(flushed->mTimer, total);
+    asyncDelta.finish(flushed->mCpu);
+
+    std::stringstream out;
+    printSnapshot(out, total);
+    if (skipped) {
+        // Assume the calls not timed take the average of the timed ones.
+        uint64_t calls = total.mCount + skipped;
+        out << " sampled: {calls: " << calls
+                << ", timed: " << total.mCount
+                << ", estimated total: " << std::to_string(ticksToMillis(total.mean() * (double)calls)) << " ms}";
+    }
+#if _ADHOC_TOOLS_PERF_PRINT_PER_THREAD_
+    if (total.mCount) {
+        out << " (threads:" << perThreadOut.str() << ")";
+    }
+#endif
+    countersDelta.print(out);
+    asyncDelta.print(out);
+    out << ", ";
+    return out.str();
+}
+
+inline void updateGaugeMax(GaugeValue& gauge, int64_t value) {
+    // Usually not greater, then it is only a load.
+    int64_t max = gauge.mMax.load(std::memory_order_relaxed);
+    while (value > max && !gauge.mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+/// The counters (delta since the last report and total) and gauges (current value and max
+/// since the last report), or "" if there are none.
+std::string flushCountersAndGauges(int slotCount) {
+    std::stringstream out;
+    for (int slot = 0; slot < slotCount; slot++) {
+        if (s_registryKinds[slot] == ITEM_COUNTER) {
+            uint64_t total = sumCounterShards(slot);
+            out << terminalcolor::lightGreen << s_registrySlots[slot].mName << ": " << terminalcolor::reset
+                    << "{delta: " << total - s_countersFlushed[slot] << ", total: " << total << "}, ";
+            s_countersFlushed[slot] = total;
+        }
+        else if (s_registryKinds[slot] == ITEM_GAUGE) {
+            GaugeValue& gauge = s_gauges[slot];
+            int64_t value = gauge.mValue.load(std::memory_order_relaxed);
+            // The max of the next period starts from the current value.
+            int64_t max = gauge.mMax.exchange(value, std::memory_order_relaxed);
+            out << terminalcolor::lightGreen << s_registrySlots[slot].mName << ": " << terminalcolor::reset
+                    << "{value: " << value << ", max: " << (max > value ? max : value) << "}, ";
+        }
+    }
+    return out.str();
+}
+
+struct MergedCallTreeNode {
+    int mSlot;
+    uint64_t mCount = 0;
+    Ticks mInclusive = 0;
+    Ticks mExclusive = 0;
+    std::vector<int> mChildren;
+};
+
+void printCallTreeNode(std::stringstream& out, const std::vector<MergedCallTreeNode>& nodes,
+        int index, int depth) {
+    const MergedCallTreeNode& node = nodes[index];
+    if (node.mCount) {
+        out << "\n" << std::string(depth * 2, ' ')
+                << terminalcolor::lightGreen << s_registrySlots[node.mSlot].mName << ": " << terminalcolor::reset
+                << "{count: " << node.mCount
+                << ", inclusive: " << std::to_string(ticksToMillis(node.mInclusive)) << " ms"
+                << ", exclusive: " << std::to_string(ticksToMillis(node.mExclusive)) << " ms"
+                << ", average inclusive: " << std::to_string(ticksToMillis((double)node.mInclusive / node.mCount)) << " ms"
+                << "}";
+    }
+    for (int child : node.mChildren) {
+        printCallTreeNode(out, nodes, child, depth + 1);
+    }
+}
+
+/// Merge the call trees of all threads by path, and print the delta since the last flush.
+std::string flushCallTrees() {
+    // The first one is the virtual root.
+    std::vector<MergedCallTreeNode> merged(1);
+    std::map<std::pair<int, int>, int> mergedIndexByParentAndSlot;
+    std::vector<int> mergedIndexByNode;
+    bool hasAny = false;
+
+    for (ThreadRecords* records = s_threadRecordsHead.load(std::memory_order_acquire);
+            records;
+            records = records->mNext) {
+        CallTree* tree = records->mCallTree.load(std::memory_order_acquire);
+        if (!tree) {
+            continue;
+        }
+        int nodeCount = tree->mNodeCount.load(std::memory_order_acquire);
+        mergedIndexByNode.resize(nodeCount);
+        for (int i = 0; i < nodeCount; i++) {
+            CallTreeNode& node = tree->mNodes[i];
+            CallTreeFlushed& flushed = tree->mFlushed[i];
+            int mergedParent = node.mParent == CALL_TREE_NO_NODE ? 0 : mergedIndexByNode[node.mParent];
+            auto key = std::make_pair(mergedParent, node.mSlot);
+            auto found = mergedIndexByParentAndSlot.find(key);
+            int mergedIndex;
+            if (found == mergedIndexByParentAndSlot.end()) {
+                mergedIndex = (int)merged.size();
+                mergedIndexByParentAndSlot[key] = mergedIndex;
+                merged.emplace_back();
+                merged[mergedIndex].mSlot = node.mSlot;
+                merged[mergedParent].mChildren.push_back(mergedIndex);
+            }
+            else {
+                mergedIndex = found->second;
+            }
+            mergedIndexByNode[i] = mergedIndex;
+
+            uint64_t count = node.mCount.load(std::memory_order_relaxed);
+            Ticks inclusive = node.mInclusive.load(std::memory_order_relaxed);
+            Ticks exclusive = node.mExclusive.load(std::memory_order_relaxed);
+            MergedCallTreeNode& mergedNode = merged[mergedIndex];
+            mergedNode.mCount += count - flushed.mCount;
+            mergedNode.mInclusive += inclusive - flushed.mInclusive;
+            mergedNode.mExclusive += exclusive - flushed.mExclusive;
+            hasAny = hasAny || count != flushed.mCount;
+            flushed.mCount = count;
+            flushed.mInclusive = inclusive;
+            flushed.mExclusive = exclusive;
+        }
+    }
+
+    if (!hasAny) {
+        return "";
+    }
+    std::stringstream out;
+    out << "call tree:";
+    printCallTreeNode(out, merged, 0, 0);
+    return out.str();
+}
+
+} // end of anonymous namespace
+
+
+double clockNanosPerTick() {
+#if _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ && defined(__aarch64__)
+    static const double nanosPerTick = [] {
+        uint64_t frequency;
+        __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+        return 1e9 / (double)frequency;
+    }();
+    return nanosPerTick;
+#elif _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_
+    static const double nanosPerTick = [] {
+        Ticks endNanos;
+        while ((endNanos = monotonicRawNanos()) - s_calibrationStartNanos < MIN_CALIBRATION_NANOS) {
+        }
+        Ticks endTicks = clockNow();
+        return (double)(endNanos - s_calibrationStartNanos) / (double)(endTicks - s_calibrationStartTicks);
+    }();
+    return nanosPerTick;
+#else
+    return 1;
+#endif
+}
+
+TimerItem::TimerItem(uint64_t nameHash, const char* name): mSlot(registerItem(nameHash, name, ITEM_TIMER)) {
+}
+
 void TimerItem::start() {
-    mStart = std::chrono::system_clock::now();
+    if (mSlot < 0) { return; }
+    TimerRecord& record = getTimerRecord(mSlot);
+    uint32_t rate = getSampleRate(mSlot);
+    if (rate > 1) {
+        // Time the first call, and then every `rate` calls.
+        record.mSkipping = record.mSampleCountdown > 1;
+        if (record.mSkipping) {
+            record.mSampleCountdown--;
+            addRelaxed(record.mSkipped, 1);
+            return;
+        }
+        record.mSampleCountdown = rate;
+    }
+    else {
+        record.mSkipping = false;
+    }
+    if (isCountersEnabled(mSlot)) {
+        startCounters(record);
+    }
+    record.mStart = clockNow();
 }
 
 void TimerItem::end() {
-    if (mLen >= LIST_MAX_LENGTH) { return; }
-    mList[mLen++] = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(
-            std::chrono::system_clock::now() - mStart).count();
+    if (mSlot < 0) { return; }
+    TimerRecord& record = getTimerRecord(mSlot);
+    if (record.mSkipping) {
+        return;
+    }
+    record.mHistogram.record(clockNow() - record.mStart);
+    if (isCountersEnabled(mSlot)) {
+        endCounters(record);
+    }
+}
+
+void TimerItem::enableHardwareCounters(bool enabled) {
+    if (mSlot < 0) { return; }
+    s_registryCountersEnabled[mSlot].store(enabled, std::memory_order_relaxed);
+}
+
+void TimerItem::setSampleRate(uint32_t rate) {
+    if (mSlot < 0) { return; }
+    s_registrySampleRates[mSlot].store(rate, std::memory_order_relaxed);
+}
+
+ScopedTimer::ScopedTimer(TimerItem& item): mSlot(item.mSlot), mParent(t_currentScope), mChildTicks(0) {
+    if (mSlot < 0) {
+        mNode = CALL_TREE_NO_NODE;
+        return;
+    }
+    int parentNode = mParent ? mParent->mNode : CALL_TREE_NO_NODE;
+    // If the parent is not in the tree (nodes used up), do not attach it to the root wrongly.
+    mNode = (mParent && parentNode == CALL_TREE_NO_NODE)
+            ? CALL_TREE_NO_NODE
+            : findOrCreateCallTreeNode(parentNode, mSlot);
+    t_currentScope = this;
+    if (isCountersEnabled(mSlot)) {
+        startCounters(getTimerRecord(mSlot));
+    }
+    mStart = clockNow();
+}
+
+ScopedTimer::~ScopedTimer() {
+    if (mSlot < 0) { return; }
+    Ticks inclusive = clockNow() - mStart;
+    t_currentScope = mParent;
+    if (mParent) {
+        mParent->mChildTicks += inclusive;
+    }
+    TimerRecord& record = getTimerRecord(mSlot);
+    record.mHistogram.record(inclusive);
+    if (isCountersEnabled(mSlot)) {
+        endCounters(record);
+    }
+    if (mNode != CALL_TREE_NO_NODE) {
+        CallTreeNode& node = t_callTree->mNodes[mNode];
+        addRelaxed(node.mCount, 1);
+        addRelaxed(node.mInclusive, inclusive);
+        addRelaxed(node.mExclusive, inclusive - mChildTicks);
+    }
+}
+
+AsyncTimer::AsyncTimer(TimerItem& item)
+        : mSlot(item.mSlot), mState(RUNNING), mSuspensions(0), mStart(0), mRunStartCpuNanos(0), mCpuNanos(0) {
+    if (mSlot < 0) {
+        mState = ENDED;
+        return;
+    }
+    mStart = clockNow();
+    mRunStartCpuNanos = threadCpuNanos();
+}
+
+AsyncTimer::~AsyncTimer() {
+    end();
+}
+
+void AsyncTimer::endRunning() {
+    uint64_t cpuNanos = threadCpuNanos() - mRunStartCpuNanos;
+    mCpuNanos += cpuNanos;
+    AsyncTimerRecord& record = getAsyncTimerRecord(mSlot);
+    addRelaxed(record.mRunNanos, cpuNanos);
+}
+
+void AsyncTimer::suspend() {
+    if (mState != RUNNING) { return; }
+    endRunning();
+    mState = SUSPENDED;
+    mSuspensions++;
+}
+
+void AsyncTimer::resume() {
+    if (mState != SUSPENDED) { return; }
+    mState = RUNNING;
+    mRunStartCpuNanos = threadCpuNanos();
+}
+
+void AsyncTimer::end() {
+    if (mState == ENDED) { return; }
+    if (mState == RUNNING) {
+        endRunning();
+    }
+    mState = ENDED;
+    Ticks wall = clockNow() - mStart;
+    getTimerRecord(mSlot).mHistogram.record(wall);
+    AsyncTimerRecord& record = getAsyncTimerRecord(mSlot);
+    addRelaxed(record.mWall, wall);
+    record.mCpuHistogram.record(mCpuNanos);
+    addRelaxed(record.mSuspensions, mSuspensions);
 }
 
 std::string TimerItem::flush() {
-    if (mLen == 0) { return "{count: 0}"; }
-    double totalTime = 0;
-    for (int i = 0; i < mLen; i++) { totalTime += mList[i]; }
-    double avg = totalTime / (double)mLen;
-    std::string msg = "{count: " + std::to_string(mLen) + ", average: " + std::to_string(avg) + " ms}, ";
-    mLen = 0;
-    return msg;
+    if (mSlot < 0) { return "{count: 0}, "; }
+    return flushTimerRecords(mSlot);
 }
 
+CounterItem::CounterItem(uint64_t nameHash, const char* name): mSlot(registerItem(nameHash, name, ITEM_COUNTER)) {
+}
+
+void CounterItem::add(uint64_t value) {
+    if (mSlot < 0) { return; }
+    addRelaxed(getCounterShard(mSlot), value);
+}
+
+uint64_t CounterItem::read() const {
+    if (mSlot < 0) { return 0; }
+    return sumCounterShards(mSlot);
+}
+
+GaugeItem::GaugeItem(uint64_t nameHash, const char* name): mSlot(registerItem(nameHash, name, ITEM_GAUGE)) {
+}
+
+void GaugeItem::set(int64_t value) {
+    if (mSlot < 0) { return; }
+    GaugeValue& gauge = s_gauges[mSlot];
+    gauge.mValue.store(value, std::memory_order_relaxed);
+    updateGaugeMax(gauge, value);
+}
 
+void GaugeItem::add(int64_t delta) {
+    if (mSlot < 0) { return; }
+    GaugeValue& gauge = s_gauges[mSlot];
+    updateGaugeMax(gauge, gauge.mValue.fetch_add(delta, std::memory_order_relaxed) + delta);
+}
+
+int64_t GaugeItem::read() const {
+    if (mSlot < 0) { return 0; }
+    return s_gauges[mSlot].mValue.load(std::memory_order_relaxed);
+}
+
+
+#ifdef _ADHOC_TOOLS_PERF_TIMER_ITEMS_
 #define _ADHOC_TOOLS_PERF_DFINE_TIMER_ITME_(name) \
-        TimerItem name;
+        TimerItem name(#name);
 
 _ADHOC_TOOLS_PERF_TIMER_ITEMS_(_ADHOC_TOOLS_PERF_DFINE_TIMER_ITME_)
+#endif
 
-#define _ADHOC_TOOLS_PERF_PRINT_TIMER_ITME_(name) \
-        << terminalcolor::lightGreen << #name ": " << terminalcolor::reset << name.flush().c_str()
+/// The counters read last by a cursor. Records of threads are never freed, so the skipped
+/// calls are keyed by the address of the record.
+struct PerfCursor::State {
+    /// By slot, summed over all threads.
+    std::map<int, HistogramCounters> mTimers;
+    std::map<const TimerRecord*, uint64_t> mSkipped;
+    uint64_t mCounters[MAX_TIMER_ITEMS] = {};
+};
+
+PerfCursor::PerfCursor(): mState(new State()) {
+}
+
+PerfCursor::~PerfCursor() {
+    delete mState;
+}
+
+void PerfCursor::collect(std::vector<PerfItemDelta>& deltas) {
+    int slotCount = s_registrySlotCount.load(std::memory_order_acquire);
+    deltas.resize(slotCount);
+    for (int slot = 0; slot < slotCount; slot++) {
+        PerfItemDelta& delta = deltas[slot];
+        delta.mKind = s_registryKinds[slot];
+        delta.mName = s_registrySlots[slot].mName;
+        delta.mTimer = HistogramSnapshot();
+        delta.mCounter = 0;
+        delta.mGauge = 0;
+        delta.mSkipped = 0;
+        if (delta.mKind == ITEM_COUNTER) {
+            uint64_t total = sumCounterShards(slot);
+            delta.mCounter = total - mState->mCounters[slot];
+            mState->mCounters[slot] = total;
+        }
+        else if (delta.mKind == ITEM_GAUGE) {
+            delta.mGauge = s_gauges[slot].mValue.load(std::memory_order_relaxed);
+        }
+    }
+    ThreadRecords* head = s_threadRecordsHead.load(std::memory_order_acquire);
+    for (int slot = 0; slot < slotCount; slot++) {
+        if (deltas[slot].mKind != ITEM_TIMER) {
+            continue;
+        }
+        HistogramCounters counters;
+        for (ThreadRecords* records = head; records; records = records->mNext) {
+            TimerRecord* record = findTimerRecord(records, slot);
+            if (!record) {
+                continue;
+            }
+            record->mHistogram.read(counters);
+            uint64_t skipped = record->mSkipped.load(std::memory_order_relaxed);
+            uint64_t& skippedRead = mState->mSkipped[record];
+            deltas[slot].mSkipped += skipped - skippedRead;
+            skippedRead = skipped;
+        }
+        counters.collect(mState->mTimers[slot], deltas[slot].mTimer);
+    }
+}
 
 void summarizeAndPrintPerf() {
     std::stringstream strToPrint;
 
-    strToPrint _ADHOC_TOOLS_PERF_TIMER_ITEMS_(_ADHOC_TOOLS_PERF_PRINT_TIMER_ITME_);
-
+    int slotCount = s_registrySlotCount.load(std::memory_order_acquire);
+    for (int slot = 0; slot < slotCount; slot++) {
+        if (s_registryKinds[slot] != ITEM_TIMER) {
+            continue;
+        }
+        strToPrint << terminalcolor::lightGreen << s_registrySlots[slot].mName << ": " << terminalcolor::reset
+                << flushTimerRecords(slot).c_str();
+    }
     _ADHOC_TOOLS_PERF_LOG_("%s", strToPrint.str().c_str());
+
+    std::string countersAndGauges = flushCountersAndGauges(slotCount);
+    if (!countersAndGauges.empty()) {
+        _ADHOC_TOOLS_PERF_LOG_("%s", countersAndGauges.c_str());
+    }
+
+    std::string callTree = flushCallTrees();
+    if (!callTree.empty()) {
+        _ADHOC_TOOLS_PERF_LOG_("%s", callTree.c_str());
+    }
+
+    int reporterCount = s_reporterCount.load(std::memory_order_acquire);
+    for (int i = 0; i < reporterCount; i++) {
+        std::string report = s_reporters[i].load(std::memory_order_relaxed)();
+        if (!report.empty()) {
+            _ADHOC_TOOLS_PERF_LOG_("%s", report.c_str());
+        }
+    }
+}
+
+bool addPerfReporter(PerfReporter reporter) {
+    int index = s_reporterAllocated.fetch_add(1, std::memory_order_relaxed);
+    if (index >= MAX_REPORTERS) {
+        _ADHOC_TOOLS_PERF_LOG_("Too many perf reporters (max: %d)", MAX_REPORTERS);
+        return false;
+    }
+    s_reporters[index].store(reporter, std::memory_order_relaxed);
+    int expected = index;
+    while (!s_reporterCount.compare_exchange_weak(
+            expected, index + 1, std::memory_order_release, std::memory_order_relaxed)) {
+        expected = index;
+    }
+    return true;
 }
 
 } // end of namespace adhocperf
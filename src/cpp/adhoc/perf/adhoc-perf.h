@@ -1,32 +1,343 @@
 #ifndef _ADHOC_TOOLS_PERF_H_
 #define _ADHOC_TOOLS_PERF_H_
 
-#include <chrono>
+#include <cstdint>
 #include <string>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+#define _ADHOC_TOOLS_PERF_COROUTINE_ 1
+#endif
+#endif
 
 #include "config.h"
+#include "histogram.h"
 
 namespace adhocperf {
 
+/// FNV-1a, can be computed in compile time.
+constexpr uint64_t timerNameHash(const char* name, uint64_t hash = 14695981039346656037ull) {
+    return *name
+            ? timerNameHash(name + 1, (hash ^ (uint8_t)*name) * 1099511628211ull)
+            : hash;
+}
+
+/// Can be started and ended from any threads.
+/// The records are kept in per-thread buffers (one buffer per thread per item),
+/// so threads do not overwrite each other's start time and do not contend on
+/// the same cache lines. They are only merged in `flush()`.
+///
+/// Timer items are registered by name in a registry of the module (the .so or executable)
+/// `adhoc-perf.cpp` is built into. Items with the same name in that module share the same
+/// records (each .so building its own `adhoc-perf.cpp` has its own registry).
+/// Usually declare them by `ADHOC_PERF_TIMER("name")` where they are used.
 class TimerItem {
   public:
+    explicit TimerItem(const char* name): TimerItem(timerNameHash(name), name) {}
+    TimerItem(uint64_t nameHash, const char* name);
     void start();
     void end();
+    /// Summarize the records since the last flush, both in aggregate and per thread.
     std::string flush();
+    /// Also count cycles, instructions, cache misses, branch misses and context switches
+    /// between `start()` and `end()` (or in `ScopedTimer`) by `perf_event_open`, and report
+    /// the IPC and miss rates. It costs 2 syscalls more per record, so enable it only for the
+    /// items in question. If the counters are not permitted, only the time is recorded.
+    /// If the counters are multiplexed with other events, the values are scaled estimates.
+    /// A recursive use of the same item in a thread only counts the innermost one.
+    void enableHardwareCounters(bool enabled = true);
+    /// Time only 1 in `rate` calls of `start()` / `end()` in each thread (by a countdown), and
+    /// only count the others. The count stays exact, and the report scales the total time by
+    /// it. 0 for `_ADHOC_TOOLS_PERF_DEFAULT_SAMPLE_RATE_`. Can be changed at any time.
+    /// `ScopedTimer` and `AsyncTimer` always time, since they are used across calls.
+    void setSampleRate(uint32_t rate);
+  private:
+    friend class ScopedTimer;
+    friend class AsyncTimer;
+    int mSlot;
+};
+
+/// Counts events (GC runs, bytes marshalled, cache hits, ...), which can be added from any
+/// threads. Each thread adds to its own shard (no atomic read-modify-write, no shared cache
+/// line), and the shards are only summed by `read()` and the report, so adding costs the
+/// same at any count of cores.
+/// Registered by name in the same registry as `TimerItem` (a name is either a timer, a
+/// counter or a gauge). Usually declare them by `ADHOC_PERF_COUNTER("name")`.
+class CounterItem {
+  public:
+    explicit CounterItem(const char* name): CounterItem(timerNameHash(name), name) {}
+    CounterItem(uint64_t nameHash, const char* name);
+    void add(uint64_t value = 1);
+    /// The total since the start of the process, summed from all threads.
+    uint64_t read() const;
   private:
-    static const int LIST_MAX_LENGTH = _ADHOC_TOOLS_PERF_RECORDS_CAPACITY_;
-    double mList[LIST_MAX_LENGTH];
-    int mLen = 0;
-    std::chrono::time_point<std::chrono::system_clock> mStart;
+    int mSlot;
 };
 
+/// A value set or moved by any threads, like the depth of a queue. The report prints the
+/// current value and the max since the last report.
+/// Usually declare them by `ADHOC_PERF_GAUGE("name")`.
+class GaugeItem {
+  public:
+    explicit GaugeItem(const char* name): GaugeItem(timerNameHash(name), name) {}
+    GaugeItem(uint64_t nameHash, const char* name);
+    void set(int64_t value);
+    /// @param delta can be negative.
+    void add(int64_t delta);
+    int64_t read() const;
+  private:
+    int mSlot;
+};
+
+/// Times the enclosing scope, like `start()` at construction and `end()` at destruction.
+/// Besides the flat records of the timer item, the nested scoped timers in a thread also
+/// build a call tree, which reports the inclusive time (including nested scoped timers)
+/// and exclusive time (excluding them) of each path like "quickjsTimer > v8Timer".
+/// Usually use it by `ADHOC_PERF_SCOPE("name")`.
+class ScopedTimer {
+  public:
+    explicit ScopedTimer(TimerItem& item);
+    ~ScopedTimer();
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+  private:
+    int mSlot;
+    int mNode;
+    ScopedTimer* mParent;
+    uint64_t mStart;
+    uint64_t mChildTicks;
+};
+
+/// Times an asynchronous procedure (a coroutine, or a chain of callbacks), which may be
+/// suspended while waiting (for I/O, another thread, etc.) and resumed in any thread.
+/// Besides the wall time (recorded in the timer item like `end()`), it reports the on-CPU
+/// time (by `CLOCK_THREAD_CPUTIME_ID` of the threads running it) and the count of
+/// suspensions, which tells waiting apart from running. The on-CPU time is also reported
+/// by the threads the procedure actually ran in.
+/// It is a handle of one procedure, and should not be used by multiple threads at the same
+/// time: `suspend()` and `resume()` are called by the thread giving up and taking over it.
+/// For example:
+/// ```cpp
+/// auto timer = std::make_shared<adhocperf::AsyncTimer>(ADHOC_PERF_TIMER("jsBridgeCall"));
+/// timer->suspend();
+/// callJava(args, [timer](Result result) {
+///     timer->resume();
+///     // ...
+///     timer->end();
+/// });
+/// ```
+class AsyncTimer {
+  public:
+    /// Begin, running in the current thread.
+    explicit AsyncTimer(TimerItem& item);
+    /// End it if not ended.
+    ~AsyncTimer();
+    AsyncTimer(const AsyncTimer&) = delete;
+    AsyncTimer& operator=(const AsyncTimer&) = delete;
+    /// Called before the procedure stops running in the current thread.
+    void suspend();
+    /// Called when the procedure continues in the current thread.
+    void resume();
+    void end();
+  private:
+    void endRunning();
+    enum State : uint8_t { RUNNING, SUSPENDED, ENDED };
+    int mSlot;
+    State mState;
+    uint32_t mSuspensions;
+    uint64_t mStart;
+    uint64_t mRunStartCpuNanos;
+    uint64_t mCpuNanos;
+};
+
+#ifdef _ADHOC_TOOLS_PERF_COROUTINE_
+/// Wraps an awaiter, so that the `AsyncTimer` is suspended while the coroutine is waiting.
+template <typename Awaiter>
+class TimedAwaiter {
+  public:
+    TimedAwaiter(AsyncTimer& timer, Awaiter&& awaiter): mTimer(timer), mAwaiter(std::forward<Awaiter>(awaiter)) {}
+
+    bool await_ready() {
+        return mAwaiter.await_ready();
+    }
+
+    template <typename Promise>
+    auto await_suspend(std::coroutine_handle<Promise> handle) {
+        mTimer.suspend();
+        using Result = decltype(mAwaiter.await_suspend(handle));
+        if constexpr (std::is_same_v<Result, bool>) {
+            // Once suspended, the coroutine may be resumed in another thread at once, so
+            // only touch the timer if it is not suspended actually.
+            bool suspended = mAwaiter.await_suspend(handle);
+            if (!suspended) {
+                mTimer.resume();
+            }
+            return suspended;
+        }
+        else {
+            return mAwaiter.await_suspend(handle);
+        }
+    }
+
+    decltype(auto) await_resume() {
+        mTimer.resume();
+        return mAwaiter.await_resume();
+    }
 
+  private:
+    AsyncTimer& mTimer;
+    std::conditional_t<std::is_lvalue_reference_v<Awaiter>, Awaiter, std::remove_cvref_t<Awaiter>> mAwaiter;
+};
+
+template <typename Awaitable>
+decltype(auto) getAwaiter(Awaitable&& awaitable) {
+    if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); }) {
+        return std::forward<Awaitable>(awaitable).operator co_await();
+    }
+    else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); }) {
+        return operator co_await(std::forward<Awaitable>(awaitable));
+    }
+    else {
+        return std::forward<Awaitable>(awaitable);
+    }
+}
+
+/// Await in a coroutine, and count the waiting as suspended. For example:
+/// ```cpp
+/// Task<std::string> fetch() {
+///     adhocperf::AsyncTimer timer(ADHOC_PERF_TIMER("fetch"));
+///     auto response = co_await adhocperf::timedAwait(timer, httpGet(url));
+///     co_return parse(response);
+/// }
+/// ```
+template <typename Awaitable>
+auto timedAwait(AsyncTimer& timer, Awaitable&& awaitable) {
+    using Awaiter = decltype(getAwaiter(std::forward<Awaitable>(awaitable)));
+    return TimedAwaiter<Awaiter>(timer, getAwaiter(std::forward<Awaitable>(awaitable)));
+}
+#endif
+
+template <uint64_t NAME_HASH>
+inline TimerItem& registeredTimerItem(const char* name) {
+    static TimerItem item(NAME_HASH, name);
+    return item;
+}
+
+/// Declare a timer item inline, where the name should be a string literal. For example:
+/// ```cpp
+/// ADHOC_PERF_TIMER("quickjsTimer").start();
+/// // ...
+/// ADHOC_PERF_TIMER("quickjsTimer").end();
+/// ```
+/// The name is hashed in compile time, and registered at the first use. After that it
+/// costs only a check of the function-local static.
+#define ADHOC_PERF_TIMER(name) \
+        (::adhocperf::registeredTimerItem<::adhocperf::timerNameHash(name)>(name))
+
+template <uint64_t NAME_HASH>
+inline CounterItem& registeredCounterItem(const char* name) {
+    static CounterItem item(NAME_HASH, name);
+    return item;
+}
+
+template <uint64_t NAME_HASH>
+inline GaugeItem& registeredGaugeItem(const char* name) {
+    static GaugeItem item(NAME_HASH, name);
+    return item;
+}
+
+/// Declare a counter or a gauge inline, like `ADHOC_PERF_TIMER`. For example:
+/// ```cpp
+/// ADHOC_PERF_COUNTER("bytesMarshalled").add(size);
+/// ADHOC_PERF_GAUGE("bridgeQueueDepth").add(1);
+/// ```
+#define ADHOC_PERF_COUNTER(name) \
+        (::adhocperf::registeredCounterItem<::adhocperf::timerNameHash(name)>(name))
+#define ADHOC_PERF_GAUGE(name) \
+        (::adhocperf::registeredGaugeItem<::adhocperf::timerNameHash(name)>(name))
+
+#define _ADHOC_TOOLS_PERF_CONCAT_INNER_(a, b) a##b
+#define _ADHOC_TOOLS_PERF_CONCAT_(a, b) _ADHOC_TOOLS_PERF_CONCAT_INNER_(a, b)
+
+/// Time the rest of the current scope. For example:
+/// ```cpp
+/// {
+///     ADHOC_PERF_SCOPE("quickjsTimer");
+///     // ...
+/// }
+/// ```
+#define ADHOC_PERF_SCOPE(name) \
+        ::adhocperf::ScopedTimer _ADHOC_TOOLS_PERF_CONCAT_(adhocPerfScope, __LINE__)(ADHOC_PERF_TIMER(name))
+
+
+/// Print all of the registered timer items, counters and gauges, and then the reports added
+/// by `addPerfReporter`.
 extern void summarizeAndPrintPerf();
 
+/// A name is registered as one kind of item, by its first registration.
+enum ItemKind : uint8_t {
+    ITEM_TIMER = 0,
+    ITEM_COUNTER,
+    ITEM_GAUGE,
+};
+
+/// One registered item in `PerfCursor::collect()`.
+struct PerfItemDelta {
+    ItemKind mKind;
+    /// Kept by the registry, never freed.
+    const char* mName;
+    /// The durations of a timer since the previous collect, in clock ticks (see
+    /// `clockTicksToNanos()`). Empty for the others.
+    HistogramSnapshot mTimer;
+    /// Of a counter, since the previous collect.
+    uint64_t mCounter;
+    /// The current value of a gauge.
+    int64_t mGauge;
+    /// The calls of a timer not timed by sampling (see `TimerItem::setSampleRate()`), so the
+    /// calls are `mTimer.mCount + mSkipped`.
+    uint64_t mSkipped;
+};
+
+/// Reads the timers, counters and gauges of all threads since its previous read (or since the
+/// start of the process for the first one), for exporters (like `adhoc-perf-exporter.h`).
+/// Nothing is reset: the recording threads only add to their own monotonic counters, and each
+/// cursor keeps the counters it read last, so cursors and `summarizeAndPrintPerf()` do not
+/// take deltas from each other. Records of one thread are read bucket by bucket while it may
+/// be recording, so a record may be seen in the next delta, but never lost or seen twice.
+/// Not thread safe, use one cursor in one thread at a time.
+class PerfCursor {
+  public:
+    PerfCursor();
+    ~PerfCursor();
+    PerfCursor(const PerfCursor&) = delete;
+    PerfCursor& operator=(const PerfCursor&) = delete;
+    /// @param deltas replaced by all of the registered items, in registration order.
+    void collect(std::vector<PerfItemDelta>& deltas);
+  private:
+    struct State;
+    State* mState;
+};
+
+/// Returns a section of `summarizeAndPrintPerf()`, or "" to print nothing this time.
+typedef std::string (*PerfReporter)();
+/// Add a report of other tools to `summarizeAndPrintPerf()`, so that this module does not
+/// depend on them. For example:
+/// ```cpp
+/// adhocperf::addPerfReporter(adhocprofiler::summarizeHeapProfile);
+/// ```
+/// @return false if there are too many (see `_ADHOC_TOOLS_PERF_MAX_REPORTERS_`).
+extern bool addPerfReporter(PerfReporter reporter);
+
+#ifdef _ADHOC_TOOLS_PERF_TIMER_ITEMS_
 #define _ADHOC_TOOLS_PERF_DECLARE_TIMER_ITME_(name) \
         extern TimerItem name;
 
 _ADHOC_TOOLS_PERF_TIMER_ITEMS_(_ADHOC_TOOLS_PERF_DECLARE_TIMER_ITME_)
+#endif
 
 } // end of namespace adhocperf
 
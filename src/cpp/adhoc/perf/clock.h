@@ -0,0 +1,58 @@
+#ifndef _ADHOC_TOOLS_PERF_CLOCK_H_
+#define _ADHOC_TOOLS_PERF_CLOCK_H_
+
+#include <cstdint>
+#include <time.h>
+
+#include "config.h"
+
+#if _ADHOC_TOOLS_PERF_USE_CYCLE_COUNTER_ && defined(__x86_64__)
+#include <x86intrin.h>
+#define _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ 1
+#elif _ADHOC_TOOLS_PERF_USE_CYCLE_COUNTER_ && defined(__aarch64__)
+#define _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ 1
+#else
+#define _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ 0
+#endif
+
+namespace adhocperf {
+
+/// Raw clock value. Only the difference of two ticks is meaningful.
+/// Convert it to time by `clockTicksToNanos()` only when reporting.
+typedef uint64_t Ticks;
+
+/// Monotonic, and not affected by NTP adjustment.
+/// - By default: `CLOCK_MONOTONIC_RAW`, in nanoseconds.
+/// - If `_ADHOC_TOOLS_PERF_USE_CYCLE_COUNTER_` is on:
+///     x86-64: TSC (`rdtsc`), calibrated against `CLOCK_MONOTONIC_RAW` once.
+///         It requires invariant TSC, which is the case on most CPUs made after 2008.
+///     aarch64: the virtual counter (`cntvct_el0`), whose frequency is given by `cntfrq_el0`.
+///     Others: fall back to `CLOCK_MONOTONIC_RAW`.
+inline Ticks clockNow() {
+#if _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ && defined(__x86_64__)
+    return __rdtsc();
+#elif _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_ && defined(__aarch64__)
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (Ticks)ts.tv_sec * 1000000000 + (Ticks)ts.tv_nsec;
+#endif
+}
+
+/// Calibrated at the first call if needed. Do not call it in hot path.
+extern double clockNanosPerTick();
+
+inline double clockTicksToNanos(double ticks) {
+#if _ADHOC_TOOLS_PERF_CLOCK_CYCLE_COUNTER_
+    return ticks * clockNanosPerTick();
+#else
+    return ticks;
+#endif
+}
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_CLOCK_H_
@@ -1,30 +1,64 @@
+/// Timer items can be declared inline by `ADHOC_PERF_TIMER("name")` without modifying
+/// this file (see `adhoc-perf.h`).
 /// ----------------------------
-/// Add your timer items below:
+/// Or add your global timer items below (optional):
 /// For example, if you want to add a timer item named "invoke_java_method",
 /// Add a line below like:
 /// ```cpp
 /// M(invoke_java_method) \
 /// ```
+/// And then use it like `adhocperf::invoke_java_method.start()`
 /// ----------------------------
 #define _ADHOC_TOOLS_PERF_TIMER_ITEMS_(M) \
     M(quickjsTimer) \
     M(v8Timer) \
     M(someTimeItemCCC) \
 
+/// The max count of registered timer items in the process.
+#define _ADHOC_TOOLS_PERF_MAX_TIMER_ITEMS_ 256
+/// Longer names are truncated in the report.
+#define _ADHOC_TOOLS_PERF_MAX_TIMER_NAME_LENGTH_ 64
+/// The max count of distinct paths of nested `ScopedTimer` in each thread.
+/// Deeper paths beyond it are only recorded in the flat timer items.
+#define _ADHOC_TOOLS_PERF_MAX_CALL_TREE_NODES_ 1024
+
+/// Time only 1 in N calls of `TimerItem::start()` / `end()` by default, and only count the
+/// others, for the timers in the tightest loops, where reading the clock costs more than the
+/// code timed. 1 to time all of them. Can be changed for each timer by
+/// `TimerItem::setSampleRate()` at runtime.
+#define _ADHOC_TOOLS_PERF_DEFAULT_SAMPLE_RATE_ 1
+
+/// The max count of reporters added by `adhocperf::addPerfReporter()`.
+#define _ADHOC_TOOLS_PERF_MAX_REPORTERS_ 16
+
 /// Modify the log tag here if needed.
 #define _ADHOC_TOOLS_PERF_LOG_TAG_ "adhoc"
 
-/// The max records to be recorded.
-#define _ADHOC_TOOLS_PERF_RECORDS_CAPACITY_ 3000
+/// Use CPU cycle counter (TSC on x86-64, CNTVCT on aarch64) rather than `CLOCK_MONOTONIC_RAW`
+/// to read time, which is cheaper. See `clock.h` for details.
+#define _ADHOC_TOOLS_PERF_USE_CYCLE_COUNTER_ 0
+
+/// Timer records are kept in log-linear histograms (in clock ticks), the count is not limited.
+/// Each power of two is split into `2 ^ _ADHOC_TOOLS_PERF_HISTOGRAM_SUB_BUCKET_BITS_` buckets,
+/// so the relative error of the reported percentiles is at most `1 / 2 ^ (bits + 1)`
+/// (6.25% by default). Increase it for better precision with more memory.
+#define _ADHOC_TOOLS_PERF_HISTOGRAM_SUB_BUCKET_BITS_ 3
+/// Values greater than `2 ^ _ADHOC_TOOLS_PERF_HISTOGRAM_MAX_VALUE_BITS_` are clamped.
+/// 40 bits is about 18 minutes in nanoseconds, or about 6 minutes in 3GHz cycles.
+#define _ADHOC_TOOLS_PERF_HISTOGRAM_MAX_VALUE_BITS_ 40
+
+/// Whether to print the result of each thread besides the aggregated result.
+#define _ADHOC_TOOLS_PERF_PRINT_PER_THREAD_ 1
 
-/// If using in other envrioment, you can modify the log implementation here.
-/// For example, if using in NDK, modify it to
+/// The log implementation. By default, it goes to the sink of `adhoc/log/adhoc-log.h`
+/// (Android logcat in NDK, or stderr in others, written in a background thread), which
+/// can be replaced by `adhoclog::setLogSink()`.
+/// If using in other envrioment, you can also modify it here. For example:
 /// ```cpp
 /// #define _ADHOC_TOOLS_PERF_LOG_INCLUDE_ <android/log.h>
 /// #define _ADHOC_TOOLS_PERF_LOG_(...) \
 ///     __android_log_print(ANDROID_LOG_INFO, "adhoc", __VA_ARGS__);
 /// ```
-/// Can also modify the log tag here if needed ("adhoc" by default).
-#define _ADHOC_TOOLS_PERF_LOG_INCLUDE_ <android/log.h>
+#define _ADHOC_TOOLS_PERF_LOG_INCLUDE_ "../log/adhoc-log.h"
 #define _ADHOC_TOOLS_PERF_LOG_(...) \
-   __android_log_print(ANDROID_LOG_INFO, "QJS", __VA_ARGS__)
\ No newline at end of file
+   ::adhoclog::logPrint(::adhoclog::LOG_LEVEL_INFO, _ADHOC_TOOLS_PERF_LOG_TAG_, __VA_ARGS__)
@@ -0,0 +1,122 @@
+#ifndef _ADHOC_TOOLS_PERF_HARDWARE_COUNTERS_H_
+#define _ADHOC_TOOLS_PERF_HARDWARE_COUNTERS_H_
+
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace adhocperf {
+
+enum HardwareCounter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    COUNTER_COUNT,
+};
+
+/// The values of all counters of a group at one time. The absent counters are 0.
+struct HardwareCounterValues {
+    uint64_t mValues[COUNTER_COUNT];
+    /// Nanoseconds the group was enabled, and actually counting. When there are more events
+    /// than the PMU has counters, the groups take turns (multiplexing), and `mRunning` is less.
+    uint64_t mEnabled;
+    uint64_t mRunning;
+};
+
+/// Counters of the calling thread, by a `perf_event_open` group, so that all of them are
+/// counted in the same period, and read by a single `read()`.
+/// The group is read by `read()` rather than `rdpmc`, because the context switch counter is
+/// a software event, which can not be read by `rdpmc`.
+/// It may be not permitted (`/proc/sys/kernel/perf_event_paranoid`, SELinux on Android) or
+/// not supported (in some VMs). Counters failed to open are absent, and if none of them
+/// can be opened, `isOpened()` is false.
+class ThreadHardwareCounters {
+  public:
+    ThreadHardwareCounters() {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            mFds[i] = -1;
+            mGroupIndices[i] = -1;
+        }
+    }
+
+    ~ThreadHardwareCounters() {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            if (mFds[i] >= 0) { close(mFds[i]); }
+        }
+    }
+
+    ThreadHardwareCounters(const ThreadHardwareCounters&) = delete;
+    ThreadHardwareCounters& operator=(const ThreadHardwareCounters&) = delete;
+
+    /// Open the counters of the calling thread, only once.
+    bool open() {
+        if (mOpenTried) {
+            return mLeaderFd >= 0;
+        }
+        mOpenTried = true;
+        static const uint32_t types[COUNTER_COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE,
+        };
+        static const uint64_t configs[COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES,
+        };
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            // A context switch happens in the kernel, so it would always be 0 if the kernel is
+            // excluded. If counting it in the kernel is not permitted, it is absent ("n/a").
+            attr.exclude_kernel = types[i] == PERF_TYPE_HARDWARE ? 1 : 0;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // Only the calling thread, on any CPU.
+            int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, mLeaderFd, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            mFds[i] = fd;
+            mGroupIndices[i] = mGroupSize++;
+            if (mLeaderFd < 0) {
+                mLeaderFd = fd;
+            }
+        }
+        return mLeaderFd >= 0;
+    }
+
+    bool isOpened() const { return mLeaderFd >= 0; }
+    bool has(int counter) const { return mFds[counter] >= 0; }
+
+    bool read(HardwareCounterValues& values) const {
+        // The count of values, the time enabled, the time running, and then the values in the
+        // order of opening.
+        uint64_t buffer[3 + COUNTER_COUNT];
+        ssize_t size = ::read(mLeaderFd, buffer, sizeof(buffer));
+        if (size < (ssize_t)sizeof(uint64_t) * (3 + mGroupSize)) {
+            return false;
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            values.mValues[i] = mGroupIndices[i] >= 0 ? buffer[3 + mGroupIndices[i]] : 0;
+        }
+        values.mEnabled = buffer[1];
+        values.mRunning = buffer[2];
+        return true;
+    }
+
+  private:
+    bool mOpenTried = false;
+    int mLeaderFd = -1;
+    int mGroupSize = 0;
+    int mFds[COUNTER_COUNT];
+    int mGroupIndices[COUNTER_COUNT];
+};
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_HARDWARE_COUNTERS_H_
@@ -0,0 +1,226 @@
+#ifndef _ADHOC_TOOLS_PERF_HISTOGRAM_H_
+#define _ADHOC_TOOLS_PERF_HISTOGRAM_H_
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "config.h"
+
+namespace adhocperf {
+
+/// Log-linear histogram (like HdrHistogram).
+/// Values below `2 * HISTOGRAM_SUB_BUCKET_COUNT` are recorded exactly. Above that, every
+/// power of two is split into `HISTOGRAM_SUB_BUCKET_COUNT` linear sub-buckets, so the
+/// relative error of the reported values (bucket midpoints) is at most
+/// `1 / (2 * HISTOGRAM_SUB_BUCKET_COUNT)`.
+/// Values not less than `2 ^ HISTOGRAM_MAX_VALUE_BITS` are clamped into the last bucket.
+const int HISTOGRAM_SUB_BUCKET_BITS = _ADHOC_TOOLS_PERF_HISTOGRAM_SUB_BUCKET_BITS_;
+const int HISTOGRAM_MAX_VALUE_BITS = _ADHOC_TOOLS_PERF_HISTOGRAM_MAX_VALUE_BITS_;
+const int HISTOGRAM_SUB_BUCKET_COUNT = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+const int HISTOGRAM_BUCKET_COUNT =
+        (HISTOGRAM_MAX_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKET_COUNT;
+
+/// Buckets are allocated in groups of two powers of two at the first value in them, since the
+/// values of one timer usually fall in a few of them.
+const int HISTOGRAM_GROUP_SIZE = 2 * HISTOGRAM_SUB_BUCKET_COUNT;
+const int HISTOGRAM_GROUP_COUNT = (HISTOGRAM_BUCKET_COUNT + HISTOGRAM_GROUP_SIZE - 1) / HISTOGRAM_GROUP_SIZE;
+
+static_assert(HISTOGRAM_SUB_BUCKET_BITS >= 1 && HISTOGRAM_MAX_VALUE_BITS <= 63
+        && HISTOGRAM_SUB_BUCKET_BITS < HISTOGRAM_MAX_VALUE_BITS, "Illegal histogram config");
+
+inline int histogramBucketIndex(uint64_t value) {
+    const uint64_t maxValue = (uint64_t(1) << HISTOGRAM_MAX_VALUE_BITS) - 1;
+    if (value > maxValue) {
+        value = maxValue;
+    }
+    if (value < 2 * HISTOGRAM_SUB_BUCKET_COUNT) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return shift * HISTOGRAM_SUB_BUCKET_COUNT + (int)(value >> shift);
+}
+
+inline uint64_t histogramBucketLowerBound(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKET_COUNT) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKET_COUNT - 1;
+    return uint64_t(index - shift * HISTOGRAM_SUB_BUCKET_COUNT) << shift;
+}
+
+inline uint64_t histogramBucketMidpoint(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKET_COUNT) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKET_COUNT - 1;
+    return histogramBucketLowerBound(index) + (uint64_t(1) << shift) / 2;
+}
+
+
+struct HistogramSnapshot;
+
+/// Plain (non-atomic) cumulative counters of one `Histogram`, or the sum of several ones.
+/// Counts are 32 bits to keep it small. They are only used to compute the delta since
+/// the previous read, which stays correct across wraparound as long as one bucket does
+/// not receive `2 ^ 32` values between two reads.
+struct HistogramCounters {
+    uint32_t mCounts[HISTOGRAM_BUCKET_COUNT] = {};
+    uint64_t mSum = 0;
+
+    /// Read the values counted since `last`, and update `last` to these counters.
+    inline void collect(HistogramCounters& last, HistogramSnapshot& delta) const;
+};
+
+/// Mergeable statistics read from one or more histograms.
+struct HistogramSnapshot {
+    uint64_t mCounts[HISTOGRAM_BUCKET_COUNT] = {};
+    uint64_t mCount = 0;
+    uint64_t mSum = 0;
+
+    void add(const HistogramSnapshot& other) {
+        for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+            mCounts[i] += other.mCounts[i];
+        }
+        mCount += other.mCount;
+        mSum += other.mSum;
+    }
+
+    double mean() const {
+        return mCount ? (double)mSum / (double)mCount : 0;
+    }
+
+    /// Computed from the bucket midpoints, so it has the same bounded relative error
+    /// as the percentiles, and no sum of squares needs to be kept.
+    double stddev() const {
+        if (!mCount) { return 0; }
+        double avg = mean();
+        double variance = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+            if (mCounts[i]) {
+                double diff = (double)histogramBucketMidpoint(i) - avg;
+                variance += diff * diff * (double)mCounts[i];
+            }
+        }
+        return std::sqrt(variance / (double)mCount);
+    }
+
+    uint64_t min() const {
+        for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+            if (mCounts[i]) { return histogramBucketMidpoint(i); }
+        }
+        return 0;
+    }
+
+    uint64_t max() const {
+        for (int i = HISTOGRAM_BUCKET_COUNT - 1; i >= 0; i--) {
+            if (mCounts[i]) { return histogramBucketMidpoint(i); }
+        }
+        return 0;
+    }
+
+    /// @param percentile in [0, 100].
+    uint64_t percentile(double percentile) const {
+        if (!mCount) { return 0; }
+        uint64_t rank = (uint64_t)std::ceil(percentile / 100.0 * (double)mCount);
+        if (rank < 1) { rank = 1; }
+        uint64_t seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+            seen += mCounts[i];
+            if (seen >= rank) { return histogramBucketMidpoint(i); }
+        }
+        return max();
+    }
+};
+
+
+void HistogramCounters::collect(HistogramCounters& last, HistogramSnapshot& delta) const {
+    for (int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+        uint32_t countDelta = mCounts[i] - last.mCounts[i];
+        delta.mCounts[i] = countDelta;
+        delta.mCount += countDelta;
+        last.mCounts[i] = mCounts[i];
+    }
+    delta.mSum = mSum - last.mSum;
+    last.mSum = mSum;
+}
+
+
+/// Written by a single thread, and can be read by any thread at the same time.
+/// It takes about `8 * HISTOGRAM_GROUP_COUNT` bytes (152 by default), and
+/// `4 * HISTOGRAM_GROUP_SIZE` bytes (64 by default) for each group of buckets used.
+/// The counters last read are kept by the readers (see `HistogramCounters`).
+class Histogram {
+  public:
+    Histogram() = default;
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    ~Histogram() {
+        for (std::atomic<std::atomic<uint32_t>*>& group : mGroups) {
+            delete[] group.load(std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t value) {
+        int index = histogramBucketIndex(value);
+        std::atomic<uint32_t>* group = mGroups[index / HISTOGRAM_GROUP_SIZE].load(std::memory_order_relaxed);
+        if (!group) {
+            group = createGroup(index / HISTOGRAM_GROUP_SIZE);
+        }
+        // Only one writer, so plain load and store are enough, no read-modify-write needed.
+        std::atomic<uint32_t>& bucket = group[index % HISTOGRAM_GROUP_SIZE];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        mCount.store(mCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        mSum.store(mSum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    /// Add the current counters to `counters`, to sum several histograms before
+    /// `HistogramCounters::collect()`.
+    void read(HistogramCounters& counters) const {
+        counters.mSum += mSum.load(std::memory_order_relaxed);
+        for (int groupIndex = 0; groupIndex < HISTOGRAM_GROUP_COUNT; groupIndex++) {
+            const std::atomic<uint32_t>* group = mGroups[groupIndex].load(std::memory_order_acquire);
+            if (!group) {
+                continue;
+            }
+            int begin = groupIndex * HISTOGRAM_GROUP_SIZE;
+            int end = begin + HISTOGRAM_GROUP_SIZE;
+            if (end > HISTOGRAM_BUCKET_COUNT) { end = HISTOGRAM_BUCKET_COUNT; }
+            for (int i = begin; i < end; i++) {
+                counters.mCounts[i] += group[i - begin].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Read the values recorded since `last`, and update `last` to the current counters.
+    void collect(HistogramCounters& last, HistogramSnapshot& delta) const {
+        HistogramCounters current;
+        read(current);
+        current.collect(last, delta);
+    }
+
+    /// The count and the sum of all of the values recorded, without reading the buckets.
+    uint64_t count() const {
+        return mCount.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+        return mSum.load(std::memory_order_relaxed);
+    }
+
+  private:
+    __attribute__((noinline)) std::atomic<uint32_t>* createGroup(int groupIndex) {
+        std::atomic<uint32_t>* group = new std::atomic<uint32_t>[HISTOGRAM_GROUP_SIZE]();
+        mGroups[groupIndex].store(group, std::memory_order_release);
+        return group;
+    }
+
+    std::atomic<std::atomic<uint32_t>*> mGroups[HISTOGRAM_GROUP_COUNT] = {};
+    std::atomic<uint64_t> mCount{0};
+    std::atomic<uint64_t> mSum{0};
+};
+
+} // end of namespace adhocperf
+
+#endif // _ADHOC_TOOLS_PERF_HISTOGRAM_H_
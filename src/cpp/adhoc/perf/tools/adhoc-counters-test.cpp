@@ -0,0 +1,82 @@
+/// Check the hardware counters of `adhoc/perf/hardware-counters.h` on Linux host (or on the
+/// device): the context switches forced by sleeping must be counted, and the values of each
+/// counter opened must not be all 0. Counters not permitted or not supported are skipped.
+///
+/// [Build]
+/// ```shell
+/// c++ -std=c++17 -O2 -o adhoc-counters-test adhoc-counters-test.cpp
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// # Prints a line for each counter, and exits with 1 if any of them fails.
+/// adhoc-counters-test
+/// ```
+
+#include <cinttypes>
+#include <cstdio>
+#include <unistd.h>
+
+#include "../hardware-counters.h"
+
+namespace {
+
+using adhocperf::COUNTER_COUNT;
+using adhocperf::HardwareCounterValues;
+using adhocperf::ThreadHardwareCounters;
+
+const char* COUNTER_NAMES[COUNTER_COUNT] = {
+    "cycles", "instructions", "cache misses", "branch misses", "context switches",
+};
+
+/// Each sleep switches out at least once.
+const int SLEEPS = 20;
+
+volatile uint64_t s_sink = 0;
+
+} // end of anonymous namespace
+
+
+int main() {
+    ThreadHardwareCounters counters;
+    if (!counters.open()) {
+        printf("SKIP: no counter can be opened (see /proc/sys/kernel/perf_event_paranoid)\n");
+        return 0;
+    }
+    HardwareCounterValues begin;
+    HardwareCounterValues end;
+    if (!counters.read(begin)) {
+        printf("FAIL: can not read the counters\n");
+        return 1;
+    }
+    for (int i = 0; i < SLEEPS; i++) {
+        for (int j = 0; j < 100000; j++) {
+            s_sink = s_sink + j;
+        }
+        usleep(1000);
+    }
+    if (!counters.read(end)) {
+        printf("FAIL: can not read the counters\n");
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (!counters.has(i)) {
+            printf("SKIP %s: not opened\n", COUNTER_NAMES[i]);
+            continue;
+        }
+        uint64_t delta = end.mValues[i] - begin.mValues[i];
+        uint64_t expectedMin = i == adhocperf::COUNTER_CONTEXT_SWITCHES ? SLEEPS : 1;
+        if (delta >= expectedMin) {
+            printf("PASS %s: %" PRIu64 "\n", COUNTER_NAMES[i], delta);
+        }
+        else {
+            printf("FAIL %s: %" PRIu64 ", expected at least %" PRIu64 "\n", COUNTER_NAMES[i], delta, expectedMin);
+            failures++;
+        }
+    }
+    printf("enabled: %" PRIu64 " ns, running: %" PRIu64 " ns\n",
+            end.mEnabled - begin.mEnabled, end.mRunning - begin.mRunning);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,322 @@
+/// Show the timers, counters and gauges of running processes live, read from the shared
+/// memory published by `adhocperf::startPerfSharedMemory()` (see `adhoc-perf-shared.h`).
+/// It only reads the memory, so the processes do not log or do anything more for it.
+///
+/// [Build]
+/// ```shell
+/// # On host.
+/// c++ -std=c++17 -O2 -o adhoc-perf-top adhoc-perf-top.cpp
+/// # For the device, by the clang of the NDK.
+/// $NDK/toolchains/llvm/prebuilt/darwin-x86_64/bin/aarch64-linux-android24-clang++ -std=c++17 -O2 -static-libstdc++ -o adhoc-perf-top adhoc-perf-top.cpp
+/// adb push adhoc-perf-top /data/local/tmp/
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// # Several processes can be given. Needs the same user as the processes, or root.
+/// adb shell su -c /data/local/tmp/adhoc-perf-top 12345 12346
+/// ```
+/// Options:
+///     -i <ms>: The interval of printing, 1000 by default.
+///     -n <count>: Exit after printing it count times, not limited by default.
+/// Each print has the deltas since the previous print (the first one since the start of the
+/// processes), with the timer percentiles of the interval.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../adhoc-perf-shared-format.h"
+
+using namespace adhocperf;
+
+namespace {
+
+/// The retries of reading while the publisher keeps writing, which takes microseconds.
+const int MAX_READ_RETRIES = 1000;
+
+/// Find the memfd in the fds of the process, or the file of `shm_open`.
+int openRegion(int pid) {
+    std::string shmPath = std::string("/dev/shm") + PERF_SHARED_SHM_PREFIX + std::to_string(pid);
+    int fd = open(shmPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        return fd;
+    }
+    std::string fdDir = "/proc/" + std::to_string(pid) + "/fd";
+    DIR* dir = opendir(fdDir.c_str());
+    if (!dir) {
+        return -1;
+    }
+    std::string expected = std::string("/memfd:") + PERF_SHARED_MEMFD_NAME + " ";
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string fdPath = fdDir + "/" + entry->d_name;
+        char target[256];
+        ssize_t length = readlink(fdPath.c_str(), target, sizeof(target) - 1);
+        if (length <= 0) {
+            continue;
+        }
+        target[length] = '\0';
+        // Like "/memfd:adhoc-perf (deleted)".
+        if (strncmp(target, expected.c_str(), expected.size()) == 0) {
+            fd = open(fdPath.c_str(), O_RDONLY | O_CLOEXEC);
+            break;
+        }
+    }
+    closedir(dir);
+    return fd;
+}
+
+uint64_t monotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/// A process attached.
+class Process {
+  public:
+    explicit Process(int pid): mPid(pid) {}
+
+    ~Process() {
+        if (mRegion) {
+            munmap(const_cast<void*>(mRegion), mSize);
+        }
+    }
+
+    bool attach() {
+        int fd = openRegion(mPid);
+        if (fd < 0) {
+            fprintf(stderr, "pid %d: no shared memory of adhoc-perf found (not started, or no permission)\n", mPid);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PerfSharedHeader)) {
+            close(fd);
+            fprintf(stderr, "pid %d: illegal shared memory\n", mPid);
+            return false;
+        }
+        mSize = (size_t)st.st_size;
+        void* region = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (region == MAP_FAILED) {
+            fprintf(stderr, "pid %d: can not map it: %s\n", mPid, strerror(errno));
+            return false;
+        }
+        mRegion = region;
+        const PerfSharedHeader* header = static_cast<const PerfSharedHeader*>(mRegion);
+        if (memcmp(header->mMagic, PERF_SHARED_MAGIC, sizeof(PERF_SHARED_MAGIC)) != 0
+                || header->mVersion != PERF_SHARED_VERSION
+                || header->mItemSize != perfSharedItemSize(header->mBucketCount)
+                || header->mHeaderSize + (size_t)header->mItemSize * header->mMaxItems > mSize) {
+            fprintf(stderr, "pid %d: unsupported shared memory (version %u)\n", mPid, header->mVersion);
+            return false;
+        }
+        return true;
+    }
+
+    /// Copy a consistent snapshot and print the deltas since the previous one.
+    void print() {
+        PerfSharedHeader current;
+        std::vector<char> items;
+        if (!read(current, items)) {
+            printf("pid %d: the publisher is always writing\n", mPid);
+            return;
+        }
+        bool exited = kill(mPid, 0) != 0 && errno == ESRCH;
+        uint64_t now = monotonicNanos();
+        double intervalSeconds = mPrevious.empty()
+                ? 0
+                : (double)(current.mPublishNanos - mPreviousPublishNanos) / 1e9;
+        printf("pid %d: %s, published %.0f ms ago%s\n", mPid,
+                mPrevious.empty() ? "since the start" : "deltas",
+                now > current.mPublishNanos ? (double)(now - current.mPublishNanos) / 1e6 : 0.0,
+                exited ? " (exited)" : intervalSeconds == 0 && !mPrevious.empty() ? " (not updated)" : "");
+        // The items registered since the previous print start from 0.
+        mPrevious.resize(items.size());
+        printKind(current, items, PERF_SHARED_TIMER, intervalSeconds);
+        printKind(current, items, PERF_SHARED_COUNTER, intervalSeconds);
+        printKind(current, items, PERF_SHARED_GAUGE, intervalSeconds);
+        mPrevious.swap(items);
+        mPreviousPublishNanos = current.mPublishNanos;
+    }
+
+  private:
+    /// Seqlock read, see `adhoc-perf-shared-format.h`.
+    bool read(PerfSharedHeader& header, std::vector<char>& items) {
+        const PerfSharedHeader* shared = static_cast<const PerfSharedHeader*>(mRegion);
+        const char* sharedItems = static_cast<const char*>(mRegion) + shared->mHeaderSize;
+        for (int retry = 0; retry < MAX_READ_RETRIES; retry++) {
+            uint64_t sequence = __atomic_load_n(&shared->mSequence, __ATOMIC_ACQUIRE);
+            if (sequence & 1) {
+                continue;
+            }
+            memcpy(&header, shared, sizeof(header));
+            uint32_t count = header.mItemCount < header.mMaxItems ? header.mItemCount : header.mMaxItems;
+            items.assign(sharedItems, sharedItems + (size_t)header.mItemSize * count);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shared->mSequence, __ATOMIC_RELAXED) == sequence) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void printKind(const PerfSharedHeader& header, const std::vector<char>& items, PerfSharedItemKind kind,
+            double intervalSeconds) {
+        bool first = true;
+        std::vector<uint64_t> buckets(header.mBucketCount);
+        double millisPerTick = header.mNanosPerTick / 1e6;
+        for (size_t offset = 0; offset < items.size(); offset += header.mItemSize) {
+            const PerfSharedItem* item = reinterpret_cast<const PerfSharedItem*>(items.data() + offset);
+            if (item->mKind != kind) {
+                continue;
+            }
+            const PerfSharedItem* previous = reinterpret_cast<const PerfSharedItem*>(mPrevious.data() + offset);
+            if (first) {
+                printHeading(kind);
+                first = false;
+            }
+            std::string name(item->mName, strnlen(item->mName, PERF_SHARED_NAME_LENGTH));
+            if (kind == PERF_SHARED_GAUGE) {
+                printf("  %-32s %12" PRId64 "\n", name.c_str(), item->mGauge);
+                continue;
+            }
+            if (kind == PERF_SHARED_COUNTER) {
+                uint64_t delta = item->mCounter - previous->mCounter;
+                if (intervalSeconds > 0) {
+                    printf("  %-32s %12" PRIu64 " %12.1f\n", name.c_str(), delta, (double)delta / intervalSeconds);
+                }
+                else {
+                    printf("  %-32s %12" PRIu64 " %12s\n", name.c_str(), delta, "-");
+                }
+                continue;
+            }
+            // Only the timed calls if it is sampled, see `TimerItem::setSampleRate()`.
+            uint64_t count = item->mCount - previous->mCount;
+            uint64_t calls = count + (item->mSkipped - previous->mSkipped);
+            const uint64_t* currentBuckets = perfSharedBuckets(item);
+            const uint64_t* previousBuckets = perfSharedBuckets(previous);
+            for (uint32_t i = 0; i < header.mBucketCount; i++) {
+                buckets[i] = currentBuckets[i] - previousBuckets[i];
+            }
+            double mean = count ? (double)(item->mSum - previous->mSum) / (double)count * millisPerTick : 0;
+            printf("  %-32s %12" PRIu64 " %12" PRIu64 " %12.6f %12.6f %12.6f %12.6f %12.6f\n", name.c_str(),
+                    calls, count, mean,
+                    percentile(header, buckets, count, 50) * millisPerTick,
+                    percentile(header, buckets, count, 90) * millisPerTick,
+                    percentile(header, buckets, count, 99) * millisPerTick,
+                    percentile(header, buckets, count, 100) * millisPerTick);
+        }
+    }
+
+    static void printHeading(PerfSharedItemKind kind) {
+        if (kind == PERF_SHARED_TIMER) {
+            printf("  %-32s %12s %12s %12s %12s %12s %12s %12s\n", "timer", "calls", "timed", "mean ms", "p50 ms",
+                    "p90 ms", "p99 ms", "max ms");
+        }
+        else if (kind == PERF_SHARED_COUNTER) {
+            printf("  %-32s %12s %12s\n", "counter", "delta", "per second");
+        }
+        else {
+            printf("  %-32s %12s\n", "gauge", "value");
+        }
+    }
+
+    static double percentile(const PerfSharedHeader& header, const std::vector<uint64_t>& buckets, uint64_t count,
+            double percentile) {
+        if (!count) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)((percentile / 100.0) * (double)count + 0.999999);
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < header.mBucketCount; i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return (double)perfSharedBucketMidpoint((int)i, header.mSubBucketBits);
+            }
+        }
+        return 0;
+    }
+
+    int mPid;
+    const void* mRegion = nullptr;
+    size_t mSize = 0;
+    std::vector<char> mPrevious;
+    uint64_t mPreviousPublishNanos = 0;
+};
+
+int printUsage() {
+    fprintf(stderr, "Usage: adhoc-perf-top [-i <interval ms>] [-n <count>] <pid>...\n");
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    long intervalMs = 1000;
+    long iterations = -1;
+    std::vector<int> pids;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            intervalMs = strtol(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = strtol(argv[++i], nullptr, 10);
+        }
+        else if (argv[i][0] == '-' || atoi(argv[i]) <= 0) {
+            return printUsage();
+        }
+        else {
+            pids.push_back(atoi(argv[i]));
+        }
+    }
+    if (pids.empty() || intervalMs <= 0) {
+        return printUsage();
+    }
+
+    std::vector<Process*> processes;
+    for (int pid : pids) {
+        Process* process = new Process(pid);
+        if (!process->attach()) {
+            delete process;
+            continue;
+        }
+        processes.push_back(process);
+    }
+    if (processes.empty()) {
+        return 1;
+    }
+    for (long iteration = 0; iterations < 0 || iteration < iterations; iteration++) {
+        if (iteration) {
+            usleep((useconds_t)intervalMs * 1000);
+            printf("\n");
+        }
+        for (Process* process : processes) {
+            process->print();
+        }
+        fflush(stdout);
+    }
+    for (Process* process : processes) {
+        delete process;
+    }
+    return 0;
+}
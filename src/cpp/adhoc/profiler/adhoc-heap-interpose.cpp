@@ -0,0 +1,309 @@
+/// Interpose `malloc`, `free` and the global `operator new` / `delete` of the .so (or
+/// executable) it is linked into, for the heap profiler (see `adhoc-heap-profiler.h`).
+/// A .so loaded by `dlopen` needs `-Wl,-Bsymbolic-functions`, or its calls are bound to libc.
+/// Only add it to the sources to use the heap profiler, it costs nothing more than a call
+/// until `adhocprofiler::startHeapProfiler()`.
+
+#include "adhoc-heap-profiler.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <dlfcn.h>
+#include <malloc.h>
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+#endif
+
+namespace {
+
+#if defined(__GLIBC__)
+
+inline void* realMalloc(size_t size) { return __libc_malloc(size); }
+inline void realFree(void* ptr) { __libc_free(ptr); }
+inline void* realCalloc(size_t count, size_t size) { return __libc_calloc(count, size); }
+inline void* realRealloc(void* ptr, size_t size) { return __libc_realloc(ptr, size); }
+inline void* realMemalign(size_t alignment, size_t size) { return __libc_memalign(alignment, size); }
+
+#else
+
+typedef void* (*MallocFunction)(size_t);
+typedef void (*FreeFunction)(void*);
+typedef void* (*CallocFunction)(size_t, size_t);
+typedef void* (*ReallocFunction)(void*, size_t);
+typedef void* (*MemalignFunction)(size_t, size_t);
+
+struct RealFunctions {
+    MallocFunction mMalloc;
+    FreeFunction mFree;
+    CallocFunction mCalloc;
+    ReallocFunction mRealloc;
+    MemalignFunction mMemalign;
+};
+RealFunctions s_real;
+std::atomic<bool> s_resolved{false};
+
+/// Serves the allocations while `dlsym` is resolving (if it allocates), never freed.
+const size_t BOOTSTRAP_BUFFER_SIZE = 4096;
+alignas(16) char s_bootstrapBuffer[BOOTSTRAP_BUFFER_SIZE];
+std::atomic<size_t> s_bootstrapUsed{0};
+std::atomic<bool> s_resolving{false};
+
+void* bootstrapAllocate(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    size_t offset = s_bootstrapUsed.fetch_add(size, std::memory_order_relaxed);
+    return offset + size <= BOOTSTRAP_BUFFER_SIZE ? s_bootstrapBuffer + offset : nullptr;
+}
+
+inline bool isBootstrap(void* ptr) {
+    return ptr >= s_bootstrapBuffer && ptr < s_bootstrapBuffer + BOOTSTRAP_BUFFER_SIZE;
+}
+
+/// @return false while resolving, then allocate from the bootstrap buffer.
+bool resolveRealFunctions() {
+    if (s_resolved.load(std::memory_order_acquire)) {
+        return true;
+    }
+    if (s_resolving.exchange(true, std::memory_order_acquire)) {
+        // Recursion from `dlsym`, or another thread resolving at the same time (rare,
+        // and the buffer is enough for both).
+        return s_resolved.load(std::memory_order_acquire);
+    }
+    RealFunctions real;
+    real.mMalloc = reinterpret_cast<MallocFunction>(dlsym(RTLD_NEXT, "malloc"));
+    real.mFree = reinterpret_cast<FreeFunction>(dlsym(RTLD_NEXT, "free"));
+    real.mCalloc = reinterpret_cast<CallocFunction>(dlsym(RTLD_NEXT, "calloc"));
+    real.mRealloc = reinterpret_cast<ReallocFunction>(dlsym(RTLD_NEXT, "realloc"));
+    real.mMemalign = reinterpret_cast<MemalignFunction>(dlsym(RTLD_NEXT, "memalign"));
+    if (!real.mMalloc || !real.mFree || !real.mCalloc || !real.mRealloc || !real.mMemalign) {
+        abort();
+    }
+    s_real = real;
+    s_resolved.store(true, std::memory_order_release);
+    return true;
+}
+
+inline void* realMalloc(size_t size) {
+    return resolveRealFunctions() ? s_real.mMalloc(size) : bootstrapAllocate(size);
+}
+
+inline void realFree(void* ptr) {
+    if (!isBootstrap(ptr) && resolveRealFunctions()) {
+        s_real.mFree(ptr);
+    }
+}
+
+inline void* realCalloc(size_t count, size_t size) {
+    // The bootstrap buffer is zero-initialized and never reused.
+    return resolveRealFunctions() ? s_real.mCalloc(count, size) : bootstrapAllocate(count * size);
+}
+
+inline void* realRealloc(void* ptr, size_t size) {
+    if (!isBootstrap(ptr)) {
+        return resolveRealFunctions() ? s_real.mRealloc(ptr, size) : nullptr;
+    }
+    void* moved = realMalloc(size);
+    if (moved) {
+        size_t available = (size_t)(s_bootstrapBuffer + BOOTSTRAP_BUFFER_SIZE - static_cast<char*>(ptr));
+        memcpy(moved, ptr, size < available ? size : available);
+    }
+    return moved;
+}
+
+inline void* realMemalign(size_t alignment, size_t size) {
+    return resolveRealFunctions() ? s_real.mMemalign(alignment, size) : nullptr;
+}
+
+#endif
+
+/// The helpers below are always inlined, so each allocation has exactly one frame of this
+/// file (the interposed function) above `recordAllocation`, which is skipped.
+const int INTERPOSER_FRAMES = 1;
+
+__attribute__((always_inline)) inline void* profiledMalloc(size_t size) {
+    void* ptr = realMalloc(size);
+    adhocprofiler::recordAllocation(ptr, size, INTERPOSER_FRAMES);
+    return ptr;
+}
+
+__attribute__((always_inline)) inline void profiledFree(void* ptr) {
+    adhocprofiler::recordFree(ptr);
+    realFree(ptr);
+}
+
+__attribute__((always_inline)) inline void* profiledMemalign(size_t alignment, size_t size) {
+    void* ptr = realMemalign(alignment, size);
+    adhocprofiler::recordAllocation(ptr, size, INTERPOSER_FRAMES);
+    return ptr;
+}
+
+__attribute__((always_inline)) inline void* profiledNew(size_t size) {
+    // Like the standard one, let the new handler free some memory and try again.
+    for (;;) {
+        void* ptr = profiledMalloc(size ? size : 1);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+__attribute__((always_inline)) inline void* profiledAlignedNew(size_t size, std::align_val_t alignment) {
+    // Like the standard one, let the new handler free some memory and try again.
+    for (;;) {
+        void* ptr = profiledMemalign((size_t)alignment, size ? size : 1);
+        if (ptr) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+} // end of anonymous namespace
+
+
+extern "C" {
+
+void* malloc(size_t size) {
+    return profiledMalloc(size);
+}
+
+void free(void* ptr) {
+    profiledFree(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    void* ptr = realCalloc(count, size);
+    adhocprofiler::recordAllocation(ptr, count * size, INTERPOSER_FRAMES);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    // Untrack it before it may be freed, or the address may be sampled again by another
+    // thread in between. If it fails, `ptr` is kept, so track it again.
+    adhocprofiler::FreedSample freed;
+    adhocprofiler::recordFree(ptr, &freed);
+    void* moved = realRealloc(ptr, size);
+    if (!moved && size) {
+        adhocprofiler::restoreFreed(ptr, freed);
+    }
+    else {
+        adhocprofiler::recordAllocation(moved, size, INTERPOSER_FRAMES);
+    }
+    return moved;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return profiledMemalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return profiledMemalign(alignment, size);
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = profiledMemalign(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *result = ptr;
+    return 0;
+}
+
+} // end of extern "C"
+
+void* operator new(size_t size) {
+    return profiledNew(size);
+}
+
+void* operator new[](size_t size) {
+    return profiledNew(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return profiledNew(size);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return profiledNew(size);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return profiledAlignedNew(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return profiledAlignedNew(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    profiledFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    profiledFree(ptr);
+}
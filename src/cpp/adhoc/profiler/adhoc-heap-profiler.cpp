@@ -0,0 +1,402 @@
+#include "adhoc-heap-profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "folded-stacks.h"
+#include "thread-state.h"
+#include "../ndk-backtrace/adhoc-backtrace.h"
+
+namespace adhocprofiler {
+
+namespace {
+
+const size_t MAX_LIVE_SAMPLES = _ADHOC_TOOLS_PROFILER_HEAP_MAX_LIVE_SAMPLES_;
+const size_t REPORT_TOP = _ADHOC_TOOLS_PROFILER_HEAP_REPORT_TOP_;
+/// A bucket of the live samples is one cache line of pointers.
+const size_t BUCKET_SIZE = 8;
+const size_t BUCKET_COUNT = MAX_LIVE_SAMPLES / BUCKET_SIZE;
+/// The innermost frames shown for each stack in `summarizeHeapProfile()`.
+const uint32_t SUMMARY_FRAMES = 6;
+
+static_assert(MAX_LIVE_SAMPLES >= BUCKET_SIZE && (MAX_LIVE_SAMPLES & (MAX_LIVE_SAMPLES - 1)) == 0,
+        "Max live samples should be power of 2");
+
+/// The estimates of one distinct stack. Never freed, since the live samples point to it.
+struct StackRecord {
+    adhocbacktrace::Backtrace mBacktrace;
+    /// Updated by `recordFree` without the lock.
+    std::atomic<int64_t> mLiveBytes{0};
+    std::atomic<int64_t> mLiveCount{0};
+    /// Guarded by `s_mutex`.
+    uint64_t mTotalBytes = 0;
+    uint64_t mTotalCount = 0;
+};
+
+/// The pointers of the sampled allocations alive, 0 if empty. Looked up by `recordFree`
+/// without the lock, in one bucket. Only inserted under `s_mutex`, and removed by CAS.
+alignas(64) std::atomic<uintptr_t> s_livePointers[MAX_LIVE_SAMPLES];
+/// Written before the pointer is published, and not changed until it is removed.
+struct LiveSampleInfo {
+    StackRecord* mStack;
+    uint64_t mBytes;
+    uint64_t mCount;
+};
+LiveSampleInfo s_liveInfos[MAX_LIVE_SAMPLES];
+std::atomic<int64_t> s_liveSampleCount{0};
+
+std::atomic<bool> s_sampling{false};
+std::atomic<uint64_t> s_intervalBytes{_ADHOC_TOOLS_PROFILER_HEAP_SAMPLE_INTERVAL_};
+std::atomic<uint64_t> s_sampleCount{0};
+/// Not tracked as alive, since their buckets are full.
+std::atomic<uint64_t> s_droppedCount{0};
+
+typedef std::vector<uintptr_t> StackKey;
+struct StackKeyHash {
+    size_t operator()(const StackKey& key) const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uintptr_t value : key) {
+            hash = (hash ^ (uint64_t)value) * 0x100000001b3ULL;
+        }
+        return (size_t)(hash ^ (hash >> 32));
+    }
+};
+/// Guards the stacks and the insertion of live samples.
+std::mutex s_mutex;
+/// Never destroyed, since allocations may still come after static destructors.
+std::unordered_map<StackKey, StackRecord*, StackKeyHash>* s_stackIndices = nullptr;
+std::vector<StackRecord*>* s_stacks = nullptr;
+
+struct HeapThreadState {
+    int64_t mBytesUntilSample = 0;
+    /// 0 before the first sample in the thread.
+    uint64_t mRandom = 0;
+    /// In the profiler itself, whose allocations are not sampled.
+    bool mBusy = false;
+};
+ThreadState<HeapThreadState> s_threadStates;
+
+class BusyScope {
+  public:
+    BusyScope(): mState(s_threadStates.get()) {
+        if (mState) {
+            mWasBusy = mState->mBusy;
+            mState->mBusy = true;
+        }
+    }
+    ~BusyScope() {
+        if (mState) {
+            mState->mBusy = mWasBusy;
+        }
+    }
+  private:
+    HeapThreadState* mState;
+    bool mWasBusy = false;
+};
+
+/// xorshift64*, uniform in [0, 1).
+double nextRandom(HeapThreadState& state) {
+    uint64_t x = state.mRandom;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    state.mRandom = x;
+    return (double)((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// Exponentially distributed with the mean of the interval.
+int64_t nextSampleBytes(HeapThreadState& state, uint64_t interval) {
+    double bytes = -std::log(1.0 - nextRandom(state)) * (double)interval;
+    return bytes < (double)INT64_MAX / 2 ? (int64_t)bytes + 1 : INT64_MAX / 2;
+}
+
+inline size_t bucketOf(uintptr_t ptr) {
+    // Allocations are aligned, mix the bits above.
+    return (size_t)(((uint64_t)(ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> 32) & (BUCKET_COUNT - 1);
+}
+
+/// Locked by `s_mutex`.
+StackRecord* findOrCreateStack(const adhocbacktrace::Backtrace& backtrace) {
+    if (!s_stackIndices) {
+        s_stackIndices = new std::unordered_map<StackKey, StackRecord*, StackKeyHash>();
+        s_stacks = new std::vector<StackRecord*>();
+    }
+    StackKey key(backtrace.mCount);
+    for (uint32_t i = 0; i < backtrace.mCount; i++) {
+        key[i] = reinterpret_cast<uintptr_t>(backtrace.mPcs[i]);
+    }
+    auto found = s_stackIndices->find(key);
+    if (found != s_stackIndices->end()) {
+        return found->second;
+    }
+    StackRecord* stack = new StackRecord();
+    stack->mBacktrace = backtrace;
+    s_stackIndices->emplace(std::move(key), stack);
+    s_stacks->push_back(stack);
+    return stack;
+}
+
+/// Locked by `s_mutex`.
+bool insertLiveSample(uintptr_t ptr, StackRecord* stack, uint64_t bytes, uint64_t count) {
+    size_t begin = bucketOf(ptr) * BUCKET_SIZE;
+    for (size_t i = begin; i < begin + BUCKET_SIZE; i++) {
+        if (s_livePointers[i].load(std::memory_order_relaxed) == 0) {
+            s_liveInfos[i] = {stack, bytes, count};
+            s_liveSampleCount.fetch_add(1, std::memory_order_relaxed);
+            s_livePointers[i].store(ptr, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((noinline)) void sampleAllocation(HeapThreadState& state, void* ptr, size_t size, int skipFrames) {
+    BusyScope busy;
+    uint64_t interval = s_intervalBytes.load(std::memory_order_relaxed);
+    if (!state.mRandom) {
+        // The first allocation in the thread, start counting down from a random point.
+        state.mRandom = ((uint64_t)syscall(SYS_gettid) << 32) ^ (uint64_t)time(nullptr) ^ reinterpret_cast<uintptr_t>(&state);
+        state.mRandom = state.mRandom ? state.mRandom : 1;
+        state.mBytesUntilSample += nextSampleBytes(state, interval);
+        if (state.mBytesUntilSample >= 0) {
+            return;
+        }
+    }
+    state.mBytesUntilSample = nextSampleBytes(state, interval);
+
+    // The allocation is sampled with the probability of `1 - exp(-size / interval)`, so it
+    // stands for `1 / probability` allocations of the size.
+    double sampledSize = size ? (double)size : 1;
+    double probability = 1 - std::exp(-sampledSize / (double)interval);
+    uint64_t count = (uint64_t)std::llround(1 / probability);
+    uint64_t bytes = (uint64_t)std::llround(sampledSize / probability);
+
+    adhocbacktrace::Backtrace backtrace;
+    // Skip this function and `recordAllocation`.
+    adhocbacktrace::captureBacktrace(backtrace, 2 + skipFrames);
+    std::lock_guard<std::mutex> lock(s_mutex);
+    StackRecord* stack = findOrCreateStack(backtrace);
+    stack->mTotalBytes += bytes;
+    stack->mTotalCount += count;
+    s_sampleCount.fetch_add(1, std::memory_order_relaxed);
+    if (insertLiveSample(reinterpret_cast<uintptr_t>(ptr), stack, bytes, count)) {
+        stack->mLiveBytes.fetch_add((int64_t)bytes, std::memory_order_relaxed);
+        stack->mLiveCount.fetch_add((int64_t)count, std::memory_order_relaxed);
+    }
+    else {
+        s_droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/// Sorted by the bytes alive, then by the bytes in total. Locked by `s_mutex`.
+std::vector<StackRecord*> sortedStacks() {
+    std::vector<StackRecord*> stacks;
+    if (s_stacks) {
+        stacks = *s_stacks;
+    }
+    std::sort(stacks.begin(), stacks.end(), [](StackRecord* a, StackRecord* b) {
+        int64_t aLive = a->mLiveBytes.load(std::memory_order_relaxed);
+        int64_t bLive = b->mLiveBytes.load(std::memory_order_relaxed);
+        return aLive != bLive ? aLive > bLive : a->mTotalBytes > b->mTotalBytes;
+    });
+    return stacks;
+}
+
+std::string formatBytes(double bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB"};
+    int unit = 0;
+    while (std::fabs(bytes) >= 1024 && unit < 3) {
+        bytes /= 1024;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+    return text;
+}
+
+} // end of anonymous namespace
+
+
+void startHeapProfiler(size_t sampleIntervalBytes) {
+    s_intervalBytes.store(sampleIntervalBytes ? sampleIntervalBytes : 1, std::memory_order_relaxed);
+    s_sampling.store(true, std::memory_order_relaxed);
+}
+
+void stopHeapProfiler() {
+    s_sampling.store(false, std::memory_order_relaxed);
+}
+
+void resetHeapProfile() {
+    BusyScope busy;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (s_stacks) {
+        for (StackRecord* stack : *s_stacks) {
+            stack->mTotalBytes = 0;
+            stack->mTotalCount = 0;
+        }
+    }
+    s_sampleCount.store(0, std::memory_order_relaxed);
+    s_droppedCount.store(0, std::memory_order_relaxed);
+}
+
+void recordAllocation(void* ptr, size_t size, int skipFrames) {
+    if (!ptr || !s_sampling.load(std::memory_order_relaxed)) {
+        return;
+    }
+    HeapThreadState* state = s_threadStates.get();
+    if (!state) {
+        return;
+    }
+    state->mBytesUntilSample -= (int64_t)size;
+    if (state->mBytesUntilSample < 0 && !state->mBusy) {
+        sampleAllocation(*state, ptr, size, skipFrames);
+        // Keep the frame of this function, which `sampleAllocation` skips, rather than a
+        // tail call.
+        __asm__ __volatile__("");
+    }
+}
+
+void recordFree(void* ptr, FreedSample* freed) {
+    if (freed) {
+        *freed = FreedSample();
+    }
+    if (!ptr || s_liveSampleCount.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    uintptr_t key = reinterpret_cast<uintptr_t>(ptr);
+    size_t begin = bucketOf(key) * BUCKET_SIZE;
+    for (size_t i = begin; i < begin + BUCKET_SIZE; i++) {
+        uintptr_t found = s_livePointers[i].load(std::memory_order_acquire);
+        if (found != key) {
+            continue;
+        }
+        // Read before removing it, since the slot may be reused right after.
+        LiveSampleInfo info = s_liveInfos[i];
+        if (s_livePointers[i].compare_exchange_strong(found, 0, std::memory_order_acq_rel)) {
+            info.mStack->mLiveBytes.fetch_sub((int64_t)info.mBytes, std::memory_order_relaxed);
+            info.mStack->mLiveCount.fetch_sub((int64_t)info.mCount, std::memory_order_relaxed);
+            s_liveSampleCount.fetch_sub(1, std::memory_order_relaxed);
+            if (freed) {
+                *freed = {info.mStack, info.mBytes, info.mCount};
+            }
+        }
+        return;
+    }
+}
+
+void restoreFreed(void* ptr, const FreedSample& freed) {
+    if (!ptr || !freed.mStack) {
+        return;
+    }
+    StackRecord* stack = static_cast<StackRecord*>(freed.mStack);
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (insertLiveSample(reinterpret_cast<uintptr_t>(ptr), stack, freed.mBytes, freed.mCount)) {
+        stack->mLiveBytes.fetch_add((int64_t)freed.mBytes, std::memory_order_relaxed);
+        stack->mLiveCount.fetch_add((int64_t)freed.mCount, std::memory_order_relaxed);
+    }
+    else {
+        s_droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::string summarizeHeapProfile() {
+    BusyScope busy;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    std::vector<StackRecord*> stacks = sortedStacks();
+    if (stacks.empty()) {
+        return "";
+    }
+    int64_t liveBytes = 0;
+    int64_t liveCount = 0;
+    uint64_t totalBytes = 0;
+    uint64_t totalCount = 0;
+    for (StackRecord* stack : stacks) {
+        liveBytes += stack->mLiveBytes.load(std::memory_order_relaxed);
+        liveCount += stack->mLiveCount.load(std::memory_order_relaxed);
+        totalBytes += stack->mTotalBytes;
+        totalCount += stack->mTotalCount;
+    }
+    std::string out = "heap profile: {live: " + formatBytes((double)liveBytes) + " in " + std::to_string(liveCount)
+            + ", total: " + formatBytes((double)totalBytes) + " in " + std::to_string(totalCount)
+            + ", samples: " + std::to_string(s_sampleCount.load(std::memory_order_relaxed))
+            + ", dropped: " + std::to_string(s_droppedCount.load(std::memory_order_relaxed))
+            + ", interval: " + formatBytes((double)s_intervalBytes.load(std::memory_order_relaxed)) + "}";
+    for (size_t i = 0; i < stacks.size() && i < REPORT_TOP; i++) {
+        StackRecord* stack = stacks[i];
+        out += "\n  live: " + formatBytes((double)stack->mLiveBytes.load(std::memory_order_relaxed))
+                + " in " + std::to_string(stack->mLiveCount.load(std::memory_order_relaxed))
+                + ", total: " + formatBytes((double)stack->mTotalBytes) + " in " + std::to_string(stack->mTotalCount)
+                + " @";
+        for (uint32_t frame = 0; frame < stack->mBacktrace.mCount && frame < SUMMARY_FRAMES; frame++) {
+            out += frame ? " < " : " ";
+            out += foldedFrameName(reinterpret_cast<uintptr_t>(stack->mBacktrace.mPcs[frame]));
+        }
+    }
+    return out;
+}
+
+void formatHeapProfile(std::string& out) {
+    BusyScope busy;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for (StackRecord* stack : sortedStacks()) {
+        char line[160];
+        snprintf(line, sizeof(line), "--- live: %s in %lld, total: %s in %llu\n",
+                formatBytes((double)stack->mLiveBytes.load(std::memory_order_relaxed)).c_str(),
+                (long long)stack->mLiveCount.load(std::memory_order_relaxed),
+                formatBytes((double)stack->mTotalBytes).c_str(), (unsigned long long)stack->mTotalCount);
+        out += line;
+        adhocbacktrace::formatBacktrace(stack->mBacktrace, out);
+    }
+}
+
+void formatHeapFoldedStacks(std::string& out, bool live) {
+    BusyScope busy;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    std::unordered_map<uintptr_t, std::string> names;
+    // Different pcs in the same function make the same line, merge them.
+    std::map<std::string, int64_t> lines;
+    for (StackRecord* stack : sortedStacks()) {
+        int64_t bytes = live ? stack->mLiveBytes.load(std::memory_order_relaxed) : (int64_t)stack->mTotalBytes;
+        if (bytes <= 0 || stack->mBacktrace.mCount == 0) {
+            continue;
+        }
+        std::string line;
+        for (uint32_t i = stack->mBacktrace.mCount; i-- > 0;) {
+            uintptr_t pc = reinterpret_cast<uintptr_t>(stack->mBacktrace.mPcs[i]);
+            auto found = names.find(pc);
+            if (found == names.end()) {
+                found = names.emplace(pc, foldedFrameName(pc)).first;
+            }
+            if (!line.empty()) {
+                line += ';';
+            }
+            line += found->second;
+        }
+        lines[line] += bytes;
+    }
+    for (auto& line : lines) {
+        out += line.first;
+        out += ' ';
+        out += std::to_string(line.second);
+        out += '\n';
+    }
+}
+
+bool writeHeapFoldedStacks(const char* path, bool live) {
+    BusyScope busy;
+    std::string out;
+    formatHeapFoldedStacks(out, live);
+    return writeProfileFile(path, out);
+}
+
+} // end of namespace adhocprofiler
@@ -0,0 +1,94 @@
+/// A sampling heap profiler, which tells where the memory alive (and allocated in total) is
+/// allocated from, cheap enough for load tests.
+///
+/// [Usage]
+/// Add `adhoc-heap-interpose.cpp` to the sources to interpose `malloc`, `free` and
+/// `operator new` / `delete` of the .so (or executable) it is linked into, and link a .so
+/// with `-Wl,-Bsymbolic-functions` (see below and `resource/adhoc-tools.cmake`). Or call
+/// `recordAllocation` / `recordFree` from your own allocator, like the `JSMallocFunctions`
+/// of QuickJS.
+/// ```cpp
+/// #include "adhoc/profiler/adhoc-heap-profiler.h"
+///
+/// adhocprofiler::startHeapProfiler();
+/// // Optional, report in `adhocperf::summarizeAndPrintPerf()`.
+/// adhocperf::addPerfReporter(adhocprofiler::summarizeHeapProfile);
+/// // ...
+/// adhocprofiler::writeHeapFoldedStacks("/data/data/com.xxx.yyy/files/heap.folded", true);
+/// ```
+///
+/// Like tcmalloc, allocations are sampled by bytes: each thread counts down the bytes
+/// allocated, and samples the allocation crossing a random point (exponentially distributed
+/// with the mean of the interval, so the sampling is a Poisson process over the bytes).
+/// Only sampled allocations capture the stack (by `adhocbacktrace::captureBacktrace`) and
+/// take a lock, others only cost a thread-local subtraction. Each sample is weighted to
+/// estimate the bytes and the count it stands for.
+/// `recordFree` looks the pointer up in a lock-free table of the sampled allocations alive,
+/// which is skipped when there are none.
+///
+/// The interposition only sees the calls that are bound to it. A .so loaded by `dlopen`
+/// (like by `System.loadLibrary`) is not in the global lookup scope, which the dynamic
+/// linker searches first (and bionic searches the global group before the .so itself), so
+/// even the calls of the .so itself are bound to libc, and nothing is recorded, unless the
+/// .so is linked with `-Wl,-Bsymbolic-functions`, which binds them to its own definitions.
+/// The calls of libc and other libraries are never seen.
+/// The counters of each thread are kept by `pthread_getspecific` rather than `thread_local`
+/// (see `thread-state.h`), since the TLS of a .so loaded by `dlopen` may allocate at the first
+/// access in a thread, and bionic refuses to load a .so with initial-exec TLS. The
+/// allocations of a thread are not sampled while its counters are being created.
+
+#ifndef _ADHOC_TOOLS_HEAP_PROFILER_H_
+#define _ADHOC_TOOLS_HEAP_PROFILER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "config.h"
+
+namespace adhocprofiler {
+
+/// Start sampling. Frees are tracked as long as sampled allocations are alive, even after
+/// `stopHeapProfiler()`.
+/// @param sampleIntervalBytes the mean bytes between samples, see
+/// `_ADHOC_TOOLS_PROFILER_HEAP_SAMPLE_INTERVAL_`.
+extern void startHeapProfiler(size_t sampleIntervalBytes = _ADHOC_TOOLS_PROFILER_HEAP_SAMPLE_INTERVAL_);
+extern void stopHeapProfiler();
+
+/// Drop the totals allocated so far (the live ones are kept).
+extern void resetHeapProfile();
+
+/// Called after an allocation succeeds. Cheap unless it is sampled.
+/// @param skipFrames the count of the innermost callers not to capture in the stack, like
+///     the frames of an allocator wrapper (so they do not take the frames of the summary).
+extern void recordAllocation(void* ptr, size_t size, int skipFrames = 0);
+/// The sample of an allocation untracked by `recordFree`, see `restoreFreed`.
+struct FreedSample {
+    /// Null if the allocation was not sampled.
+    void* mStack = nullptr;
+    uint64_t mBytes = 0;
+    uint64_t mCount = 0;
+};
+/// Called before `ptr` is freed. Null is ignored.
+/// @param freed if not null, receives the sample of `ptr`, to track it again by
+///     `restoreFreed` if it is not freed after all (like by a failed `realloc`).
+extern void recordFree(void* ptr, FreedSample* freed = nullptr);
+/// Track `ptr` again as sampled before `recordFree(ptr, &freed)`, with the same stack.
+extern void restoreFreed(void* ptr, const FreedSample& freed);
+
+/// A summary of the estimated bytes and counts alive and allocated in total, and the top
+/// stacks by the bytes alive (see `_ADHOC_TOOLS_PROFILER_HEAP_REPORT_TOP_`), each in a line
+/// of the innermost frames. For `adhocperf::addPerfReporter`.
+extern std::string summarizeHeapProfile();
+
+/// All stacks by the bytes alive, each with the full backtrace.
+extern void formatHeapProfile(std::string& out);
+
+/// Lines of `outermost;...;innermost bytes` (see `adhocprofiler::formatFoldedStacks`).
+/// @param live the bytes alive if true, or else the bytes allocated in total.
+extern void formatHeapFoldedStacks(std::string& out, bool live);
+extern bool writeHeapFoldedStacks(const char* path, bool live);
+
+} // end of namespace adhocprofiler
+
+#endif // _ADHOC_TOOLS_HEAP_PROFILER_H_
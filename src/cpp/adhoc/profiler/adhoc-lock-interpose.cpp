@@ -0,0 +1,150 @@
+/// Interpose `pthread_mutex_lock` (and `trylock`, `unlock`, and the waits of condition
+/// variables, which release the mutex) of the .so (or executable) it is linked into, for
+/// the lock profiler (see `adhoc-lock-profiler.h`). `std::mutex` is profiled as well, since
+/// it calls them. Only add it to the sources to use the lock profiler, it costs nothing
+/// more than a call until `adhocprofiler::startLockProfiler()`.
+/// A .so loaded by `dlopen` needs `-Wl,-Bsymbolic-functions`, or its calls are bound to libc.
+
+#include "adhoc-lock-profiler.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <dlfcn.h>
+#include <pthread.h>
+
+namespace {
+
+typedef int (*MutexFunction)(pthread_mutex_t*);
+typedef int (*CondWaitFunction)(pthread_cond_t*, pthread_mutex_t*);
+typedef int (*CondTimedWaitFunction)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+typedef int (*CondClockWaitFunction)(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*);
+
+/// `dlsym` does not lock by the interposed functions (the dynamic linkers have their own
+/// locks). glibc has `__pthread_mutex_lock` as well, but it is private since 2.34.
+void* resolveFunction(const char* name) {
+    void* function = dlsym(RTLD_NEXT, name);
+    if (!function) {
+        abort();
+    }
+    return function;
+}
+
+inline int realLock(pthread_mutex_t* mutex) {
+    static MutexFunction function = reinterpret_cast<MutexFunction>(resolveFunction("pthread_mutex_lock"));
+    return function(mutex);
+}
+
+inline int realTrylock(pthread_mutex_t* mutex) {
+    static MutexFunction function = reinterpret_cast<MutexFunction>(resolveFunction("pthread_mutex_trylock"));
+    return function(mutex);
+}
+
+inline int realUnlock(pthread_mutex_t* mutex) {
+    static MutexFunction function = reinterpret_cast<MutexFunction>(resolveFunction("pthread_mutex_unlock"));
+    return function(mutex);
+}
+
+/// The condition variables of glibc have an old version (before 2.3.2) besides the default
+/// one, and `dlsym` may find the old one, so ask for the default version by `dlvsym`.
+void* resolveConditionFunction(const char* name) {
+    void* function = nullptr;
+#if defined(__GLIBC__)
+#if defined(__x86_64__) || defined(__i386__)
+    function = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+#endif
+#endif
+    return function ? function : resolveFunction(name);
+}
+
+/// The interposed function calling `beginLockWait`, which is not captured in the stack.
+const int INTERPOSER_FRAMES = 1;
+
+} // end of anonymous namespace
+
+
+extern "C" {
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    if (!adhocprofiler::shouldProfileLocks()) {
+        return realLock(mutex);
+    }
+    int result = realTrylock(mutex);
+    if (result == 0) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, nullptr);
+        return 0;
+    }
+    if (result != EBUSY) {
+        // Like EDEADLK of error-checking mutexes, let the real one report it.
+        return realLock(mutex);
+    }
+    adhocprofiler::LockWait wait;
+    adhocprofiler::beginLockWait(wait, INTERPOSER_FRAMES);
+    result = realLock(mutex);
+    if (result == 0) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, &wait);
+    }
+    return result;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+    int result = realTrylock(mutex);
+    if (result == 0 && adhocprofiler::shouldProfileLocks()) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, nullptr);
+    }
+    return result;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+    if (adhocprofiler::shouldProfileLocks()) {
+        adhocprofiler::onLockReleased(mutex);
+    }
+    return realUnlock(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    static CondWaitFunction function = reinterpret_cast<CondWaitFunction>(resolveConditionFunction("pthread_cond_wait"));
+    bool profile = adhocprofiler::shouldProfileLocks();
+    if (profile) {
+        adhocprofiler::onLockReleased(mutex);
+    }
+    int result = function(cond, mutex);
+    if (profile) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, nullptr);
+    }
+    return result;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    static CondTimedWaitFunction function =
+            reinterpret_cast<CondTimedWaitFunction>(resolveConditionFunction("pthread_cond_timedwait"));
+    bool profile = adhocprofiler::shouldProfileLocks();
+    if (profile) {
+        adhocprofiler::onLockReleased(mutex);
+    }
+    int result = function(cond, mutex, deadline);
+    if (profile) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, nullptr);
+    }
+    return result;
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+/// Used by `std::condition_variable::wait_for` of libstdc++.
+int pthread_cond_clockwait(pthread_cond_t* cond, pthread_mutex_t* mutex, clockid_t clock,
+        const struct timespec* deadline) {
+    static CondClockWaitFunction function =
+            reinterpret_cast<CondClockWaitFunction>(resolveFunction("pthread_cond_clockwait"));
+    bool profile = adhocprofiler::shouldProfileLocks();
+    if (profile) {
+        adhocprofiler::onLockReleased(mutex);
+    }
+    int result = function(cond, mutex, clock, deadline);
+    if (profile) {
+        adhocprofiler::onLockAcquired(mutex, nullptr, nullptr);
+    }
+    return result;
+}
+#endif
+
+} // end of extern "C"
@@ -0,0 +1,361 @@
+#include "adhoc-lock-profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <dlfcn.h>
+
+#include "config.h"
+#include "folded-stacks.h"
+#include "thread-state.h"
+#include "../perf/clock.h"
+#include "../perf/histogram.h"
+
+namespace adhocprofiler {
+
+namespace {
+
+const size_t MAX_LOCKS = _ADHOC_TOOLS_PROFILER_LOCK_MAX_LOCKS_;
+const size_t REPORT_TOP = _ADHOC_TOOLS_PROFILER_LOCK_REPORT_TOP_;
+const size_t REPORT_STACKS = _ADHOC_TOOLS_PROFILER_LOCK_REPORT_STACKS_;
+/// The innermost frames shown for each stack in the report.
+const uint32_t REPORT_FRAMES = 6;
+
+/// The statistics of one lock. Written only by the thread holding the lock, and read by
+/// the report at the same time. Never freed.
+struct LockRecord {
+    uintptr_t mLock = 0;
+    const char* mName = nullptr;
+    std::atomic<uint64_t> mAcquisitions{0};
+    std::atomic<adhocperf::Ticks> mHoldTicks{0};
+    /// Of the contended acquisitions only, or the percentiles would be all 0 for most locks.
+    adhocperf::Histogram mWaitHistogram;
+    adhocperf::Ticks mHoldStart = 0;
+
+    /// Only written by the report.
+    uint64_t mAcquisitionsFlushed = 0;
+    adhocperf::Ticks mHoldTicksFlushed = 0;
+    adhocperf::HistogramCounters mWaitFlushed;
+};
+
+/// Open addressing by the address of the lock. The key is claimed by CAS first, and then
+/// the record is published.
+std::atomic<uintptr_t> s_lockKeys[MAX_LOCKS];
+std::atomic<LockRecord*> s_lockRecords[MAX_LOCKS];
+std::atomic<bool> s_started{false};
+
+/// The waits of a lock from a stack, guarded by `s_stackMutex`.
+struct StackRecord {
+    LockRecord* mLock;
+    adhocperf::Ticks mWaitTicks = 0;
+    uint64_t mCount = 0;
+    adhocperf::Ticks mWaitTicksFlushed = 0;
+    uint64_t mCountFlushed = 0;
+    adhocbacktrace::Backtrace mBacktrace;
+};
+/// The address of the lock followed by the pcs.
+typedef std::vector<uintptr_t> StackKey;
+struct StackKeyHash {
+    size_t operator()(const StackKey& key) const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uintptr_t value : key) {
+            hash = (hash ^ (uint64_t)value) * 0x100000001b3ULL;
+        }
+        return (size_t)(hash ^ (hash >> 32));
+    }
+};
+std::mutex s_stackMutex;
+/// Never destroyed, since locks may still be taken after static destructors.
+std::unordered_map<StackKey, StackRecord*, StackKeyHash>* s_stacks = nullptr;
+/// Only one report at a time, since it writes the flushed values.
+std::mutex s_reportMutex;
+
+struct LockThreadState {
+    /// In the profiler itself (or in `ProfiledMutex`), whose locks are not profiled.
+    bool mBusy = false;
+};
+/// Not `thread_local`, see `thread-state.h`.
+ThreadState<LockThreadState> s_threadStates;
+
+class BusyScope {
+  public:
+    BusyScope(): mState(s_threadStates.get()) {
+        if (mState) {
+            mWasBusy = mState->mBusy;
+            mState->mBusy = true;
+        }
+    }
+    ~BusyScope() {
+        if (mState) {
+            mState->mBusy = mWasBusy;
+        }
+    }
+  private:
+    LockThreadState* mState;
+    bool mWasBusy = false;
+};
+
+inline size_t hashLock(uintptr_t lock) {
+    return (size_t)(((uint64_t)(lock >> 3) * 0x9e3779b97f4a7c15ULL) >> 32) % MAX_LOCKS;
+}
+
+/// @param create false to only find it.
+/// @return null if the table is full, or the record is being created by another thread.
+LockRecord* findLockRecord(uintptr_t lock, const char* name, bool create) {
+    size_t begin = hashLock(lock);
+    for (size_t probe = 0; probe < MAX_LOCKS; probe++) {
+        size_t index = (begin + probe) % MAX_LOCKS;
+        uintptr_t key = s_lockKeys[index].load(std::memory_order_acquire);
+        if (key == 0) {
+            if (!create) {
+                return nullptr;
+            }
+            if (!s_lockKeys[index].compare_exchange_strong(key, lock, std::memory_order_acq_rel)) {
+                if (key != lock) {
+                    continue;
+                }
+                return s_lockRecords[index].load(std::memory_order_acquire);
+            }
+            BusyScope busy;
+            LockRecord* record = new LockRecord();
+            record->mLock = lock;
+            record->mName = name;
+            s_lockRecords[index].store(record, std::memory_order_release);
+            return record;
+        }
+        if (key == lock) {
+            return s_lockRecords[index].load(std::memory_order_acquire);
+        }
+    }
+    return nullptr;
+}
+
+/// Only written by the thread holding the lock, so no read-modify-write is needed.
+template <typename T>
+inline void addRelaxed(std::atomic<T>& target, T value) {
+    target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void recordStack(LockRecord* lock, const LockWait& wait, adhocperf::Ticks waitTicks) {
+    BusyScope busy;
+    StackKey key(wait.mBacktrace.mCount + 1);
+    key[0] = lock->mLock;
+    for (uint32_t i = 0; i < wait.mBacktrace.mCount; i++) {
+        key[i + 1] = reinterpret_cast<uintptr_t>(wait.mBacktrace.mPcs[i]);
+    }
+    std::lock_guard<std::mutex> guard(s_stackMutex);
+    if (!s_stacks) {
+        s_stacks = new std::unordered_map<StackKey, StackRecord*, StackKeyHash>();
+    }
+    StackRecord*& stack = (*s_stacks)[key];
+    if (!stack) {
+        stack = new StackRecord();
+        stack->mLock = lock;
+        stack->mBacktrace = wait.mBacktrace;
+    }
+    stack->mWaitTicks += waitTicks;
+    stack->mCount++;
+}
+
+double ticksToMillis(double ticks) {
+    return adhocperf::clockTicksToNanos(ticks) / 1e6;
+}
+
+/// The statistics of one lock since the last report.
+struct LockDelta {
+    LockRecord* mLock;
+    uint64_t mAcquisitions;
+    adhocperf::Ticks mHoldTicks;
+    /// Of the contended acquisitions.
+    adhocperf::HistogramSnapshot mWait;
+};
+
+std::string lockName(const LockRecord& lock) {
+    char text[64];
+    snprintf(text, sizeof(text), "%p", reinterpret_cast<void*>(lock.mLock));
+    std::string name = text;
+    if (lock.mName) {
+        return name + " \"" + lock.mName + "\"";
+    }
+    // Global locks can be named by their symbols.
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(lock.mLock), &info) && info.dli_sname && info.dli_saddr) {
+        return name + " (" + info.dli_sname + ")";
+    }
+    return name;
+}
+
+} // end of anonymous namespace
+
+
+void startLockProfiler() {
+    s_started.store(true, std::memory_order_relaxed);
+}
+
+void stopLockProfiler() {
+    s_started.store(false, std::memory_order_relaxed);
+}
+
+bool shouldProfileLocks() {
+    if (!s_started.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    // Null while it is being created, whose locks are not profiled either.
+    LockThreadState* state = s_threadStates.get();
+    return state && !state->mBusy;
+}
+
+void beginLockWait(LockWait& wait, int skipFrames) {
+    BusyScope busy;
+    // Skip this function.
+    adhocbacktrace::captureBacktrace(wait.mBacktrace, 1 + skipFrames);
+    wait.mStartTicks = adhocperf::clockNow();
+}
+
+void onLockAcquired(const void* lock, const char* name, const LockWait* wait) {
+    adhocperf::Ticks now = adhocperf::clockNow();
+    LockRecord* record = findLockRecord(reinterpret_cast<uintptr_t>(lock), name, true);
+    if (!record) {
+        return;
+    }
+    addRelaxed<uint64_t>(record->mAcquisitions, 1);
+    if (wait) {
+        // The histogram may allocate a group of buckets.
+        BusyScope busy;
+        adhocperf::Ticks waitTicks = now - wait->mStartTicks;
+        record->mWaitHistogram.record(waitTicks);
+        recordStack(record, *wait, waitTicks);
+    }
+    // Not counting the profiler above.
+    record->mHoldStart = adhocperf::clockNow();
+}
+
+void onLockReleased(const void* lock) {
+    LockRecord* record = findLockRecord(reinterpret_cast<uintptr_t>(lock), nullptr, false);
+    // Taken before the profiler started.
+    if (!record || !record->mHoldStart) {
+        return;
+    }
+    addRelaxed<adhocperf::Ticks>(record->mHoldTicks, adhocperf::clockNow() - record->mHoldStart);
+    record->mHoldStart = 0;
+}
+
+void ProfiledMutex::lock() {
+    if (!shouldProfileLocks()) {
+        BusyScope busy;
+        pthread_mutex_lock(&mMutex);
+        return;
+    }
+    BusyScope busy;
+    if (pthread_mutex_trylock(&mMutex) == 0) {
+        onLockAcquired(&mMutex, mName, nullptr);
+        return;
+    }
+    LockWait wait;
+    // Skip this function.
+    beginLockWait(wait, 1);
+    pthread_mutex_lock(&mMutex);
+    onLockAcquired(&mMutex, mName, &wait);
+}
+
+bool ProfiledMutex::try_lock() {
+    bool profile = shouldProfileLocks();
+    BusyScope busy;
+    if (pthread_mutex_trylock(&mMutex) != 0) {
+        return false;
+    }
+    if (profile) {
+        onLockAcquired(&mMutex, mName, nullptr);
+    }
+    return true;
+}
+
+void ProfiledMutex::unlock() {
+    // Even if it is stopped, end the hold started.
+    onLockReleased(&mMutex);
+    BusyScope busy;
+    pthread_mutex_unlock(&mMutex);
+}
+
+std::string summarizeLockProfile() {
+    BusyScope busy;
+    std::lock_guard<std::mutex> reportLock(s_reportMutex);
+    std::vector<LockDelta> deltas;
+    for (size_t i = 0; i < MAX_LOCKS; i++) {
+        LockRecord* record = s_lockRecords[i].load(std::memory_order_acquire);
+        if (!record) {
+            continue;
+        }
+        LockDelta delta;
+        delta.mLock = record;
+        uint64_t acquisitions = record->mAcquisitions.load(std::memory_order_relaxed);
+        delta.mAcquisitions = acquisitions - record->mAcquisitionsFlushed;
+        record->mAcquisitionsFlushed = acquisitions;
+        adhocperf::Ticks holdTicks = record->mHoldTicks.load(std::memory_order_relaxed);
+        delta.mHoldTicks = holdTicks - record->mHoldTicksFlushed;
+        record->mHoldTicksFlushed = holdTicks;
+        record->mWaitHistogram.collect(record->mWaitFlushed, delta.mWait);
+        if (delta.mWait.mCount) {
+            deltas.push_back(delta);
+        }
+    }
+    if (deltas.empty()) {
+        return "";
+    }
+    std::sort(deltas.begin(), deltas.end(), [](const LockDelta& a, const LockDelta& b) {
+        return a.mWait.mSum > b.mWait.mSum;
+    });
+
+    // The stacks of the locks reported, by the wait since the last report.
+    std::unordered_map<LockRecord*, std::vector<std::pair<adhocperf::Ticks, StackRecord*>>> stacksByLock;
+    {
+        std::lock_guard<std::mutex> guard(s_stackMutex);
+        if (s_stacks) {
+            for (auto& entry : *s_stacks) {
+                StackRecord* stack = entry.second;
+                adhocperf::Ticks waitTicks = stack->mWaitTicks - stack->mWaitTicksFlushed;
+                uint64_t count = stack->mCount - stack->mCountFlushed;
+                stack->mWaitTicksFlushed = stack->mWaitTicks;
+                stack->mCountFlushed = stack->mCount;
+                if (count) {
+                    stacksByLock[stack->mLock].emplace_back(waitTicks, stack);
+                }
+            }
+        }
+    }
+
+    std::string out = "lock contention:";
+    char line[256];
+    for (size_t i = 0; i < deltas.size() && i < REPORT_TOP; i++) {
+        const LockDelta& delta = deltas[i];
+        double count = delta.mAcquisitions ? (double)delta.mAcquisitions : 1;
+        snprintf(line, sizeof(line), "\n  %s: {acquisitions: %llu, contended: %llu (%.1f%%), wait: %f ms, contended p99 wait: %f ms,"
+                " max wait: %f ms, hold: %f ms, average hold: %f ms}",
+                lockName(*delta.mLock).c_str(), (unsigned long long)delta.mAcquisitions,
+                (unsigned long long)delta.mWait.mCount, (double)delta.mWait.mCount * 100 / count,
+                ticksToMillis((double)delta.mWait.mSum), ticksToMillis((double)delta.mWait.percentile(99)),
+                ticksToMillis((double)delta.mWait.max()), ticksToMillis((double)delta.mHoldTicks),
+                ticksToMillis((double)delta.mHoldTicks / count));
+        out += line;
+        auto& stacks = stacksByLock[delta.mLock];
+        std::sort(stacks.begin(), stacks.end(), [](const std::pair<adhocperf::Ticks, StackRecord*>& a,
+                const std::pair<adhocperf::Ticks, StackRecord*>& b) {
+            return a.first > b.first;
+        });
+        for (size_t j = 0; j < stacks.size() && j < REPORT_STACKS; j++) {
+            StackRecord* stack = stacks[j].second;
+            snprintf(line, sizeof(line), "\n    wait: %f ms @", ticksToMillis((double)stacks[j].first));
+            out += line;
+            for (uint32_t frame = 0; frame < stack->mBacktrace.mCount && frame < REPORT_FRAMES; frame++) {
+                out += frame ? " < " : " ";
+                out += foldedFrameName(reinterpret_cast<uintptr_t>(stack->mBacktrace.mPcs[frame]));
+            }
+        }
+    }
+    return out;
+}
+
+} // end of namespace adhocprofiler
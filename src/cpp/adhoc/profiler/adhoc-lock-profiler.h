@@ -0,0 +1,90 @@
+/// A lock contention profiler, which tells how long threads wait for each lock (and hold
+/// it), and from where they wait.
+///
+/// [Usage]
+/// Replace `std::mutex` by `adhocprofiler::ProfiledMutex`, or add `adhoc-lock-interpose.cpp`
+/// to the sources to interpose `pthread_mutex_lock` (and so `std::mutex`) of the .so (or
+/// executable) it is linked into. A .so loaded by `dlopen` (like by `System.loadLibrary`) is
+/// not in the global lookup scope, which the dynamic linker searches first, so its calls are
+/// bound to libc and nothing is profiled, unless it is linked with `-Wl,-Bsymbolic-functions`
+/// (see `resource/adhoc-tools.cmake`). The locks taken in libc and other libraries are
+/// never seen by the interposer.
+/// ```cpp
+/// #include "adhoc/profiler/adhoc-lock-profiler.h"
+///
+/// adhocprofiler::ProfiledMutex s_bridgeMutex("bridge");
+/// // ...
+/// adhocprofiler::startLockProfiler();
+/// adhocperf::addPerfReporter(adhocprofiler::summarizeLockProfile);
+/// // ...
+/// adhocperf::summarizeAndPrintPerf();
+/// ```
+///
+/// Every acquisition first tries the lock. Only if it is taken (contended) is the wait
+/// timed, and the stack captured (while waiting anyway). The statistics of a lock are
+/// written only by the thread holding it, so they need no lock of their own.
+/// Locks are identified by address: a lock destroyed and another one created at the same
+/// address are merged. Recursive mutexes re-locked by the owner count the hold time of
+/// the inner ones twice. With the interposer, the hold time does not include the waits in
+/// `pthread_cond_wait` (and `timedwait`, `clockwait`).
+
+#ifndef _ADHOC_TOOLS_LOCK_PROFILER_H_
+#define _ADHOC_TOOLS_LOCK_PROFILER_H_
+
+#include <cstdint>
+#include <string>
+#include <pthread.h>
+
+#include "config.h"
+#include "../ndk-backtrace/adhoc-backtrace.h"
+
+namespace adhocprofiler {
+
+extern void startLockProfiler();
+extern void stopLockProfiler();
+
+/// A drop-in replacement of `std::mutex` (it meets `Lockable`), which is profiled while the
+/// lock profiler is started, named in the report.
+class ProfiledMutex {
+  public:
+    /// @param name for the report, not copied (usually a string literal), can be null.
+    explicit ProfiledMutex(const char* name = nullptr): mName(name) {}
+    ~ProfiledMutex() { pthread_mutex_destroy(&mMutex); }
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+    pthread_mutex_t* native_handle() { return &mMutex; }
+
+  private:
+    pthread_mutex_t mMutex = PTHREAD_MUTEX_INITIALIZER;
+    const char* mName;
+};
+
+/// The hooks for other kinds of locks, see `ProfiledMutex::lock()` for how they are called.
+struct LockWait {
+    uint64_t mStartTicks;
+    adhocbacktrace::Backtrace mBacktrace;
+};
+/// False if not started, or in the profiler itself (so it never profiles its own locks).
+extern bool shouldProfileLocks();
+/// Called when the lock is found taken, right before blocking.
+/// @param skipFrames the count of the innermost callers not to capture in the stack, like
+/// the interposed `pthread_mutex_lock` or `ProfiledMutex::lock()` calling it.
+extern void beginLockWait(LockWait& wait, int skipFrames = 0);
+/// Called after the lock is taken.
+/// @param wait null if it was not contended.
+extern void onLockAcquired(const void* lock, const char* name, const LockWait* wait);
+/// Called before the lock is released.
+extern void onLockReleased(const void* lock);
+
+/// The worst locks since the last summary by the total wait (see
+/// `_ADHOC_TOOLS_PROFILER_LOCK_REPORT_TOP_`), with the p99 of the contended waits, the hold
+/// time, and the stacks waiting most. For `adhocperf::addPerfReporter`.
+extern std::string summarizeLockProfile();
+
+} // end of namespace adhocprofiler
+
+#endif // _ADHOC_TOOLS_LOCK_PROFILER_H_
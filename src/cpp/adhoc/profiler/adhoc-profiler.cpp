@@ -0,0 +1,679 @@
+#include "adhoc-profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "folded-stacks.h"
+#include "../ndk-backtrace/adhoc-backtrace.h"
+#include _ADHOC_TOOLS_PROFILER_LOG_INCLUDE_
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace adhocprofiler {
+
+namespace {
+
+const size_t MAX_FRAMES = _ADHOC_TOOLS_PROFILER_MAX_FRAMES_;
+const uint64_t RING_CAPACITY = _ADHOC_TOOLS_PROFILER_RING_CAPACITY_;
+const int AGGREGATE_INTERVAL_MS = _ADHOC_TOOLS_PROFILER_AGGREGATE_INTERVAL_MS_;
+/// The max count of threads profiled at the same time.
+const uint32_t MAX_THREADS = 1024;
+const size_t CACHE_LINE_SIZE = 64;
+/// In the high bits of the value of the timer signals, to tell them from the `SIGPROF` of
+/// other timers. The low bits are the index of the thread profile.
+const int SIGNAL_VALUE_MAGIC = 0x5a0b0000;
+const int SIGNAL_VALUE_MAGIC_MASK = (int)0xffff0000;
+
+static_assert((RING_CAPACITY & (RING_CAPACITY - 1)) == 0, "Ring capacity should be power of 2");
+static_assert(MAX_THREADS <= 0x10000, "The index of the thread profile should fit in 16 bits");
+
+struct Sample {
+    uint32_t mCount;
+    /// The count of timer periods the sample stands for, see `onProfileSignal`.
+    uint32_t mWeight;
+    void* mPcs[MAX_FRAMES];
+};
+
+/// The sampling state of a thread, with a single-producer (the signal handler in the thread)
+/// / single-consumer (the aggregation) ring buffer.
+/// Never freed, since a signal of a deleted timer may still be pending. Reused by later
+/// threads instead, and the handler checks the thread id.
+struct ThreadProfile {
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mWritten{0};
+    /// Only written by the signal handler.
+    std::atomic<uint64_t> mDropped{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mRead{0};
+    /// 0 if the profile is free.
+    std::atomic<pid_t> mTid{0};
+    /// The fields below are guarded by `s_mutex`.
+    uint32_t mIndex = 0;
+    bool mRegistered = false;
+    bool mHasTimer = false;
+    timer_t mTimer;
+    uint64_t mDroppedAggregated = 0;
+    /// Index of `s_threadNames`.
+    uint32_t mThreadName = 0;
+    alignas(CACHE_LINE_SIZE) Sample mSamples[RING_CAPACITY];
+};
+
+std::atomic<ThreadProfile*> s_profiles[MAX_THREADS];
+/// The count of `s_profiles` allocated.
+uint32_t s_profileCount = 0;
+
+std::atomic<bool> s_sampling{false};
+bool s_allThreads = false;
+int64_t s_intervalNanos = 1000000000 / _ADHOC_TOOLS_PROFILER_FREQUENCY_HZ_;
+struct sigaction s_previousAction;
+
+/// Guards the profiles (except the ring buffers) and the aggregated stacks.
+std::mutex s_mutex;
+std::thread s_aggregateThread;
+std::mutex s_aggregateMutex;
+std::condition_variable s_aggregateCondition;
+bool s_stopRequested = false;
+
+/// The first element is the index of the thread name, followed by pcs, the innermost first.
+typedef std::vector<uintptr_t> StackKey;
+struct StackKeyHash {
+    size_t operator()(const StackKey& key) const {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uintptr_t value : key) {
+            hash = (hash ^ (uint64_t)value) * 0x100000001b3ULL;
+        }
+        return (size_t)(hash ^ (hash >> 32));
+    }
+};
+std::unordered_map<StackKey, uint64_t, StackKeyHash> s_stacks;
+std::vector<std::string> s_threadNames;
+std::unordered_map<std::string, uint32_t> s_threadNameIndices;
+uint64_t s_sampleCount = 0;
+uint64_t s_droppedCount = 0;
+int64_t s_profileStartNanos = 0;
+
+int64_t realtimeNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+pid_t currentTid() {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+/// The CPU-time clock of another thread of the process, like `CLOCK_THREAD_CPUTIME_ID` in
+/// the thread itself (`MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED)` of the kernel).
+clockid_t threadCpuClock(pid_t tid) {
+    return (clockid_t)((~(unsigned)tid << 3) | 6);
+}
+
+void onProfileSignal(int sigNum, siginfo_t* sigInfo, void* ucontext) {
+    int value = sigInfo->si_value.sival_int;
+    if (sigInfo->si_code != SI_TIMER || (value & SIGNAL_VALUE_MAGIC_MASK) != SIGNAL_VALUE_MAGIC) {
+        // Not ours.
+        if (s_previousAction.sa_flags & SA_SIGINFO) {
+            if (s_previousAction.sa_sigaction) {
+                s_previousAction.sa_sigaction(sigNum, sigInfo, ucontext);
+            }
+        }
+        else if (s_previousAction.sa_handler != SIG_DFL && s_previousAction.sa_handler != SIG_IGN) {
+            s_previousAction.sa_handler(sigNum);
+        }
+        return;
+    }
+    uint32_t index = (uint32_t)(value & ~SIGNAL_VALUE_MAGIC_MASK);
+    ThreadProfile* profile = index < MAX_THREADS ? s_profiles[index].load(std::memory_order_acquire) : nullptr;
+    if (!profile || !s_sampling.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int savedErrno = errno;
+    // The signal of a deleted timer may arrive after the profile is reused by another thread.
+    if (profile->mTid.load(std::memory_order_relaxed) == currentTid()) {
+        // The expirations while the signal was pending are merged into it (`si_overrun`), which
+        // is common at high frequencies, the sample stands for all of them.
+        uint32_t weight = 1 + (uint32_t)(sigInfo->si_overrun > 0 ? sigInfo->si_overrun : 0);
+        uint64_t written = profile->mWritten.load(std::memory_order_relaxed);
+        if (written - profile->mRead.load(std::memory_order_acquire) >= RING_CAPACITY) {
+            profile->mDropped.store(profile->mDropped.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+        }
+        else {
+            Sample& sample = profile->mSamples[written & (RING_CAPACITY - 1)];
+            sample.mCount = (uint32_t)adhocbacktrace::captureInterruptedBacktrace(ucontext, sample.mPcs, MAX_FRAMES);
+            sample.mWeight = weight;
+            profile->mWritten.store(written + 1, std::memory_order_release);
+        }
+    }
+    errno = savedErrno;
+}
+
+uint32_t internThreadName(const std::string& name) {
+    auto found = s_threadNameIndices.find(name);
+    if (found != s_threadNameIndices.end()) {
+        return found->second;
+    }
+    uint32_t index = (uint32_t)s_threadNames.size();
+    s_threadNames.push_back(name);
+    s_threadNameIndices.emplace(name, index);
+    return index;
+}
+
+std::string readThreadName(pid_t tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", (int)tid);
+    char name[32] = "";
+    FILE* file = fopen(path, "re");
+    if (file) {
+        if (fgets(name, sizeof(name), file)) {
+            name[strcspn(name, "\n")] = '\0';
+        }
+        fclose(file);
+    }
+    return name[0] ? std::string(name) : "tid-" + std::to_string((int)tid);
+}
+
+/// Move the samples of the ring buffer into `s_stacks`. Locked by `s_mutex`.
+void aggregateProfile(ThreadProfile* profile) {
+    uint64_t read = profile->mRead.load(std::memory_order_relaxed);
+    uint64_t written = profile->mWritten.load(std::memory_order_acquire);
+    StackKey key;
+    for (; read < written; read++) {
+        const Sample& sample = profile->mSamples[read & (RING_CAPACITY - 1)];
+        if (sample.mCount == 0) {
+            continue;
+        }
+        key.assign(1, profile->mThreadName);
+        for (uint32_t i = 0; i < sample.mCount; i++) {
+            key.push_back(reinterpret_cast<uintptr_t>(sample.mPcs[i]));
+        }
+        s_stacks[key] += sample.mWeight;
+        s_sampleCount += sample.mWeight;
+    }
+    profile->mRead.store(written, std::memory_order_release);
+    uint64_t dropped = profile->mDropped.load(std::memory_order_relaxed);
+    s_droppedCount += dropped - profile->mDroppedAggregated;
+    profile->mDroppedAggregated = dropped;
+}
+
+void aggregateAll() {
+    for (uint32_t i = 0; i < s_profileCount; i++) {
+        aggregateProfile(s_profiles[i].load(std::memory_order_relaxed));
+    }
+}
+
+/// @param isCurrentThread use `CLOCK_THREAD_CPUTIME_ID` rather than the clock by tid.
+bool createTimer(ThreadProfile* profile, bool isCurrentThread) {
+    if (profile->mHasTimer) {
+        return true;
+    }
+    pid_t tid = profile->mTid.load(std::memory_order_relaxed);
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = tid;
+    event.sigev_value.sival_int = SIGNAL_VALUE_MAGIC | (int)profile->mIndex;
+    if (timer_create(isCurrentThread ? CLOCK_THREAD_CPUTIME_ID : threadCpuClock(tid), &event, &profile->mTimer) != 0) {
+        return false;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = (time_t)(s_intervalNanos / 1000000000);
+    spec.it_interval.tv_nsec = (long)(s_intervalNanos % 1000000000);
+    spec.it_value = spec.it_interval;
+    if (timer_settime(profile->mTimer, 0, &spec, nullptr) != 0) {
+        timer_delete(profile->mTimer);
+        return false;
+    }
+    profile->mHasTimer = true;
+    return true;
+}
+
+void deleteTimer(ThreadProfile* profile) {
+    if (profile->mHasTimer) {
+        timer_delete(profile->mTimer);
+        profile->mHasTimer = false;
+    }
+}
+
+ThreadProfile* findProfile(pid_t tid) {
+    for (uint32_t i = 0; i < s_profileCount; i++) {
+        ThreadProfile* profile = s_profiles[i].load(std::memory_order_relaxed);
+        if (profile->mTid.load(std::memory_order_relaxed) == tid) {
+            return profile;
+        }
+    }
+    return nullptr;
+}
+
+/// Take a free profile (or allocate one) for the thread. Locked by `s_mutex`.
+ThreadProfile* acquireProfile(pid_t tid, const std::string& threadName) {
+    ThreadProfile* profile = nullptr;
+    for (uint32_t i = 0; i < s_profileCount && !profile; i++) {
+        ThreadProfile* candidate = s_profiles[i].load(std::memory_order_relaxed);
+        if (candidate->mTid.load(std::memory_order_relaxed) == 0) {
+            profile = candidate;
+        }
+    }
+    if (!profile) {
+        if (s_profileCount >= MAX_THREADS) {
+            return nullptr;
+        }
+        profile = new ThreadProfile();
+        profile->mIndex = s_profileCount;
+        s_profiles[s_profileCount++].store(profile, std::memory_order_release);
+    }
+    profile->mThreadName = internThreadName(threadName);
+    profile->mRegistered = false;
+    profile->mTid.store(tid, std::memory_order_relaxed);
+    return profile;
+}
+
+/// Locked by `s_mutex`.
+void releaseProfile(ThreadProfile* profile) {
+    deleteTimer(profile);
+    // Keep the samples taken, before the profile is reused.
+    aggregateProfile(profile);
+    profile->mRegistered = false;
+    profile->mTid.store(0, std::memory_order_relaxed);
+}
+
+/// Release the profiles of the threads exited, and (if profiling all threads) take the new
+/// threads. Locked by `s_mutex`.
+void updateThreads() {
+    pid_t pid = getpid();
+    for (uint32_t i = 0; i < s_profileCount; i++) {
+        ThreadProfile* profile = s_profiles[i].load(std::memory_order_relaxed);
+        pid_t tid = profile->mTid.load(std::memory_order_relaxed);
+        if (tid && syscall(SYS_tgkill, pid, tid, 0) != 0 && errno == ESRCH) {
+            releaseProfile(profile);
+        }
+    }
+    if (!s_allThreads) {
+        return;
+    }
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+        return;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        pid_t tid = (pid_t)atoi(entry->d_name);
+        if (tid <= 0 || findProfile(tid)) {
+            continue;
+        }
+        ThreadProfile* profile = acquireProfile(tid, readThreadName(tid));
+        if (profile && !createTimer(profile, false)) {
+            // Exited already.
+            releaseProfile(profile);
+        }
+    }
+    closedir(dir);
+}
+
+void aggregateLoop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(s_aggregateMutex);
+            if (s_aggregateCondition.wait_for(lock, std::chrono::milliseconds(AGGREGATE_INTERVAL_MS),
+                    [] { return s_stopRequested; })) {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> lock(s_mutex);
+        updateThreads();
+        aggregateAll();
+    }
+}
+
+/// A minimal protobuf writer, enough for `profile.proto`.
+class ProtoWriter {
+  public:
+    void varint(uint64_t value) {
+        while (value >= 0x80) {
+            mData += (char)(value | 0x80);
+            value >>= 7;
+        }
+        mData += (char)value;
+    }
+    void uint64Field(uint32_t field, uint64_t value) {
+        varint((uint64_t)field << 3);
+        varint(value);
+    }
+    void bytesField(uint32_t field, const std::string& value) {
+        varint(((uint64_t)field << 3) | 2);
+        varint(value.size());
+        mData += value;
+    }
+    void packedField(uint32_t field, const std::vector<uint64_t>& values) {
+        ProtoWriter packed;
+        for (uint64_t value : values) {
+            packed.varint(value);
+        }
+        bytesField(field, packed.mData);
+    }
+    const std::string& data() const { return mData; }
+  private:
+    std::string mData;
+};
+
+class StringTable {
+  public:
+    StringTable() { intern(""); }
+    uint64_t intern(const std::string& str) {
+        auto found = mIndices.find(str);
+        if (found != mIndices.end()) {
+            return found->second;
+        }
+        uint64_t index = mStrings.size();
+        mStrings.push_back(str);
+        mIndices.emplace(str, index);
+        return index;
+    }
+    const std::vector<std::string>& strings() const { return mStrings; }
+  private:
+    std::vector<std::string> mStrings;
+    std::unordered_map<std::string, uint64_t> mIndices;
+};
+
+/// The address ranges of the mapped files, by path.
+std::map<std::string, std::pair<uint64_t, uint64_t>> readMappedRanges() {
+    std::map<std::string, std::pair<uint64_t, uint64_t>> ranges;
+    FILE* maps = fopen("/proc/self/maps", "re");
+    if (!maps) {
+        return ranges;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long long start = 0;
+        unsigned long long end = 0;
+        int pathOffset = 0;
+        if (sscanf(line, "%llx-%llx %*s %*s %*s %*s %n", &start, &end, &pathOffset) < 2 || line[pathOffset] != '/') {
+            continue;
+        }
+        std::string path(line + pathOffset);
+        path.erase(path.find_last_not_of("\n") + 1);
+        auto inserted = ranges.emplace(path, std::make_pair((uint64_t)start, (uint64_t)end));
+        if (!inserted.second) {
+            inserted.first->second.first = std::min(inserted.first->second.first, (uint64_t)start);
+            inserted.first->second.second = std::max(inserted.first->second.second, (uint64_t)end);
+        }
+    }
+    fclose(maps);
+    return ranges;
+}
+
+} // end of anonymous namespace
+
+
+bool startProfiler(int frequencyHz, bool allThreads) {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (s_sampling.load(std::memory_order_relaxed) || frequencyHz <= 0) {
+        return false;
+    }
+    s_intervalNanos = 1000000000 / frequencyHz;
+    s_allThreads = allThreads;
+    if (!s_profileStartNanos) {
+        s_profileStartNanos = realtimeNanos();
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = onProfileSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    if (sigaction(SIGPROF, &action, &s_previousAction) != 0) {
+        return false;
+    }
+    s_sampling.store(true, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < s_profileCount; i++) {
+        ThreadProfile* profile = s_profiles[i].load(std::memory_order_relaxed);
+        if (profile->mTid.load(std::memory_order_relaxed) && !createTimer(profile, false)) {
+            releaseProfile(profile);
+        }
+    }
+    updateThreads();
+    {
+        std::lock_guard<std::mutex> aggregateLock(s_aggregateMutex);
+        s_stopRequested = false;
+    }
+    s_aggregateThread = std::thread(aggregateLoop);
+    _ADHOC_TOOLS_PROFILER_LOG_("adhoc profiler: started at %d Hz%s", frequencyHz, allThreads ? " (all threads)" : "");
+    return true;
+}
+
+void stopProfiler() {
+    if (!s_sampling.load(std::memory_order_relaxed)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> aggregateLock(s_aggregateMutex);
+        s_stopRequested = true;
+    }
+    s_aggregateCondition.notify_all();
+    if (s_aggregateThread.joinable()) {
+        s_aggregateThread.join();
+    }
+    std::lock_guard<std::mutex> lock(s_mutex);
+    for (uint32_t i = 0; i < s_profileCount; i++) {
+        ThreadProfile* profile = s_profiles[i].load(std::memory_order_relaxed);
+        deleteTimer(profile);
+        // The threads found in `/proc/self/task` are found again at the next start.
+        if (!profile->mRegistered && profile->mTid.load(std::memory_order_relaxed)) {
+            releaseProfile(profile);
+        }
+    }
+    s_sampling.store(false, std::memory_order_relaxed);
+    // Pending signals are still ours, ignore them before restoring the previous handler.
+    aggregateAll();
+    sigaction(SIGPROF, &s_previousAction, nullptr);
+    _ADHOC_TOOLS_PROFILER_LOG_("adhoc profiler: stopped, %llu samples (%llu dropped)",
+            (unsigned long long)s_sampleCount, (unsigned long long)s_droppedCount);
+}
+
+bool registerThread() {
+    adhocbacktrace::initThreadStackBounds();
+    char name[17] = "";
+    prctl(PR_GET_NAME, name);
+    pid_t tid = currentTid();
+    std::lock_guard<std::mutex> lock(s_mutex);
+    ThreadProfile* profile = findProfile(tid);
+    if (!profile) {
+        profile = acquireProfile(tid, name[0] ? std::string(name) : "tid-" + std::to_string((int)tid));
+        if (!profile) {
+            return false;
+        }
+    }
+    profile->mRegistered = true;
+    if (s_sampling.load(std::memory_order_relaxed) && !createTimer(profile, true)) {
+        releaseProfile(profile);
+        return false;
+    }
+    return true;
+}
+
+void unregisterThread() {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    ThreadProfile* profile = findProfile(currentTid());
+    if (profile) {
+        releaseProfile(profile);
+    }
+}
+
+void resetProfile() {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    aggregateAll();
+    s_stacks.clear();
+    s_sampleCount = 0;
+    s_droppedCount = 0;
+    s_profileStartNanos = realtimeNanos();
+}
+
+void formatFoldedStacks(std::string& out) {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    aggregateAll();
+    std::unordered_map<uintptr_t, std::string> names;
+    // Different pcs in the same function make the same line, merge them. Sorted by the line.
+    std::map<std::string, uint64_t> lines;
+    for (auto& stack : s_stacks) {
+        const StackKey& key = stack.first;
+        std::string line = s_threadNames[key[0]];
+        std::replace(line.begin(), line.end(), ';', ':');
+        for (size_t i = key.size() - 1; i >= 1; i--) {
+            auto found = names.find(key[i]);
+            if (found == names.end()) {
+                found = names.emplace(key[i], foldedFrameName(key[i])).first;
+            }
+            line += ';';
+            line += found->second;
+        }
+        lines[line] += stack.second;
+    }
+    for (auto& line : lines) {
+        out += line.first;
+        out += ' ';
+        out += std::to_string(line.second);
+        out += '\n';
+    }
+}
+
+bool writeFoldedStacks(const char* path) {
+    std::string out;
+    formatFoldedStacks(out);
+    return writeProfileFile(path, out);
+}
+
+void formatPprof(std::string& out) {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    aggregateAll();
+    StringTable strings;
+    ProtoWriter profile;
+
+    // sample_type: the count and the CPU time.
+    const char* valueTypes[2][2] = {{"samples", "count"}, {"cpu", "nanoseconds"}};
+    for (auto& valueType : valueTypes) {
+        ProtoWriter type;
+        type.uint64Field(1, strings.intern(valueType[0]));
+        type.uint64Field(2, strings.intern(valueType[1]));
+        profile.bytesField(1, type.data());
+    }
+
+    std::unordered_map<uintptr_t, uint64_t> locationIds;
+    std::map<std::pair<std::string, std::string>, uint64_t> functionIds;
+    std::map<std::string, uint64_t> mappingIds;
+    std::map<std::string, std::pair<uint64_t, uint64_t>> mappedRanges = readMappedRanges();
+    ProtoWriter locations;
+    ProtoWriter functions;
+    ProtoWriter mappings;
+    uint64_t threadLabelKey = strings.intern("thread");
+
+    for (auto& stack : s_stacks) {
+        const StackKey& key = stack.first;
+        std::vector<uint64_t> sampleLocations;
+        for (size_t i = 1; i < key.size(); i++) {
+            uintptr_t pc = key[i];
+            auto foundLocation = locationIds.find(pc);
+            if (foundLocation != locationIds.end()) {
+                sampleLocations.push_back(foundLocation->second);
+                continue;
+            }
+            const adhocbacktrace::SymbolInfo& info = adhocbacktrace::symbolize(reinterpret_cast<const void*>(pc));
+            uint64_t mappingId = 0;
+            if (info.mModule) {
+                auto foundMapping = mappingIds.find(info.mModule);
+                if (foundMapping == mappingIds.end()) {
+                    mappingId = mappingIds.size() + 1;
+                    mappingIds.emplace(info.mModule, mappingId);
+                    uint64_t base = pc - info.mModuleOffset;
+                    auto range = mappedRanges.find(info.mModule);
+                    ProtoWriter mapping;
+                    mapping.uint64Field(1, mappingId);
+                    mapping.uint64Field(2, range != mappedRanges.end() ? range->second.first : base);
+                    mapping.uint64Field(3, range != mappedRanges.end() ? range->second.second : pc + 1);
+                    mapping.uint64Field(5, strings.intern(info.mModule));
+                    mapping.uint64Field(7, 1); // has_functions
+                    mapping.uint64Field(8, info.mFile ? 1 : 0); // has_filenames
+                    mapping.uint64Field(9, info.mFile ? 1 : 0); // has_line_numbers
+                    mappings.bytesField(3, mapping.data());
+                }
+                else {
+                    mappingId = foundMapping->second;
+                }
+            }
+            std::string name = foldedFrameName(pc);
+            std::string file = info.mFile ? info.mFile : "";
+            auto foundFunction = functionIds.find(std::make_pair(name, file));
+            uint64_t functionId = 0;
+            if (foundFunction == functionIds.end()) {
+                functionId = functionIds.size() + 1;
+                functionIds.emplace(std::make_pair(name, file), functionId);
+                ProtoWriter function;
+                function.uint64Field(1, functionId);
+                function.uint64Field(2, strings.intern(name));
+                function.uint64Field(3, strings.intern(info.mSymbol ? info.mSymbol : name));
+                function.uint64Field(4, strings.intern(file));
+                functions.bytesField(5, function.data());
+            }
+            else {
+                functionId = foundFunction->second;
+            }
+            uint64_t locationId = locationIds.size() + 1;
+            locationIds.emplace(pc, locationId);
+            ProtoWriter line;
+            line.uint64Field(1, functionId);
+            line.uint64Field(2, info.mLine);
+            ProtoWriter location;
+            location.uint64Field(1, locationId);
+            location.uint64Field(2, mappingId);
+            location.uint64Field(3, pc);
+            location.bytesField(4, line.data());
+            locations.bytesField(4, location.data());
+            sampleLocations.push_back(locationId);
+        }
+        ProtoWriter label;
+        label.uint64Field(1, threadLabelKey);
+        label.uint64Field(2, strings.intern(s_threadNames[key[0]]));
+        ProtoWriter sample;
+        sample.packedField(1, sampleLocations);
+        sample.packedField(2, {stack.second, stack.second * (uint64_t)s_intervalNanos});
+        sample.bytesField(3, label.data());
+        profile.bytesField(2, sample.data());
+    }
+
+    std::string data = profile.data() + mappings.data() + locations.data() + functions.data();
+    ProtoWriter tail;
+    for (auto& str : strings.strings()) {
+        tail.bytesField(6, str);
+    }
+    int64_t now = realtimeNanos();
+    tail.uint64Field(9, (uint64_t)s_profileStartNanos);
+    tail.uint64Field(10, (uint64_t)(now - s_profileStartNanos));
+    ProtoWriter periodType;
+    periodType.uint64Field(1, strings.intern("cpu"));
+    periodType.uint64Field(2, strings.intern("nanoseconds"));
+    tail.bytesField(11, periodType.data());
+    tail.uint64Field(12, (uint64_t)s_intervalNanos);
+    out += data;
+    out += tail.data();
+}
+
+bool writePprof(const char* path) {
+    std::string out;
+    formatPprof(out);
+    return writeProfileFile(path, out);
+}
+
+} // end of namespace adhocprofiler
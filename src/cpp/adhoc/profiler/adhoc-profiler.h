@@ -0,0 +1,75 @@
+/// A sampling CPU profiler, cheap enough to be always on.
+///
+/// [Usage]
+/// ```cpp
+/// #include "adhoc/profiler/adhoc-profiler.h"
+///
+/// adhocprofiler::startProfiler();
+/// // In each thread to profile (or pass `allThreads` to `startProfiler`).
+/// adhocprofiler::registerThread();
+/// // ...
+/// adhocprofiler::writeFoldedStacks("/data/data/com.xxx.yyy/files/cpu.folded");
+/// adhocprofiler::writePprof("/data/data/com.xxx.yyy/files/cpu.pb");
+/// ```
+/// Then `flamegraph.pl cpu.folded > cpu.svg` (https://github.com/brendangregg/FlameGraph), or
+/// load it in https://www.speedscope.app, or `pprof -http=: cpu.pb`.
+///
+/// Each profiled thread has a timer of its own CPU time (`timer_create`), which sends
+/// `SIGPROF` to the thread itself at the frequency. The signal handler captures the
+/// interrupted stack (see `adhocbacktrace::captureInterruptedBacktrace`) into a lock-free
+/// ring buffer of the thread, and a background thread moves the samples into a table of
+/// distinct stacks. Stacks are symbolized only when the profile is written.
+/// At high frequencies the kernel may merge several expirations of the timer into one signal
+/// (the timer slack, or the thread not scheduled in time), then the sample is counted once
+/// for each of them, so the counts still add up to the CPU time.
+///
+/// Build with `-fno-omit-frame-pointer` and use `adhocbacktrace::UNWIND_BY_FRAME_POINTERS`
+/// for the lowest overhead, which is then well below 1% at the default frequency. The unwind
+/// tables also work, but cost microseconds per sample, and the unwinder may take locks, which
+/// can deadlock if it interrupts the same unwinder in the thread.
+
+#ifndef _ADHOC_TOOLS_PROFILER_H_
+#define _ADHOC_TOOLS_PROFILER_H_
+
+#include <cstdint>
+#include <string>
+
+#include "config.h"
+
+namespace adhocprofiler {
+
+/// Install the `SIGPROF` handler and start the background thread. Samples are taken only
+/// in the threads registered (or all threads if `allThreads`).
+/// @param allThreads also profile the threads not registered, which are found in
+/// `/proc/self/task` every `_ADHOC_TOOLS_PROFILER_AGGREGATE_INTERVAL_MS_`. Their frame
+/// pointers can not be checked against their stack bounds, so they are always unwound by
+/// the unwind tables.
+extern bool startProfiler(int frequencyHz = _ADHOC_TOOLS_PROFILER_FREQUENCY_HZ_, bool allThreads = false);
+
+/// Stop sampling, and restore the previous `SIGPROF` handler. The samples aggregated are kept
+/// until `resetProfile()`, so they can still be written.
+extern void stopProfiler();
+
+/// Start sampling the current thread (before or after `startProfiler`). Also finds the
+/// bounds of its stack for the frame pointer unwinder.
+extern bool registerThread();
+
+/// Stop sampling the current thread. Call it before the thread exits if it is registered.
+extern void unregisterThread();
+
+/// Drop all of the samples aggregated.
+extern void resetProfile();
+
+/// Lines of `thread;outermost;...;innermost count`, which `flamegraph.pl` and speedscope
+/// accept.
+extern void formatFoldedStacks(std::string& out);
+extern bool writeFoldedStacks(const char* path);
+
+/// The `profile.proto` of pprof (https://github.com/google/pprof/blob/main/proto/profile.proto),
+/// not gzipped (pprof accepts both), with the sample count and the CPU time of each stack.
+extern void formatPprof(std::string& out);
+extern bool writePprof(const char* path);
+
+} // end of namespace adhocprofiler
+
+#endif // _ADHOC_TOOLS_PROFILER_H_
@@ -0,0 +1,41 @@
+/// The default sampling frequency (samples per second of CPU time of each thread). Not a
+/// round number, so that it does not run in lockstep with periodic work.
+#define _ADHOC_TOOLS_PROFILER_FREQUENCY_HZ_ 99
+
+/// The max count of frames of a sample. Deeper frames (the outermost ones) are cut.
+#define _ADHOC_TOOLS_PROFILER_MAX_FRAMES_ 64
+
+/// The capacity (count of samples) of the ring buffer of each thread. Must be power of 2.
+/// Each sample takes `8 * (_ADHOC_TOOLS_PROFILER_MAX_FRAMES_ + 1)` bytes. If the aggregation
+/// thread can not catch up, new samples are dropped (and counted).
+#define _ADHOC_TOOLS_PROFILER_RING_CAPACITY_ 64
+
+/// How often the background thread moves the samples from the ring buffers into the
+/// aggregated stacks, and (if profiling all threads) looks for new threads.
+#define _ADHOC_TOOLS_PROFILER_AGGREGATE_INTERVAL_MS_ 100
+
+/// The mean count of bytes allocated between two samples of the heap profiler (see
+/// `adhoc-heap-profiler.h`) by default. Each allocation is sampled with the probability of
+/// `1 - exp(-size / interval)`, so large ones are always sampled.
+#define _ADHOC_TOOLS_PROFILER_HEAP_SAMPLE_INTERVAL_ (512 * 1024)
+
+/// The max count of sampled allocations alive at the same time (must be power of 2). Samples
+/// beyond it are dropped (and counted). Each one takes 32 bytes, allocated statically.
+#define _ADHOC_TOOLS_PROFILER_HEAP_MAX_LIVE_SAMPLES_ 16384
+
+/// The count of stacks in `adhocprofiler::summarizeHeapProfile()`.
+#define _ADHOC_TOOLS_PROFILER_HEAP_REPORT_TOP_ 10
+
+/// The max count of distinct locks profiled by the lock profiler (see
+/// `adhoc-lock-profiler.h`). Each one takes about 1.5KB, allocated at its first use.
+#define _ADHOC_TOOLS_PROFILER_LOCK_MAX_LOCKS_ 4096
+
+/// The count of locks in `adhocprofiler::summarizeLockProfile()`, and the count of stacks
+/// shown for each of them.
+#define _ADHOC_TOOLS_PROFILER_LOCK_REPORT_TOP_ 10
+#define _ADHOC_TOOLS_PROFILER_LOCK_REPORT_STACKS_ 3
+
+/// The log implementation, see `_ADHOC_TOOLS_PERF_LOG_` in `adhoc/perf/config.h`.
+#define _ADHOC_TOOLS_PROFILER_LOG_INCLUDE_ "../log/adhoc-log.h"
+#define _ADHOC_TOOLS_PROFILER_LOG_(...) \
+   ::adhoclog::logPrint(::adhoclog::LOG_LEVEL_INFO, "adhoc", __VA_ARGS__)
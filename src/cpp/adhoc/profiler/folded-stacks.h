@@ -0,0 +1,52 @@
+/// Helpers shared by the profilers to write their outputs. Not a public API.
+
+#ifndef _ADHOC_TOOLS_PROFILER_FOLDED_STACKS_H_
+#define _ADHOC_TOOLS_PROFILER_FOLDED_STACKS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "config.h"
+#include "../ndk-backtrace/adhoc-backtrace.h"
+#include _ADHOC_TOOLS_PROFILER_LOG_INCLUDE_
+
+namespace adhocprofiler {
+
+/// The name of a frame in the folded stacks: the demangled function, or else like
+/// `libxxx.so+0x1234`, which can still be resolved by `addr2line`.
+inline std::string foldedFrameName(uintptr_t pc) {
+    const adhocbacktrace::SymbolInfo& info = adhocbacktrace::symbolize(reinterpret_cast<const void*>(pc));
+    std::string name;
+    if (info.mDemangled) {
+        name = info.mDemangled;
+    }
+    else {
+        const char* module = info.mModule ? strrchr(info.mModule, '/') : nullptr;
+        module = module ? module + 1 : (info.mModule ? info.mModule : "?");
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%zx", (size_t)info.mModuleOffset);
+        name = std::string(module) + offset;
+    }
+    // They separate frames and lines in the folded stacks.
+    std::replace(name.begin(), name.end(), ';', ':');
+    std::replace(name.begin(), name.end(), '\n', ' ');
+    return name;
+}
+
+inline bool writeProfileFile(const char* path, const std::string& content) {
+    FILE* file = fopen(path, "we");
+    if (!file) {
+        _ADHOC_TOOLS_PROFILER_LOG_("adhoc profiler: can not open %s", path);
+        return false;
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), file) == content.size();
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+} // end of namespace adhocprofiler
+
+#endif // _ADHOC_TOOLS_PROFILER_FOLDED_STACKS_H_
@@ -0,0 +1,93 @@
+#ifndef _ADHOC_TOOLS_PROFILER_THREAD_STATE_H_
+#define _ADHOC_TOOLS_PROFILER_THREAD_STATE_H_
+
+#include <atomic>
+#include <pthread.h>
+
+namespace adhocprofiler {
+
+namespace {
+
+/// The threads creating their states at the same time, more of them wait for the next time.
+const int MAX_CREATING_THREADS = 16;
+
+/// The state of each thread of the heap and lock profilers, kept by `pthread_getspecific`
+/// rather than `thread_local`. The profilers are built into .so files loaded by `dlopen`,
+/// where `thread_local` is either emulated (which allocates at the first access in each
+/// thread) or in the dynamic TLS (which may allocate too), and the initial-exec TLS model
+/// is refused by bionic. So the first access may call `malloc` or lock, which are interposed
+/// and come back to the profilers.
+/// It is created at the first `get()` in each thread, and freed when the thread exits. While
+/// it is being created (or if it can not be), `get()` returns null, so the allocations and
+/// locks of the creation itself are not profiled.
+/// Only defined at namespace scope, which is zero-initialized before any code runs.
+template <typename State>
+class ThreadState {
+  public:
+    State* get() {
+        int keyStatus = mKeyStatus.load(std::memory_order_acquire);
+        if (keyStatus != KEY_CREATED) {
+            if (keyStatus != KEY_NONE || !createKey()) {
+                return nullptr;
+            }
+        }
+        State* state = static_cast<State*>(pthread_getspecific(mKey));
+        return state ? state : create();
+    }
+
+  private:
+    enum KeyStatus {
+        KEY_NONE = 0,
+        KEY_CREATING,
+        KEY_CREATED,
+        KEY_FAILED,
+    };
+
+    static void destroy(void* state) {
+        delete static_cast<State*>(state);
+    }
+
+    __attribute__((noinline)) bool createKey() {
+        int keyStatus = KEY_NONE;
+        if (!mKeyStatus.compare_exchange_strong(keyStatus, KEY_CREATING, std::memory_order_acquire)) {
+            return false;
+        }
+        bool created = pthread_key_create(&mKey, destroy) == 0;
+        mKeyStatus.store(created ? KEY_CREATED : KEY_FAILED, std::memory_order_release);
+        return created;
+    }
+
+    __attribute__((noinline)) State* create() {
+        pthread_t self = pthread_self();
+        for (std::atomic<pthread_t>& creating : mCreatingThreads) {
+            if (creating.load(std::memory_order_relaxed) == self) {
+                // Called back from the creation below.
+                return nullptr;
+            }
+        }
+        for (std::atomic<pthread_t>& creating : mCreatingThreads) {
+            pthread_t empty = pthread_t();
+            if (!creating.compare_exchange_strong(empty, self, std::memory_order_relaxed)) {
+                continue;
+            }
+            State* state = new State();
+            if (pthread_setspecific(mKey, state) != 0) {
+                delete state;
+                state = nullptr;
+            }
+            creating.store(pthread_t(), std::memory_order_relaxed);
+            return state;
+        }
+        return nullptr;
+    }
+
+    std::atomic<int> mKeyStatus;
+    pthread_key_t mKey;
+    std::atomic<pthread_t> mCreatingThreads[MAX_CREATING_THREADS];
+};
+
+} // end of anonymous namespace
+
+} // end of namespace adhocprofiler
+
+#endif // _ADHOC_TOOLS_PROFILER_THREAD_STATE_H_
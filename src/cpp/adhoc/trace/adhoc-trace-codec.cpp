@@ -0,0 +1,557 @@
+#include "adhoc-trace-codec.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace adhoctrace {
+
+namespace {
+
+enum OpKind : uint8_t {
+    OP_DEFINE_STRING = 0,
+    OP_BEGIN = 1,
+    OP_END = 2,
+    OP_END_OF_OPEN_SPAN = 3,
+};
+const uint8_t OP_KIND_MASK = 0x3;
+const uint8_t OP_FLAG_STRING_TRACE_ID = 1 << 2;
+const uint8_t OP_FLAG_HAS_EXT = 1 << 3;
+const uint8_t OP_FLAG_SAME_THREAD = 1 << 4;
+const uint8_t OP_FLAG_SAME_TAG = 1 << 5;
+const uint8_t OP_FLAG_TIMED_RANDOM_TRACE_ID = 1 << 6;
+
+/// The digits of `Math.random()` fit in `uint64_t`.
+const uint64_t MAX_RANDOM_DIGIT_COUNT = 19;
+
+const uint32_t NO_STRING = UINT32_MAX;
+
+const char TEXT_DELIMITER[] = "^_^";
+const size_t TEXT_DELIMITER_LENGTH = sizeof(TEXT_DELIMITER) - 1;
+const char TEXT_RECORD_SUFFIX[] = "]-o-o-";
+const size_t TEXT_RECORD_SUFFIX_LENGTH = sizeof(TEXT_RECORD_SUFFIX) - 1;
+
+inline void writeVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+inline uint64_t zigzagEncode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+inline bool readVarint(const uint8_t*& cursor, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (cursor >= end) {
+            return false;
+        }
+        uint8_t byte = *cursor++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Canonical decimal (no leading zeros, fits in 63 bits), so that it can be restored exactly.
+bool parseNumericTraceId(const std::string& str, uint64_t& value) {
+    if (str.empty() || str.size() > 18 || (str[0] == '0' && str.size() > 1)) {
+        return false;
+    }
+    value = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (uint64_t)(c - '0');
+    }
+    return true;
+}
+
+/// The trace id of `src/js/trace/trace.js`: `<milliseconds>_0.<digits>`, where the milliseconds
+/// are canonical decimal and usually the same as the timestamp of the begin event.
+/// @param head output zigzag(milliseconds - event milliseconds) * 20 + digit count.
+bool encodeTimedRandomTraceId(const std::string& str, int64_t timestampNanos, uint64_t& head, uint64_t& digits) {
+    size_t separator = str.find("_0.");
+    uint64_t millis;
+    if (separator == std::string::npos || !parseNumericTraceId(str.substr(0, separator), millis)) {
+        return false;
+    }
+    uint64_t digitCount = str.size() - (separator + 3);
+    if (digitCount == 0 || digitCount > MAX_RANDOM_DIGIT_COUNT) {
+        return false;
+    }
+    digits = 0;
+    for (size_t i = separator + 3; i < str.size(); i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        digits = digits * 10 + (uint64_t)(str[i] - '0');
+    }
+    uint64_t millisDelta = zigzagEncode((int64_t)millis - timestampNanos / 1000000);
+    if (millisDelta > (UINT64_MAX - MAX_RANDOM_DIGIT_COUNT) / (MAX_RANDOM_DIGIT_COUNT + 1)) {
+        return false;
+    }
+    head = millisDelta * (MAX_RANDOM_DIGIT_COUNT + 1) + digitCount;
+    return true;
+}
+
+bool decodeTimedRandomTraceId(uint64_t head, uint64_t digits, int64_t timestampNanos, std::string& str) {
+    int digitCount = (int)(head % (MAX_RANDOM_DIGIT_COUNT + 1));
+    int64_t millis = timestampNanos / 1000000 + zigzagDecode(head / (MAX_RANDOM_DIGIT_COUNT + 1));
+    char buffer[48];
+    if (digitCount == 0 || millis < 0
+            || snprintf(buffer, sizeof(buffer), "%lld_0.%0*llu", (long long)millis, digitCount,
+                    (unsigned long long)digits) >= (int)sizeof(buffer)) {
+        return false;
+    }
+    str = buffer;
+    // Digits more than the digit count are corrupted.
+    return str.size() - str.find('_') - 3 == (size_t)digitCount;
+}
+
+/// A begin event that is not ended yet in the block, for decoding.
+struct DecodedOpenSpan {
+    std::string mTraceId;
+    uint64_t mTag;
+    uint64_t mExt;
+};
+
+const char* findText(const char* begin, const char* end, const char* pattern, size_t patternLength) {
+    if ((size_t)(end - begin) < patternLength) {
+        return nullptr;
+    }
+    const char* last = end - patternLength;
+    for (const char* cursor = begin; cursor <= last; cursor++) {
+        cursor = static_cast<const char*>(memchr(cursor, pattern[0], last - cursor + 1));
+        if (!cursor) {
+            return nullptr;
+        }
+        if (memcmp(cursor, pattern, patternLength) == 0) {
+            return cursor;
+        }
+    }
+    return nullptr;
+}
+
+} // end of anonymous namespace
+
+
+TraceEncoder::TraceEncoder(Output output, size_t blockSize): mOutput(output), mBlockSize(blockSize) {
+    uint8_t header[TRACE_COMPACT_FILE_HEADER_SIZE];
+    memcpy(header, TRACE_COMPACT_MAGIC, sizeof(TRACE_COMPACT_MAGIC));
+    for (int i = 0; i < 4; i++) {
+        header[sizeof(TRACE_COMPACT_MAGIC) + i] = (uint8_t)(TRACE_COMPACT_VERSION >> (i * 8));
+    }
+    mOutput(header, sizeof(header));
+    mPayload.reserve(blockSize + 1024);
+    resetBlock();
+}
+
+TraceEncoder::~TraceEncoder() {
+    flush();
+}
+
+void TraceEncoder::resetBlock() {
+    mPayload.clear();
+    mEventCount = 0;
+    mStringIndices.clear();
+    mPreviousThread = NO_STRING;
+    mPreviousTag = NO_STRING;
+    mPreviousTimestamp = 0;
+    mPreviousNumericTraceId = 0;
+    mOpenSpans.clear();
+}
+
+uint32_t TraceEncoder::stringIndex(const std::string& str) {
+    auto found = mStringIndices.find(str);
+    if (found != mStringIndices.end()) {
+        return found->second;
+    }
+    uint32_t index = (uint32_t)mStringIndices.size();
+    mStringIndices.emplace(str, index);
+    mPayload.push_back(OP_DEFINE_STRING);
+    writeVarint(mPayload, str.size());
+    mPayload.insert(mPayload.end(), str.begin(), str.end());
+    return index;
+}
+
+void TraceEncoder::add(const TraceEvent& event) {
+    // Strings are defined before the event op that uses them.
+    uint32_t thread = stringIndex(event.mThread);
+    uint32_t tag = stringIndex(event.mTag);
+    uint32_t ext = event.mExt.empty() ? NO_STRING : stringIndex(event.mExt);
+    if (event.mType != TRACE_RECORD_END || !writeEndOfOpenSpan(event, thread, tag, ext)) {
+        writeEvent(event, thread, tag, ext);
+    }
+    mPreviousThread = thread;
+    mPreviousTag = tag;
+    mPreviousTimestamp = event.mTimestampNanos;
+    mEventCount++;
+
+    if (mPayload.size() >= mBlockSize) {
+        flush();
+    }
+}
+
+void TraceEncoder::writeEvent(const TraceEvent& event, uint32_t thread, uint32_t tag, uint32_t ext) {
+    uint64_t numericTraceId = 0;
+    uint64_t randomHead = 0;
+    uint64_t randomDigits = 0;
+    uint32_t traceIdString = NO_STRING;
+    uint8_t op = event.mType == TRACE_RECORD_BEGIN ? OP_BEGIN : OP_END;
+    if (parseNumericTraceId(event.mTraceId, numericTraceId)) {
+        // Numeric.
+    }
+    else if (encodeTimedRandomTraceId(event.mTraceId, event.mTimestampNanos, randomHead, randomDigits)) {
+        op |= OP_FLAG_TIMED_RANDOM_TRACE_ID;
+    }
+    else {
+        op |= OP_FLAG_STRING_TRACE_ID;
+        traceIdString = stringIndex(event.mTraceId);
+    }
+    if (ext != NO_STRING) { op |= OP_FLAG_HAS_EXT; }
+    if (thread == mPreviousThread) { op |= OP_FLAG_SAME_THREAD; }
+    if (tag == mPreviousTag) { op |= OP_FLAG_SAME_TAG; }
+    mPayload.push_back(op);
+
+    if (thread != mPreviousThread) { writeVarint(mPayload, thread); }
+    if (tag != mPreviousTag) { writeVarint(mPayload, tag); }
+    writeVarint(mPayload, zigzagEncode(event.mTimestampNanos - mPreviousTimestamp));
+    if (op & OP_FLAG_STRING_TRACE_ID) {
+        writeVarint(mPayload, traceIdString);
+    }
+    else if (op & OP_FLAG_TIMED_RANDOM_TRACE_ID) {
+        writeVarint(mPayload, randomHead);
+        writeVarint(mPayload, randomDigits);
+    }
+    else {
+        writeVarint(mPayload, zigzagEncode((int64_t)(numericTraceId - mPreviousNumericTraceId)));
+        mPreviousNumericTraceId = numericTraceId;
+    }
+    if (ext != NO_STRING) { writeVarint(mPayload, ext); }
+
+    if (event.mType == TRACE_RECORD_BEGIN) {
+        mOpenSpans[thread].push_back(OpenSpan{event.mTraceId, tag, ext});
+    }
+}
+
+bool TraceEncoder::writeEndOfOpenSpan(const TraceEvent& event, uint32_t thread, uint32_t tag, uint32_t ext) {
+    auto found = mOpenSpans.find(thread);
+    if (found == mOpenSpans.end()) {
+        return false;
+    }
+    std::vector<OpenSpan>& spans = found->second;
+    // Spans usually end in the reverse order, so the one to end is mostly the latest.
+    for (size_t depth = 0; depth < spans.size(); depth++) {
+        auto span = spans.end() - 1 - depth;
+        if (span->mTag != tag || span->mTraceId != event.mTraceId) {
+            continue;
+        }
+        uint8_t op = OP_END_OF_OPEN_SPAN;
+        if (ext != span->mExt) { op |= OP_FLAG_HAS_EXT; }
+        if (thread == mPreviousThread) { op |= OP_FLAG_SAME_THREAD; }
+        mPayload.push_back(op);
+
+        if (thread != mPreviousThread) { writeVarint(mPayload, thread); }
+        writeVarint(mPayload, zigzagEncode(event.mTimestampNanos - mPreviousTimestamp));
+        writeVarint(mPayload, depth);
+        if (ext != span->mExt) { writeVarint(mPayload, ext == NO_STRING ? 0 : (uint64_t)ext + 1); }
+        spans.erase(span);
+        return true;
+    }
+    return false;
+}
+
+void TraceEncoder::flush() {
+    if (mPayload.empty()) {
+        return;
+    }
+    mBlockHeader.clear();
+    writeVarint(mBlockHeader, mPayload.size());
+    writeVarint(mBlockHeader, mEventCount);
+    mOutput(mBlockHeader.data(), mBlockHeader.size());
+    mOutput(mPayload.data(), mPayload.size());
+    resetBlock();
+}
+
+
+bool TraceDecoder::isCompact(const uint8_t* data, size_t size) {
+    return size >= TRACE_COMPACT_FILE_HEADER_SIZE
+            && memcmp(data, TRACE_COMPACT_MAGIC, sizeof(TRACE_COMPACT_MAGIC)) == 0;
+}
+
+bool TraceDecoder::forEachBlock(const uint8_t* data, size_t size,
+        const std::function<void(const uint8_t*, size_t, uint64_t)>& onBlock) {
+    if (!isCompact(data, size)) {
+        return false;
+    }
+    const uint8_t* cursor = data + TRACE_COMPACT_FILE_HEADER_SIZE;
+    const uint8_t* end = data + size;
+    while (cursor < end) {
+        uint64_t payloadSize;
+        uint64_t eventCount;
+        if (!readVarint(cursor, end, payloadSize)) {
+            return false;
+        }
+        if (payloadSize == 0) {
+            break;
+        }
+        if (!readVarint(cursor, end, eventCount) || payloadSize > (uint64_t)(end - cursor)) {
+            return false;
+        }
+        onBlock(cursor, payloadSize, eventCount);
+        cursor += payloadSize;
+    }
+    return true;
+}
+
+bool TraceDecoder::decodeBlock(const uint8_t* payload, size_t payloadSize,
+        const std::function<void(const TraceEvent&)>& onEvent) {
+    const uint8_t* cursor = payload;
+    const uint8_t* end = payload + payloadSize;
+    std::vector<std::string> strings;
+    std::unordered_map<uint64_t, std::vector<DecodedOpenSpan>> openSpans;
+    uint64_t thread = NO_STRING;
+    uint64_t tag = NO_STRING;
+    uint64_t ext = NO_STRING;
+    int64_t timestamp = 0;
+    uint64_t numericTraceId = 0;
+    TraceEvent event;
+
+    while (cursor < end) {
+        uint8_t op = *cursor++;
+        uint8_t kind = op & OP_KIND_MASK;
+        uint64_t value;
+        if (kind == OP_DEFINE_STRING) {
+            if (!readVarint(cursor, end, value) || value > (uint64_t)(end - cursor)) {
+                return false;
+            }
+            strings.emplace_back(reinterpret_cast<const char*>(cursor), value);
+            cursor += value;
+            continue;
+        }
+        if (!(op & OP_FLAG_SAME_THREAD) && !readVarint(cursor, end, thread)) {
+            return false;
+        }
+        if (kind != OP_END_OF_OPEN_SPAN && !(op & OP_FLAG_SAME_TAG) && !readVarint(cursor, end, tag)) {
+            return false;
+        }
+        if (thread >= strings.size() || !readVarint(cursor, end, value)) {
+            return false;
+        }
+        timestamp += zigzagDecode(value);
+        if (!readVarint(cursor, end, value)) {
+            return false;
+        }
+
+        if (kind == OP_END_OF_OPEN_SPAN) {
+            std::vector<DecodedOpenSpan>& spans = openSpans[thread];
+            if (value >= spans.size()) {
+                return false;
+            }
+            auto span = spans.end() - 1 - value;
+            event.mTraceId = std::move(span->mTraceId);
+            tag = span->mTag;
+            ext = span->mExt;
+            spans.erase(span);
+            if (op & OP_FLAG_HAS_EXT) {
+                if (!readVarint(cursor, end, value) || value > strings.size()) {
+                    return false;
+                }
+                ext = value == 0 ? NO_STRING : value - 1;
+            }
+        }
+        else {
+            if (tag >= strings.size()) {
+                return false;
+            }
+            if (op & OP_FLAG_STRING_TRACE_ID) {
+                if (value >= strings.size()) {
+                    return false;
+                }
+                event.mTraceId = strings[value];
+            }
+            else if (op & OP_FLAG_TIMED_RANDOM_TRACE_ID) {
+                uint64_t digits;
+                if (!readVarint(cursor, end, digits)
+                        || !decodeTimedRandomTraceId(value, digits, timestamp, event.mTraceId)) {
+                    return false;
+                }
+            }
+            else {
+                numericTraceId += (uint64_t)zigzagDecode(value);
+                event.mTraceId = std::to_string(numericTraceId);
+            }
+            ext = NO_STRING;
+            if (op & OP_FLAG_HAS_EXT) {
+                if (!readVarint(cursor, end, ext) || ext >= strings.size()) {
+                    return false;
+                }
+            }
+            if (kind == OP_BEGIN) {
+                openSpans[thread].push_back(DecodedOpenSpan{event.mTraceId, tag, ext});
+            }
+        }
+        event.mType = kind == OP_BEGIN ? TRACE_RECORD_BEGIN : TRACE_RECORD_END;
+        event.mThread = strings[thread];
+        event.mTag = strings[tag];
+        event.mTimestampNanos = timestamp;
+        event.mExt = ext == NO_STRING ? std::string() : strings[ext];
+        onEvent(event);
+    }
+    return true;
+}
+
+bool TraceDecoder::decode(const uint8_t* data, size_t size, const std::function<void(const TraceEvent&)>& onEvent) {
+    bool ok = true;
+    bool complete = forEachBlock(data, size, [&](const uint8_t* payload, size_t payloadSize, uint64_t) {
+        ok = ok && decodeBlock(payload, payloadSize, onEvent);
+    });
+    return ok && complete;
+}
+
+
+const char TEXT_TRACE_RECORD_PREFIX[] = "-o-o-[aDhOcTrAcE_";
+const size_t TEXT_TRACE_RECORD_PREFIX_LENGTH = sizeof(TEXT_TRACE_RECORD_PREFIX) - 1;
+
+bool parseMillisToNanos(const char* begin, const char* end, int64_t& nanos) {
+    const char* cursor = begin;
+    bool negative = cursor < end && *cursor == '-';
+    if (negative) {
+        cursor++;
+    }
+    int64_t millis = 0;
+    int integerDigits = 0;
+    for (; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++, integerDigits++) {
+        millis = millis * 10 + (*cursor - '0');
+    }
+    int64_t fraction = 0;
+    int fractionDigits = 0;
+    if (cursor < end && *cursor == '.') {
+        for (cursor++; cursor < end && *cursor >= '0' && *cursor <= '9'; cursor++, fractionDigits++) {
+            fraction = fraction * 10 + (*cursor - '0');
+        }
+        if (fractionDigits == 0 || fractionDigits > 6) {
+            return false;
+        }
+    }
+    if (cursor != end || integerDigits == 0 || integerDigits > 13) {
+        return false;
+    }
+    for (int i = fractionDigits; i < 6; i++) {
+        fraction *= 10;
+    }
+    nanos = millis * 1000000 + fraction;
+    if (negative) {
+        nanos = -nanos;
+    }
+    return true;
+}
+
+void formatNanosToMillis(int64_t nanos, std::string& out) {
+    if (nanos < 0) {
+        out += '-';
+        nanos = -nanos;
+    }
+    out += std::to_string(nanos / 1000000);
+    int64_t fraction = nanos % 1000000;
+    if (fraction) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), ".%06lld", (long long)fraction);
+        out += buffer;
+    }
+}
+
+bool parseTextTraceRecord(const char* begin, const char* end, TraceEventView& event, const char** recordEnd) {
+    const char* cursor = begin + TEXT_TRACE_RECORD_PREFIX_LENGTH;
+    if (cursor > end || memcmp(begin, TEXT_TRACE_RECORD_PREFIX, TEXT_TRACE_RECORD_PREFIX_LENGTH) != 0) {
+        return false;
+    }
+    // A record never crosses lines.
+    const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+    if (!lineEnd) {
+        lineEnd = end;
+    }
+    TextRange fields[6];
+    for (int i = 0; i < 5; i++) {
+        const char* delimiter = findText(cursor, lineEnd, TEXT_DELIMITER, TEXT_DELIMITER_LENGTH);
+        if (!delimiter) {
+            return false;
+        }
+        fields[i] = TextRange{cursor, (size_t)(delimiter - cursor)};
+        cursor = delimiter + TEXT_DELIMITER_LENGTH;
+    }
+    // The ext message is the last one, which may contain anything.
+    const char* suffix = nullptr;
+    for (const char* found = cursor;
+            (found = findText(found, lineEnd, TEXT_RECORD_SUFFIX, TEXT_RECORD_SUFFIX_LENGTH)) != nullptr;
+            found++) {
+        suffix = found;
+    }
+    if (!suffix) {
+        return false;
+    }
+    fields[5] = TextRange{cursor, (size_t)(suffix - cursor)};
+
+    if (fields[0].mLength == 5 && memcmp(fields[0].mData, "begin", 5) == 0) {
+        event.mType = TRACE_RECORD_BEGIN;
+    }
+    else if (fields[0].mLength == 3 && memcmp(fields[0].mData, "end", 3) == 0) {
+        event.mType = TRACE_RECORD_END;
+    }
+    else {
+        return false;
+    }
+    if (!parseMillisToNanos(fields[4].mData, fields[4].mData + fields[4].mLength, event.mTimestampNanos)) {
+        return false;
+    }
+    event.mTraceId = fields[1];
+    event.mThread = fields[2];
+    event.mTag = fields[3];
+    event.mExt = fields[5];
+    if (recordEnd) {
+        *recordEnd = suffix + TEXT_RECORD_SUFFIX_LENGTH;
+    }
+    return true;
+}
+
+bool parseTextTraceRecord(const char* begin, const char* end, TraceEvent& event, const char** recordEnd) {
+    TraceEventView view;
+    if (!parseTextTraceRecord(begin, end, view, recordEnd)) {
+        return false;
+    }
+    event.mType = view.mType;
+    event.mTraceId.assign(view.mTraceId.mData, view.mTraceId.mLength);
+    event.mThread.assign(view.mThread.mData, view.mThread.mLength);
+    event.mTag.assign(view.mTag.mData, view.mTag.mLength);
+    event.mTimestampNanos = view.mTimestampNanos;
+    event.mExt.assign(view.mExt.mData, view.mExt.mLength);
+    return true;
+}
+
+void formatTextTraceRecord(const TraceEvent& event, std::string& out) {
+    out += TEXT_TRACE_RECORD_PREFIX;
+    out += event.mType == TRACE_RECORD_BEGIN ? "begin" : "end";
+    out += TEXT_DELIMITER;
+    out += event.mTraceId;
+    out += TEXT_DELIMITER;
+    out += event.mThread;
+    out += TEXT_DELIMITER;
+    out += event.mTag;
+    out += TEXT_DELIMITER;
+    formatNanosToMillis(event.mTimestampNanos, out);
+    out += TEXT_DELIMITER;
+    out += event.mExt;
+    out += TEXT_RECORD_SUFFIX;
+}
+
+} // end of namespace adhoctrace
@@ -0,0 +1,161 @@
+/// Compact trace encoding, and the text log format of `src/js/trace/trace.js`.
+///
+/// [Compact format]
+/// "ADHOCTRZ" (8 bytes), version (u32, little endian), and then blocks:
+/// [varint payload size][varint event count][payload]
+/// A block of payload size 0 means the end (so a zero-filled tail is also the end).
+/// Blocks are self-contained (the string table is reset in each block), so they can be
+/// skipped or decoded in parallel.
+///
+/// The payload is a sequence of ops. The first byte of an op:
+///     bits 0-1: 0 (define string) / 1 (begin event) / 2 (end event) / 3 (end of an open span)
+///     For define string: followed by [varint length][bytes]. The n-th defined string in
+///         the block has the index n.
+///     For begin and end events:
+///         bit 2: trace id is a string index (otherwise a numeric id, zigzag delta to the
+///                previous numeric id in the block)
+///         bit 3: has ext message
+///         bit 4: same thread as the previous event (otherwise followed by string index)
+///         bit 5: same tag as the previous event (otherwise followed by string index)
+///         bit 6: trace id is `<milliseconds>_0.<digits>` of `trace.js`, which is
+///                [varint zigzag(milliseconds - event milliseconds) * 20 + digit count]
+///                [varint digits] (bit 2 is not set then)
+///         Fields: [thread?][tag?][timestamp: zigzag varint nanoseconds delta to the previous
+///                 event in the block][trace id][ext?]
+///     For end of an open span, which takes the trace id, tag and ext of a begin event in the
+///     block that is not ended yet:
+///         bit 3: the ext message differs from the begin event's (followed by varint string
+///                index + 1, or 0 for no ext message)
+///         bit 4: same thread as the previous event (otherwise followed by string index)
+///         Fields: [thread?][timestamp][varint depth of the begin event in the open spans of
+///                 the thread, 0 for the latest][ext?]
+///
+/// Version 2 adds bit 6 and the end of an open span, so version 1 files are decoded the same.
+
+#ifndef _ADHOC_TOOLS_TRACE_CODEC_H_
+#define _ADHOC_TOOLS_TRACE_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "adhoc-trace-format.h"
+
+namespace adhoctrace {
+
+const char TRACE_COMPACT_MAGIC[8] = {'A', 'D', 'H', 'O', 'C', 'T', 'R', 'Z'};
+const uint32_t TRACE_COMPACT_VERSION = 2;
+const size_t TRACE_COMPACT_FILE_HEADER_SIZE = 12;
+const size_t TRACE_COMPACT_DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+struct TraceEvent {
+    TraceRecordType mType;
+    std::string mTraceId;
+    std::string mThread;
+    std::string mTag;
+    /// Wall clock.
+    int64_t mTimestampNanos;
+    std::string mExt;
+};
+
+class TraceEncoder {
+  public:
+    typedef std::function<void(const uint8_t* data, size_t size)> Output;
+
+    /// @param output receives the file header at once, and then a whole block each time.
+    explicit TraceEncoder(Output output, size_t blockSize = TRACE_COMPACT_DEFAULT_BLOCK_SIZE);
+    ~TraceEncoder();
+
+    void add(const TraceEvent& event);
+    /// Output the current block if not empty.
+    void flush();
+
+  private:
+    /// A begin event that is not ended yet in the block.
+    struct OpenSpan {
+        std::string mTraceId;
+        uint32_t mTag;
+        uint32_t mExt;
+    };
+
+    uint32_t stringIndex(const std::string& str);
+    void resetBlock();
+    void writeEvent(const TraceEvent& event, uint32_t thread, uint32_t tag, uint32_t ext);
+    /// @return false if the event does not end an open span, and nothing is written.
+    bool writeEndOfOpenSpan(const TraceEvent& event, uint32_t thread, uint32_t tag, uint32_t ext);
+
+    Output mOutput;
+    size_t mBlockSize;
+    std::vector<uint8_t> mPayload;
+    std::vector<uint8_t> mBlockHeader;
+    uint64_t mEventCount;
+    std::unordered_map<std::string, uint32_t> mStringIndices;
+    uint32_t mPreviousThread;
+    uint32_t mPreviousTag;
+    int64_t mPreviousTimestamp;
+    uint64_t mPreviousNumericTraceId;
+    /// Open spans of each thread (by string index), the latest at the back.
+    std::unordered_map<uint32_t, std::vector<OpenSpan>> mOpenSpans;
+};
+
+class TraceDecoder {
+  public:
+    static bool isCompact(const uint8_t* data, size_t size);
+
+    /// Iterate blocks without decoding them.
+    /// @param onBlock `void(const uint8_t* payload, size_t payloadSize, uint64_t eventCount)`
+    /// @return false if the data is corrupted or truncated.
+    static bool forEachBlock(const uint8_t* data, size_t size,
+            const std::function<void(const uint8_t*, size_t, uint64_t)>& onBlock);
+
+    /// @return false if the block is corrupted.
+    static bool decodeBlock(const uint8_t* payload, size_t payloadSize,
+            const std::function<void(const TraceEvent&)>& onEvent);
+
+    /// Decode all of the blocks in order.
+    static bool decode(const uint8_t* data, size_t size, const std::function<void(const TraceEvent&)>& onEvent);
+};
+
+
+/// A text range in the input, not owned.
+struct TextRange {
+    const char* mData;
+    size_t mLength;
+};
+
+/// `TraceEvent` that refers to the text, to avoid copying strings when scanning huge logs.
+struct TraceEventView {
+    TraceRecordType mType;
+    TextRange mTraceId;
+    TextRange mThread;
+    TextRange mTag;
+    int64_t mTimestampNanos;
+    TextRange mExt;
+};
+
+/// The marker of the text log records.
+extern const char TEXT_TRACE_RECORD_PREFIX[];
+extern const size_t TEXT_TRACE_RECORD_PREFIX_LENGTH;
+
+/// Parse a text record like
+/// `-o-o-[aDhOcTrAcE_begin^_^110^_^tA^_^wood^_^1651079393537^_^/output/app.js]-o-o-`
+/// @param begin should point to `TEXT_TRACE_RECORD_PREFIX`.
+/// @param recordEnd output the position after the record.
+/// @return false if it is not a legal record.
+extern bool parseTextTraceRecord(const char* begin, const char* end, TraceEvent& event, const char** recordEnd);
+extern bool parseTextTraceRecord(const char* begin, const char* end, TraceEventView& event, const char** recordEnd);
+
+/// Append the text record (without line break).
+/// The timestamp is in milliseconds, with 6 decimals if it is not integral.
+extern void formatTextTraceRecord(const TraceEvent& event, std::string& out);
+
+/// Decimal milliseconds (at most 6 decimals) to nanoseconds, without loss.
+extern bool parseMillisToNanos(const char* begin, const char* end, int64_t& nanos);
+extern void formatNanosToMillis(int64_t nanos, std::string& out);
+
+} // end of namespace adhoctrace
+
+#endif // _ADHOC_TOOLS_TRACE_CODEC_H_
@@ -0,0 +1,84 @@
+/// The binary trace file format, shared by `adhoc-trace.cpp` and the offline tools.
+///
+/// [TraceFileHeader][chunk][chunk]...
+/// Each chunk is [TraceChunkHeader][payload of `mSize` bytes]:
+///     TRACE_CHUNK_STRINGS: [TraceStringHeader][chars, padded to 4 bytes]...
+///     TRACE_CHUNK_RECORDS: [TraceRecord]...
+/// A string is always written before the records using it.
+/// All of the values are in the native byte order.
+
+#ifndef _ADHOC_TOOLS_TRACE_FORMAT_H_
+#define _ADHOC_TOOLS_TRACE_FORMAT_H_
+
+#include <cstdint>
+
+namespace adhoctrace {
+
+const char TRACE_FILE_MAGIC[8] = {'A', 'D', 'H', 'O', 'C', 'T', 'R', 'C'};
+const uint32_t TRACE_FILE_VERSION = 1;
+
+struct TraceFileHeader {
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mHeaderSize;
+    /// Byte size of the chunks after the header. Updated after every drain, so the file is
+    /// still readable if the process is killed.
+    uint64_t mDataSize;
+    /// Timestamps of records are in clock ticks (see `adhoc/perf/clock.h`).
+    /// `wall clock nanoseconds = mAnchorRealtimeNanos + (ticks - mAnchorTicks) * mNanosPerTick`
+    double mNanosPerTick;
+    uint64_t mAnchorTicks;
+    uint64_t mAnchorRealtimeNanos;
+    uint64_t mDroppedRecords;
+    uint32_t mPid;
+    uint32_t mReserved;
+};
+
+enum TraceChunkType : uint32_t {
+    TRACE_CHUNK_STRINGS = 1,
+    TRACE_CHUNK_RECORDS = 2,
+};
+
+struct TraceChunkHeader {
+    uint32_t mType;
+    uint32_t mSize;
+};
+
+enum TraceStringKind : uint8_t {
+    /// Tags and ext messages. `mId` is the string id used in records.
+    TRACE_STRING_NORMAL = 1,
+    /// `mId` is the thread id.
+    TRACE_STRING_THREAD_NAME = 2,
+};
+
+struct TraceStringHeader {
+    uint32_t mId;
+    uint16_t mLength;
+    uint8_t mKind;
+    uint8_t mReserved;
+};
+
+enum TraceRecordType : uint32_t {
+    TRACE_RECORD_BEGIN = 1,
+    TRACE_RECORD_END = 2,
+};
+
+/// 0 means none for the string ids.
+struct TraceRecord {
+    uint64_t mTicks;
+    uint64_t mSpanId;
+    uint32_t mThreadId;
+    uint32_t mTagId;
+    uint32_t mExtId;
+    uint32_t mType;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord should be 32 bytes");
+
+inline uint32_t traceStringPaddedSize(uint32_t length) {
+    return (length + 3) & ~3u;
+}
+
+} // end of namespace adhoctrace
+
+#endif // _ADHOC_TOOLS_TRACE_FORMAT_H_
@@ -0,0 +1,374 @@
+#include "adhoc-trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "adhoc-trace-format.h"
+#include "../perf/clock.h"
+#include _ADHOC_TOOLS_TRACE_LOG_INCLUDE_
+
+namespace adhoctrace {
+
+namespace {
+
+using adhocperf::Ticks;
+using adhocperf::clockNow;
+
+const uint64_t RING_CAPACITY = _ADHOC_TOOLS_TRACE_RING_CAPACITY_;
+const size_t FILE_GROW_SIZE = _ADHOC_TOOLS_TRACE_FILE_GROW_SIZE_;
+const uint32_t MAX_STRINGS = _ADHOC_TOOLS_TRACE_MAX_STRINGS_;
+const size_t CACHE_LINE_SIZE = 64;
+
+static_assert((RING_CAPACITY & (RING_CAPACITY - 1)) == 0, "Ring capacity should be power of 2");
+
+/// Single-producer (the owner thread) / single-consumer (the drain thread) ring buffer.
+struct ThreadRing {
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mWritten{0};
+    uint64_t mNextSpanSeq = 0;
+    uint32_t mThreadId = 0;
+    /// Only written by the owner thread.
+    std::atomic<uint64_t> mDropped{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> mRead{0};
+    /// Never removed from the list, so that records of exited threads are still drained.
+    ThreadRing* mNext = nullptr;
+    /// Set when the owner thread exits, then the ring is taken by a new thread rather than
+    /// allocating another one. The records left are drained as usual.
+    std::atomic<bool> mFree{false};
+    alignas(CACHE_LINE_SIZE) TraceRecord mRecords[RING_CAPACITY];
+};
+
+std::atomic<ThreadRing*> s_ringsHead{nullptr};
+thread_local ThreadRing* t_ring = nullptr;
+
+std::atomic<bool> s_started{false};
+
+/// Interned strings. Entries below `s_stringCount` are immutable.
+struct StringEntry {
+    uint32_t mId;
+    TraceStringKind mKind;
+    std::string mValue;
+};
+std::mutex s_stringsMutex;
+std::unordered_map<std::string, uint32_t> s_stringIds;
+StringEntry s_strings[MAX_STRINGS];
+std::atomic<uint32_t> s_stringCount{0};
+
+struct TraceFile {
+    int mFd = -1;
+    uint8_t* mData = nullptr;
+    size_t mMappedSize = 0;
+    /// Byte offset to write the next chunk.
+    size_t mOffset = 0;
+    uint32_t mWrittenStringCount = 0;
+};
+
+TraceFile s_file;
+std::thread s_drainThread;
+std::mutex s_drainMutex;
+std::condition_variable s_drainCondition;
+bool s_stopRequested = false;
+
+/// Give the ring back when the thread exits. Only constructed by the threads tracing, so
+/// `t_ring` itself stays a plain pointer on the fast path.
+struct ThreadRingReleaser {
+    ~ThreadRingReleaser() {
+        if (t_ring) {
+            t_ring->mFree.store(true, std::memory_order_release);
+            t_ring = nullptr;
+        }
+    }
+};
+
+ThreadRing* createThreadRing() {
+    static thread_local ThreadRingReleaser releaser;
+    uint32_t threadId = (uint32_t)syscall(SYS_gettid);
+    for (ThreadRing* ring = s_ringsHead.load(std::memory_order_acquire); ring; ring = ring->mNext) {
+        bool free = true;
+        if (ring->mFree.load(std::memory_order_relaxed)
+                && ring->mFree.compare_exchange_strong(free, false, std::memory_order_acquire)) {
+            ring->mThreadId = threadId;
+            return ring;
+        }
+    }
+    ThreadRing* ring = new ThreadRing();
+    ring->mThreadId = threadId;
+    ring->mNext = s_ringsHead.load(std::memory_order_relaxed);
+    while (!s_ringsHead.compare_exchange_weak(
+            ring->mNext, ring, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return ring;
+}
+
+inline ThreadRing* getThreadRing() {
+    ThreadRing* ring = t_ring;
+    if (!ring) {
+        ring = t_ring = createThreadRing();
+    }
+    return ring;
+}
+
+inline void pushRecord(ThreadRing* ring, TraceRecordType type, uint64_t spanId, uint32_t tagId, uint32_t extId) {
+    uint64_t written = ring->mWritten.load(std::memory_order_relaxed);
+    if (written - ring->mRead.load(std::memory_order_acquire) >= RING_CAPACITY) {
+        ring->mDropped.store(ring->mDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    TraceRecord& record = ring->mRecords[written & (RING_CAPACITY - 1)];
+    record.mTicks = clockNow();
+    record.mSpanId = spanId;
+    record.mThreadId = ring->mThreadId;
+    record.mTagId = tagId;
+    record.mExtId = extId;
+    record.mType = type;
+    ring->mWritten.store(written + 1, std::memory_order_release);
+}
+
+uint32_t addString(TraceStringKind kind, uint32_t id, const char* value) {
+    uint32_t index = s_stringCount.load(std::memory_order_relaxed);
+    if (index >= MAX_STRINGS) {
+        return 0;
+    }
+    StringEntry& entry = s_strings[index];
+    entry.mId = id;
+    entry.mKind = kind;
+    entry.mValue = value;
+    if (entry.mValue.size() > UINT16_MAX) {
+        entry.mValue.resize(UINT16_MAX);
+    }
+    s_stringCount.store(index + 1, std::memory_order_release);
+    return id;
+}
+
+Ticks realtimeNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (Ticks)ts.tv_sec * 1000000000 + (Ticks)ts.tv_nsec;
+}
+
+inline TraceFileHeader* fileHeader() {
+    return reinterpret_cast<TraceFileHeader*>(s_file.mData);
+}
+
+bool ensureFileCapacity(size_t size) {
+    if (s_file.mOffset + size <= s_file.mMappedSize) {
+        return true;
+    }
+    size_t newSize = s_file.mMappedSize;
+    while (s_file.mOffset + size > newSize) {
+        newSize += FILE_GROW_SIZE;
+    }
+    if (ftruncate(s_file.mFd, newSize) != 0) {
+        return false;
+    }
+    void* data = mremap(s_file.mData, s_file.mMappedSize, newSize, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    s_file.mData = static_cast<uint8_t*>(data);
+    s_file.mMappedSize = newSize;
+    return true;
+}
+
+/// Reserve a chunk and return the payload pointer, or null if failed.
+uint8_t* beginChunk(TraceChunkType type, size_t payloadSize) {
+    if (!ensureFileCapacity(sizeof(TraceChunkHeader) + payloadSize)) {
+        return nullptr;
+    }
+    TraceChunkHeader* chunkHeader = reinterpret_cast<TraceChunkHeader*>(s_file.mData + s_file.mOffset);
+    chunkHeader->mType = type;
+    chunkHeader->mSize = (uint32_t)payloadSize;
+    s_file.mOffset += sizeof(TraceChunkHeader) + payloadSize;
+    return reinterpret_cast<uint8_t*>(chunkHeader + 1);
+}
+
+void writeNewStrings() {
+    uint32_t stringCount = s_stringCount.load(std::memory_order_acquire);
+    if (stringCount == s_file.mWrittenStringCount) {
+        return;
+    }
+    size_t payloadSize = 0;
+    for (uint32_t i = s_file.mWrittenStringCount; i < stringCount; i++) {
+        payloadSize += sizeof(TraceStringHeader) + traceStringPaddedSize((uint32_t)s_strings[i].mValue.size());
+    }
+    uint8_t* out = beginChunk(TRACE_CHUNK_STRINGS, payloadSize);
+    if (!out) {
+        return;
+    }
+    for (uint32_t i = s_file.mWrittenStringCount; i < stringCount; i++) {
+        const StringEntry& entry = s_strings[i];
+        TraceStringHeader stringHeader = {};
+        stringHeader.mId = entry.mId;
+        stringHeader.mLength = (uint16_t)entry.mValue.size();
+        stringHeader.mKind = entry.mKind;
+        memcpy(out, &stringHeader, sizeof(stringHeader));
+        out += sizeof(stringHeader);
+        memset(out, 0, traceStringPaddedSize(stringHeader.mLength));
+        memcpy(out, entry.mValue.data(), stringHeader.mLength);
+        out += traceStringPaddedSize(stringHeader.mLength);
+    }
+    s_file.mWrittenStringCount = stringCount;
+}
+
+void drainRing(ThreadRing* ring, uint64_t written) {
+    uint64_t read = ring->mRead.load(std::memory_order_relaxed);
+    if (read == written) {
+        return;
+    }
+    // The records may wrap around the end of the ring, so copy in at most 2 parts.
+    uint64_t count = written - read;
+    uint8_t* out = beginChunk(TRACE_CHUNK_RECORDS, count * sizeof(TraceRecord));
+    if (!out) {
+        return;
+    }
+    uint64_t begin = read & (RING_CAPACITY - 1);
+    uint64_t firstPart = std::min(count, RING_CAPACITY - begin);
+    memcpy(out, &ring->mRecords[begin], firstPart * sizeof(TraceRecord));
+    memcpy(out + firstPart * sizeof(TraceRecord), &ring->mRecords[0], (count - firstPart) * sizeof(TraceRecord));
+    ring->mRead.store(written, std::memory_order_release);
+}
+
+void drainAll() {
+    // Take the positions of rings first, and then the strings. Strings are always interned
+    // before the records using them, so all of the strings needed by the records before
+    // these positions are written before the records.
+    std::vector<std::pair<ThreadRing*, uint64_t>> positions;
+    for (ThreadRing* ring = s_ringsHead.load(std::memory_order_acquire); ring; ring = ring->mNext) {
+        positions.emplace_back(ring, ring->mWritten.load(std::memory_order_acquire));
+    }
+    writeNewStrings();
+    uint64_t dropped = 0;
+    for (auto& position : positions) {
+        drainRing(position.first, position.second);
+        dropped += position.first->mDropped.load(std::memory_order_relaxed);
+    }
+    TraceFileHeader* header = fileHeader();
+    header->mDroppedRecords = dropped;
+    header->mDataSize = s_file.mOffset - sizeof(TraceFileHeader);
+}
+
+void drainLoop() {
+    std::unique_lock<std::mutex> lock(s_drainMutex);
+    while (!s_stopRequested) {
+        s_drainCondition.wait_for(lock, std::chrono::milliseconds(_ADHOC_TOOLS_TRACE_DRAIN_INTERVAL_MS_));
+        drainAll();
+    }
+}
+
+} // end of anonymous namespace
+
+
+bool startTrace(const char* filePath) {
+    std::lock_guard<std::mutex> lock(s_drainMutex);
+    if (s_started.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    int fd = open(filePath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        _ADHOC_TOOLS_TRACE_LOG_("adhoctrace: can not open %s", filePath);
+        return false;
+    }
+    if (ftruncate(fd, FILE_GROW_SIZE) != 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, FILE_GROW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    s_file = TraceFile();
+    s_file.mFd = fd;
+    s_file.mData = static_cast<uint8_t*>(data);
+    s_file.mMappedSize = FILE_GROW_SIZE;
+    s_file.mOffset = sizeof(TraceFileHeader);
+
+    TraceFileHeader* header = fileHeader();
+    memcpy(header->mMagic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+    header->mVersion = TRACE_FILE_VERSION;
+    header->mHeaderSize = sizeof(TraceFileHeader);
+    header->mAnchorTicks = clockNow();
+    header->mAnchorRealtimeNanos = realtimeNanos();
+    header->mPid = (uint32_t)getpid();
+    header->mNanosPerTick = adhocperf::clockNanosPerTick();
+
+    // Records left by the previous trace (if any) should not go into this file.
+    for (ThreadRing* ring = s_ringsHead.load(std::memory_order_acquire); ring; ring = ring->mNext) {
+        ring->mRead.store(ring->mWritten.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    s_stopRequested = false;
+    s_drainThread = std::thread(drainLoop);
+    s_started.store(true, std::memory_order_release);
+    return true;
+}
+
+void stopTrace() {
+    {
+        std::lock_guard<std::mutex> lock(s_drainMutex);
+        if (!s_started.load(std::memory_order_relaxed)) {
+            return;
+        }
+        s_started.store(false, std::memory_order_release);
+        s_stopRequested = true;
+    }
+    s_drainCondition.notify_all();
+    s_drainThread.join();
+
+    std::lock_guard<std::mutex> lock(s_drainMutex);
+    drainAll();
+    munmap(s_file.mData, s_file.mMappedSize);
+    if (ftruncate(s_file.mFd, s_file.mOffset) != 0) {
+        _ADHOC_TOOLS_TRACE_LOG_("adhoctrace: truncate trace file failed");
+    }
+    close(s_file.mFd);
+    s_file = TraceFile();
+}
+
+uint32_t internString(const char* str) {
+    std::lock_guard<std::mutex> lock(s_stringsMutex);
+    auto found = s_stringIds.find(str);
+    if (found != s_stringIds.end()) {
+        return found->second;
+    }
+    // Ids start from 1, 0 means none.
+    uint32_t id = addString(TRACE_STRING_NORMAL, (uint32_t)s_stringIds.size() + 1, str);
+    if (id) {
+        s_stringIds[str] = id;
+    }
+    return id;
+}
+
+void setThreadName(const char* name) {
+    std::lock_guard<std::mutex> lock(s_stringsMutex);
+    addString(TRACE_STRING_THREAD_NAME, getThreadRing()->mThreadId, name);
+}
+
+uint64_t beginSpan(uint32_t tagId, uint32_t extId) {
+    if (!s_started.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    ThreadRing* ring = getThreadRing();
+    uint64_t spanId = ((uint64_t)ring->mThreadId << 32) | (++ring->mNextSpanSeq & 0xffffffff);
+    pushRecord(ring, TRACE_RECORD_BEGIN, spanId, tagId, extId);
+    return spanId;
+}
+
+void endSpan(uint64_t spanId, uint32_t tagId, uint32_t extId) {
+    if (!spanId || !s_started.load(std::memory_order_relaxed)) {
+        return;
+    }
+    pushRecord(getThreadRing(), TRACE_RECORD_END, spanId, tagId, extId);
+}
+
+} // end of namespace adhoctrace
@@ -0,0 +1,78 @@
+/// [Usage]
+/// ```cpp
+/// adhoctrace::startTrace("/data/data/com.xxx.yyy/files/1.adhoctrace");
+/// adhoctrace::setThreadName("tA");
+/// {
+///     ADHOC_TRACE_SCOPE("wood");
+///     doSomething();
+/// }
+/// adhoctrace::stopTrace();
+/// ```
+/// Then convert the file to the text log (for `src/js/trace/parse_trace.js`)
+/// or Chrome trace-event JSON (for chrome://tracing or https://ui.perfetto.dev) by
+/// `tools/adhoc-trace-convert.cpp`.
+///
+/// Records are written to per-thread lock-free ring buffers in binary, and a background
+/// thread drains them into the memory-mapped trace file. The ring of an exited thread is
+/// reused by the next new thread, so the rings are only as many as the threads tracing at
+/// the same time.
+
+#ifndef _ADHOC_TOOLS_TRACE_H_
+#define _ADHOC_TOOLS_TRACE_H_
+
+#include <cstdint>
+
+#include "config.h"
+
+namespace adhoctrace {
+
+/// Create the trace file and start the background drain thread.
+/// Spans are ignored (cost only a check) if not started.
+extern bool startTrace(const char* filePath);
+
+/// Drain all of the records and close the trace file.
+extern void stopTrace();
+
+/// Get the id of a string (tag or ext message). The same string always gets the same id.
+/// It locks, so keep the id rather than calling it every time. Returns 0 if too many strings.
+extern uint32_t internString(const char* str);
+
+/// Name the current thread in the trace. Thread id is used if not named.
+extern void setThreadName(const char* name);
+
+/// @param tagId from `internString`.
+/// @param extId from `internString`, or 0.
+/// @return span id, which should be passed to `endSpan`.
+extern uint64_t beginSpan(uint32_t tagId, uint32_t extId = 0);
+
+extern void endSpan(uint64_t spanId, uint32_t tagId, uint32_t extId = 0);
+
+class ScopedSpan {
+  public:
+    explicit ScopedSpan(uint32_t tagId, uint32_t extId = 0)
+            : mTagId(tagId), mExtId(extId), mSpanId(beginSpan(tagId, extId)) {}
+    ~ScopedSpan() {
+        endSpan(mSpanId, mTagId, mExtId);
+    }
+    ScopedSpan(const ScopedSpan&) = delete;
+    ScopedSpan& operator=(const ScopedSpan&) = delete;
+  private:
+    uint32_t mTagId;
+    uint32_t mExtId;
+    uint64_t mSpanId;
+};
+
+#define _ADHOC_TOOLS_TRACE_CONCAT_INNER_(a, b) a##b
+#define _ADHOC_TOOLS_TRACE_CONCAT_(a, b) _ADHOC_TOOLS_TRACE_CONCAT_INNER_(a, b)
+
+/// Trace the rest of the current scope as a span. The tag should be a string literal,
+/// which is interned only at the first time.
+#define ADHOC_TRACE_SCOPE(tag) \
+        static const uint32_t _ADHOC_TOOLS_TRACE_CONCAT_(adhocTraceTag, __LINE__) = \
+                ::adhoctrace::internString(tag); \
+        ::adhoctrace::ScopedSpan _ADHOC_TOOLS_TRACE_CONCAT_(adhocTraceSpan, __LINE__)( \
+                _ADHOC_TOOLS_TRACE_CONCAT_(adhocTraceTag, __LINE__))
+
+} // end of namespace adhoctrace
+
+#endif // _ADHOC_TOOLS_TRACE_H_
@@ -0,0 +1,19 @@
+/// The capacity (count of records) of the ring buffer of each thread. Must be power of 2.
+/// Each record is 32 bytes. If the drain thread can not catch up, new records are dropped
+/// (and the dropped count is written in the trace file).
+#define _ADHOC_TOOLS_TRACE_RING_CAPACITY_ 16384
+
+/// How often the background thread drains the ring buffers into the trace file.
+/// With the default ring capacity, each thread can sustain about 1.6 million records per second.
+#define _ADHOC_TOOLS_TRACE_DRAIN_INTERVAL_MS_ 10
+
+/// The trace file is mapped and grown in this size.
+#define _ADHOC_TOOLS_TRACE_FILE_GROW_SIZE_ (16 * 1024 * 1024)
+
+/// The max count of distinct interned strings (tags, ext messages) in the process.
+#define _ADHOC_TOOLS_TRACE_MAX_STRINGS_ 4096
+
+/// The log implementation, see `_ADHOC_TOOLS_PERF_LOG_` in `adhoc/perf/config.h`.
+#define _ADHOC_TOOLS_TRACE_LOG_INCLUDE_ "../log/adhoc-log.h"
+#define _ADHOC_TOOLS_TRACE_LOG_(...) \
+   ::adhoclog::logPrint(::adhoclog::LOG_LEVEL_INFO, "adhoc", __VA_ARGS__)
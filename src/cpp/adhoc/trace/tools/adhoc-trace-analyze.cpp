@@ -0,0 +1,578 @@
+/// Analyze huge traces natively, which `src/js/trace/parse_trace.js` can not load into memory.
+/// The input (the text log of `src/js/trace/trace.js`, the compact trace file, or the binary
+/// trace file of `adhoc-trace.cpp`) is memory-mapped and split into chunks. Chunks are
+/// scanned and paired in parallel, and the spans crossing chunks are stitched at last.
+///
+/// [Build] (on host)
+/// ```shell
+/// c++ -std=c++17 -O2 -pthread -o adhoc-trace-analyze adhoc-trace-analyze.cpp ../adhoc-trace-codec.cpp
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// # Print the statistics by tag and by thread.
+/// adhoc-trace-analyze 1.log
+/// # Also generate the chart like `parse_trace.js` does.
+/// adhoc-trace-analyze 1.log --html 1.html --template-dir ../../../../js/trace
+/// ```
+/// Options:
+///     -j <count>: The count of worker threads, the count of cores by default.
+///     --html <file>: Generate the chart from `chart_template.html` and `echarts.min.js`.
+///     --template-dir <dir>: The directory of `chart_template.html`, `src/js/trace` by default.
+///     --data <file>: Output the chart data (`RESULT_DATA` of `chart_template.html`) as JSON.
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "trace-event-reader.h"
+
+using namespace adhoctrace;
+
+namespace {
+
+#ifndef ADHOC_TRACE_TEMPLATE_DIR
+#define ADHOC_TRACE_TEMPLATE_DIR "src/js/trace"
+#endif
+
+const char TRACE_MARKER[] = "aDhOcTrAcE_";
+const size_t TRACE_MARKER_LENGTH = sizeof(TRACE_MARKER) - 1;
+/// `-o-o-[` before the marker.
+const size_t TRACE_MARKER_OFFSET = TEXT_TRACE_RECORD_PREFIX_LENGTH - TRACE_MARKER_LENGTH;
+
+/// Find the marker by comparing its first and last bytes at 16 positions at once, and only
+/// compare the whole marker at the positions matching both. Log lines that are not trace
+/// records are skipped at about the memory bandwidth.
+const char* findTraceMarker(const char* begin, const char* end) {
+    const char* cursor = begin;
+#if defined(__SSE2__) || defined(__aarch64__)
+    const size_t lastOffset = TRACE_MARKER_LENGTH - 1;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(TRACE_MARKER[0]);
+    const __m128i last = _mm_set1_epi8(TRACE_MARKER[lastOffset]);
+#else
+    const uint8x16_t first = vdupq_n_u8((uint8_t)TRACE_MARKER[0]);
+    const uint8x16_t last = vdupq_n_u8((uint8_t)TRACE_MARKER[lastOffset]);
+#endif
+    for (; cursor + 16 + lastOffset <= end; cursor += 16) {
+#if defined(__SSE2__)
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cursor));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cursor + lastOffset));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(cursor + bit + 1, TRACE_MARKER + 1, TRACE_MARKER_LENGTH - 2) == 0) {
+                return cursor + bit;
+            }
+            mask &= mask - 1;
+        }
+#else
+        uint8x16_t blockFirst = vld1q_u8(reinterpret_cast<const uint8_t*>(cursor));
+        uint8x16_t blockLast = vld1q_u8(reinterpret_cast<const uint8_t*>(cursor + lastOffset));
+        uint8x16_t matched = vandq_u8(vceqq_u8(blockFirst, first), vceqq_u8(blockLast, last));
+        // No movemask on NEON, narrow to 4 bits per byte instead.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matched), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask) / 4;
+            if (memcmp(cursor + bit + 1, TRACE_MARKER + 1, TRACE_MARKER_LENGTH - 2) == 0) {
+                return cursor + bit;
+            }
+            mask &= ~(uint64_t(0xf) << (bit * 4));
+        }
+#endif
+    }
+#endif
+    const void* found = memmem(cursor, end - cursor, TRACE_MARKER, TRACE_MARKER_LENGTH);
+    return static_cast<const char*>(found);
+}
+
+struct Span {
+    std::string_view mThread;
+    std::string_view mTag;
+    std::string_view mExt;
+    int64_t mBegin;
+    int64_t mEnd;
+};
+
+struct PendingEvent {
+    TraceRecordType mType;
+    std::string_view mTraceId;
+    std::string_view mThread;
+    std::string_view mTag;
+    std::string_view mExt;
+    int64_t mTimestampNanos;
+};
+
+struct SpanKey {
+    std::string_view mThread;
+    std::string_view mTraceId;
+    bool operator==(const SpanKey& other) const {
+        return mThread == other.mThread && mTraceId == other.mTraceId;
+    }
+};
+
+struct SpanKeyHash {
+    size_t operator()(const SpanKey& key) const {
+        std::hash<std::string_view> hash;
+        return hash(key.mThread) * 31 + hash(key.mTraceId);
+    }
+};
+
+/// Pair begin and end events by thread and trace id, as `parse_trace.js` does.
+class SpanPairer {
+  public:
+    explicit SpanPairer(std::vector<Span>& spans): mSpans(spans) {}
+
+    /// @param unmatched receives the events that may be paired with other chunks.
+    void add(const PendingEvent& event, std::vector<PendingEvent>* unmatched) {
+        SpanKey key{event.mThread, event.mTraceId};
+        if (event.mType == TRACE_RECORD_BEGIN) {
+            if (!mPendingBegins.emplace(key, event).second) {
+                mIllegalCount++;
+            }
+            return;
+        }
+        auto found = mPendingBegins.find(key);
+        if (found == mPendingBegins.end()) {
+            if (unmatched) {
+                unmatched->push_back(event);
+            }
+            else {
+                mIllegalCount++;
+            }
+            return;
+        }
+        const PendingEvent& begin = found->second;
+        mSpans.push_back(Span{begin.mThread, begin.mTag, begin.mExt, begin.mTimestampNanos, event.mTimestampNanos});
+        mPendingBegins.erase(found);
+    }
+
+    /// The begins left are after all of the unmatched ends of the same key in the chunk
+    /// (otherwise they are paired), so they can be appended after the ends.
+    void takePendingBegins(std::vector<PendingEvent>& unmatched) {
+        for (auto& pending : mPendingBegins) {
+            unmatched.push_back(pending.second);
+        }
+        mPendingBegins.clear();
+    }
+
+    size_t pendingCount() const { return mPendingBegins.size(); }
+    size_t illegalCount() const { return mIllegalCount; }
+
+  private:
+    std::vector<Span>& mSpans;
+    std::unordered_map<SpanKey, PendingEvent, SpanKeyHash> mPendingBegins;
+    size_t mIllegalCount = 0;
+};
+
+struct Chunk {
+    std::vector<Span> mSpans;
+    /// Unmatched ends in order, and then the begins not ended in this chunk.
+    std::vector<PendingEvent> mUnmatched;
+    /// Owns the strings not in the mapped text (decoded from the compact or binary format).
+    std::unordered_set<std::string> mStringPool;
+    size_t mIllegalCount = 0;
+
+    std::string_view intern(const std::string& str) {
+        return *mStringPool.insert(str).first;
+    }
+
+    void addEvent(SpanPairer& pairer, const TraceEvent& event) {
+        pairer.add(PendingEvent{event.mType, intern(event.mTraceId), intern(event.mThread), intern(event.mTag),
+                intern(event.mExt), event.mTimestampNanos}, &mUnmatched);
+    }
+};
+
+std::string_view toView(const TextRange& range) {
+    return std::string_view(range.mData, range.mLength);
+}
+
+void scanTextChunk(const char* begin, const char* end, Chunk& chunk) {
+    SpanPairer pairer(chunk.mSpans);
+    TraceEventView view;
+    const char* cursor = begin;
+    while (const char* marker = findTraceMarker(cursor, end)) {
+        const char* record = marker - TRACE_MARKER_OFFSET;
+        const char* recordEnd;
+        if (record >= begin && parseTextTraceRecord(record, end, view, &recordEnd)) {
+            pairer.add(PendingEvent{view.mType, toView(view.mTraceId), toView(view.mThread), toView(view.mTag),
+                    toView(view.mExt), view.mTimestampNanos}, &chunk.mUnmatched);
+            cursor = recordEnd;
+        }
+        else {
+            chunk.mIllegalCount++;
+            cursor = marker + TRACE_MARKER_LENGTH;
+        }
+    }
+    pairer.takePendingBegins(chunk.mUnmatched);
+    chunk.mIllegalCount += pairer.illegalCount();
+}
+
+struct CompactBlock {
+    const uint8_t* mPayload;
+    size_t mSize;
+};
+
+void decodeCompactChunk(const CompactBlock* blocks, size_t count, Chunk& chunk, bool& corrupted) {
+    SpanPairer pairer(chunk.mSpans);
+    for (size_t i = 0; i < count; i++) {
+        if (!TraceDecoder::decodeBlock(blocks[i].mPayload, blocks[i].mSize, [&](const TraceEvent& event) {
+            chunk.addEvent(pairer, event);
+        })) {
+            corrupted = true;
+        }
+    }
+    pairer.takePendingBegins(chunk.mUnmatched);
+    chunk.mIllegalCount += pairer.illegalCount();
+}
+
+/// Run `work(index)` for every chunk in `threadCount` threads.
+template <typename Work>
+void parallelFor(size_t count, int threadCount, Work work) {
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next{0};
+    for (int i = 0; i < threadCount; i++) {
+        threads.emplace_back([&]() {
+            for (size_t index; (index = next.fetch_add(1)) < count;) {
+                work(index);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+struct TagStats {
+    std::vector<int64_t> mDurations;
+    int64_t mTotal = 0;
+};
+
+struct ThreadStats {
+    std::vector<std::pair<int64_t, int64_t>> mIntervals;
+    size_t mCount = 0;
+    int64_t mTotal = 0;
+    /// The union of the spans, nested or overlapped spans are counted once.
+    int64_t mBusy = 0;
+};
+
+double nanosToMillis(int64_t nanos) {
+    return (double)nanos / 1e6;
+}
+
+/// Nearest-rank percentile of sorted values.
+int64_t percentileOf(const std::vector<int64_t>& sorted, double percentile) {
+    size_t rank = (size_t)std::ceil(percentile / 100.0 * (double)sorted.size());
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+void writeJsonString(std::string& out, std::string_view str) {
+    out += '"';
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        }
+        else if (c < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+        }
+        else {
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+/// The same as `parseLogFile` of `parse_trace.js`: `[threadId, tagName, begin, end, extMsg]`.
+std::string makeChartData(const std::vector<const std::vector<Span>*>& spanLists) {
+    std::string out = "[\n";
+    bool first = true;
+    for (auto* spans : spanLists) {
+        for (auto& span : *spans) {
+            out += first ? "[" : ",\n[";
+            writeJsonString(out, span.mThread);
+            out += ", ";
+            writeJsonString(out, span.mTag);
+            out += ", ";
+            formatNanosToMillis(span.mBegin, out);
+            out += ", ";
+            formatNanosToMillis(span.mEnd, out);
+            out += ", ";
+            writeJsonString(out, span.mExt);
+            out += "]";
+            first = false;
+        }
+    }
+    out += "\n]";
+    return out;
+}
+
+bool readWholeFile(const std::string& path, std::string& content) {
+    MappedFile file;
+    if (!file.open(path.c_str())) {
+        return false;
+    }
+    content.assign(reinterpret_cast<const char*>(file.data()), file.size());
+    return true;
+}
+
+bool writeWholeFile(const std::string& path, const std::string& content) {
+    FILE* out = fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), out) == content.size();
+    return fclose(out) == 0 && ok;
+}
+
+void replaceOnce(std::string& str, const std::string& from, const std::string& to) {
+    size_t position = str.find(from);
+    if (position != std::string::npos) {
+        str.replace(position, from.size(), to);
+    }
+}
+
+int printUsage() {
+    fprintf(stderr, "Usage: adhoc-trace-analyze <input trace file> [-j <count>] [--html <file>]"
+            " [--template-dir <dir>] [--data <file>]\n");
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        return printUsage();
+    }
+    const char* inputPath = argv[1];
+    int threadCount = (int)std::max(1u, std::thread::hardware_concurrency());
+    std::string htmlPath;
+    std::string dataPath;
+    std::string templateDir = ADHOC_TRACE_TEMPLATE_DIR;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return printUsage();
+        }
+        if (strcmp(argv[i], "-j") == 0) {
+            threadCount = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--html") == 0) {
+            htmlPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--template-dir") == 0) {
+            templateDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--data") == 0) {
+            dataPath = argv[++i];
+        }
+        else {
+            return printUsage();
+        }
+    }
+
+    MappedFile file;
+    if (!file.open(inputPath)) {
+        fprintf(stderr, "Can not read trace file: %s\n", inputPath);
+        return 1;
+    }
+    TraceInputFormat format = detectTraceInputFormat(file.data(), file.size());
+    std::vector<Chunk> chunks;
+    bool complete = true;
+
+    if (format == TRACE_INPUT_TEXT) {
+        // Some chunks per thread to balance the load. Chunks end at line breaks, and records
+        // never cross lines.
+        const char* data = reinterpret_cast<const char*>(file.data());
+        const char* dataEnd = data + file.size();
+        const size_t minChunkSize = 1 << 20;
+        size_t chunkCount = std::max<size_t>(1, std::min<size_t>(threadCount * 4, file.size() / minChunkSize));
+        std::vector<std::pair<const char*, const char*>> ranges;
+        const char* cursor = data;
+        for (size_t i = 1; i <= chunkCount && cursor < dataEnd; i++) {
+            const char* chunkEnd = i == chunkCount ? dataEnd : data + file.size() / chunkCount * i;
+            if (chunkEnd < cursor) {
+                continue;
+            }
+            const char* lineEnd = static_cast<const char*>(memchr(chunkEnd, '\n', dataEnd - chunkEnd));
+            chunkEnd = lineEnd ? lineEnd + 1 : dataEnd;
+            ranges.emplace_back(cursor, chunkEnd);
+            cursor = chunkEnd;
+        }
+        chunks.resize(ranges.size());
+        parallelFor(ranges.size(), threadCount, [&](size_t index) {
+            scanTextChunk(ranges[index].first, ranges[index].second, chunks[index]);
+        });
+    }
+    else if (format == TRACE_INPUT_COMPACT) {
+        std::vector<CompactBlock> blocks;
+        complete = TraceDecoder::forEachBlock(file.data(), file.size(),
+                [&](const uint8_t* payload, size_t payloadSize, uint64_t) {
+            blocks.push_back(CompactBlock{payload, payloadSize});
+        });
+        size_t chunkCount = std::min<size_t>(threadCount * 4, blocks.size());
+        chunks.resize(chunkCount);
+        std::vector<char> corrupted(chunkCount, 0);
+        parallelFor(chunkCount, threadCount, [&](size_t index) {
+            size_t begin = blocks.size() * index / chunkCount;
+            size_t end = blocks.size() * (index + 1) / chunkCount;
+            bool chunkCorrupted = false;
+            decodeCompactChunk(&blocks[begin], end - begin, chunks[index], chunkCorrupted);
+            corrupted[index] = chunkCorrupted;
+        });
+        complete = complete && std::find(corrupted.begin(), corrupted.end(), 1) == corrupted.end();
+    }
+    else {
+        // Spans in the binary trace file are already paired by span id while reading.
+        chunks.resize(1);
+        SpanPairer pairer(chunks[0].mSpans);
+        TraceEventReadResult result;
+        readTraceEvents(inputPath, [&](const TraceEvent& event) {
+            chunks[0].addEvent(pairer, event);
+        }, result);
+        pairer.takePendingBegins(chunks[0].mUnmatched);
+        complete = result.mComplete;
+        if (result.mDroppedRecords) {
+            fprintf(stderr, "Warning: %" PRIu64 " records were dropped while tracing.\n", result.mDroppedRecords);
+        }
+    }
+
+    // Stitch the spans crossing chunks, in the order of chunks.
+    std::vector<Span> stitchedSpans;
+    SpanPairer stitcher(stitchedSpans);
+    size_t illegalCount = 0;
+    for (auto& chunk : chunks) {
+        for (auto& event : chunk.mUnmatched) {
+            stitcher.add(event, nullptr);
+        }
+        illegalCount += chunk.mIllegalCount;
+    }
+    illegalCount += stitcher.illegalCount();
+    size_t pendingCount = stitcher.pendingCount();
+
+    std::vector<const std::vector<Span>*> spanLists;
+    for (auto& chunk : chunks) {
+        spanLists.push_back(&chunk.mSpans);
+    }
+    spanLists.push_back(&stitchedSpans);
+
+    // Aggregate.
+    std::map<std::string_view, TagStats> tagStats;
+    std::map<std::string_view, ThreadStats> threadStats;
+    int64_t minBegin = INT64_MAX;
+    int64_t maxEnd = INT64_MIN;
+    size_t spanCount = 0;
+    for (auto* spans : spanLists) {
+        for (auto& span : *spans) {
+            int64_t duration = span.mEnd - span.mBegin;
+            TagStats& tag = tagStats[span.mTag];
+            tag.mDurations.push_back(duration);
+            tag.mTotal += duration;
+            ThreadStats& thread = threadStats[span.mThread];
+            thread.mIntervals.emplace_back(span.mBegin, span.mEnd);
+            thread.mCount++;
+            thread.mTotal += duration;
+            minBegin = std::min(minBegin, span.mBegin);
+            maxEnd = std::max(maxEnd, span.mEnd);
+            spanCount++;
+        }
+    }
+    std::vector<TagStats*> tagList;
+    for (auto& tag : tagStats) {
+        tagList.push_back(&tag.second);
+    }
+    parallelFor(tagList.size(), threadCount, [&](size_t index) {
+        std::sort(tagList[index]->mDurations.begin(), tagList[index]->mDurations.end());
+    });
+    std::vector<ThreadStats*> threadList;
+    for (auto& thread : threadStats) {
+        threadList.push_back(&thread.second);
+    }
+    parallelFor(threadList.size(), threadCount, [&](size_t index) {
+        ThreadStats& thread = *threadList[index];
+        std::sort(thread.mIntervals.begin(), thread.mIntervals.end());
+        int64_t coveredEnd = INT64_MIN;
+        for (auto& interval : thread.mIntervals) {
+            int64_t begin = std::max(interval.first, coveredEnd);
+            if (interval.second > begin) {
+                thread.mBusy += interval.second - begin;
+                coveredEnd = interval.second;
+            }
+        }
+        std::vector<std::pair<int64_t, int64_t>>().swap(thread.mIntervals);
+    });
+
+    int64_t sessionNanos = spanCount ? maxEnd - minBegin : 0;
+    printf("%zu spans, %zu threads, %.3f ms in total.\n\n", spanCount, threadStats.size(), nanosToMillis(sessionNanos));
+    printf("%-24s %10s %14s %12s %12s %12s %12s %12s\n",
+            "tag", "count", "total ms", "average ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (auto& entry : tagStats) {
+        const std::vector<int64_t>& durations = entry.second.mDurations;
+        printf("%-24.*s %10zu %14.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n",
+                (int)entry.first.size(), entry.first.data(), durations.size(), nanosToMillis(entry.second.mTotal),
+                nanosToMillis(entry.second.mTotal) / (double)durations.size(),
+                nanosToMillis(percentileOf(durations, 50)), nanosToMillis(percentileOf(durations, 90)),
+                nanosToMillis(percentileOf(durations, 99)), nanosToMillis(durations.back()));
+    }
+    printf("\n%-24s %10s %14s %12s %12s\n", "thread", "count", "total ms", "busy ms", "utilization");
+    for (auto& entry : threadStats) {
+        double utilization = sessionNanos ? (double)entry.second.mBusy / (double)sessionNanos * 100 : 0;
+        printf("%-24.*s %10zu %14.3f %12.3f %11.2f%%\n",
+                (int)entry.first.size(), entry.first.data(), entry.second.mCount,
+                nanosToMillis(entry.second.mTotal), nanosToMillis(entry.second.mBusy), utilization);
+    }
+
+    if (!htmlPath.empty() || !dataPath.empty()) {
+        std::string chartData = makeChartData(spanLists);
+        if (!dataPath.empty() && !writeWholeFile(dataPath, chartData)) {
+            fprintf(stderr, "Can not write: %s\n", dataPath.c_str());
+            return 1;
+        }
+        if (!htmlPath.empty()) {
+            std::string html;
+            std::string echarts;
+            if (!readWholeFile(templateDir + "/chart_template.html", html)
+                    || !readWholeFile(templateDir + "/echarts.min.js", echarts)) {
+                fprintf(stderr, "Can not read chart_template.html or echarts.min.js in %s\n", templateDir.c_str());
+                return 1;
+            }
+            replaceOnce(html, "/*[_[_[ECHARTS_CONTENT]_]_]*/", echarts);
+            replaceOnce(html, "/*[_[_[RESULT_DATA]_]_]*/", chartData);
+            if (!writeWholeFile(htmlPath, html)) {
+                fprintf(stderr, "Can not write: %s\n", htmlPath.c_str());
+                return 1;
+            }
+            printf("\nResult generated: %s\n", htmlPath.c_str());
+        }
+    }
+
+    if (!complete) {
+        fprintf(stderr, "Warning: the trace file is truncated.\n");
+    }
+    if (pendingCount) {
+        fprintf(stderr, "Warning: %zu spans are not ended.\n", pendingCount);
+    }
+    if (illegalCount) {
+        fprintf(stderr, "Warning: %zu illegal records (not parsed, or not paired) are skipped.\n", illegalCount);
+    }
+    return 0;
+}
@@ -0,0 +1,264 @@
+/// Convert between trace formats: the binary trace file written by `adhoc-trace.cpp`, the
+/// compact trace file of `adhoc-trace-codec.h`, and the text log of `src/js/trace/trace.js`.
+/// The input format is detected automatically.
+///
+/// [Build] (on host)
+/// ```shell
+/// c++ -std=c++17 -O2 -o adhoc-trace-convert adhoc-trace-convert.cpp ../adhoc-trace-codec.cpp
+/// ```
+///
+/// [Usage]
+/// ```shell
+/// # To the text log that `src/js/trace/parse_trace.js` reads.
+/// adhoc-trace-convert text 1.adhoctrace 1.log
+/// node ../../../../js/trace/parse_trace.js 1.log
+/// # To Chrome trace-event JSON, which can be opened in chrome://tracing or https://ui.perfetto.dev
+/// adhoc-trace-convert chrome 1.adhoctrace 1.json
+/// # To the compact trace file, which is much smaller to store or to pull off devices.
+/// adhoc-trace-convert compact 1.log 1.adhoctracez
+/// # Check that a text log round-trips through the compact encoding without any loss.
+/// adhoc-trace-convert verify 1.log
+/// ```
+/// Output to stdout if the output file is not specified.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "trace-event-reader.h"
+
+using namespace adhoctrace;
+
+namespace {
+
+void writeJsonString(FILE* out, const std::string& str) {
+    fputc('"', out);
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        }
+        else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        }
+        else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/// Pair begin and end events by thread and trace id, as `parse_trace.js` does.
+class ChromeTraceWriter {
+  public:
+    ChromeTraceWriter(FILE* out, uint32_t pid): mOut(out), mPid(pid) {
+        fprintf(mOut, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    }
+
+    void add(const TraceEvent& event) {
+        std::string key = event.mThread + '\n' + event.mTraceId;
+        if (event.mType == TRACE_RECORD_BEGIN) {
+            mPendingBegins[key] = event;
+            return;
+        }
+        auto found = mPendingBegins.find(key);
+        if (found == mPendingBegins.end()) {
+            mUnpairedCount++;
+            return;
+        }
+        const TraceEvent& begin = found->second;
+        fprintf(mOut, "%s{\"ph\": \"X\", \"cat\": \"adhoc\", \"name\": ", mFirstEvent ? "" : ",\n");
+        writeJsonString(mOut, begin.mTag);
+        fprintf(mOut, ", \"pid\": %u, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",
+                mPid, threadId(begin.mThread), (double)begin.mTimestampNanos / 1e3,
+                (double)(event.mTimestampNanos - begin.mTimestampNanos) / 1e3);
+        if (!begin.mExt.empty()) {
+            fprintf(mOut, ", \"args\": {\"ext\": ");
+            writeJsonString(mOut, begin.mExt);
+            fprintf(mOut, "}");
+        }
+        fprintf(mOut, "}");
+        mFirstEvent = false;
+        mPendingBegins.erase(found);
+    }
+
+    /// @return the count of events not paired.
+    size_t finish() {
+        for (auto& thread : mThreadIds) {
+            fprintf(mOut, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %u, \"tid\": %u, \"args\": {\"name\": ",
+                    mFirstEvent ? "" : ",\n", mPid, thread.second);
+            writeJsonString(mOut, thread.first);
+            fprintf(mOut, "}}");
+            mFirstEvent = false;
+        }
+        fprintf(mOut, "\n]}\n");
+        return mUnpairedCount + mPendingBegins.size();
+    }
+
+  private:
+    /// Chrome needs numeric thread ids, but threads are named by strings in the text log.
+    uint32_t threadId(const std::string& thread) {
+        auto found = mThreadIds.find(thread);
+        if (found != mThreadIds.end()) {
+            return found->second;
+        }
+        uint32_t id = (uint32_t)mThreadIds.size() + 1;
+        mThreadIds.emplace(thread, id);
+        return id;
+    }
+
+    FILE* mOut;
+    uint32_t mPid;
+    bool mFirstEvent = true;
+    size_t mUnpairedCount = 0;
+    std::unordered_map<std::string, TraceEvent> mPendingBegins;
+    std::unordered_map<std::string, uint32_t> mThreadIds;
+};
+
+bool sameEvent(const TraceEvent& a, const TraceEvent& b) {
+    return a.mType == b.mType && a.mTraceId == b.mTraceId && a.mThread == b.mThread
+            && a.mTag == b.mTag && a.mTimestampNanos == b.mTimestampNanos && a.mExt == b.mExt;
+}
+
+/// Encode to the compact format in memory, decode it back, and compare every event. The
+/// text record is also formatted and parsed back, so that the compact file can always be
+/// converted to the same text log.
+int verify(const std::vector<TraceEvent>& events, size_t inputSize) {
+    std::vector<uint8_t> encoded;
+    {
+        TraceEncoder encoder([&](const uint8_t* data, size_t size) {
+            encoded.insert(encoded.end(), data, data + size);
+        });
+        for (auto& event : events) {
+            encoder.add(event);
+        }
+    }
+
+    size_t index = 0;
+    size_t mismatchCount = 0;
+    std::string text;
+    TraceEvent parsed;
+    bool complete = TraceDecoder::decode(encoded.data(), encoded.size(), [&](const TraceEvent& event) {
+        text.clear();
+        formatTextTraceRecord(event, text);
+        bool ok = index < events.size() && sameEvent(event, events[index])
+                && parseTextTraceRecord(text.data(), text.data() + text.size(), parsed, nullptr)
+                && sameEvent(parsed, event);
+        if (!ok && mismatchCount++ < 10) {
+            fprintf(stderr, "Mismatch at event %zu: %s\n", index, text.c_str());
+        }
+        index++;
+    });
+    if (!complete || index != events.size()) {
+        fprintf(stderr, "Decoded %zu events of %zu%s.\n", index, events.size(), complete ? "" : " (corrupted)");
+        return 1;
+    }
+    if (mismatchCount) {
+        fprintf(stderr, "%zu events mismatched.\n", mismatchCount);
+        return 1;
+    }
+    printf("OK: %zu events, %zu bytes -> %zu bytes (%.1fx).\n", events.size(), inputSize, encoded.size(),
+            encoded.empty() ? 0.0 : (double)inputSize / (double)encoded.size());
+    return 0;
+}
+
+size_t fileSize(const char* path) {
+    MappedFile file;
+    return file.open(path) ? file.size() : 0;
+}
+
+int printUsage() {
+    fprintf(stderr, "Usage: adhoc-trace-convert <text|chrome|compact> <input trace file> [output file]\n");
+    fprintf(stderr, "       adhoc-trace-convert verify <input trace file>\n");
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        return printUsage();
+    }
+    const char* command = argv[1];
+    bool toText = strcmp(command, "text") == 0;
+    bool toChrome = strcmp(command, "chrome") == 0;
+    bool toCompact = strcmp(command, "compact") == 0;
+    bool toVerify = strcmp(command, "verify") == 0;
+    if (!toText && !toChrome && !toCompact && !toVerify) {
+        return printUsage();
+    }
+
+    FILE* out = stdout;
+    if (!toVerify && argc > 3) {
+        out = fopen(argv[3], toCompact ? "wb" : "w");
+        if (!out) {
+            fprintf(stderr, "Can not write: %s\n", argv[3]);
+            return 1;
+        }
+    }
+
+    TraceEventReadResult result;
+    std::vector<TraceEvent> verifyEvents;
+    std::string line;
+    // The pid is only known after the binary trace file is opened.
+    std::unique_ptr<ChromeTraceWriter> chrome;
+    std::unique_ptr<TraceEncoder> encoder;
+    if (toCompact) {
+        encoder.reset(new TraceEncoder([&](const uint8_t* data, size_t size) { fwrite(data, 1, size, out); }));
+    }
+    bool ok = readTraceEvents(argv[2], [&](const TraceEvent& event) {
+        if (toText) {
+            line.clear();
+            formatTextTraceRecord(event, line);
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), out);
+        }
+        else if (toChrome) {
+            if (!chrome) { chrome.reset(new ChromeTraceWriter(out, result.mPid)); }
+            chrome->add(event);
+        }
+        else if (toCompact) {
+            encoder->add(event);
+        }
+        else {
+            verifyEvents.push_back(event);
+        }
+    }, result);
+    if (!ok) {
+        fprintf(stderr, "Can not read trace file: %s\n", argv[2]);
+        return 1;
+    }
+
+    size_t unpairedCount = result.mUnpairedRecords;
+    if (toChrome) {
+        if (!chrome) { chrome.reset(new ChromeTraceWriter(out, result.mPid)); }
+        unpairedCount += chrome->finish();
+    }
+    // Flush the last block.
+    encoder.reset();
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (!result.mComplete) {
+        fprintf(stderr, "Warning: the trace file is truncated.\n");
+    }
+    if (result.mDroppedRecords) {
+        fprintf(stderr, "Warning: %" PRIu64 " records were dropped while tracing.\n", result.mDroppedRecords);
+    }
+    if (unpairedCount) {
+        fprintf(stderr, "Warning: %zu records are not paired (spans not ended).\n", unpairedCount);
+    }
+    if (result.mIllegalTextRecords) {
+        fprintf(stderr, "Warning: %zu illegal text records are skipped.\n", result.mIllegalTextRecords);
+    }
+    if (toVerify) {
+        return verify(verifyEvents, fileSize(argv[2]));
+    }
+    return 0;
+}
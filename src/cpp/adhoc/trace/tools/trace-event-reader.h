@@ -0,0 +1,142 @@
+/// Read trace events from any of the trace formats. Only for offline tools.
+///  + The binary trace file written by `adhoc-trace.cpp` ("ADHOCTRC").
+///  + The compact trace file of `adhoc-trace-codec.h` ("ADHOCTRZ").
+///  + The text log of `src/js/trace/trace.js` (other lines in the log are skipped).
+
+#ifndef _ADHOC_TOOLS_TRACE_EVENT_READER_H_
+#define _ADHOC_TOOLS_TRACE_EVENT_READER_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "../adhoc-trace-codec.h"
+#include "trace-file-reader.h"
+
+namespace adhoctrace {
+
+enum TraceInputFormat {
+    TRACE_INPUT_BINARY,
+    TRACE_INPUT_COMPACT,
+    TRACE_INPUT_TEXT,
+};
+
+struct TraceEventReadResult {
+    TraceInputFormat mFormat = TRACE_INPUT_TEXT;
+    /// False if the file is truncated or corrupted.
+    bool mComplete = true;
+    /// Only known for the binary trace file.
+    uint64_t mDroppedRecords = 0;
+    uint32_t mPid = 0;
+    /// Binary records whose begin or end is missing, they can not be converted to events.
+    size_t mUnpairedRecords = 0;
+    size_t mIllegalTextRecords = 0;
+};
+
+inline TraceInputFormat detectTraceInputFormat(const uint8_t* data, size_t size) {
+    if (size >= sizeof(TRACE_FILE_MAGIC) && memcmp(data, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) == 0) {
+        return TRACE_INPUT_BINARY;
+    }
+    return TraceDecoder::isCompact(data, size) ? TRACE_INPUT_COMPACT : TRACE_INPUT_TEXT;
+}
+
+/// @param onEvent `void(const TraceEvent& event)`. For the binary trace file, the begin
+///     and the end event of a span are given together in the order of ending, and both of
+///     them use the thread of the begin (like `trace.js`, which pairs them by thread).
+/// @return false if the file can not be read.
+template <typename OnEvent>
+bool readTraceEvents(const char* path, OnEvent onEvent, TraceEventReadResult& result) {
+    MappedFile file;
+    if (!file.open(path)) {
+        return false;
+    }
+    result.mFormat = detectTraceInputFormat(file.data(), file.size());
+
+    if (result.mFormat == TRACE_INPUT_COMPACT) {
+        result.mComplete = TraceDecoder::decode(file.data(), file.size(), onEvent);
+        return true;
+    }
+
+    if (result.mFormat == TRACE_INPUT_TEXT) {
+        const char* cursor = reinterpret_cast<const char*>(file.data());
+        const char* end = cursor + file.size();
+        TraceEvent event;
+        while (cursor < end) {
+            const char* found = static_cast<const char*>(memmem(cursor, end - cursor,
+                    TEXT_TRACE_RECORD_PREFIX, TEXT_TRACE_RECORD_PREFIX_LENGTH));
+            if (!found) {
+                break;
+            }
+            const char* recordEnd;
+            if (parseTextTraceRecord(found, end, event, &recordEnd)) {
+                onEvent(event);
+                cursor = recordEnd;
+            }
+            else {
+                result.mIllegalTextRecords++;
+                cursor = found + TEXT_TRACE_RECORD_PREFIX_LENGTH;
+            }
+        }
+        return true;
+    }
+
+    TraceFileReader reader;
+    if (!reader.open(path)) {
+        return false;
+    }
+    result.mDroppedRecords = reader.header().mDroppedRecords;
+    result.mPid = reader.header().mPid;
+
+    std::unordered_map<uint32_t, std::string> strings;
+    std::unordered_map<uint32_t, std::string> threadNames;
+    auto getString = [&](uint32_t id) -> std::string {
+        auto found = strings.find(id);
+        return found == strings.end() ? std::string() : found->second;
+    };
+    auto getThreadName = [&](uint32_t threadId) -> std::string {
+        auto found = threadNames.find(threadId);
+        return found == threadNames.end() ? std::to_string(threadId) : found->second;
+    };
+    auto onString = [&](TraceStringKind kind, uint32_t id, const std::string& value) {
+        (kind == TRACE_STRING_THREAD_NAME ? threadNames : strings)[id] = value;
+    };
+
+    // Begin and end records of a span may be in different chunks (for example, when a span
+    // ends in another thread), in any order.
+    std::unordered_map<uint64_t, TraceRecord> pendingBegins;
+    std::unordered_map<uint64_t, TraceRecord> pendingEnds;
+    TraceEvent event;
+    auto onRecord = [&](const TraceRecord& record) {
+        bool isBegin = record.mType == TRACE_RECORD_BEGIN;
+        auto& others = isBegin ? pendingEnds : pendingBegins;
+        auto found = others.find(record.mSpanId);
+        if (found == others.end()) {
+            (isBegin ? pendingBegins : pendingEnds)[record.mSpanId] = record;
+            return;
+        }
+        const TraceRecord& begin = isBegin ? record : found->second;
+        const TraceRecord& end = isBegin ? found->second : record;
+        event.mTraceId = std::to_string(begin.mSpanId);
+        event.mThread = getThreadName(begin.mThreadId);
+        event.mTag = getString(begin.mTagId);
+        event.mExt = getString(begin.mExtId);
+        event.mType = TRACE_RECORD_BEGIN;
+        event.mTimestampNanos = (int64_t)std::llround(reader.toRealtimeNanos(begin.mTicks));
+        onEvent(event);
+        // Like `trace.js`, the ext message is only on the begin.
+        event.mType = TRACE_RECORD_END;
+        event.mExt.clear();
+        event.mTimestampNanos = (int64_t)std::llround(reader.toRealtimeNanos(end.mTicks));
+        onEvent(event);
+        others.erase(found);
+    };
+    result.mComplete = reader.forEach(onString, onRecord);
+    result.mUnpairedRecords = pendingBegins.size() + pendingEnds.size();
+    return true;
+}
+
+} // end of namespace adhoctrace
+
+#endif // _ADHOC_TOOLS_TRACE_EVENT_READER_H_
@@ -0,0 +1,118 @@
+/// Read the binary trace file written by `adhoc-trace.cpp`. Only for offline tools.
+
+#ifndef _ADHOC_TOOLS_TRACE_FILE_READER_H_
+#define _ADHOC_TOOLS_TRACE_FILE_READER_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../adhoc-trace-format.h"
+
+namespace adhoctrace {
+
+/// Map a whole file read-only.
+class MappedFile {
+  public:
+    ~MappedFile() {
+        if (mData) { munmap(const_cast<uint8_t*>(mData), mSize); }
+    }
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { return false; }
+        struct stat fileStat;
+        bool ok = fstat(fd, &fileStat) == 0;
+        mSize = ok ? (size_t)fileStat.st_size : 0;
+        if (ok && mSize > 0) {
+            void* data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = data != MAP_FAILED;
+            mData = ok ? static_cast<const uint8_t*>(data) : nullptr;
+        }
+        ::close(fd);
+        return ok;
+    }
+    const uint8_t* data() const { return mData; }
+    size_t size() const { return mSize; }
+  private:
+    const uint8_t* mData = nullptr;
+    size_t mSize = 0;
+};
+
+class TraceFileReader {
+  public:
+    bool open(const char* path) {
+        if (!mFile.open(path) || mFile.size() < sizeof(TraceFileHeader)) {
+            return false;
+        }
+        memcpy(&mHeader, mFile.data(), sizeof(TraceFileHeader));
+        if (memcmp(mHeader.mMagic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) != 0
+                || mHeader.mVersion != TRACE_FILE_VERSION) {
+            return false;
+        }
+        if (mHeader.mNanosPerTick <= 0) {
+            mHeader.mNanosPerTick = 1;
+        }
+        return true;
+    }
+
+    const TraceFileHeader& header() const { return mHeader; }
+
+    /// Convert the ticks of records to wall clock nanoseconds.
+    double toRealtimeNanos(uint64_t ticks) const {
+        return (double)mHeader.mAnchorRealtimeNanos
+                + ((double)ticks - (double)mHeader.mAnchorTicks) * mHeader.mNanosPerTick;
+    }
+
+    /// @param onString `void(TraceStringKind kind, uint32_t id, const std::string& value)`
+    /// @param onRecord `void(const TraceRecord& record)`
+    /// @return false if the file is truncated.
+    template <typename OnString, typename OnRecord>
+    bool forEach(OnString onString, OnRecord onRecord) const {
+        const uint8_t* cursor = mFile.data() + mHeader.mHeaderSize;
+        const uint8_t* end = cursor + mHeader.mDataSize;
+        if (end > mFile.data() + mFile.size()) {
+            end = mFile.data() + mFile.size();
+        }
+        while (cursor + sizeof(TraceChunkHeader) <= end) {
+            TraceChunkHeader chunkHeader;
+            memcpy(&chunkHeader, cursor, sizeof(chunkHeader));
+            cursor += sizeof(chunkHeader);
+            const uint8_t* chunkEnd = cursor + chunkHeader.mSize;
+            if (chunkEnd > end) {
+                return false;
+            }
+            if (chunkHeader.mType == TRACE_CHUNK_STRINGS) {
+                while (cursor + sizeof(TraceStringHeader) <= chunkEnd) {
+                    TraceStringHeader stringHeader;
+                    memcpy(&stringHeader, cursor, sizeof(stringHeader));
+                    cursor += sizeof(stringHeader);
+                    onString((TraceStringKind)stringHeader.mKind, stringHeader.mId,
+                            std::string(reinterpret_cast<const char*>(cursor), stringHeader.mLength));
+                    cursor += traceStringPaddedSize(stringHeader.mLength);
+                }
+            }
+            else if (chunkHeader.mType == TRACE_CHUNK_RECORDS) {
+                for (; cursor + sizeof(TraceRecord) <= chunkEnd; cursor += sizeof(TraceRecord)) {
+                    TraceRecord record;
+                    memcpy(&record, cursor, sizeof(record));
+                    onRecord(record);
+                }
+            }
+            cursor = chunkEnd;
+        }
+        return true;
+    }
+
+  private:
+    MappedFile mFile;
+    TraceFileHeader mHeader;
+};
+
+} // end of namespace adhoctrace
+
+#endif // _ADHOC_TOOLS_TRACE_FILE_READER_H_